@@ -0,0 +1,125 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef ALLOC_INTERNAL_H
+#define ALLOC_INTERNAL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mmpredefs.h"
+
+/*
+ * Memory blocks returned by mm_aligned_alloc_ex() may be directly mapped
+ * from the system instead of being allocated from the heap. Those blocks
+ * are recorded in a registry so that mm_aligned_free() can recognize them
+ * and release them with the right backend.
+ */
+
+enum mapped_type {
+	MAPPED_PLAIN,
+	MAPPED_THP,
+	MAPPED_HUGETLB,
+};
+
+/**
+ * struct mapped_block - memory block directly mapped from the system
+ * @next:       next block in the same bucket of the registry
+ * @ptr:        start of the block (and of the mapping)
+ * @len:        length of the mapping
+ * @pagesize:   size of the pages requested for the mapping
+ * @type:       backend used to map the block (one of MAPPED_* value)
+ */
+struct mapped_block {
+	struct mapped_block* next;
+	char* ptr;
+	size_t len;
+	size_t pagesize;
+	int type;
+};
+
+extern atomic_int num_mapped_blocks;
+
+void* mapped_block_alloc(size_t alignment, size_t size, int type);
+int mapped_block_free(void* ptr);
+void* mapped_block_realloc(void* ptr, size_t alignment, size_t size);
+int mapped_block_lookup(const void* ptr, struct mapped_block* blk);
+size_t get_system_pagesize(void);
+
+
+/*
+ * Heap memory used by mmlib goes through site_alloc() and site_free(). Each
+ * call site passes a static descriptor declared with ALLOC_SITE_INIT() to
+ * which the allocations are accounted when the instrumentation is enabled.
+ */
+
+/**
+ * struct alloc_site - allocation call site
+ * @file:       source file of the call site
+ * @line:       line of the call site
+ * @desc:       short description of what is allocated
+ * @num_alloc:  number of allocations performed so far
+ * @num_bytes:  number of bytes allocated so far
+ * @live_count: number of blocks currently allocated
+ * @live_bytes: number of bytes currently allocated
+ * @peak_bytes: maximum value reached by @live_bytes
+ * @next:       next call site in the list of sites having allocated memory
+ * @is_registered: true if site has been added to the list of sites
+ */
+struct alloc_site {
+	const char* file;
+	int line;
+	const char* desc;
+	atomic_uint_least64_t num_alloc;
+	atomic_uint_least64_t num_bytes;
+	atomic_size_t live_count;
+	atomic_size_t live_bytes;
+	atomic_size_t peak_bytes;
+	struct alloc_site* next;
+	atomic_int is_registered;
+};
+
+#define ALLOC_SITE_INIT(description) \
+	{.file = __FILE__, .line = __LINE__, .desc = (description)}
+
+void* internal_aligned_alloc(size_t alignment, size_t size);
+void* site_alloc(struct alloc_site* site, size_t alignment, size_t size);
+void* site_realloc(struct alloc_site* site, void* ptr,
+                   size_t alignment, size_t size);
+void site_free(void* ptr);
+size_t site_get_size(void* ptr, size_t alignment);
+int site_is_tracking(void);
+void site_account_alloc(struct alloc_site* site, size_t size);
+void site_account_free(struct alloc_site* site, size_t size);
+
+/* Alignment of blocks replacing malloc() */
+#define SITE_MALLOC_ALIGN       (2*sizeof(void*))
+
+static inline
+void* site_malloc(struct alloc_site* site, size_t size)
+{
+	return site_alloc(site, SITE_MALLOC_ALIGN, size);
+}
+
+
+/**
+ * is_mapped_block_candidate() - test whether a pointer might be mapped block
+ * @ptr:        pointer to a block allocated by mm_aligned_alloc_ex()
+ *
+ * Fast test used to avoid looking up the registry of mapped blocks when
+ * this is not necessary: no mapped block exists or @ptr is not page-aligned.
+ *
+ * Return: 1 if @ptr might be a mapped block, 0 if it is surely not.
+ */
+static inline
+int is_mapped_block_candidate(const void* ptr)
+{
+	if (((uintptr_t)ptr & (MM_PAGESZ-1)) != 0)
+		return 0;
+
+	return atomic_load_explicit(&num_mapped_blocks,
+	                            memory_order_relaxed) > 0;
+}
+
+#endif /* ifndef ALLOC_INTERNAL_H */
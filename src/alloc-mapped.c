@@ -0,0 +1,714 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+// Needed for mremap() if available
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "mmlib.h"
+#include "mmerrno.h"
+#include "mmpredefs.h"
+#include "mmthread.h"
+#include "alloc-internal.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+#define DEFAULT_HUGE_PAGESIZE   (2*1024*1024)
+#define REGISTRY_NBUCKET        64
+
+static mm_thr_mutex_t registry_mtx = MM_THR_MUTEX_INITIALIZER;
+static struct mapped_block* registry[REGISTRY_NBUCKET];
+LOCAL_SYMBOL atomic_int num_mapped_blocks;
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Page size queries                             *
+ *                                                                        *
+ **************************************************************************/
+
+LOCAL_SYMBOL
+size_t get_system_pagesize(void)
+{
+	static atomic_size_t pagesize;
+	size_t sz;
+
+	sz = atomic_load_explicit(&pagesize, memory_order_relaxed);
+	if (LIKELY(sz))
+		return sz;
+
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	sz = info.dwPageSize;
+#else
+	sz = sysconf(_SC_PAGESIZE);
+#endif
+
+	atomic_store_explicit(&pagesize, sz, memory_order_relaxed);
+	return sz;
+}
+
+
+#ifdef __linux__
+/**
+ * read_size_from_file() - read a size value from a system file
+ * @path:       path of the file to read
+ * @key:        prefix of the line holding the value (NULL if the file only
+ *              contains the value)
+ * @unit:       multiplier to apply to the read value
+ *
+ * Return: the read value multiplied by @unit, 0 if not found.
+ */
+static
+size_t read_size_from_file(const char* path, const char* key, size_t unit)
+{
+	char line[128];
+	unsigned long long val = 0;
+	size_t keylen = key ? strlen(key) : 0;
+	FILE* fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, key ? key : "", keylen) == 0) {
+			if (sscanf(line + keylen, "%llu", &val) != 1)
+				val = 0;
+
+			break;
+		}
+	}
+
+	fclose(fp);
+	return (size_t)val * unit;
+}
+#endif /* __linux__ */
+
+
+/**
+ * get_hugetlb_pagesize() - get size of explicit huge pages
+ *
+ * Return: the size of the pages obtained with MAP_HUGETLB (or
+ * MEM_LARGE_PAGES on Windows), 0 if not supported.
+ */
+static
+size_t get_hugetlb_pagesize(void)
+{
+	static atomic_size_t pagesize;
+	size_t sz;
+
+	sz = atomic_load_explicit(&pagesize, memory_order_relaxed);
+	if (LIKELY(sz))
+		return sz;
+
+#if defined (_WIN32)
+	sz = GetLargePageMinimum();
+#elif defined (__linux__)
+	sz = read_size_from_file("/proc/meminfo", "Hugepagesize:", 1024);
+	if (!sz)
+		sz = DEFAULT_HUGE_PAGESIZE;
+#else
+	sz = 0;
+#endif
+
+	atomic_store_explicit(&pagesize, sz, memory_order_relaxed);
+	return sz;
+}
+
+
+/**
+ * get_thp_pagesize() - get size of transparent huge pages
+ *
+ * Return: the size of the transparent huge pages, 0 if not supported.
+ */
+static
+size_t get_thp_pagesize(void)
+{
+	static atomic_size_t pagesize;
+	size_t sz;
+
+	sz = atomic_load_explicit(&pagesize, memory_order_relaxed);
+	if (LIKELY(sz))
+		return sz;
+
+#if defined (__linux__) && defined (MADV_HUGEPAGE)
+	sz = read_size_from_file("/sys/kernel/mm/transparent_hugepage/"
+	                         "hpage_pmd_size", NULL, 1);
+	if (!sz)
+		sz = DEFAULT_HUGE_PAGESIZE;
+#else
+	sz = 0;
+#endif
+
+	atomic_store_explicit(&pagesize, sz, memory_order_relaxed);
+	return sz;
+}
+
+
+#ifdef __linux__
+/**
+ * is_thp_backed() - test whether a mapping is backed by transparent huge pages
+ * @ptr:        address in the mapping to test
+ *
+ * Return: 1 if at least part of the memory region containing @ptr is backed
+ * by transparent huge pages, 0 otherwise.
+ */
+static
+int is_thp_backed(const void* ptr)
+{
+	char line[256];
+	unsigned long start, end;
+	unsigned long long anon_huge;
+	int in_region = 0;
+	int line_start = 1;
+	int rv = 0;
+	FILE* fp;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		// Skip continuation of lines longer than the buffer
+		if (!line_start) {
+			line_start = (strchr(line, '\n') != NULL);
+			continue;
+		}
+
+		line_start = (strchr(line, '\n') != NULL);
+
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			in_region = ((uintptr_t)ptr >= start
+			             && (uintptr_t)ptr < end);
+			continue;
+		}
+
+		if (in_region
+		    && sscanf(line, "AnonHugePages: %llu", &anon_huge) == 1) {
+			rv = (anon_huge != 0);
+			break;
+		}
+	}
+
+	fclose(fp);
+	return rv;
+}
+#endif /* __linux__ */
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Mapping backends                              *
+ *                                                                        *
+ **************************************************************************/
+
+#ifdef _WIN32
+
+static
+char* map_block(size_t len, size_t alignment, int type)
+{
+	DWORD flags = MEM_RESERVE|MEM_COMMIT;
+	SYSTEM_INFO info;
+	char* ptr;
+
+	GetSystemInfo(&info);
+	if (type == MAPPED_THP || alignment > info.dwAllocationGranularity) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	if (type == MAPPED_HUGETLB)
+		flags |= MEM_LARGE_PAGES;
+
+	ptr = VirtualAlloc(NULL, len, flags, PAGE_READWRITE);
+	if (!ptr) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return ptr;
+}
+
+
+static
+void unmap_block(char* ptr, size_t len)
+{
+	(void)len;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+#else /* _WIN32 */
+
+static
+char* map_block(size_t len, size_t alignment, int type)
+{
+	int mflags = MAP_PRIVATE|MAP_ANONYMOUS;
+	size_t pgsz = get_system_pagesize();
+	size_t maplen, head, tail;
+	char* base;
+	char* ptr;
+
+	if (type == MAPPED_HUGETLB) {
+#ifdef MAP_HUGETLB
+		// Huge page mappings are always aligned on huge page size
+		mflags |= MAP_HUGETLB;
+		pgsz = get_hugetlb_pagesize();
+#else
+		errno = ENOTSUP;
+		return NULL;
+#endif
+	}
+
+	// Map more than needed if alignment is bigger than page size and trim
+	// the excess
+	maplen = len;
+	if (alignment > pgsz) {
+		maplen += alignment - pgsz;
+		if (maplen < len) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	base = mmap(NULL, maplen, PROT_READ|PROT_WRITE, mflags, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	ptr = (char*)(((uintptr_t)base + alignment-1) & ~(uintptr_t)(alignment-1));
+	head = ptr - base;
+	tail = maplen - len - head;
+	if (head)
+		munmap(base, head);
+
+	if (tail)
+		munmap(ptr + len, tail);
+
+#ifdef MADV_HUGEPAGE
+	if (type == MAPPED_THP && madvise(ptr, len, MADV_HUGEPAGE)) {
+		munmap(ptr, len);
+		return NULL;
+	}
+#endif
+
+	return ptr;
+}
+
+
+static
+void unmap_block(char* ptr, size_t len)
+{
+	munmap(ptr, len);
+}
+
+#endif /* _WIN32 */
+
+
+/**************************************************************************
+ *                                                                        *
+ *                     Registry of mapped blocks                          *
+ *                                                                        *
+ **************************************************************************/
+
+static inline
+int get_bucket_index(const void* ptr)
+{
+	uintptr_t val = (uintptr_t)ptr / MM_PAGESZ;
+
+	val ^= (val >> 9) ^ (val >> 18);
+	return val % REGISTRY_NBUCKET;
+}
+
+
+static
+void registry_insert(struct mapped_block* blk)
+{
+	int idx = get_bucket_index(blk->ptr);
+
+	mm_thr_mutex_lock(&registry_mtx);
+	blk->next = registry[idx];
+	registry[idx] = blk;
+	atomic_fetch_add(&num_mapped_blocks, 1);
+	mm_thr_mutex_unlock(&registry_mtx);
+}
+
+
+/**
+ * registry_remove() - remove a block from the registry of mapped blocks
+ * @ptr:        pointer to the start of the block
+ *
+ * Return: the removed block, NULL if @ptr is not a mapped block.
+ */
+static
+struct mapped_block* registry_remove(const void* ptr)
+{
+	struct mapped_block** pblk;
+	struct mapped_block* blk;
+
+	mm_thr_mutex_lock(&registry_mtx);
+
+	pblk = &registry[get_bucket_index(ptr)];
+	for (blk = *pblk; blk != NULL; blk = *pblk) {
+		if (blk->ptr == ptr) {
+			*pblk = blk->next;
+			atomic_fetch_sub(&num_mapped_blocks, 1);
+			break;
+		}
+
+		pblk = &blk->next;
+	}
+
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	return blk;
+}
+
+
+/*
+ * Mapped blocks are accounted per backend (indexed by MAPPED_* value)
+ * instead of per caller.
+ */
+static struct alloc_site mapped_sites[] = {
+	[MAPPED_PLAIN] = ALLOC_SITE_INIT("mapped block"),
+	[MAPPED_THP] = ALLOC_SITE_INIT("mapped block (THP)"),
+	[MAPPED_HUGETLB] = ALLOC_SITE_INIT("mapped block (hugetlb)"),
+};
+
+
+/**
+ * mapped_block_alloc() - map memory block and register it
+ * @alignment:  alignment of the block, must be a power of 2
+ * @size:       size of the block
+ * @type:       backend to use (MAPPED_PLAIN, MAPPED_THP or MAPPED_HUGETLB)
+ *
+ * Return: pointer to the block in case of success, NULL otherwise with
+ * errno set. The error state is not set since the caller is expected to
+ * fall back to another allocation method.
+ */
+LOCAL_SYMBOL
+void* mapped_block_alloc(size_t alignment, size_t size, int type)
+{
+	static struct alloc_site blk_site = ALLOC_SITE_INIT("mapped block desc");
+	struct mapped_block* blk;
+	size_t pgsz, len;
+	char* ptr;
+
+	switch (type) {
+	case MAPPED_HUGETLB: pgsz = get_hugetlb_pagesize(); break;
+	case MAPPED_THP:     pgsz = get_thp_pagesize(); break;
+	default:             pgsz = get_system_pagesize(); break;
+	}
+
+	if (!pgsz || (type == MAPPED_HUGETLB && alignment > pgsz)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	// Transparent huge pages can be used only on aligned memory
+	if (type == MAPPED_THP && alignment < pgsz)
+		alignment = pgsz;
+
+	len = (size + pgsz-1) & ~(pgsz-1);
+	if (len < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	blk = site_malloc(&blk_site, sizeof(*blk));
+	if (!blk)
+		return NULL;
+
+	ptr = map_block(len, alignment, type);
+	if (!ptr) {
+		site_free(blk);
+		return NULL;
+	}
+
+	if (site_is_tracking())
+		site_account_alloc(&mapped_sites[type], len);
+
+	*blk = (struct mapped_block) {
+		.ptr = ptr,
+		.len = len,
+		.pagesize = pgsz,
+		.type = type,
+	};
+	registry_insert(blk);
+
+	return ptr;
+}
+
+
+/**
+ * mapped_block_free() - unmap a block if it has been mapped
+ * @ptr:        pointer to a block allocated by mm_aligned_alloc_ex()
+ *
+ * Return: 1 if @ptr was a mapped block and has been unmapped, 0 otherwise.
+ */
+LOCAL_SYMBOL
+int mapped_block_free(void* ptr)
+{
+	struct mapped_block* blk;
+
+	blk = registry_remove(ptr);
+	if (!blk)
+		return 0;
+
+	if (site_is_tracking())
+		site_account_free(&mapped_sites[blk->type], blk->len);
+
+	unmap_block(blk->ptr, blk->len);
+	site_free(blk);
+	return 1;
+}
+
+
+/**
+ * mapped_block_realloc() - resize a mapped block without copy
+ * @ptr:        pointer to the start of a mapped block
+ * @alignment:  alignment of the resized block, must be a power of 2
+ * @size:       new size of the block
+ *
+ * Resize a mapped block by remapping its pages: the block is grown or
+ * shrunk in place if possible, otherwise its pages are moved to a new
+ * location. In both cases, the content is not copied.
+ *
+ * Return: pointer to the resized block in case of success, NULL otherwise
+ * with errno set (ENOTSUP if the remapping is not supported on the
+ * platform or for the type of the block). In case of failure, the block
+ * pointed to by @ptr is left untouched.
+ */
+LOCAL_SYMBOL
+void* mapped_block_realloc(void* ptr, size_t alignment, size_t size)
+{
+#if defined (MREMAP_MAYMOVE) && defined (MREMAP_FIXED)
+	struct mapped_block* blk;
+	size_t newlen;
+	char* newptr;
+	char* target;
+
+	blk = registry_remove(ptr);
+	if (!blk) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (blk->type == MAPPED_HUGETLB) {
+		errno = ENOTSUP;
+		goto failure;
+	}
+
+	newlen = (size + blk->pagesize-1) & ~(blk->pagesize-1);
+	if (newlen < size) {
+		errno = ENOMEM;
+		goto failure;
+	}
+
+	if (newlen == 0)
+		newlen = blk->pagesize;
+
+	if (newlen == blk->len) {
+		registry_insert(blk);
+		return ptr;
+	}
+
+	// Try to resize in place first
+	newptr = mremap(ptr, blk->len, newlen, 0);
+	if (newptr != MAP_FAILED)
+		goto exit;
+
+	if (blk->type == MAPPED_THP && alignment < blk->pagesize)
+		alignment = blk->pagesize;
+
+	if (alignment <= get_system_pagesize()) {
+		newptr = mremap(ptr, blk->len, newlen, MREMAP_MAYMOVE);
+		if (newptr == MAP_FAILED)
+			goto failure;
+	} else {
+		// Reserve a suitably aligned region and move pages there
+		target = map_block(newlen, alignment, MAPPED_PLAIN);
+		if (!target)
+			goto failure;
+
+		newptr = mremap(ptr, blk->len, newlen,
+		                MREMAP_MAYMOVE|MREMAP_FIXED, target);
+		if (newptr == MAP_FAILED) {
+			munmap(target, newlen);
+			goto failure;
+		}
+	}
+
+exit:
+	if (site_is_tracking()) {
+		site_account_free(&mapped_sites[blk->type], blk->len);
+		site_account_alloc(&mapped_sites[blk->type], newlen);
+	}
+
+	blk->ptr = newptr;
+	blk->len = newlen;
+	registry_insert(blk);
+	return newptr;
+
+failure:
+	registry_insert(blk);
+	return NULL;
+
+#else /* MREMAP_MAYMOVE */
+
+	(void)ptr;
+	(void)alignment;
+	(void)size;
+
+	errno = ENOTSUP;
+	return NULL;
+
+#endif /* MREMAP_MAYMOVE */
+}
+
+
+/**
+ * mapped_block_lookup() - get information about a mapped block
+ * @ptr:        pointer to a block allocated by mm_aligned_alloc_ex()
+ * @blk:        structure receiving a copy of the block information
+ *
+ * Return: 0 if @ptr is a mapped block, -1 otherwise.
+ */
+LOCAL_SYMBOL
+int mapped_block_lookup(const void* ptr, struct mapped_block* blk)
+{
+	struct mapped_block* b;
+	int rv = -1;
+
+	mm_thr_mutex_lock(&registry_mtx);
+
+	for (b = registry[get_bucket_index(ptr)]; b != NULL; b = b->next) {
+		if (b->ptr == ptr) {
+			*blk = *b;
+			rv = 0;
+			break;
+		}
+	}
+
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                                 API                                    *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_aligned_alloc_ex() - Allocate aligned memory with page size control
+ * @alignment:  alignment value, must be a power of 2
+ * @size:       size of the requested memory allocation
+ * @flags:      0 or combination of MM_ALLOC_HUGEPAGE and MM_ALLOC_THP_HINT
+ *
+ * This function is similar to mm_aligned_alloc() but allows to request the
+ * block to be backed by huge pages. This reduces the TLB pressure when
+ * accessing randomly large memory blocks. Depending on @flags, the
+ * allocation is attempted with the following backends in this order:
+ *
+ * - explicit huge pages (MAP_HUGETLB on Linux, MEM_LARGE_PAGES on Windows)
+ *   if MM_ALLOC_HUGEPAGE is set. This requires the system to have huge
+ *   pages reserved (or the process the privilege to use large pages).
+ * - anonymous mapping advised to use transparent huge pages if
+ *   MM_ALLOC_HUGEPAGE or MM_ALLOC_THP_HINT is set (Linux only).
+ * - the same heap allocation as mm_aligned_alloc().
+ *
+ * The page size actually backing the block can be retrieved with
+ * mm_aligned_get_pagesize(). Whatever the backend used, the block must be
+ * deallocated with mm_aligned_free().
+ *
+ * Return: A pointer to the memory block that was allocated in case of
+ * success. Otherwise NULL is returned and error state set accordingly
+ */
+API_EXPORTED
+void* mm_aligned_alloc_ex(size_t alignment, size_t size, int flags)
+{
+	void* ptr;
+
+	if (flags & ~(MM_ALLOC_HUGEPAGE | MM_ALLOC_THP_HINT)) {
+		mm_raise_error(EINVAL, "Invalid flags (0x%08x)", flags);
+		return NULL;
+	}
+
+	if (!MM_IS_POW2(alignment) || alignment < sizeof(void*)) {
+		mm_raise_error(EINVAL, "Invalid alignment (%zu)", alignment);
+		return NULL;
+	}
+
+	if (size == 0)
+		flags = 0;
+
+	if (flags & MM_ALLOC_HUGEPAGE) {
+		ptr = mapped_block_alloc(alignment, size, MAPPED_HUGETLB);
+		if (ptr)
+			return ptr;
+	}
+
+	if (flags & (MM_ALLOC_HUGEPAGE | MM_ALLOC_THP_HINT)) {
+		ptr = mapped_block_alloc(alignment, size, MAPPED_THP);
+		if (ptr)
+			return ptr;
+	}
+
+	return mm_aligned_alloc(alignment, size);
+}
+
+
+/**
+ * mm_aligned_get_pagesize() - get page size backing an aligned memory block
+ * @ptr:        pointer to block allocated with mm_aligned_alloc_ex()
+ *
+ * This function reports the size of the pages backing the block pointed to
+ * by @ptr. For a block using transparent huge pages, the huge page size is
+ * reported only if the system has actually backed (part of) the block with
+ * huge pages, hence after the memory has been touched.
+ *
+ * Return: the page size of the block pointed to by @ptr.
+ */
+API_EXPORTED
+size_t mm_aligned_get_pagesize(const void* ptr)
+{
+	struct mapped_block blk;
+
+	if (!is_mapped_block_candidate(ptr)
+	    || mapped_block_lookup(ptr, &blk))
+		return get_system_pagesize();
+
+	switch (blk.type) {
+	case MAPPED_HUGETLB:
+		return blk.pagesize;
+
+#ifdef __linux__
+	case MAPPED_THP:
+		return is_thp_backed(ptr) ? blk.pagesize : get_system_pagesize();
+#endif
+
+	default:
+		return get_system_pagesize();
+	}
+}
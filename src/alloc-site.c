@@ -0,0 +1,687 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "mmlib.h"
+#include "mmerrno.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "alloc-internal.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (HAVE__ALIGNED_MALLOC) || defined (HAVE_MALLOC_USABLE_SIZE)
+#include <malloc.h>
+#endif
+
+// Define STDERR_FILENO if not (may happen with some compiler for Windows)
+#ifndef STDERR_FILENO
+#  define STDERR_FILENO 2
+#endif
+
+/*
+ * All the memory allocated from the heap by mmlib for its own use goes
+ * through the site_*() functions. Each call site declares a static
+ * descriptor (struct alloc_site) to which the allocations are accounted
+ * when instrumentation is enabled.
+ *
+ * The allocation mode is set once for all at the first allocation (the mode
+ * is then said "sealed"):
+ *  - by default, the blocks are allocated directly with the system allocator
+ *    and nothing is accounted.
+ *  - if the instrumentation has been enabled (mm_alloc_stats_enable() or
+ *    MMLIB_ALLOC_STATS environment variable) or if a user allocator has been
+ *    set (mm_set_allocator()), each block is preceded by a header recording
+ *    its size and its call site.
+ * Changing mode after the first allocation would lead to free a block with
+ * a backend different from the one used to allocate it, hence the seal.
+ */
+
+#define MODE_SEALED     0x1
+#define MODE_TRACKED    0x2
+#define MODE_HOOKED     0x4
+
+#define SITE_PRINT_LINE_MAXLEN  256
+
+/**
+ * struct alloc_hdr - header preceding a block in tracked mode
+ * @site:       call site that has allocated the block
+ * @size:       size requested for the block
+ * @offset:     distance between the start of the underlying allocation and
+ *              the block
+ */
+struct alloc_hdr {
+	struct alloc_site* site;
+	size_t size;
+	size_t offset;
+};
+
+
+static mm_thr_mutex_t site_mtx = MM_THR_MUTEX_INITIALIZER;
+static atomic_int alloc_mode;
+static int tracking_requested;
+static struct mm_allocator user_allocator;
+static struct alloc_site* site_list;
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          System allocator                              *
+ *                                                                        *
+ **************************************************************************/
+
+LOCAL_SYMBOL
+void* internal_aligned_alloc(size_t alignment, size_t size)
+{
+	void * ptr = NULL;
+
+#if defined (HAVE_POSIX_MEMALIGN)
+
+	int ret = posix_memalign(&ptr, alignment, size);
+	if (ret) {
+		errno = ret;
+		ptr = NULL;
+	}
+
+#elif defined (HAVE_ALIGNED_ALLOC)
+
+	ptr = aligned_alloc(alignment, size);
+
+#elif defined (HAVE__ALIGNED_MALLOC)
+
+	if (!MM_IS_POW2(alignment) || (alignment < sizeof(void*))) {
+		ptr = NULL;
+		errno = EINVAL;
+	} else {
+		ptr = _aligned_malloc(size, alignment);
+	}
+
+#else
+#  error Cannot find aligned allocation primitive
+#endif /* if defined (HAVE_POSIX_MEMALIGN) */
+
+	return ptr;
+}
+
+
+static
+void internal_aligned_free(void* ptr)
+{
+#ifdef HAVE__ALIGNED_MALLOC
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+
+/**
+ * heap_realloc() - resize an aligned block allocated on heap
+ * @ptr:        pointer to block allocated with internal_aligned_alloc()
+ * @alignment:  alignment of the block, must be a power of 2
+ * @size:       new size of the block
+ *
+ * Return: pointer to the resized block in case of success, NULL otherwise
+ * with errno set. In case of failure, @ptr is left untouched.
+ */
+static
+void* heap_realloc(void* ptr, size_t alignment, size_t size)
+{
+	void* newptr;
+
+	// Ensure a unique pointer is returned if size is 0
+	if (size == 0)
+		size = 1;
+
+#if defined (HAVE__ALIGNED_MALLOC)
+
+	newptr = _aligned_realloc(ptr, size, alignment);
+
+#elif defined (HAVE_MALLOC_USABLE_SIZE)
+
+	size_t oldsize;
+
+	// realloc() only guarantees the alignment of malloc()
+	if (alignment <= _Alignof(max_align_t))
+		return realloc(ptr, size);
+
+	newptr = internal_aligned_alloc(alignment, size);
+	if (!newptr)
+		return NULL;
+
+	oldsize = malloc_usable_size(ptr);
+	memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+	free(ptr);
+
+#else
+
+	void* aligned;
+
+	newptr = realloc(ptr, size);
+	if (!newptr || ((uintptr_t)newptr & (alignment-1)) == 0)
+		return newptr;
+
+	// realloc() has not kept alignment: move data to aligned block
+	aligned = internal_aligned_alloc(alignment, size);
+	if (aligned)
+		memcpy(aligned, newptr, size);
+
+	free(newptr);
+	newptr = aligned;
+
+#endif
+
+	return newptr;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                       Allocation mode handling                         *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * seal_alloc_mode() - fix the allocation mode
+ *
+ * Return: the sealed allocation mode
+ */
+static NOINLINE
+int seal_alloc_mode(void)
+{
+	int mode;
+
+	mm_thr_mutex_lock(&site_mtx);
+
+	mode = atomic_load(&alloc_mode);
+	if (!(mode & MODE_SEALED)) {
+		mode = MODE_SEALED;
+		if (tracking_requested)
+			mode |= MODE_TRACKED;
+
+		if (user_allocator.alloc)
+			mode |= MODE_HOOKED;
+
+		atomic_store(&alloc_mode, mode);
+	}
+
+	mm_thr_mutex_unlock(&site_mtx);
+
+	return mode;
+}
+
+
+static inline
+int get_alloc_mode(void)
+{
+	int mode = atomic_load_explicit(&alloc_mode, memory_order_acquire);
+
+	if (UNLIKELY(!(mode & MODE_SEALED)))
+		mode = seal_alloc_mode();
+
+	return mode;
+}
+
+
+LOCAL_SYMBOL
+int site_is_tracking(void)
+{
+	return (get_alloc_mode() & MODE_TRACKED) ? 1 : 0;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                        Call site accounting                            *
+ *                                                                        *
+ **************************************************************************/
+
+static
+void register_site(struct alloc_site* site)
+{
+	mm_thr_mutex_lock(&site_mtx);
+
+	if (!atomic_load(&site->is_registered)) {
+		site->next = site_list;
+		site_list = site;
+		atomic_store(&site->is_registered, 1);
+	}
+
+	mm_thr_mutex_unlock(&site_mtx);
+}
+
+
+LOCAL_SYMBOL
+void site_account_alloc(struct alloc_site* site, size_t size)
+{
+	size_t live, peak;
+
+	if (UNLIKELY(!atomic_load_explicit(&site->is_registered,
+	                                   memory_order_acquire)))
+		register_site(site);
+
+	atomic_fetch_add_explicit(&site->num_alloc, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&site->num_bytes, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&site->live_count, 1, memory_order_relaxed);
+	live = atomic_fetch_add_explicit(&site->live_bytes, size,
+	                                 memory_order_relaxed) + size;
+
+	peak = atomic_load_explicit(&site->peak_bytes, memory_order_relaxed);
+	while (live > peak) {
+		if (atomic_compare_exchange_weak_explicit(&site->peak_bytes,
+		                                          &peak, live,
+		                                          memory_order_relaxed,
+		                                          memory_order_relaxed))
+			break;
+	}
+}
+
+
+LOCAL_SYMBOL
+void site_account_free(struct alloc_site* site, size_t size)
+{
+	atomic_fetch_sub_explicit(&site->live_count, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&site->live_bytes, size, memory_order_relaxed);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Site allocation                               *
+ *                                                                        *
+ **************************************************************************/
+
+static
+void* tracked_alloc(int mode, struct alloc_site* site,
+                    size_t alignment, size_t size)
+{
+	struct alloc_hdr* hdr;
+	size_t offset, total;
+	char* base;
+
+	// Header is placed just before the block
+	offset = (sizeof(*hdr) + alignment-1) & ~(alignment-1);
+	total = offset + size;
+	if (total < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (mode & MODE_HOOKED)
+		base = user_allocator.alloc(user_allocator.data, alignment, total);
+	else
+		base = internal_aligned_alloc(alignment, total);
+
+	if (!base) {
+		if (!errno)
+			errno = ENOMEM;
+
+		return NULL;
+	}
+
+	hdr = (struct alloc_hdr*)(base + offset) - 1;
+	hdr->site = site;
+	hdr->size = size;
+	hdr->offset = offset;
+
+	if (mode & MODE_TRACKED)
+		site_account_alloc(site, size);
+
+	return base + offset;
+}
+
+
+static
+void tracked_free(int mode, void* ptr)
+{
+	struct alloc_hdr* hdr = (struct alloc_hdr*)ptr - 1;
+	char* base = (char*)ptr - hdr->offset;
+
+	if (mode & MODE_TRACKED)
+		site_account_free(hdr->site, hdr->size);
+
+	if (mode & MODE_HOOKED)
+		user_allocator.free(user_allocator.data, base);
+	else
+		internal_aligned_free(base);
+}
+
+
+/**
+ * site_alloc() - allocate memory block for mmlib internal use
+ * @site:       descriptor of the call site
+ * @alignment:  alignment of the block, must be a power of 2 and at least
+ *              the size of a pointer
+ * @size:       size of the block
+ *
+ * Return: pointer to the allocated block in case of success, NULL
+ * otherwise with errno set. The block must be deallocated with site_free()
+ * or mm_aligned_free().
+ */
+LOCAL_SYMBOL
+void* site_alloc(struct alloc_site* site, size_t alignment, size_t size)
+{
+	int mode = get_alloc_mode();
+
+	if (LIKELY(!(mode & (MODE_TRACKED | MODE_HOOKED))))
+		return internal_aligned_alloc(alignment, size);
+
+	return tracked_alloc(mode, site, alignment, size);
+}
+
+
+/**
+ * site_realloc() - resize memory block allocated with site_alloc()
+ * @site:       descriptor of the call site (used if @ptr is NULL)
+ * @ptr:        block to resize (may be NULL)
+ * @alignment:  alignment of the block, must be the same as the one used
+ *              to allocate @ptr
+ * @size:       new size of the block
+ *
+ * Return: pointer to the resized block in case of success, NULL otherwise
+ * with errno set. In case of failure, @ptr is left untouched.
+ */
+LOCAL_SYMBOL
+void* site_realloc(struct alloc_site* site, void* ptr,
+                   size_t alignment, size_t size)
+{
+	int mode = get_alloc_mode();
+	struct alloc_hdr* hdr;
+	void* newptr;
+
+	if (!ptr)
+		return site_alloc(site, alignment, size);
+
+	if (LIKELY(!(mode & (MODE_TRACKED | MODE_HOOKED))))
+		return heap_realloc(ptr, alignment, size);
+
+	// Keep block accounted to the site that has allocated it first
+	hdr = (struct alloc_hdr*)ptr - 1;
+	newptr = tracked_alloc(mode, hdr->site, alignment, size);
+	if (!newptr)
+		return NULL;
+
+	memcpy(newptr, ptr, hdr->size < size ? hdr->size : size);
+	tracked_free(mode, ptr);
+
+	return newptr;
+}
+
+
+/**
+ * site_free() - deallocate memory block allocated with site_alloc()
+ * @ptr:        block to deallocate (may be NULL)
+ */
+LOCAL_SYMBOL
+void site_free(void* ptr)
+{
+	int mode = atomic_load_explicit(&alloc_mode, memory_order_relaxed);
+
+	if (!ptr)
+		return;
+
+	if (LIKELY(!(mode & (MODE_TRACKED | MODE_HOOKED))))
+		internal_aligned_free(ptr);
+	else
+		tracked_free(mode, ptr);
+}
+
+
+/**
+ * site_get_size() - get the size of a block allocated with site_alloc()
+ * @ptr:        block allocated with site_alloc() or site_realloc()
+ * @alignment:  alignment used to allocate @ptr
+ *
+ * Return: the number of bytes usable in @ptr (at least the size requested
+ * when allocating it), or SIZE_MAX if it cannot be determined on this
+ * platform.
+ */
+LOCAL_SYMBOL
+size_t site_get_size(void* ptr, size_t alignment)
+{
+	int mode = atomic_load_explicit(&alloc_mode, memory_order_relaxed);
+	struct alloc_hdr* hdr;
+
+	if (mode & (MODE_TRACKED | MODE_HOOKED)) {
+		hdr = (struct alloc_hdr*)ptr - 1;
+		return hdr->size;
+	}
+
+#if defined (HAVE__ALIGNED_MALLOC)
+	return _aligned_msize(ptr, alignment, 0);
+#elif defined (HAVE_MALLOC_USABLE_SIZE)
+	(void)alignment;
+	return malloc_usable_size(ptr);
+#else
+	(void)alignment;
+	return SIZE_MAX;
+#endif
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                                  API                                   *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_set_allocator() - route the memory allocations of mmlib to user allocator
+ * @allocator:  user allocator to use
+ *
+ * This function makes all the memory allocated from the heap by mmlib for
+ * its internal use and by mm_aligned_alloc() be served by the functions set
+ * in @allocator. The @allocator->alloc() callback receives the alignment
+ * and the size of the requested block and must return a pointer to a block
+ * aligned accordingly (or NULL in case of failure). The @allocator->free()
+ * callback is called to release the blocks returned by
+ * @allocator->alloc(). The memory directly mapped from the system (huge
+ * pages, NUMA placement, large blocks of mm_aligned_realloc()) and the
+ * strings returned by mmlib to be freed with free() are not affected.
+ *
+ * The allocator can only be set before mmlib allocates any memory, ie,
+ * typically at the very beginning of main().
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly (EBUSY if mmlib has already allocated memory).
+ */
+API_EXPORTED
+int mm_set_allocator(const struct mm_allocator* allocator)
+{
+	int rv = 0;
+
+	if (!allocator || !allocator->alloc || !allocator->free)
+		return mm_raise_error(EINVAL, "Invalid allocator");
+
+	mm_thr_mutex_lock(&site_mtx);
+
+	if (atomic_load(&alloc_mode) & MODE_SEALED)
+		rv = -1;
+	else
+		user_allocator = *allocator;
+
+	mm_thr_mutex_unlock(&site_mtx);
+
+	if (rv)
+		mm_raise_error(EBUSY, "mmlib has already allocated memory");
+
+	return rv;
+}
+
+
+/**
+ * mm_alloc_stats_enable() - enable instrumentation of mmlib allocations
+ *
+ * This function enables the accounting of the memory allocated by mmlib
+ * (including through mm_aligned_alloc() and mm_malloca()) per call site.
+ * The statistics can then be retrieved with mm_alloc_get_stats() or printed
+ * with mm_alloc_print_stats().
+ *
+ * Like mm_set_allocator(), this must be called before mmlib allocates any
+ * memory. Alternatively, the instrumentation can be enabled by setting the
+ * environment variable MMLIB_ALLOC_STATS to a non-empty value when the
+ * process starts. In such a case, the statistics are also printed on
+ * standard error when the process exits.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly (EBUSY if mmlib has already allocated memory).
+ */
+API_EXPORTED
+int mm_alloc_stats_enable(void)
+{
+	int rv = 0;
+
+	mm_thr_mutex_lock(&site_mtx);
+
+	if (atomic_load(&alloc_mode) & MODE_SEALED)
+		rv = -1;
+	else
+		tracking_requested = 1;
+
+	mm_thr_mutex_unlock(&site_mtx);
+
+	if (rv)
+		mm_raise_error(EBUSY, "mmlib has already allocated memory");
+
+	return rv;
+}
+
+
+/**
+ * mm_alloc_get_stats() - get allocation statistics of mmlib call sites
+ * @stats:      array receiving the statistics of the call sites
+ * @max_num:    maximum number of elements that can be written in @stats
+ *
+ * Fill @stats with the allocation statistics of the call sites of mmlib
+ * that have allocated memory since the start of the process. If there are
+ * more than @max_num such sites, only the first @max_num are reported.
+ *
+ * Return: the total number of call sites having allocated memory. This can
+ * be bigger than @max_num. If instrumentation is not enabled, 0 is returned.
+ */
+API_EXPORTED
+int mm_alloc_get_stats(struct mm_alloc_site_stats* stats, int max_num)
+{
+	struct alloc_site* site;
+	int num = 0;
+
+	mm_thr_mutex_lock(&site_mtx);
+
+	for (site = site_list; site != NULL; site = site->next) {
+		if (num < max_num) {
+			stats[num] = (struct mm_alloc_site_stats) {
+				.file = site->file,
+				.line = site->line,
+				.desc = site->desc,
+				.num_alloc = atomic_load(&site->num_alloc),
+				.num_bytes = atomic_load(&site->num_bytes),
+				.live_count = atomic_load(&site->live_count),
+				.live_bytes = atomic_load(&site->live_bytes),
+				.peak_bytes = atomic_load(&site->peak_bytes),
+			};
+		}
+
+		num++;
+	}
+
+	mm_thr_mutex_unlock(&site_mtx);
+
+	return num;
+}
+
+
+static
+const char* get_filename(const char* path)
+{
+	const char* name = path;
+
+	for (; *path; path++) {
+		if (*path == '/' || *path == '\\')
+			name = path + 1;
+	}
+
+	return name;
+}
+
+
+/**
+ * mm_alloc_print_stats() - print allocation statistics of mmlib call sites
+ * @fd:         file descriptor to which the statistics must be written
+ *
+ * Write a table of the allocation statistics of mmlib call sites along with
+ * their total. Nothing is printed if the instrumentation is not enabled.
+ */
+API_EXPORTED
+void mm_alloc_print_stats(int fd)
+{
+	struct alloc_site* site;
+	char line[SITE_PRINT_LINE_MAXLEN];
+	char location[64];
+	uint64_t sum_alloc = 0, sum_bytes = 0;
+	size_t sum_live = 0;
+	int len;
+
+	if (!(atomic_load(&alloc_mode) & MODE_TRACKED))
+		return;
+
+	len = snprintf(line, sizeof(line), "%-40s %10s %14s %10s %14s %14s\n",
+	               "mmlib allocation site", "allocs", "bytes",
+	               "live", "live bytes", "peak bytes");
+	mm_write(fd, line, len);
+
+	mm_thr_mutex_lock(&site_mtx);
+
+	for (site = site_list; site != NULL; site = site->next) {
+		snprintf(location, sizeof(location), "%s (%s:%i)",
+		         site->desc, get_filename(site->file), site->line);
+		len = snprintf(line, sizeof(line),
+		               "%-40s %10llu %14llu %10zu %14zu %14zu\n",
+		               location,
+		               (unsigned long long)atomic_load(&site->num_alloc),
+		               (unsigned long long)atomic_load(&site->num_bytes),
+		               atomic_load(&site->live_count),
+		               atomic_load(&site->live_bytes),
+		               atomic_load(&site->peak_bytes));
+		mm_write(fd, line, len);
+
+		sum_alloc += atomic_load(&site->num_alloc);
+		sum_bytes += atomic_load(&site->num_bytes);
+		sum_live += atomic_load(&site->live_bytes);
+	}
+
+	mm_thr_mutex_unlock(&site_mtx);
+
+	len = snprintf(line, sizeof(line), "%-40s %10llu %14llu %10s %14zu\n",
+	               "total", (unsigned long long)sum_alloc,
+	               (unsigned long long)sum_bytes, "", sum_live);
+	mm_write(fd, line, len);
+}
+
+
+static
+void print_stats_at_exit(void)
+{
+	mm_alloc_print_stats(STDERR_FILENO);
+}
+
+
+MM_CONSTRUCTOR(alloc_stats)
+{
+	const char* envval;
+
+	envval = getenv("MMLIB_ALLOC_STATS");
+	if (!envval || envval[0] == '\0')
+		return;
+
+	if (!mm_alloc_stats_enable())
+		atexit(print_stats_at_exit);
+}
@@ -5,48 +5,28 @@
 # include <config.h>
 #endif
 
+// Needed for pthread_getattr_np() if available
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "mmlib.h"
 #include "mmerrno.h"
-#include <stdlib.h>
 #include "mmpredefs.h"
+#include "mmthread.h"
+#include "alloc-internal.h"
+#include "tls-internal.h"
 
-#ifdef HAVE__ALIGNED_MALLOC
-#include <malloc.h>
-#endif
-
-static
-void* internal_aligned_alloc(size_t alignment, size_t size)
-{
-	void * ptr = NULL;
-
-#if defined (HAVE_POSIX_MEMALIGN)
-
-	int ret = posix_memalign(&ptr, alignment, size);
-	if (ret) {
-		errno = ret;
-		ptr = NULL;
-	}
-
-#elif defined (HAVE_ALIGNED_ALLOC)
-
-	ptr = aligned_alloc(alignment, size);
-
-#elif defined (HAVE__ALIGNED_MALLOC)
-
-	if (!MM_IS_POW2(alignment) || (alignment < sizeof(void*))) {
-		ptr = NULL;
-		errno = EINVAL;
-	} else {
-		ptr = _aligned_malloc(size, alignment);
-	}
-
-#else
-#  error Cannot find aligned allocation primitive
-#endif /* if defined (HAVE_POSIX_MEMALIGN) */
-
-	return ptr;
-}
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#ifndef _WIN32
+#  include <pthread.h>
+#  include <sys/mman.h>
+#endif
 
 /**
  * mm_aligned_alloc() - Allocate memory on a specified alignment boundary.
@@ -64,7 +44,8 @@ void* internal_aligned_alloc(size_t alignment, size_t size)
 API_EXPORTED
 void* mm_aligned_alloc(size_t alignment, size_t size)
 {
-	void * ptr = internal_aligned_alloc(alignment, size);
+	static struct alloc_site site = ALLOC_SITE_INIT("mm_aligned_alloc");
+	void * ptr = site_alloc(&site, alignment, size);
 
 	if (!ptr) {
 		mm_raise_from_errno("Cannot allocate buffer "
@@ -84,59 +65,560 @@ void* mm_aligned_alloc(size_t alignment, size_t size)
  * This function cause the space pointed to by @ptr to be deallocated. If
  * ptr is a NULL pointer, no action occur (this is not an error). Otherwise
  * the behavior is undefined if the space has not been allocated with
- * mm_aligned_alloc().
+ * mm_aligned_alloc() or mm_aligned_alloc_ex().
  */
 API_EXPORTED
 void mm_aligned_free(void* ptr)
 {
-#ifdef HAVE__ALIGNED_MALLOC
-	_aligned_free(ptr);
+	if (UNLIKELY(is_mapped_block_candidate(ptr)) && ptr
+	    && mapped_block_free(ptr))
+		return;
+
+	site_free(ptr);
+}
+
+
+/**
+ * mm_aligned_realloc() - Resize memory allocated with mm_aligned_alloc()
+ * @ptr:        block to resize (may be NULL)
+ * @alignment:  alignment value, must be a power of 2. It must be the same as
+ *              the one used to allocate @ptr.
+ * @size:       new size of the memory block
+ *
+ * This function changes the size of the block pointed to by @ptr to @size
+ * bytes while keeping the alignment guarantee of the block. The content is
+ * unchanged up to the minimum of the old and new size. If @ptr is NULL, this
+ * is equivalent to call mm_aligned_alloc().
+ *
+ * Blocks of page size or bigger are directly mapped from the system. On
+ * platforms supporting it (Linux), such a block is resized by remapping its
+ * pages: it grows in place if the address space allows it, otherwise its
+ * pages are moved to a new location without any copy of data. This makes
+ * the repeated growth of large buffers cheap.
+ *
+ * The returned block must be deallocated with mm_aligned_free().
+ *
+ * Return: A pointer to the resized memory block in case of success.
+ * Otherwise NULL is returned with error state set accordingly and @ptr is
+ * left untouched.
+ */
+API_EXPORTED
+void* mm_aligned_realloc(void* ptr, size_t alignment, size_t size)
+{
+	static struct alloc_site site = ALLOC_SITE_INIT("mm_aligned_realloc");
+	struct mapped_block blk;
+	void* newptr;
+	void* oldptr;
+	size_t copy_len;
+	int is_large = (size >= get_system_pagesize());
+
+	if (!MM_IS_POW2(alignment) || alignment < sizeof(void*)) {
+		mm_raise_error(EINVAL, "Invalid alignment (%zu)", alignment);
+		return NULL;
+	}
+
+	if (!ptr && !is_large)
+		return mm_aligned_alloc(alignment, size);
+
+	if (ptr && is_mapped_block_candidate(ptr)
+	    && !mapped_block_lookup(ptr, &blk)) {
+		// Move pages of mapped block if possible, copy otherwise
+		newptr = mapped_block_realloc(ptr, alignment, size);
+		if (newptr)
+			return newptr;
+
+		oldptr = ptr;
+		copy_len = (blk.len < size) ? blk.len : size;
+	} else {
+		newptr = NULL;
+		if (is_large)
+			newptr = mapped_block_alloc(alignment, size, MAPPED_PLAIN);
+
+		if (!newptr) {
+			// Block remains on heap
+			newptr = site_realloc(&site, ptr, alignment, size);
+			goto exit;
+		}
+
+		if (!ptr)
+			return newptr;
+
+		// Heap block becoming large moves to mapped block: its data is
+		// copied once, straight from the heap block
+		oldptr = ptr;
+		copy_len = site_get_size(ptr, alignment);
+		if (UNLIKELY(copy_len == SIZE_MAX)) {
+			// Since the size of the heap block is unknown, resize
+			// it first to be sure that @size bytes can be copied.
+			oldptr = site_realloc(&site, ptr, alignment, size);
+			if (!oldptr) {
+				mapped_block_free(newptr);
+				newptr = NULL;
+				goto exit;
+			}
+		}
+
+		if (copy_len > size)
+			copy_len = size;
+
+		memcpy(newptr, oldptr, copy_len);
+		mm_aligned_free(oldptr);
+		return newptr;
+	}
+
+	// Allocate new block and copy data there
+	newptr = NULL;
+	if (is_large)
+		newptr = mapped_block_alloc(alignment, size, MAPPED_PLAIN);
+
+	if (!newptr)
+		newptr = site_alloc(&site, alignment, size ? size : 1);
+
+	if (newptr) {
+		memcpy(newptr, oldptr, copy_len);
+		mm_aligned_free(oldptr);
+	}
+
+exit:
+	if (!newptr) {
+		mm_raise_from_errno("Cannot reallocate buffer "
+		                    "(alignment=%zu, size=%zu)",
+		                    alignment, size);
+	}
+
+	return newptr;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                     Per-thread scratch stack                           *
+ *                                                                        *
+ **************************************************************************/
+/*
+ * When mm_malloca() cannot allocate on stack, the memory is carved from a
+ * scratch stack owned by the calling thread: a list of chunks mapped lazily
+ * from which the blocks are allocated and released in LIFO order. This
+ * avoids to go through the general purpose allocator (and its locks) for
+ * temporary buffers. The heap is used only when the scratch stack cannot
+ * serve the request (too big or limit of mapped memory reached).
+ *
+ * The pointers returned by mm_malloca() are tagged by their alignment so
+ * that mm_freea() can recognize how they have been allocated. With
+ * A=MM_STK_ALIGN, a pointer is:
+ *  - 0 mod 2A: allocated on stack (nothing to do to free it)
+ *  - A mod 4A: allocated in the scratch stack of the thread
+ *  - 3A mod 4A: allocated on heap
+ * The inline mm_freea() only needs to distinguish the stack from the rest,
+ * _mm_freea_on_heap() takes care of the remaining distinction.
+ */
+
+#define MALLOCA_TAG_MASK        (4*MM_STK_ALIGN-1)
+#define MALLOCA_SCRATCH_TAG     MM_STK_ALIGN
+#define MALLOCA_HEAP_TAG        (3*MM_STK_ALIGN)
+
+#define SCRATCH_CHUNK_MIN       (256*1024)
+#define SCRATCH_CHUNK_MAX       (8*1024*1024)
+#define SCRATCH_MAPPED_MAX      (32*1024*1024)
+
+/**
+ * struct scratch_chunk - header of a memory region of a scratch stack
+ * @next:       next chunk in the scratch stack (kept for reuse)
+ * @end:        end of the chunk
+ * @len:        length of the mapping of the chunk (including header)
+ */
+struct scratch_chunk {
+	struct scratch_chunk* next;
+	char* end;
+	size_t len;
+};
+
+
+/**
+ * struct scratch_hdr - header preceding a block of the scratch stack
+ * @prev:       block allocated before this one (NULL if none)
+ * @prev_chunk: chunk in use before the allocation of the block
+ * @prev_top:   top of the scratch stack before the allocation of the block
+ * @is_freed:   set when the block has been released by mm_freea()
+ *
+ * Blocks are expected to be released in the reverse order of their
+ * allocation. If not, a block released before the ones allocated after it
+ * is only marked as freed and its memory is reclaimed when all the blocks
+ * allocated after it are released.
+ */
+struct scratch_hdr {
+	struct scratch_hdr* prev;
+	struct scratch_chunk* prev_chunk;
+	char* prev_top;
+	int is_freed;
+};
+
+
+/**
+ * struct scratch_stack - per-thread scratch stack
+ * @top:        next free byte of the current chunk
+ * @end:        end of the current chunk
+ * @curr:       current chunk (NULL if nothing has been allocated yet)
+ * @first:      first chunk of the stack
+ * @last:       last allocated block still in use
+ * @mapped:     total size of the chunks mapped by the stack
+ * @num_scratch: number of allocations served by the scratch stack
+ * @num_heap:   number of allocations that have fallen back to heap
+ * @next:       next scratch stack in the list of all scratch stacks
+ *
+ * Only the owner thread modifies the statistic counters. They are atomic
+ * only to allow them to be read safely by mm_malloca_get_stats().
+ */
+struct scratch_stack {
+	char* top;
+	char* end;
+	struct scratch_chunk* curr;
+	struct scratch_chunk* first;
+	struct scratch_hdr* last;
+	atomic_size_t mapped;
+	atomic_uint_least64_t num_scratch;
+	atomic_uint_least64_t num_heap;
+	struct scratch_stack* next;
+};
+
+
+// List of scratch stack of live threads and counters of the exited ones
+static mm_thr_mutex_t scratch_mtx = MM_THR_MUTEX_INITIALIZER;
+static struct scratch_stack* scratch_list;
+static uint64_t retired_num_scratch;
+static atomic_uint_least64_t retired_num_heap;
+
+static thread_local struct scratch_stack* thread_scratch;
+
+static tls_key_t scratch_key;
+static int scratch_key_valid;
+static mm_thr_once_t scratch_key_once = MM_THR_ONCE_INIT;
+
+
+static inline
+void counter_inc(atomic_uint_least64_t* cnt)
+{
+	uint64_t val = atomic_load_explicit(cnt, memory_order_relaxed);
+	atomic_store_explicit(cnt, val+1, memory_order_relaxed);
+}
+
+
+static inline
+uint64_t counter_get(atomic_uint_least64_t* cnt)
+{
+	return atomic_load_explicit(cnt, memory_order_relaxed);
+}
+
+
+static
+void* map_scratch_chunk(size_t len)
+{
+#ifdef _WIN32
+	return VirtualAlloc(NULL, len, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* ptr;
+
+	ptr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+	           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	return (ptr == MAP_FAILED) ? NULL : ptr;
+#endif
+}
+
+
+static
+void unmap_scratch_chunk(struct scratch_chunk* chunk)
+{
+#ifdef _WIN32
+	VirtualFree(chunk, 0, MEM_RELEASE);
 #else
-	free(ptr);
+	munmap(chunk, chunk->len);
 #endif
 }
 
 
 /**
- * _mm_malloca_on_heap() - heap memory allocation version of mm_malloca()
- * @size:       size of memory to be allocated
+ * scratch_thread_exit() - release scratch stack of exiting thread
+ * @arg:        pointer to the scratch stack of the thread
+ */
+static
+void scratch_thread_exit(void* arg)
+{
+	struct scratch_stack* st = arg;
+	struct scratch_stack** pnext;
+	struct scratch_chunk *chunk, *next;
+
+	mm_thr_mutex_lock(&scratch_mtx);
+
+	for (pnext = &scratch_list; *pnext != st; pnext = &(*pnext)->next)
+		;
+
+	*pnext = st->next;
+	retired_num_scratch += counter_get(&st->num_scratch);
+	atomic_fetch_add(&retired_num_heap, counter_get(&st->num_heap));
+
+	mm_thr_mutex_unlock(&scratch_mtx);
+
+	for (chunk = st->first; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		unmap_scratch_chunk(chunk);
+	}
+
+	free(st);
+	thread_scratch = NULL;
+}
+
+
+static
+void init_scratch_key(void)
+{
+	if (!tls_key_create(&scratch_key, scratch_thread_exit))
+		scratch_key_valid = 1;
+}
+
+
+/**
+ * get_scratch_stack() - get scratch stack of calling thread
  *
- * Function called when mm_malloca() cannot allocate on stack because @size is
- * too big. The allocation will be attempted on heap.
+ * Return: the scratch stack of the thread, allocated if not done yet. NULL
+ * if the scratch stack cannot be allocated.
+ */
+static
+struct scratch_stack* get_scratch_stack(void)
+{
+	struct scratch_stack* st = thread_scratch;
+
+	if (LIKELY(st != NULL))
+		return st;
+
+	// Without possibility to release the scratch stack at thread exit,
+	// use only the heap
+	mm_thr_once(&scratch_key_once, init_scratch_key);
+	if (!scratch_key_valid)
+		return NULL;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	tls_key_set(scratch_key, st);
+	thread_scratch = st;
+
+	mm_thr_mutex_lock(&scratch_mtx);
+	st->next = scratch_list;
+	scratch_list = st;
+	mm_thr_mutex_unlock(&scratch_mtx);
+
+	return st;
+}
+
+
+/**
+ * scratch_next_chunk() - switch scratch stack to a chunk with enough space
+ * @st:         scratch stack of the calling thread
+ * @needed:     minimal size that the chunk must be able to provide
  *
- * NOTE: although this is function is exported, this should not be used
- * anywhere excepting by the mm_malloca() macro.
+ * The chunk following the current one is reused if it is big enough.
+ * Otherwise it is replaced by a newly mapped chunk.
  *
- * Return: the pointer on allocated memory in case of success. The return value
- * is then ensured to be of value MM_STK_ALIGN modulo (2*MM_STK_ALIGN). This
- * particularity will be used to recognize when a memory block has been
- * allocated on stack or on heap. In case of failure (likely due to @size too
- * large), NULL is returned.
+ * Return: 0 in case of success, -1 if a chunk cannot be mapped.
  */
-API_EXPORTED
-void* _mm_malloca_on_heap(size_t size)
+static NOINLINE
+int scratch_next_chunk(struct scratch_stack* st, size_t needed)
+{
+	struct scratch_chunk* chunk;
+	size_t len, mapped;
+
+	chunk = st->curr ? st->curr->next : st->first;
+	needed += sizeof(*chunk);
+	if (chunk && chunk->len >= needed)
+		goto exit;
+
+	// Drop next chunk if not big enough, it will be replaced by a new one
+	mapped = atomic_load_explicit(&st->mapped, memory_order_relaxed);
+	if (chunk) {
+		if (st->curr)
+			st->curr->next = chunk->next;
+		else
+			st->first = chunk->next;
+
+		mapped -= chunk->len;
+		unmap_scratch_chunk(chunk);
+	}
+
+	// Each new chunk doubles the scratch stack capacity (within limit)
+	len = st->curr ? 2*st->curr->len : SCRATCH_CHUNK_MIN;
+	if (len > SCRATCH_CHUNK_MAX)
+		len = SCRATCH_CHUNK_MAX;
+
+	if (len < needed)
+		len = needed;
+
+	if (mapped + len > SCRATCH_MAPPED_MAX) {
+		atomic_store_explicit(&st->mapped, mapped, memory_order_relaxed);
+		return -1;
+	}
+
+	chunk = map_scratch_chunk(len);
+	if (!chunk) {
+		atomic_store_explicit(&st->mapped, mapped, memory_order_relaxed);
+		return -1;
+	}
+
+	atomic_store_explicit(&st->mapped, mapped + len, memory_order_relaxed);
+	chunk->len = len;
+	chunk->end = (char*)chunk + len;
+	if (st->curr) {
+		chunk->next = st->curr->next;
+		st->curr->next = chunk;
+	} else {
+		chunk->next = st->first;
+		st->first = chunk;
+	}
+
+exit:
+	st->curr = chunk;
+	st->top = (char*)(chunk + 1);
+	st->end = chunk->end;
+	return 0;
+}
+
+
+/**
+ * scratch_alloc() - allocate block from the scratch stack of the thread
+ * @st:         scratch stack of the calling thread
+ * @size:       size of the block (must not exceed SCRATCH_CHUNK_MAX)
+ *
+ * Return: pointer to block aligned on MALLOCA_SCRATCH_TAG modulo
+ * 4*MM_STK_ALIGN in case of success, NULL if the scratch stack cannot serve
+ * the request.
+ */
+static
+void* scratch_alloc(struct scratch_stack* st, size_t size)
+{
+	struct scratch_hdr* hdr;
+	struct scratch_chunk* prev_chunk = st->curr;
+	char* prev_top = st->top;
+	uintptr_t addr;
+	size_t needed;
+
+	// Worst case of space consumed by header, alignment padding and data
+	needed = sizeof(*hdr) + 4*MM_STK_ALIGN + size;
+	if ((size_t)(st->end - st->top) < needed) {
+		if (scratch_next_chunk(st, needed))
+			return NULL;
+	}
+
+	// Get the lowest address after the header having the scratch tag
+	addr = (uintptr_t)st->top + sizeof(*hdr) - MALLOCA_SCRATCH_TAG;
+	addr = (addr + MALLOCA_TAG_MASK) & ~(uintptr_t)MALLOCA_TAG_MASK;
+	addr += MALLOCA_SCRATCH_TAG;
+
+	hdr = (struct scratch_hdr*)addr - 1;
+	hdr->prev = st->last;
+	hdr->prev_chunk = prev_chunk;
+	hdr->prev_top = prev_top;
+	hdr->is_freed = 0;
+
+	st->last = hdr;
+	st->top = (char*)addr + size;
+	counter_inc(&st->num_scratch);
+
+	return (void*)addr;
+}
+
+
+/**
+ * scratch_free() - release block allocated with scratch_alloc()
+ * @ptr:        block to release
+ */
+static
+void scratch_free(void* ptr)
+{
+	struct scratch_stack* st = thread_scratch;
+	struct scratch_hdr* hdr = (struct scratch_hdr*)ptr - 1;
+
+	hdr->is_freed = 1;
+
+	// Pop all released blocks from the top of the stack
+	while (st->last && st->last->is_freed) {
+		hdr = st->last;
+		st->last = hdr->prev;
+		st->curr = hdr->prev_chunk;
+		st->top = hdr->prev_top;
+		st->end = st->curr ? st->curr->end : NULL;
+	}
+}
+
+
+/**
+ * heap_alloc() - allocate block on heap for mm_malloca()
+ * @size:       size of the block
+ *
+ * Return: pointer to block aligned on MALLOCA_HEAP_TAG modulo
+ * 4*MM_STK_ALIGN in case of success, NULL otherwise with error state set.
+ */
+static
+void* heap_alloc(size_t size)
 {
+	static struct alloc_site site = ALLOC_SITE_INIT("mm_malloca");
 	char * ptr;
 	size_t alloc_size;
 
 	// Increase allocated size to guarantee alignment requirement
-	alloc_size = size + 2*MM_STK_ALIGN;
+	alloc_size = size + 4*MM_STK_ALIGN;
 	if (alloc_size < size) {
 		mm_raise_error(ENOMEM, "size=%zu is too big", size);
 		return NULL;
 	}
 
 	// Allocate memory block
-	ptr = internal_aligned_alloc(2*MM_STK_ALIGN, alloc_size);
+	ptr = site_alloc(&site, 4*MM_STK_ALIGN, alloc_size);
 	if (ptr == NULL) {
 		mm_raise_from_errno("malloca_on_heap(%zu) failed", alloc_size);
 		return NULL;
 	}
 
-	// Get pointer aligned on MM_STK_ALIGN modulo (2*MM_STK_ALIGN)
-	ptr += MM_STK_ALIGN;
+	return ptr + MALLOCA_HEAP_TAG;
+}
+
 
-	return ptr;
+/**
+ * _mm_malloca_on_heap() - heap memory allocation version of mm_malloca()
+ * @size:       size of memory to be allocated
+ *
+ * Function called when mm_malloca() cannot allocate on stack because @size is
+ * too big. The allocation will be attempted in the scratch stack of the
+ * calling thread and, if it cannot be served there, on heap.
+ *
+ * NOTE: although this is function is exported, this should not be used
+ * anywhere excepting by the mm_malloca() macro.
+ *
+ * Return: the pointer on allocated memory in case of success. The return value
+ * is then ensured to be of value MM_STK_ALIGN modulo (2*MM_STK_ALIGN). This
+ * particularity will be used to recognize when a memory block has been
+ * allocated on stack or not. In case of failure (likely due to @size too
+ * large), NULL is returned.
+ */
+API_EXPORTED
+void* _mm_malloca_on_heap(size_t size)
+{
+	struct scratch_stack* st;
+	void* ptr;
+
+	st = get_scratch_stack();
+	if (UNLIKELY(!st)) {
+		atomic_fetch_add(&retired_num_heap, 1);
+		return heap_alloc(size);
+	}
+
+	if (size <= SCRATCH_CHUNK_MAX/2) {
+		ptr = scratch_alloc(st, size);
+		if (ptr)
+			return ptr;
+	}
+
+	counter_inc(&st->num_heap);
+	return heap_alloc(size);
 }
 
 
@@ -144,8 +626,8 @@ void* _mm_malloca_on_heap(size_t size)
  * _mm_freea_on_heap() - deallocate memory when mm_malloca() has used heap
  * @ptr:        memory block to deallocate
  *
- * Function called when mm_freea() has detected that @ptr has been allocated on
- * heap.
+ * Function called when mm_freea() has detected that @ptr has not been
+ * allocated on stack.
  *
  * NOTE: although this is function is exported, this should not be used
  * anywhere excepting by the mm_freea() macro.
@@ -155,5 +637,143 @@ void _mm_freea_on_heap(void* ptr)
 {
 	char* base = ptr;
 
-	mm_aligned_free(base - MM_STK_ALIGN);
+	if (((uintptr_t)ptr & MALLOCA_TAG_MASK) == MALLOCA_SCRATCH_TAG) {
+		scratch_free(ptr);
+		return;
+	}
+
+	site_free(base - MALLOCA_HEAP_TAG);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                    Adaptive stack allocation limit                     *
+ *                                                                        *
+ **************************************************************************/
+
+// Stack space never used by mm_malloca_adaptive()
+#define STACK_SAFETY_MARGIN     (64*1024)
+
+// stack_bounds_state values
+#define STACK_BOUNDS_UNKNOWN    0
+#define STACK_BOUNDS_VALID      1
+#define STACK_BOUNDS_INVALID    -1
+
+static thread_local int stack_bounds_state;
+static thread_local uintptr_t stack_low;
+static thread_local uintptr_t stack_high;
+
+
+/**
+ * init_stack_bounds() - get the bounds of the stack of the calling thread
+ *
+ * Initialize @stack_low and @stack_high of the calling thread and set
+ * @stack_bounds_state accordingly.
+ */
+static NOINLINE
+void init_stack_bounds(void)
+{
+	stack_bounds_state = STACK_BOUNDS_INVALID;
+
+#if defined (_WIN32)
+
+	ULONG_PTR low, high;
+
+	GetCurrentThreadStackLimits(&low, &high);
+	stack_low = low;
+	stack_high = high;
+	stack_bounds_state = STACK_BOUNDS_VALID;
+
+#elif defined (HAVE_PTHREAD_GETATTR_NP)
+
+	pthread_attr_t attr;
+	void* addr;
+	size_t size;
+
+	if (pthread_getattr_np(pthread_self(), &attr))
+		return;
+
+	if (!pthread_attr_getstack(&attr, &addr, &size)) {
+		stack_low = (uintptr_t)addr;
+		stack_high = stack_low + size;
+		stack_bounds_state = STACK_BOUNDS_VALID;
+	}
+
+	pthread_attr_destroy(&attr);
+
+#endif /* if defined (_WIN32) */
+}
+
+
+/**
+ * _mm_malloca_fits_stack() - test whether a block can be allocated on stack
+ * @size:       size of the block to allocate
+ *
+ * Function called by mm_malloca_adaptive() when @size is above
+ * MM_STACK_ALLOC_THRESHOLD. The stack space left to the calling thread is
+ * estimated from the stack bounds of the thread (determined once per
+ * thread) and the current stack pointer.
+ *
+ * NOTE: although this is function is exported, this should not be used
+ * anywhere excepting by the mm_malloca_adaptive() macro.
+ *
+ * Return: 1 if the allocation of @size bytes would consume at most half of
+ * the stack left (after removal of a safety margin), 0 otherwise or if the
+ * stack bounds are not known.
+ */
+API_EXPORTED
+int _mm_malloca_fits_stack(size_t size)
+{
+	char marker;
+	uintptr_t sp = (uintptr_t)&marker;
+	size_t headroom;
+
+	if (UNLIKELY(stack_bounds_state == STACK_BOUNDS_UNKNOWN))
+		init_stack_bounds();
+
+	// The stack pointer might be out of the stack bounds if the thread
+	// runs on an alternate stack (signal handler, sanitizer fake stack)
+	if (stack_bounds_state != STACK_BOUNDS_VALID
+	    || sp <= stack_low || sp > stack_high)
+		return 0;
+
+	headroom = sp - stack_low;
+	if (headroom < STACK_SAFETY_MARGIN)
+		return 0;
+
+	return size <= (headroom - STACK_SAFETY_MARGIN) / 2;
+}
+
+
+/**
+ * mm_malloca_get_stats() - get statistics of mm_malloca() fallbacks
+ * @stats:      pointer to structure receiving the statistics
+ *
+ * Report how the allocations of mm_malloca() that could not be done on stack
+ * have been served, accumulated over all the threads of the process since
+ * its start. The allocations done on stack are not accounted.
+ *
+ * Return: always 0
+ */
+API_EXPORTED
+int mm_malloca_get_stats(struct mm_malloca_stats* stats)
+{
+	struct scratch_stack* st;
+
+	mm_thr_mutex_lock(&scratch_mtx);
+
+	stats->scratch_allocs = retired_num_scratch;
+	stats->heap_fallbacks = atomic_load(&retired_num_heap);
+	stats->scratch_mapped = 0;
+	for (st = scratch_list; st != NULL; st = st->next) {
+		stats->scratch_allocs += counter_get(&st->num_scratch);
+		stats->heap_fallbacks += counter_get(&st->num_heap);
+		stats->scratch_mapped += atomic_load_explicit(&st->mapped,
+		                                              memory_order_relaxed);
+	}
+
+	mm_thr_mutex_unlock(&scratch_mtx);
+
+	return 0;
 }
@@ -0,0 +1,450 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "mmlib.h"
+#include "mmerrno.h"
+#include "mmpredefs.h"
+#include "alloc-internal.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+#define ARENA_CHUNK_SIZE_DEFAULT        (64*1024)
+
+/**
+ * struct arena_chunk - header of a memory block of an arena
+ * @next:       next chunk in the list of chunks of the arena
+ * @end:        end of the usable area of the chunk
+ * @maplen:     length of mapping (including header and guard page) if the
+ *              chunk has been allocated with guard page. 0 otherwise.
+ *
+ * The usable memory of the chunk starts right after the header.
+ */
+struct arena_chunk {
+	struct arena_chunk* next;
+	char* end;
+	size_t maplen;
+};
+
+
+/**
+ * struct mm_arena - region allocator
+ * @ptr:        next free byte in the current chunk
+ * @end:        end of the usable area of the current chunk
+ * @curr:       chunk from which the allocations are currently served
+ * @first:      first chunk of the arena
+ * @chunk_size: default size of a chunk
+ * @flags:      flags passed at arena creation
+ */
+struct mm_arena {
+	char* ptr;
+	char* end;
+	struct arena_chunk* curr;
+	struct arena_chunk* first;
+	size_t chunk_size;
+	int flags;
+};
+
+#define CHUNK_HDR_SIZE \
+	((sizeof(struct arena_chunk) + 2*MM_STK_ALIGN-1) & ~(2*MM_STK_ALIGN-1))
+
+
+/**************************************************************************
+ *                                                                        *
+ *                       Chunk allocation                                 *
+ *                                                                        *
+ **************************************************************************/
+
+static
+size_t get_page_size(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+
+/**
+ * map_guarded_chunk() - allocate chunk followed by a guard page
+ * @size:       minimal usable size of the chunk
+ *
+ * Return: pointer to the initialized chunk in case of success, NULL
+ * otherwise with error state set accordingly
+ */
+static
+struct arena_chunk* map_guarded_chunk(size_t size)
+{
+	struct arena_chunk* chunk;
+	size_t pgsz = get_page_size();
+	size_t maplen;
+	char* base;
+
+	// usable area + header rounded to page size, plus the guard page
+	maplen = ((size + CHUNK_HDR_SIZE + pgsz-1) & ~(pgsz-1)) + pgsz;
+
+#ifdef _WIN32
+	DWORD old_prot;
+
+	base = VirtualAlloc(NULL, maplen, MEM_RESERVE|MEM_COMMIT,
+	                    PAGE_READWRITE);
+	if (!base) {
+		mm_raise_error(ENOMEM, "Cannot map arena chunk (len=%zu)",
+		               maplen);
+		return NULL;
+	}
+
+	if (!VirtualProtect(base + maplen - pgsz, pgsz,
+	                    PAGE_NOACCESS, &old_prot)) {
+		VirtualFree(base, 0, MEM_RELEASE);
+		mm_raise_error(ENOMEM, "Cannot set guard page");
+		return NULL;
+	}
+
+#else /* _WIN32 */
+
+	base = mmap(NULL, maplen, PROT_READ|PROT_WRITE,
+	            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		mm_raise_from_errno("Cannot map arena chunk (len=%zu)", maplen);
+		return NULL;
+	}
+
+	if (mprotect(base + maplen - pgsz, pgsz, PROT_NONE)) {
+		mm_raise_from_errno("Cannot set guard page");
+		munmap(base, maplen);
+		return NULL;
+	}
+
+#endif /* _WIN32 */
+
+	chunk = (struct arena_chunk*)base;
+	chunk->end = base + maplen - pgsz;
+	chunk->maplen = maplen;
+
+	return chunk;
+}
+
+
+/**
+ * unmap_guarded_chunk() - deallocate chunk mapped with map_guarded_chunk()
+ * @chunk:      chunk to deallocate
+ */
+static
+void unmap_guarded_chunk(struct arena_chunk* chunk)
+{
+#ifdef _WIN32
+	VirtualFree(chunk, 0, MEM_RELEASE);
+#else
+	munmap(chunk, chunk->maplen);
+#endif
+}
+
+
+/**
+ * chunk_create() - allocate a new chunk for an arena
+ * @arena:      arena for which the chunk is allocated
+ * @size:       minimal usable size of the chunk
+ *
+ * Return: pointer to the initialized chunk in case of success, NULL
+ * otherwise with error state set accordingly
+ */
+static
+struct arena_chunk* chunk_create(struct mm_arena* arena, size_t size)
+{
+	static struct alloc_site site = ALLOC_SITE_INIT("arena chunk");
+	struct arena_chunk* chunk;
+
+	if (size < arena->chunk_size)
+		size = arena->chunk_size;
+
+	if (size > SIZE_MAX - CHUNK_HDR_SIZE - 2*get_page_size()) {
+		mm_raise_error(ENOMEM, "size=%zu is too big", size);
+		return NULL;
+	}
+
+	if (arena->flags & MM_ARENA_GUARD)
+		return map_guarded_chunk(size);
+
+	chunk = site_alloc(&site, 2*MM_STK_ALIGN, size + CHUNK_HDR_SIZE);
+	if (!chunk) {
+		mm_raise_from_errno("Cannot allocate arena chunk");
+		return NULL;
+	}
+
+	chunk->end = (char*)chunk + CHUNK_HDR_SIZE + size;
+	chunk->maplen = 0;
+
+	return chunk;
+}
+
+
+static
+void chunk_destroy(struct arena_chunk* chunk)
+{
+	if (chunk->maplen)
+		unmap_guarded_chunk(chunk);
+	else
+		site_free(chunk);
+}
+
+
+static inline
+char* chunk_data(struct arena_chunk* chunk)
+{
+	return (char*)chunk + CHUNK_HDR_SIZE;
+}
+
+
+static
+void arena_set_curr_chunk(struct mm_arena* arena, struct arena_chunk* chunk)
+{
+	arena->curr = chunk;
+	arena->ptr = chunk_data(chunk);
+	arena->end = chunk->end;
+}
+
+
+/**
+ * arena_alloc_slow() - allocate from the next chunk
+ * @arena:      arena to allocate from
+ * @alignment:  alignment of requested block
+ * @size:       size of requested block
+ *
+ * Called when the current chunk has not enough space left. The next chunk
+ * in the list is reused if it is big enough, otherwise a new chunk is
+ * inserted after the current one.
+ *
+ * Return: allocated memory block in case of success, NULL otherwise with
+ * error state set.
+ */
+static NOINLINE
+void* arena_alloc_slow(struct mm_arena* arena, size_t alignment, size_t size)
+{
+	struct arena_chunk* next;
+	size_t needed;
+
+	if (size > SIZE_MAX - alignment) {
+		mm_raise_error(ENOMEM, "size=%zu is too big", size);
+		return NULL;
+	}
+
+	// Chunk data are aligned on 2*MM_STK_ALIGN, so only bigger
+	// alignment may need padding
+	needed = size;
+	if (alignment > 2*MM_STK_ALIGN)
+		needed += alignment;
+
+	next = arena->curr->next;
+	if (!next || (size_t)(next->end - chunk_data(next)) < needed) {
+		next = chunk_create(arena, needed);
+		if (!next)
+			return NULL;
+
+		next->next = arena->curr->next;
+		arena->curr->next = next;
+	}
+
+	arena_set_curr_chunk(arena, next);
+
+	return mm_arena_alloc(arena, alignment, size);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                               Arena API                                *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_arena_create() - create a region allocator
+ * @chunk_size: default size of the memory chunks of the arena. If 0, a
+ *              default of 64KiB is used.
+ * @flags:      0 or MM_ARENA_GUARD
+ *
+ * This function creates a bump-pointer allocator: memory blocks allocated
+ * with mm_arena_alloc() are carved sequentially from large chunks and are
+ * never freed individually. Instead, the state of the arena can be
+ * recorded with mm_arena_mark() and all the allocations performed after
+ * that point can be released at once with mm_arena_rewind(). Similarly,
+ * mm_arena_reset() releases all the allocations of the arena. This makes
+ * the arena suitable for request-scoped scratch memory: each allocation
+ * costs a pointer increment and freeing everything at the end of the
+ * request is O(1).
+ *
+ * The arena grows by chunks of @chunk_size bytes (or more if an allocation
+ * does not fit in that size). The chunks are kept by the arena when memory
+ * is released with mm_arena_rewind() or mm_arena_reset(), so that they can
+ * be reused without asking new memory to the system. They are all given back
+ * when the arena is destroyed with mm_arena_destroy().
+ *
+ * If @flags contains MM_ARENA_GUARD, each chunk is directly mapped from the
+ * system and followed by an inaccessible guard page: an overflow past the
+ * last block of a chunk will then trigger a segmentation fault instead of
+ * silently corrupting memory.
+ *
+ * An arena is not thread-safe: it must not be used concurrently by
+ * multiple threads.
+ *
+ * Return: pointer to the created arena in case of success. NULL otherwise
+ * with error state set accordingly.
+ */
+API_EXPORTED
+struct mm_arena* mm_arena_create(size_t chunk_size, int flags)
+{
+	struct mm_arena* arena;
+	struct arena_chunk* chunk;
+
+	if (flags & ~MM_ARENA_GUARD) {
+		mm_raise_error(EINVAL, "Invalid flags (0x%08x)", flags);
+		return NULL;
+	}
+
+	arena = malloc(sizeof(*arena));
+	if (!arena) {
+		mm_raise_from_errno("Cannot allocate arena");
+		return NULL;
+	}
+
+	*arena = (struct mm_arena) {
+		.chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE_DEFAULT,
+		.flags = flags,
+	};
+
+	chunk = chunk_create(arena, arena->chunk_size);
+	if (!chunk) {
+		free(arena);
+		return NULL;
+	}
+
+	chunk->next = NULL;
+	arena->first = chunk;
+	arena_set_curr_chunk(arena, chunk);
+
+	return arena;
+}
+
+
+/**
+ * mm_arena_destroy() - destroy an arena
+ * @arena:      arena to destroy (may be NULL)
+ *
+ * Release all the memory held by @arena. All blocks allocated from @arena
+ * become invalid.
+ */
+API_EXPORTED
+void mm_arena_destroy(struct mm_arena* arena)
+{
+	struct arena_chunk* chunk;
+	struct arena_chunk* next;
+
+	if (!arena)
+		return;
+
+	for (chunk = arena->first; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		chunk_destroy(chunk);
+	}
+
+	free(arena);
+}
+
+
+/**
+ * mm_arena_alloc() - allocate memory block from an arena
+ * @arena:      arena from which the memory must be allocated
+ * @alignment:  alignment of the block, must be a power of 2. If 0, the
+ *              block is aligned on a boundary suitable for any data type.
+ * @size:       size of the block
+ *
+ * Return: pointer to the allocated memory in case of success. NULL
+ * otherwise with error state set accordingly.
+ */
+API_EXPORTED
+void* mm_arena_alloc(struct mm_arena* arena, size_t alignment, size_t size)
+{
+	uintptr_t addr;
+
+	if (alignment == 0)
+		alignment = MM_STK_ALIGN;
+
+	if (UNLIKELY(!MM_IS_POW2(alignment))) {
+		mm_raise_error(EINVAL, "alignment (%zu) is not a power of 2",
+		               alignment);
+		return NULL;
+	}
+
+	addr = ((uintptr_t)arena->ptr + alignment-1) & ~(uintptr_t)(alignment-1);
+	if (UNLIKELY(addr > (uintptr_t)arena->end
+	             || size > (uintptr_t)arena->end - addr))
+		return arena_alloc_slow(arena, alignment, size);
+
+	arena->ptr = (char*)(addr + size);
+	return (void*)addr;
+}
+
+
+/**
+ * mm_arena_mark() - record the current allocation state of an arena
+ * @arena:      arena whose state must be recorded
+ * @pos:        location receiving the state
+ *
+ * Store in @pos the current allocation point of @arena. Passing @pos later
+ * to mm_arena_rewind() will release all blocks allocated after this call.
+ */
+API_EXPORTED
+void mm_arena_mark(struct mm_arena* arena, struct mm_arena_pos* pos)
+{
+	pos->chunk = arena->curr;
+	pos->ptr = arena->ptr;
+}
+
+
+/**
+ * mm_arena_rewind() - release all the blocks allocated after a mark
+ * @arena:      arena to rewind
+ * @pos:        state previously recorded with mm_arena_mark()
+ *
+ * Release all the blocks allocated from @arena since @pos has been recorded
+ * with mm_arena_mark(). The blocks allocated before the mark remain valid.
+ * The memory is kept by the arena to serve the next allocations. @pos must
+ * not have been recorded before a call to mm_arena_reset() or before a
+ * rewind to an earlier position.
+ */
+API_EXPORTED
+void mm_arena_rewind(struct mm_arena* arena, const struct mm_arena_pos* pos)
+{
+	arena->curr = pos->chunk;
+	arena->ptr = pos->ptr;
+	arena->end = arena->curr->end;
+}
+
+
+/**
+ * mm_arena_reset() - release all the blocks of an arena
+ * @arena:      arena to reset
+ *
+ * Release all the blocks allocated from @arena. The memory is kept by the
+ * arena to serve the next allocations.
+ */
+API_EXPORTED
+void mm_arena_reset(struct mm_arena* arena)
+{
+	arena_set_curr_chunk(arena, arena->first);
+}
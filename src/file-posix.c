@@ -14,6 +14,7 @@
 #include "mmerrno.h"
 #include "mmpredefs.h"
 #include "mmsysio.h"
+#include "alloc-internal.h"
 #include "file-internal.h"
 #include "utils-posix.h"
 
@@ -951,9 +952,10 @@ int mm_remove(const char* path, int flags)
 API_EXPORTED
 MM_DIR* mm_opendir(const char* path)
 {
+	static struct alloc_site site = ALLOC_SITE_INIT("MM_DIR");
 	DIR * dir;
 	MM_DIR * d;
-	d = malloc(sizeof(*d));
+	d = site_malloc(&site, sizeof(*d));
 	if (d == NULL) {
 		mm_raise_from_errno("opendir(%s) failed", path);
 		return NULL;
@@ -961,7 +963,7 @@ MM_DIR* mm_opendir(const char* path)
 
 	dir = opendir(path);
 	if (dir == NULL) {
-		free(d);
+		site_free(d);
 		mm_raise_from_errno("opendir(%s) failed", path);
 		return NULL;
 	}
@@ -988,8 +990,8 @@ void mm_closedir(MM_DIR* dir)
 		return;
 
 	closedir(dir->dir);
-	free(dir->dirent);
-	free(dir);
+	site_free(dir->dirent);
+	site_free(dir);
 }
 
 
@@ -1047,6 +1049,7 @@ void mm_rewinddir(MM_DIR* dir)
 API_EXPORTED
 const struct mm_dirent* mm_readdir(MM_DIR* d, int * status)
 {
+	static struct alloc_site dirent_site = ALLOC_SITE_INIT("mm_dirent");
 	size_t reclen, namelen;
 	struct dirent* rd;
 
@@ -1071,7 +1074,8 @@ const struct mm_dirent* mm_readdir(MM_DIR* d, int * status)
 	namelen = strlen(rd->d_name) + 1;
 	reclen = sizeof(*d->dirent) + namelen;
 	if (UNLIKELY(d->dirent == NULL || d->dirent->reclen < reclen)) {
-		void * tmp = realloc(d->dirent, reclen);
+		void * tmp = site_realloc(&dirent_site, d->dirent,
+		                          SITE_MALLOC_ALIGN, reclen);
 		if (tmp == NULL) {
 			mm_raise_from_errno("failed to alloc required memory");
 			return NULL;
@@ -1106,12 +1110,13 @@ const struct mm_dirent* mm_readdir(MM_DIR* d, int * status)
 static
 int clone_fd_fallback(int fd_in, int fd_out)
 {
+	static struct alloc_site site = ALLOC_SITE_INIT("file copy buffer");
 	size_t wbuf_sz;
 	char * buffer, * wbuf;
 	ssize_t rsz, wsz;
 	int rv = -1;
 
-	buffer = malloc(COPYBUFFER_SIZE);
+	buffer = site_malloc(&site, COPYBUFFER_SIZE);
 	if (!buffer)
 		return mm_raise_from_errno("unable to alloc transfer buffer");
 
@@ -1138,7 +1143,7 @@ int clone_fd_fallback(int fd_in, int fd_out)
 	rv = 0;
 
 exit:
-	free(buffer);
+	site_free(buffer);
 	return rv;
 }
 
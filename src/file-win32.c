@@ -8,6 +8,7 @@
 #include "mmsysio.h"
 #include "mmerrno.h"
 #include "mmlib.h"
+#include "alloc-internal.h"
 #include "file-internal.h"
 #include "local-ipc-win32.h"
 #include "socket-win32.h"
@@ -1262,6 +1263,7 @@ int mm_remove(const char* path, int flags)
 static
 int win32_find_file(MM_DIR * dir)
 {
+	static struct alloc_site dirent_site = ALLOC_SITE_INIT("mm_dirent");
 	size_t reclen, namelen;
 	int path_u16_len;
 	char16_t* path_u16;
@@ -1307,7 +1309,8 @@ int win32_find_file(MM_DIR * dir)
 	namelen = get_utf8_buffer_len_from_utf16(find_dataw.cFileName);
 	reclen = sizeof(*dir->dirent) + namelen;
 	if (dir->dirent == NULL || dir->dirent->reclen != reclen) {
-		void * tmp = realloc(dir->dirent, reclen);
+		void * tmp = site_realloc(&dirent_site, dir->dirent,
+		                          SITE_MALLOC_ALIGN, reclen);
 		if (tmp == NULL)
 			return mm_raise_from_errno("cannot alloc dirent");
 
@@ -1325,11 +1328,12 @@ int win32_find_file(MM_DIR * dir)
 API_EXPORTED
 MM_DIR* mm_opendir(const char* path)
 {
+	static struct alloc_site site = ALLOC_SITE_INIT("MM_DIR");
 	int len;
 	MM_DIR * d;
 
 	len = strlen(path) + 3;  // concat with "/*\0"
-	d = malloc(sizeof(*d) + len);
+	d = site_malloc(&site, sizeof(*d) + len);
 	if (d == NULL)
 		goto error;
 
@@ -1360,8 +1364,8 @@ void mm_closedir(MM_DIR* dir)
 	if (dir->hdir != INVALID_HANDLE_VALUE)
 		FindClose(dir->hdir);
 
-	free(dir->dirent);
-	free(dir);
+	site_free(dir->dirent);
+	site_free(dir);
 }
 
 /* doc in posix implementation */
@@ -1739,12 +1743,13 @@ exit:
 static
 int clone_hnd_fallback(HANDLE hnd_src, HANDLE hnd_dst)
 {
+	static struct alloc_site site = ALLOC_SITE_INIT("file copy buffer");
 	size_t wbuf_sz;
 	char * buffer, * wbuf;
 	ssize_t rsz, wsz;
 	int rv = -1;
 
-	buffer = malloc(COPYBUFFER_SIZE);
+	buffer = site_malloc(&site, COPYBUFFER_SIZE);
 	if (!buffer)
 		return -1;
 
@@ -1771,7 +1776,7 @@ int clone_hnd_fallback(HANDLE hnd_src, HANDLE hnd_dst)
 	rv = 0;
 
 exit:
-	free(buffer);
+	site_free(buffer);
 	return rv;
 }
 
@@ -0,0 +1,1762 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc-internal.h"
+#include "log-internal.h"
+#include "mmerrno.h"
+#include "mmlog.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "mmtime.h"
+#include "tls-internal.h"
+
+/**
+ * DOC:
+ * In binary mode, mm_log() does not format the log line: it only stores
+ * the level, a timestamp, the address of the location and format strings
+ * and the raw bytes of the arguments in a ring buffer private to the
+ * calling thread. A background thread consumes the records of all threads
+ * in timestamp order and either formats them as usual log lines or writes
+ * them as a binary stream that is decoded later by mm_log_binary_decode()
+ * (or the mmlog-decode tool).
+ *
+ * The types of the arguments are found by parsing the format string. This
+ * is done only the first time a format string is met: the result is kept
+ * in a table indexed by the address of the string and cached in the
+ * buffer of each thread. Hence the format and location strings must be
+ * string literals (or at least remain valid and unchanged), which is how
+ * the mm_log_*() macros are meant to be used. A format that cannot be
+ * handled (positional arguments, %n, wide strings...) is formatted
+ * immediately and recorded as a string.
+ *
+ * Each thread is the only producer of its buffer and the background thread
+ * the only consumer, so recording never takes a lock (except to parse a new
+ * format). If the buffer is full, the record is dropped and accounted.
+ */
+
+#define BINLOG_BUFSIZE          (64*1024)
+#define BINLOG_MAX_CONV         16
+#define BINLOG_SPEC_MAXLEN      15
+#define BINLOG_FORMAT_MAXLEN    UINT16_MAX
+#define BINLOG_PERIOD_MS        10
+#define BINLOG_DONE_WAIT_MS     10
+#define BINLOG_ENTRY_MAXLEN     (1024*1024)
+#define BINLOG_VERSION          1
+#define FMT_CACHE_SIZE          64
+#define FMT_TABLE_MIN_SIZE      64
+#define CACHELINE_SIZE          64
+#define WRBUF_SIZE              4096
+#define SEC_IN_NSEC             1000000000
+#define BYTE_ORDER_MARK         0x01020304
+#define REC_PADDING             1
+#define PREC_NONE               -1
+#define PREC_STAR               -2
+
+#define ALIGN8(x)       (((x) + 7) & ~(size_t)7)
+#define MIN(a, b)       ((a) <= (b) ? (a) : (b))
+
+enum arg_type {
+	ARG_NONE,       // "%%" conversion: no argument
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_INTMAX,
+	ARG_PTRDIFF,
+	ARG_DOUBLE,
+	ARG_LDOUBLE,
+	ARG_PTR,
+	ARG_STR,
+};
+
+/**
+ * struct log_conv - conversion specification of a format string
+ * @start:      offset of the '%' in the format string
+ * @len:        length of the specification
+ * @type:       type of the converted argument (one of the ARG_* value)
+ * @num_star:   number of int arguments supplying the field width and
+ *              precision ('*') before the converted argument
+ * @prec:       precision of the conversion, PREC_NONE if not specified,
+ *              PREC_STAR if supplied by the last '*' argument
+ */
+struct log_conv {
+	uint16_t start;
+	uint8_t len;
+	uint8_t type;
+	uint8_t num_star;
+	int prec;
+};
+
+
+/**
+ * struct log_format - parsed format (or location) string
+ * @key:        address of the string
+ * @id:         identifier of the string in the current binary stream
+ * @epoch:      binary stream in which @id has been defined (0 if none)
+ * @valid:      true if the format can be recorded in binary
+ * @num_conv:   number of conversion specifications in @convs
+ * @max_args_size: maximum size of the arguments recorded for the format
+ * @convs:      conversion specifications of the format
+ */
+struct log_format {
+	const char* key;
+	uint32_t id;
+	unsigned int epoch;
+	int valid;
+	int num_conv;
+	size_t max_args_size;
+	struct log_conv convs[BINLOG_MAX_CONV];
+};
+
+
+/**
+ * struct binlog_rec - header of a record in a thread buffer
+ * @size:       size of the record including the arguments (multiple of 8).
+ *              If REC_PADDING is set, the record is a padding up to the end
+ *              of the ring and only @size is valid: the padding may be
+ *              smaller than the header.
+ * @lvl:        level of the log
+ * @ts_format:  timestamp format of the log (MM_LOG_TS_*)
+ * @ts:         time of the log in ns (in the clock matching @ts_format)
+ * @location:   location string supplied to mm_log()
+ * @fmt:        parsed format string
+ * @args:       raw arguments
+ */
+struct binlog_rec {
+	uint32_t size;
+	int16_t lvl;
+	int16_t ts_format;
+	int64_t ts;
+	const char* location;
+	const struct log_format* fmt;
+	unsigned char args[];
+};
+
+
+struct fmt_cache_entry {
+	const char* key;
+	const struct log_format* fmt;
+};
+
+
+/**
+ * struct binlog_buffer - ring buffer of the log records of a thread
+ * @next:       next buffer in the registry
+ * @exited:     true once the thread has terminated
+ * @mask:       size of @data minus 1
+ * @num_dropped: number of records dropped because the buffer was full
+ * @num_reported: number of dropped records already reported (consumer)
+ * @cache:      formats recently used by the thread
+ * @head:       offset of the next record to write (written by the thread)
+ * @tail:       offset of the next record to read (written by the consumer)
+ * @data:       storage of the records
+ */
+struct binlog_buffer {
+	struct binlog_buffer* next;
+	atomic_int exited;
+	size_t mask;
+	atomic_size_t num_dropped;
+	size_t num_reported;
+	struct fmt_cache_entry cache[FMT_CACHE_SIZE];
+	_Alignas(CACHELINE_SIZE) atomic_size_t head;
+	_Alignas(CACHELINE_SIZE) atomic_size_t tail;
+	_Alignas(CACHELINE_SIZE) unsigned char data[];
+};
+
+
+/**
+ * struct binlog_state - state of the binary logging
+ * @mtx:        mutex protecting the fields below and the registry
+ * @wake_cond:  condition signalled to wake up the consumer
+ * @done_cond:  condition broadcast when the consumer has drained the
+ *              buffers
+ * @generation: number of times the consumer has drained the buffers
+ * @running:    true if the consumer thread is running
+ * @stop:       true if the consumer thread must exit
+ * @epoch:      number of binary streams started so far
+ * @next_id:    identifier of the next string defined in the stream
+ * @thread:     consumer thread
+ */
+struct binlog_state {
+	mm_thr_mutex_t mtx;
+	mm_thr_cond_t wake_cond;
+	mm_thr_cond_t done_cond;
+	unsigned int generation;
+	int running;
+	int stop;
+	unsigned int epoch;
+	uint32_t next_id;
+	mm_thread_t thread;
+};
+
+
+/**
+ * struct binlog_file_header - header of a binary log stream
+ * @magic:      "MMLOGBIN"
+ * @version:    BINLOG_VERSION
+ * @byte_order: BYTE_ORDER_MARK written in the byte order of the producer
+ * @ldouble_size: size of long double in the producer
+ * @reserved:   0
+ */
+struct binlog_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t ldouble_size;
+	uint32_t reserved;
+};
+
+
+enum binlog_entry_type {
+	BINLOG_STRING = 1,
+	BINLOG_LOG,
+	BINLOG_DROPPED,
+};
+
+/**
+ * struct binlog_entry - header of an entry of a binary log stream
+ * @type:       type of entry (one of BINLOG_STRING, BINLOG_LOG or
+ *              BINLOG_DROPPED)
+ * @len:        size of the payload following the header
+ *
+ * The payload of BINLOG_STRING is the identifier of the string (uint32_t)
+ * followed by its content. The payload of BINLOG_DROPPED is the number of
+ * records dropped (uint64_t). The payload of BINLOG_LOG is a struct
+ * binlog_log_entry followed by the arguments.
+ */
+struct binlog_entry {
+	uint32_t type;
+	uint32_t len;
+};
+
+
+struct binlog_log_entry {
+	int32_t lvl;
+	uint32_t fmt_id;
+	uint32_t loc_id;
+	int32_t ts_format;
+	int64_t ts;
+};
+
+
+atomic_int binlog_active;
+
+static struct binlog_state binlog = {
+	.mtx = MM_THR_MUTEX_INITIALIZER,
+	.wake_cond = MM_THR_COND_INITIALIZER,
+	.done_cond = MM_THR_COND_INITIALIZER,
+};
+
+static thread_local struct binlog_buffer* thread_buffer;
+static struct binlog_buffer* registry;
+static mm_thr_once_t binlog_once = MM_THR_ONCE_INIT;
+static tls_key_t binlog_key;
+static int binlog_key_valid;
+
+static mm_thr_mutex_t fmt_mtx = MM_THR_MUTEX_INITIALIZER;
+static struct log_format** fmt_table;
+static int fmt_table_size;
+static int fmt_table_num;
+static struct log_format raw_format;
+
+
+/**************************************************************************
+ *                                                                        *
+ *                           Format parsing                               *
+ *                                                                        *
+ **************************************************************************/
+
+static
+size_t arg_max_size(int type)
+{
+	switch (type) {
+	case ARG_NONE:    return 0;
+	case ARG_LDOUBLE: return ALIGN8(sizeof(long double));
+	case ARG_STR:     return ALIGN8(sizeof(uint32_t) + MM_LOG_LINE_MAXLEN);
+	default:          return sizeof(int64_t);
+	}
+}
+
+
+/**
+ * parse_conv_type() - get the argument type of a conversion
+ * @mod:        length modifier ("", "hh", "h", "l", "ll", "L", "z", "j",
+ *              "t" or "q")
+ * @conv:       conversion specifier
+ *
+ * Return: the ARG_* type, -1 if the conversion is not supported
+ */
+static
+int parse_conv_type(const char* mod, char conv)
+{
+	switch (conv) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		if (!mod[0] || mod[0] == 'h')
+			return ARG_INT;
+
+		if (!strcmp(mod, "l"))
+			return ARG_LONG;
+
+		if (!strcmp(mod, "ll") || !strcmp(mod, "q"))
+			return ARG_LLONG;
+
+		if (!strcmp(mod, "z"))
+			return ARG_SIZE;
+
+		if (!strcmp(mod, "j"))
+			return ARG_INTMAX;
+
+		if (!strcmp(mod, "t"))
+			return ARG_PTRDIFF;
+
+		return -1;
+
+	case 'f': case 'F': case 'e': case 'E':
+	case 'g': case 'G': case 'a': case 'A':
+		if (!mod[0] || !strcmp(mod, "l"))
+			return ARG_DOUBLE;
+
+		if (!strcmp(mod, "L"))
+			return ARG_LDOUBLE;
+
+		return -1;
+
+	case 'c':
+		return mod[0] ? -1 : ARG_INT;
+
+	case 's':
+		return mod[0] ? -1 : ARG_STR;
+
+	case 'p':
+		return mod[0] ? -1 : ARG_PTR;
+
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * parse_log_format() - find the arguments of a format string
+ * @lf:         parsed format to initialize
+ * @fmt:        format string
+ *
+ * Fill @lf with the conversion specifications of @fmt. If a conversion is
+ * not supported, @lf->valid is left to 0 and @lf->max_args_size is the size
+ * of the formatted message recorded instead of the arguments.
+ */
+static
+void parse_log_format(struct log_format* lf, const char* fmt)
+{
+	const char* p = fmt;
+	char mod[3];
+	int type, num_star, prec, i;
+	size_t start, len;
+	char conv;
+
+	lf->key = fmt;
+	lf->valid = 0;
+	lf->num_conv = 0;
+	lf->max_args_size = 0;
+
+	while ((p = strchr(p, '%'))) {
+		start = p - fmt;
+		p++;
+
+		// flags, field width and precision
+		num_star = 0;
+		p += strspn(p, "-+ #0'");
+		if (*p == '*') {
+			num_star++;
+			p++;
+		} else {
+			p += strspn(p, "0123456789");
+		}
+
+		prec = PREC_NONE;
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				prec = PREC_STAR;
+				num_star++;
+				p++;
+			} else {
+				// Longer strings are truncated when formatted anyway
+				for (prec = 0; *p >= '0' && *p <= '9'; p++)
+					prec = MIN(10*prec + (*p - '0'),
+					           MM_LOG_LINE_MAXLEN);
+			}
+		}
+
+		// length modifier
+		for (i = 0; i < 2 && strchr("hlLzjtq", *p) && *p; i++)
+			mod[i] = *p++;
+
+		mod[i] = '\0';
+
+		conv = *p;
+		if (!conv)
+			goto invalid;
+
+		p++;
+		len = p - (fmt + start);
+		if (conv == '%' && len == 2)
+			type = ARG_NONE;
+		else
+			type = parse_conv_type(mod, conv);
+
+		if (type < 0 || len > BINLOG_SPEC_MAXLEN
+		    || start > BINLOG_FORMAT_MAXLEN
+		    || lf->num_conv == BINLOG_MAX_CONV)
+			goto invalid;
+
+		lf->convs[lf->num_conv++] = (struct log_conv) {
+			.start = start,
+			.len = len,
+			.type = type,
+			.num_star = num_star,
+			.prec = prec,
+		};
+		lf->max_args_size += num_star * sizeof(int64_t)
+		                     + arg_max_size(type);
+	}
+
+	lf->valid = 1;
+	return;
+
+invalid:
+	// The message is formatted when logged and recorded as a string
+	lf->max_args_size = arg_max_size(ARG_STR);
+}
+
+
+static inline
+unsigned int hash_ptr(const void* key)
+{
+	uintptr_t v = (uintptr_t)key;
+
+	v ^= v >> 17;
+	v *= UINT32_C(0x9e3779b1);
+	return (unsigned int)(v ^ (v >> 15));
+}
+
+
+static
+int fmt_table_grow(void)
+{
+	struct log_format** table;
+	int i, j, size = fmt_table_size ? 2*fmt_table_size : FMT_TABLE_MIN_SIZE;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -1;
+
+	for (i = 0; i < fmt_table_size; i++) {
+		if (!fmt_table[i])
+			continue;
+
+		j = hash_ptr(fmt_table[i]->key) & (size-1);
+		while (table[j])
+			j = (j+1) & (size-1);
+
+		table[j] = fmt_table[i];
+	}
+
+	free(fmt_table);
+	fmt_table = table;
+	fmt_table_size = size;
+	return 0;
+}
+
+
+/**
+ * get_log_format() - get the parsed version of a format string
+ * @key:        format string (or location string)
+ *
+ * Return: the parsed format, NULL in case of allocation failure
+ */
+static NOINLINE
+struct log_format* get_log_format(const char* key)
+{
+	struct log_format* lf = NULL;
+	int i;
+
+	mm_thr_mutex_lock(&fmt_mtx);
+
+	if (2*(fmt_table_num+1) > fmt_table_size && fmt_table_grow())
+		goto exit;
+
+	i = hash_ptr(key) & (fmt_table_size-1);
+	while (fmt_table[i] && fmt_table[i]->key != key)
+		i = (i+1) & (fmt_table_size-1);
+
+	lf = fmt_table[i];
+	if (lf)
+		goto exit;
+
+	lf = calloc(1, sizeof(*lf));
+	if (!lf)
+		goto exit;
+
+	parse_log_format(lf, key);
+	fmt_table[i] = lf;
+	fmt_table_num++;
+
+exit:
+	mm_thr_mutex_unlock(&fmt_mtx);
+	return lf;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                            Thread buffers                              *
+ *                                                                        *
+ **************************************************************************/
+
+static
+void binlog_thread_exit(void* arg)
+{
+	struct binlog_buffer* buf = arg;
+
+	// The buffer is released by the consumer once emptied
+	atomic_store_explicit(&buf->exited, 1, memory_order_release);
+	thread_buffer = NULL;
+}
+
+
+static
+void init_binlog(void)
+{
+	if (!tls_key_create(&binlog_key, binlog_thread_exit))
+		binlog_key_valid = 1;
+
+	parse_log_format(&raw_format, "%s");
+}
+
+
+static NOINLINE
+struct binlog_buffer* create_thread_buffer(void)
+{
+	static struct alloc_site site = ALLOC_SITE_INIT("binary log buffer");
+	struct binlog_buffer* buf;
+
+	if (!binlog_key_valid)
+		return NULL;
+
+	buf = site_alloc(&site, CACHELINE_SIZE, sizeof(*buf) + BINLOG_BUFSIZE);
+	if (!buf)
+		return NULL;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->mask = BINLOG_BUFSIZE - 1;
+
+	mm_thr_mutex_lock(&binlog.mtx);
+	buf->next = registry;
+	registry = buf;
+	mm_thr_mutex_unlock(&binlog.mtx);
+
+	tls_key_set(binlog_key, buf);
+	thread_buffer = buf;
+
+	return buf;
+}
+
+
+static inline
+const struct log_format* get_cached_format(struct binlog_buffer* buf,
+                                           const char* msg)
+{
+	struct fmt_cache_entry* entry;
+
+	entry = &buf->cache[hash_ptr(msg) & (FMT_CACHE_SIZE-1)];
+	if (UNLIKELY(entry->key != msg)) {
+		entry->fmt = get_log_format(msg);
+		entry->key = entry->fmt ? msg : NULL;
+	}
+
+	return entry->fmt;
+}
+
+
+/**
+ * reserve_record() - reserve space for a record in a thread buffer
+ * @buf:        buffer of the calling thread
+ * @size:       maximum size of the record
+ *
+ * Return: the location at which the record can be written (contiguously),
+ * NULL if the buffer is full.
+ */
+static inline
+struct binlog_rec* reserve_record(struct binlog_buffer* buf, size_t size)
+{
+	struct binlog_rec* pad;
+	size_t head, tail, contiguous;
+
+	head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+	contiguous = buf->mask + 1 - (head & buf->mask);
+
+	// A record cannot be split: skip the end of the ring if needed
+	if (contiguous < size) {
+		if (head + contiguous + size - tail > buf->mask + 1)
+			return NULL;
+
+		// Only the size fits if less than a header is left
+		pad = (struct binlog_rec*)(buf->data + (head & buf->mask));
+		pad->size = contiguous | REC_PADDING;
+		head += contiguous;
+		atomic_store_explicit(&buf->head, head, memory_order_release);
+	} else if (head + size - tail > buf->mask + 1) {
+		return NULL;
+	}
+
+	return (struct binlog_rec*)(buf->data + (head & buf->mask));
+}
+
+
+static
+void commit_record(struct binlog_buffer* buf, struct binlog_rec* rec)
+{
+	size_t head;
+
+	head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+	atomic_store_explicit(&buf->head, head + rec->size,
+	                      memory_order_release);
+}
+
+
+static inline
+size_t put_i64(unsigned char* out, int64_t value)
+{
+	memcpy(out, &value, sizeof(value));
+	return sizeof(value);
+}
+
+
+/**
+ * put_str() - copy a string argument in a record
+ * @out:        location receiving the string
+ * @str:        string argument
+ * @maxlen:     maximum number of bytes to read from @str (precision of the
+ *              conversion): @str may not be null terminated within it
+ *
+ * Return: the size written in @out
+ */
+static
+size_t put_str(unsigned char* out, const char* str, size_t maxlen)
+{
+	uint32_t len;
+
+	if (!str)
+		str = "(null)";
+
+	// The log line is truncated anyway
+	maxlen = MIN(maxlen, MM_LOG_LINE_MAXLEN-1);
+	for (len = 0; len < maxlen && str[len]; len++)
+		;
+
+	memcpy(out, &len, sizeof(len));
+	memcpy(out + sizeof(len), str, len);
+	out[sizeof(len) + len] = '\0';
+
+	return ALIGN8(sizeof(len) + len + 1);
+}
+
+
+/**
+ * capture_args() - copy the arguments of a log in a record
+ * @lf:         parsed format of the log
+ * @out:        location receiving the arguments (at least
+ *              @lf->max_args_size bytes)
+ * @args:       arguments supplied to mm_log()
+ *
+ * Return: the size of the arguments written in @out
+ */
+static
+size_t capture_args(const struct log_format* lf, unsigned char* out,
+                    va_list args)
+{
+	const struct log_conv* conv;
+	long double ldval;
+	double dval;
+	size_t len = 0;
+	int i, s, star, prec;
+
+	for (i = 0; i < lf->num_conv; i++) {
+		conv = &lf->convs[i];
+		star = 0;
+		for (s = 0; s < conv->num_star; s++) {
+			star = va_arg(args, int);
+			len += put_i64(out + len, star);
+		}
+
+		// A negative precision is taken as if it were omitted
+		prec = (conv->prec == PREC_STAR) ? star : conv->prec;
+
+		switch (conv->type) {
+		case ARG_NONE:
+			break;
+
+		case ARG_INT:
+			len += put_i64(out + len, va_arg(args, int));
+			break;
+
+		case ARG_LONG:
+			len += put_i64(out + len, va_arg(args, long));
+			break;
+
+		case ARG_LLONG:
+			len += put_i64(out + len, va_arg(args, long long));
+			break;
+
+		case ARG_SIZE:
+			len += put_i64(out + len, va_arg(args, size_t));
+			break;
+
+		case ARG_INTMAX:
+			len += put_i64(out + len, va_arg(args, intmax_t));
+			break;
+
+		case ARG_PTRDIFF:
+			len += put_i64(out + len, va_arg(args, ptrdiff_t));
+			break;
+
+		case ARG_DOUBLE:
+			dval = va_arg(args, double);
+			memcpy(out + len, &dval, sizeof(dval));
+			len += sizeof(int64_t);
+			break;
+
+		case ARG_LDOUBLE:
+			ldval = va_arg(args, long double);
+			memcpy(out + len, &ldval, sizeof(ldval));
+			len += ALIGN8(sizeof(ldval));
+			break;
+
+		case ARG_PTR:
+			len += put_i64(out + len,
+			               (intptr_t)va_arg(args, void*));
+			break;
+
+		case ARG_STR:
+			len += put_str(out + len, va_arg(args, const char*),
+			               prec < 0 ? SIZE_MAX : (size_t)prec);
+			break;
+		}
+	}
+
+	return len;
+}
+
+
+static
+void write_log_now(int lvl, const char* location, const char* msg,
+                   va_list args)
+{
+	char buff[MM_LOG_LINE_MAXLEN];
+	struct mm_timespec ts;
+	size_t len;
+	int rv, ts_format;
+
+	ts_format = get_log_timestamp(&ts);
+	len = format_log_header(buff, sizeof(buff), ts_format, &ts,
+	                        lvl, location);
+	rv = vsnprintf(buff + len, sizeof(buff) - len, msg, args);
+	if (rv > 0)
+		len += MIN((size_t)rv, sizeof(buff) - len - 1);
+
+	buff[len++] = '\n';
+	if (write_log_files(lvl, buff, len))
+		write_log_str(buff, len);
+}
+
+
+/**
+ * binlog_record() - record a log in the buffer of the calling thread
+ * @lvl:        level of the log
+ * @location:   location string supplied to mm_log()
+ * @msg:        format string supplied to mm_log()
+ * @args:       arguments supplied to mm_log()
+ */
+LOCAL_SYMBOL
+void binlog_record(int lvl, const char* location, const char* msg,
+                   va_list args)
+{
+	struct binlog_buffer* buf;
+	const struct log_format* lf;
+	struct binlog_rec* rec;
+	struct mm_timespec ts;
+	char str[MM_LOG_LINE_MAXLEN];
+	size_t args_size;
+
+	buf = thread_buffer;
+	if (UNLIKELY(!buf)) {
+		mm_thr_once(&binlog_once, init_binlog);
+		buf = create_thread_buffer();
+		if (!buf) {
+			write_log_now(lvl, location, msg, args);
+			return;
+		}
+	}
+
+	lf = get_cached_format(buf, msg);
+	if (UNLIKELY(!lf)) {
+		write_log_now(lvl, location, msg, args);
+		return;
+	}
+
+	rec = reserve_record(buf, sizeof(*rec) + lf->max_args_size);
+	if (UNLIKELY(!rec)) {
+		atomic_fetch_add_explicit(&buf->num_dropped, 1,
+		                          memory_order_relaxed);
+		return;
+	}
+
+	rec->ts_format = get_log_timestamp(&ts);
+	rec->lvl = lvl;
+	rec->ts = (int64_t)ts.tv_sec * SEC_IN_NSEC + ts.tv_nsec;
+	rec->location = location;
+
+	if (LIKELY(lf->valid)) {
+		args_size = capture_args(lf, rec->args, args);
+	} else {
+		// Unsupported format: record the formatted message instead
+		vsnprintf(str, sizeof(str), msg, args);
+		lf = &raw_format;
+		args_size = put_str(rec->args, str, SIZE_MAX);
+	}
+
+	rec->fmt = lf;
+	rec->size = ALIGN8(sizeof(*rec) + args_size);
+	commit_record(buf, rec);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Record formatting                             *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct args_reader - cursor over the arguments of a record
+ * @data:       next byte to read
+ * @len:        number of bytes remaining
+ */
+struct args_reader {
+	const unsigned char* data;
+	size_t len;
+};
+
+
+static
+int read_arg(struct args_reader* rd, void* value, size_t size)
+{
+	if (rd->len < ALIGN8(size))
+		return -1;
+
+	memcpy(value, rd->data, size);
+	rd->data += ALIGN8(size);
+	rd->len -= ALIGN8(size);
+	return 0;
+}
+
+
+static
+const char* read_str_arg(struct args_reader* rd)
+{
+	const char* str;
+	uint32_t len;
+	size_t size;
+
+	if (rd->len < sizeof(len))
+		return NULL;
+
+	memcpy(&len, rd->data, sizeof(len));
+	size = ALIGN8(sizeof(len) + (size_t)len + 1);
+	if (len >= MM_LOG_LINE_MAXLEN || rd->len < size
+	    || rd->data[sizeof(len) + len] != '\0')
+		return NULL;
+
+	str = (const char*)rd->data + sizeof(len);
+	rd->data += size;
+	rd->len -= size;
+	return str;
+}
+
+
+static
+size_t append_str(char* buff, size_t blen, size_t len,
+                  const char* str, size_t slen)
+{
+	slen = MIN(slen, blen - len - 1);
+	memcpy(buff + len, str, slen);
+	return len + slen;
+}
+
+
+#define FORMAT_ARG(value) \
+	(conv->num_star == 0 ? snprintf(dst, rlen, spec, value) \
+	 : conv->num_star == 1 ? snprintf(dst, rlen, spec, star[0], value) \
+	 : snprintf(dst, rlen, spec, star[0], star[1], value))
+
+/**
+ * format_conv() - format an argument according to its conversion
+ * @conv:       conversion specification
+ * @spec:       null terminated conversion specification
+ * @rd:         arguments of the record
+ * @dst:        buffer receiving the formatted argument
+ * @rlen:       size of @dst
+ *
+ * Return: the number of bytes that would be written in @dst if large
+ * enough, -1 if the arguments are invalid.
+ */
+static
+int format_conv(const struct log_conv* conv, const char* spec,
+                struct args_reader* rd, char* dst, size_t rlen)
+{
+	int64_t ival;
+	double dval;
+	long double ldval;
+	const char* str;
+	int i, star[2];
+
+	for (i = 0; i < conv->num_star; i++) {
+		if (read_arg(rd, &ival, sizeof(ival)))
+			return -1;
+
+		star[i] = (int)ival;
+	}
+
+	switch (conv->type) {
+	case ARG_DOUBLE:
+		if (read_arg(rd, &dval, sizeof(dval)))
+			return -1;
+
+		return FORMAT_ARG(dval);
+
+	case ARG_LDOUBLE:
+		if (read_arg(rd, &ldval, sizeof(ldval)))
+			return -1;
+
+		return FORMAT_ARG(ldval);
+
+	case ARG_STR:
+		str = read_str_arg(rd);
+		if (!str)
+			return -1;
+
+		return FORMAT_ARG(str);
+
+	default:
+		break;
+	}
+
+	if (read_arg(rd, &ival, sizeof(ival)))
+		return -1;
+
+	switch (conv->type) {
+	case ARG_INT:     return FORMAT_ARG((int)ival);
+	case ARG_LONG:    return FORMAT_ARG((long)ival);
+	case ARG_LLONG:   return FORMAT_ARG((long long)ival);
+	case ARG_SIZE:    return FORMAT_ARG((size_t)ival);
+	case ARG_INTMAX:  return FORMAT_ARG((intmax_t)ival);
+	case ARG_PTRDIFF: return FORMAT_ARG((ptrdiff_t)ival);
+	case ARG_PTR:     return FORMAT_ARG((void*)(intptr_t)ival);
+	default:          return -1;
+	}
+}
+
+
+/**
+ * format_record_line() - generate the log line of a record
+ * @buff:       buffer that must receive the log line
+ * @blen:       size of @buff
+ * @ts:         time of the log in ns
+ * @ts_format:  timestamp format of the log (MM_LOG_TS_*)
+ * @lvl:        level of the log
+ * @location:   location string of the log
+ * @lf:         parsed format string of the log
+ * @args:       arguments recorded
+ * @args_len:   size of @args
+ *
+ * Return: the number of byte written on @buffer (not null terminated),
+ * including the end of line.
+ */
+static
+size_t format_record_line(char* buff, size_t blen, int64_t ts,
+                          int ts_format, int lvl, const char* location,
+                          const struct log_format* lf,
+                          const void* args, size_t args_len)
+{
+	struct mm_timespec log_ts = {
+		.tv_sec = ts / SEC_IN_NSEC,
+		.tv_nsec = ts % SEC_IN_NSEC,
+	};
+	struct args_reader rd = {.data = args, .len = args_len};
+	const struct log_conv* conv;
+	const char* fmt = lf->key;
+	char spec[BINLOG_SPEC_MAXLEN+1];
+	size_t len, pos = 0;
+	int i, rv;
+
+	len = format_log_header(buff, blen, ts_format, &log_ts, lvl, location);
+
+	for (i = 0; i < lf->num_conv; i++) {
+		conv = &lf->convs[i];
+		len = append_str(buff, blen, len, fmt + pos, conv->start - pos);
+		pos = conv->start + conv->len;
+
+		if (conv->type == ARG_NONE) {
+			len = append_str(buff, blen, len, "%", 1);
+			continue;
+		}
+
+		memcpy(spec, fmt + conv->start, conv->len);
+		spec[conv->len] = '\0';
+		rv = format_conv(conv, spec, &rd, buff + len, blen - len);
+		if (rv < 0) {
+			len = append_str(buff, blen, len, "(invalid)", 9);
+			break;
+		}
+
+		len += MIN((size_t)rv, blen - len - 1);
+	}
+
+	if (i == lf->num_conv)
+		len = append_str(buff, blen, len, fmt + pos, strlen(fmt + pos));
+
+	buff[len++] = '\n';
+	return len;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                              Consumer                                  *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct wrbuf - output buffer of the consumer
+ * @fd:         file descriptor to which the data is written (-1 for the
+ *              standard error)
+ * @binary:     true if the records are written as a binary stream, false
+ *              if they are written as log lines
+ * @len:        number of bytes pending in @data
+ * @data:       pending data
+ */
+struct wrbuf {
+	int fd;
+	int binary;
+	size_t len;
+	char data[WRBUF_SIZE];
+};
+
+
+static
+void wrbuf_flush(struct wrbuf* wr)
+{
+	const char* ptr = wr->data;
+	ssize_t rsz;
+
+	if (wr->fd < 0) {
+		write_log_str(wr->data, wr->len);
+		wr->len = 0;
+		return;
+	}
+
+	while (wr->len) {
+		rsz = mm_write(wr->fd, ptr, wr->len);
+		if (rsz < 0)
+			break;
+
+		ptr += rsz;
+		wr->len -= rsz;
+	}
+
+	wr->len = 0;
+}
+
+
+static
+void wrbuf_write(struct wrbuf* wr, const void* data, size_t len)
+{
+	const char* cdata = data;
+	size_t chunk;
+
+	while (len) {
+		if (wr->len == sizeof(wr->data))
+			wrbuf_flush(wr);
+
+		chunk = MIN(len, sizeof(wr->data) - wr->len);
+		memcpy(wr->data + wr->len, cdata, chunk);
+		wr->len += chunk;
+		cdata += chunk;
+		len -= chunk;
+	}
+}
+
+
+static
+void write_entry_header(struct wrbuf* wr, int type, size_t len)
+{
+	struct binlog_entry entry = {.type = type, .len = len};
+
+	wrbuf_write(wr, &entry, sizeof(entry));
+}
+
+
+/**
+ * get_string_id() - get the identifier of a string in the binary stream
+ * @wr:         output buffer of the stream
+ * @lf:         parsed string
+ *
+ * Define the string in the stream if not done yet.
+ *
+ * Return: the identifier of @lf in the stream
+ */
+static
+uint32_t get_string_id(struct wrbuf* wr, struct log_format* lf)
+{
+	size_t len;
+
+	if (lf->epoch == binlog.epoch)
+		return lf->id;
+
+	lf->id = binlog.next_id++;
+	lf->epoch = binlog.epoch;
+
+	len = strlen(lf->key);
+	write_entry_header(wr, BINLOG_STRING, sizeof(lf->id) + len);
+	wrbuf_write(wr, &lf->id, sizeof(lf->id));
+	wrbuf_write(wr, lf->key, len);
+
+	return lf->id;
+}
+
+
+static
+void write_record(struct wrbuf* wr, const struct binlog_rec* rec)
+{
+	struct binlog_log_entry entry;
+	struct log_format* lf = (struct log_format*)rec->fmt;
+	struct log_format* loc;
+	char line[MM_LOG_LINE_MAXLEN];
+	size_t len, args_len = rec->size - sizeof(*rec);
+
+	if (!wr->binary) {
+		len = format_record_line(line, sizeof(line), rec->ts,
+		                         rec->ts_format, rec->lvl,
+		                         rec->location, lf, rec->args,
+		                         args_len);
+		if (write_log_files(rec->lvl, line, len))
+			wrbuf_write(wr, line, len);
+
+		return;
+	}
+
+	loc = get_log_format(rec->location);
+	if (!loc)
+		return;
+
+	entry = (struct binlog_log_entry) {
+		.lvl = rec->lvl,
+		.fmt_id = get_string_id(wr, lf),
+		.loc_id = get_string_id(wr, loc),
+		.ts_format = rec->ts_format,
+		.ts = rec->ts,
+	};
+	write_entry_header(wr, BINLOG_LOG, sizeof(entry) + args_len);
+	wrbuf_write(wr, &entry, sizeof(entry));
+	wrbuf_write(wr, rec->args, args_len);
+}
+
+
+static
+void write_dropped(struct wrbuf* wr, uint64_t num_dropped)
+{
+	char line[MM_LOG_LINE_MAXLEN];
+	struct mm_timespec ts;
+	size_t len;
+	int ts_format;
+
+	if (wr->binary) {
+		write_entry_header(wr, BINLOG_DROPPED, sizeof(num_dropped));
+		wrbuf_write(wr, &num_dropped, sizeof(num_dropped));
+		return;
+	}
+
+	ts_format = get_log_timestamp(&ts);
+	len = format_log_header(line, sizeof(line), ts_format, &ts,
+	                        MM_LOG_WARN, "mmlog");
+	len += snprintf(line + len, sizeof(line) - len,
+	                "%llu log messages dropped\n",
+	                (unsigned long long)num_dropped);
+	len = MIN(len, sizeof(line));
+
+	// The decoder writes on its own output, not on the log sinks
+	if (wr->fd >= 0 || write_log_files(MM_LOG_WARN, line, len))
+		wrbuf_write(wr, line, len);
+}
+
+
+/**
+ * peek_record() - get the oldest record of a thread buffer
+ * @buf:        thread buffer
+ *
+ * Return: the oldest record, NULL if @buf is empty
+ */
+static
+const struct binlog_rec* peek_record(struct binlog_buffer* buf)
+{
+	const struct binlog_rec* rec;
+	size_t head, tail;
+
+	tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&buf->head, memory_order_acquire);
+	while (tail != head) {
+		rec = (const struct binlog_rec*)(buf->data + (tail & buf->mask));
+		if (!(rec->size & REC_PADDING))
+			return rec;
+
+		// Skip padding
+		tail += rec->size & ~REC_PADDING;
+		atomic_store_explicit(&buf->tail, tail, memory_order_release);
+	}
+
+	return NULL;
+}
+
+
+static
+void consume_record(struct binlog_buffer* buf, const struct binlog_rec* rec)
+{
+	size_t tail;
+
+	tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+	atomic_store_explicit(&buf->tail, tail + rec->size,
+	                      memory_order_release);
+}
+
+
+/**
+ * drain_buffers() - write the records of all threads in timestamp order
+ * @wr:         output buffer
+ */
+static
+void drain_buffers(struct wrbuf* wr)
+{
+	struct binlog_buffer *buf, *oldest_buf, **pbuf, *list;
+	const struct binlog_rec *rec, *oldest;
+	size_t num_dropped;
+
+	// Release the buffers of the exited threads that have been emptied.
+	// The buffers are only removed by the consumer: the list can be
+	// walked without lock afterwards.
+	mm_thr_mutex_lock(&binlog.mtx);
+	pbuf = &registry;
+	while ((buf = *pbuf)) {
+		if (atomic_load_explicit(&buf->exited, memory_order_acquire)
+		    && !peek_record(buf)
+		    && buf->num_reported == atomic_load(&buf->num_dropped)) {
+			*pbuf = buf->next;
+			site_free(buf);
+		} else {
+			pbuf = &buf->next;
+		}
+	}
+
+	list = registry;
+	mm_thr_mutex_unlock(&binlog.mtx);
+
+	while (1) {
+		oldest = NULL;
+		oldest_buf = NULL;
+		for (buf = list; buf; buf = buf->next) {
+			rec = peek_record(buf);
+			if (rec && (!oldest || rec->ts < oldest->ts)) {
+				oldest = rec;
+				oldest_buf = buf;
+			}
+		}
+
+		if (!oldest)
+			break;
+
+		write_record(wr, oldest);
+		consume_record(oldest_buf, oldest);
+	}
+
+	for (buf = list; buf; buf = buf->next) {
+		num_dropped = atomic_load(&buf->num_dropped);
+		if (num_dropped != buf->num_reported) {
+			write_dropped(wr, num_dropped - buf->num_reported);
+			buf->num_reported = num_dropped;
+		}
+	}
+
+	wrbuf_flush(wr);
+}
+
+
+static
+void write_stream_header(struct wrbuf* wr)
+{
+	struct binlog_file_header hdr = {
+		.magic = "MMLOGBIN",
+		.version = BINLOG_VERSION,
+		.byte_order = BYTE_ORDER_MARK,
+		.ldouble_size = sizeof(long double),
+	};
+
+	wrbuf_write(wr, &hdr, sizeof(hdr));
+}
+
+
+static
+void* binlog_consumer_thread(void* arg)
+{
+	struct wrbuf* wr = arg;
+	struct mm_timespec ts;
+	int stop;
+
+	if (wr->binary)
+		write_stream_header(wr);
+
+	do {
+		mm_thr_mutex_lock(&binlog.mtx);
+		stop = binlog.stop;
+		mm_thr_mutex_unlock(&binlog.mtx);
+
+		drain_buffers(wr);
+
+		mm_thr_mutex_lock(&binlog.mtx);
+		binlog.generation++;
+		mm_thr_cond_broadcast(&binlog.done_cond);
+		if (!binlog.stop) {
+			mm_gettime(MM_CLK_REALTIME, &ts);
+			mm_timeadd_ms(&ts, BINLOG_PERIOD_MS);
+			mm_thr_cond_timedwait(&binlog.wake_cond, &binlog.mtx,
+			                      &ts);
+		}
+
+		mm_thr_mutex_unlock(&binlog.mtx);
+	} while (!stop);
+
+	free(wr);
+	return NULL;
+}
+
+
+/**
+ * binlog_flush() - wait for the records logged so far to be written
+ */
+LOCAL_SYMBOL
+void binlog_flush(void)
+{
+	struct mm_timespec ts;
+	unsigned int target;
+
+	mm_thr_mutex_lock(&binlog.mtx);
+
+	// The draining in progress may have missed the latest records: wait
+	// for the next one to complete
+	target = binlog.generation + 2;
+	while (binlog.running && (int)(binlog.generation - target) < 0) {
+		mm_thr_cond_signal(&binlog.wake_cond);
+		mm_gettime(MM_CLK_REALTIME, &ts);
+		mm_timeadd_ms(&ts, BINLOG_DONE_WAIT_MS);
+		mm_thr_cond_timedwait(&binlog.done_cond, &binlog.mtx, &ts);
+	}
+
+	mm_thr_mutex_unlock(&binlog.mtx);
+}
+
+
+static
+void stop_binlog(void)
+{
+	mm_thr_mutex_lock(&binlog.mtx);
+	if (!binlog.running) {
+		mm_thr_mutex_unlock(&binlog.mtx);
+		return;
+	}
+
+	// The next logs are written directly
+	atomic_store(&binlog_active, 0);
+	binlog.stop = 1;
+	mm_thr_cond_signal(&binlog.wake_cond);
+	mm_thr_mutex_unlock(&binlog.mtx);
+
+	mm_thr_join(binlog.thread, NULL);
+
+	mm_thr_mutex_lock(&binlog.mtx);
+	binlog.running = 0;
+	binlog.stop = 0;
+	mm_thr_cond_broadcast(&binlog.done_cond);
+	mm_thr_mutex_unlock(&binlog.mtx);
+}
+
+
+MM_DESTRUCTOR(binlog)
+{
+	stop_binlog();
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                              Decoder                                   *
+ *                                                                        *
+ **************************************************************************/
+
+static
+int full_read(int fd, void* buf, size_t len)
+{
+	char* cbuf = buf;
+	ssize_t rsz;
+
+	while (len) {
+		rsz = mm_read(fd, cbuf, len);
+		if (rsz <= 0)
+			return rsz < 0 ? -1 : 1;
+
+		cbuf += rsz;
+		len -= rsz;
+	}
+
+	return 0;
+}
+
+
+/**
+ * struct decoder - state of the decoding of a binary log stream
+ * @strings:    strings defined in the stream indexed by their identifier
+ *              (each parsed as a format, the string follows the struct)
+ * @num_strings: number of elements of @strings
+ * @payload:    buffer receiving the payload of an entry
+ * @payload_size: size of @payload
+ */
+struct decoder {
+	struct log_format** strings;
+	uint32_t num_strings;
+	unsigned char* payload;
+	size_t payload_size;
+};
+
+
+static
+int decoder_define_string(struct decoder* dec, const unsigned char* data,
+                          size_t len)
+{
+	struct log_format** strings;
+	struct log_format* lf;
+	uint32_t i, id;
+	char* str;
+
+	if (len < sizeof(id))
+		return mm_raise_error(MM_EBADFMT, "Invalid string entry");
+
+	memcpy(&id, data, sizeof(id));
+	len -= sizeof(id);
+	if (id > BINLOG_ENTRY_MAXLEN)
+		return mm_raise_error(MM_EBADFMT, "Invalid string id");
+
+	if (id >= dec->num_strings) {
+		strings = realloc(dec->strings, (id+1) * sizeof(*strings));
+		if (!strings)
+			return mm_raise_from_errno("Cannot allocate strings");
+
+		for (i = dec->num_strings; i <= id; i++)
+			strings[i] = NULL;
+
+		dec->strings = strings;
+		dec->num_strings = id+1;
+	}
+
+	lf = malloc(sizeof(*lf) + len + 1);
+	if (!lf)
+		return mm_raise_from_errno("Cannot allocate string");
+
+	str = (char*)(lf + 1);
+	memcpy(str, data + sizeof(id), len);
+	str[len] = '\0';
+	parse_log_format(lf, str);
+
+	free(dec->strings[id]);
+	dec->strings[id] = lf;
+	return 0;
+}
+
+
+static
+int decoder_write_log(struct decoder* dec, struct wrbuf* wr,
+                      const unsigned char* data, size_t len)
+{
+	struct binlog_log_entry entry;
+	const struct log_format* lf;
+	const struct log_format* loc;
+	char line[MM_LOG_LINE_MAXLEN];
+	size_t line_len;
+
+	if (len < sizeof(entry))
+		return mm_raise_error(MM_EBADFMT, "Invalid log entry");
+
+	memcpy(&entry, data, sizeof(entry));
+	if (entry.fmt_id >= dec->num_strings || !dec->strings[entry.fmt_id]
+	    || entry.loc_id >= dec->num_strings || !dec->strings[entry.loc_id]
+	    || entry.lvl < MM_LOG_FATAL || entry.lvl > MM_LOG_DEBUG
+	    || entry.ts_format < MM_LOG_TS_DEFAULT
+	    || entry.ts_format > MM_LOG_TS_MONOTONIC)
+		return mm_raise_error(MM_EBADFMT, "Invalid log entry");
+
+	lf = dec->strings[entry.fmt_id];
+	loc = dec->strings[entry.loc_id];
+	if (!lf->valid)
+		return mm_raise_error(MM_EBADFMT, "Invalid log format");
+
+	line_len = format_record_line(line, sizeof(line), entry.ts,
+	                              entry.ts_format, entry.lvl, loc->key, lf,
+	                              data + sizeof(entry), len - sizeof(entry));
+	wrbuf_write(wr, line, line_len);
+	return 0;
+}
+
+
+static
+int decode_stream(struct decoder* dec, int in_fd, struct wrbuf* wr)
+{
+	struct binlog_file_header hdr;
+	struct binlog_entry entry;
+	unsigned char* payload;
+	uint64_t num_dropped;
+	int rv;
+
+	if (full_read(in_fd, &hdr, sizeof(hdr)))
+		return mm_raise_error(MM_EBADFMT, "Cannot read binary log header");
+
+	if (memcmp(hdr.magic, "MMLOGBIN", sizeof(hdr.magic))
+	    || hdr.version != BINLOG_VERSION)
+		return mm_raise_error(MM_EBADFMT, "Not a binary log stream");
+
+	if (hdr.byte_order != BYTE_ORDER_MARK
+	    || hdr.ldouble_size != sizeof(long double))
+		return mm_raise_error(MM_EBADFMT, "Binary log stream produced on "
+		                      "an incompatible platform");
+
+	while (1) {
+		rv = full_read(in_fd, &entry, sizeof(entry));
+		if (rv > 0)
+			return 0;
+
+		if (rv < 0)
+			return -1;
+
+		if (entry.len > BINLOG_ENTRY_MAXLEN)
+			return mm_raise_error(MM_EBADFMT, "Invalid entry length");
+
+		if (entry.len > dec->payload_size) {
+			payload = realloc(dec->payload, entry.len);
+			if (!payload)
+				return mm_raise_from_errno("Cannot allocate "
+				                           "entry");
+
+			dec->payload = payload;
+			dec->payload_size = entry.len;
+		}
+
+		if (full_read(in_fd, dec->payload, entry.len))
+			return mm_raise_error(MM_EBADFMT, "Truncated entry");
+
+		switch (entry.type) {
+		case BINLOG_STRING:
+			rv = decoder_define_string(dec, dec->payload,
+			                           entry.len);
+			break;
+
+		case BINLOG_LOG:
+			rv = decoder_write_log(dec, wr, dec->payload,
+			                       entry.len);
+			break;
+
+		case BINLOG_DROPPED:
+			if (entry.len != sizeof(num_dropped))
+				return mm_raise_error(MM_EBADFMT, "Invalid entry");
+
+			memcpy(&num_dropped, dec->payload, sizeof(num_dropped));
+			write_dropped(wr, num_dropped);
+			rv = 0;
+			break;
+
+		default:
+			// Unknown entries are skipped
+			rv = 0;
+			break;
+		}
+
+		if (rv)
+			return rv;
+	}
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                                  API                                   *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_log_binary_start() - defer the formatting of the logs
+ * @fd:         file descriptor receiving the binary log stream, -1 to
+ *              write formatted log lines on the log output
+ *
+ * Switch the logging to binary mode: mm_log() no longer formats the log
+ * line but only copies the format pointer, a timestamp and the raw
+ * arguments in a buffer private to the calling thread. This removes
+ * nearly all the logging cost (strftime(), localtime_r(), vsnprintf())
+ * from the calling thread. A background thread periodically collects the
+ * records of all threads and, in timestamp order:
+ *
+ * - if @fd is -1, formats them as usual log lines and writes them on the
+ *   log output.
+ * - otherwise writes them in binary on @fd. The stream is decoded later
+ *   into usual log lines by mm_log_binary_decode() or the mmlog-decode
+ *   tool, on the same platform.
+ *
+ * The arguments must match the printf conversions of the format: integer
+ * (with or without length modifier), floating point, character, string
+ * and pointer conversions are supported, as well as '*' field width and
+ * precision. Other formats are formatted immediately and recorded as a
+ * string. The format and location strings must be string literals, as
+ * with the mm_log_*() macros. The logs are timestamped when recorded,
+ * with the clock of the timestamp format set by mm_log_set_timestamp().
+ *
+ * The records of a thread are dropped if its 64KiB buffer fills up before
+ * the background thread collects them: the number of dropped records is
+ * reported in the log. A log of level MM_LOG_FATAL is written along with
+ * all pending records before mm_log() returns. The pending records are also
+ * written when the process exits normally, or by mm_log_flush(). The
+ * binary mode takes precedence over the mode set by mm_log_async_start().
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_binary_start(int fd)
+{
+	struct wrbuf* wr;
+	int rv = 0;
+
+	mm_thr_once(&binlog_once, init_binlog);
+	if (!binlog_key_valid)
+		return mm_raise_error(ENOMEM, "Cannot create thread key");
+
+	wr = malloc(sizeof(*wr));
+	if (!wr)
+		return mm_raise_from_errno("Cannot allocate output buffer");
+
+	wr->fd = fd < 0 ? -1 : fd;
+	wr->binary = fd >= 0;
+	wr->len = 0;
+
+	mm_thr_mutex_lock(&binlog.mtx);
+
+	if (binlog.running) {
+		rv = mm_raise_error(EALREADY, "Binary log already started");
+		free(wr);
+		goto exit;
+	}
+
+	// Start a new stream: the strings must be defined again
+	binlog.epoch++;
+	binlog.next_id = 0;
+
+	if (mm_thr_create(&binlog.thread, binlog_consumer_thread, wr)) {
+		free(wr);
+		rv = -1;
+		goto exit;
+	}
+
+	binlog.running = 1;
+	atomic_store(&binlog_active, 1);
+
+exit:
+	mm_thr_mutex_unlock(&binlog.mtx);
+	return rv;
+}
+
+
+/**
+ * mm_log_binary_stop() - format the logs in the calling thread again
+ *
+ * Write all pending records, stop the background thread started by
+ * mm_log_binary_start() and revert to the previous logging mode. No other
+ * thread may call mm_log() concurrently. Nothing is done if the binary
+ * mode is not active.
+ *
+ * Return: 0
+ */
+API_EXPORTED
+int mm_log_binary_stop(void)
+{
+	stop_binlog();
+	return 0;
+}
+
+
+/**
+ * mm_log_binary_decode() - convert a binary log stream into log lines
+ * @in_fd:      file descriptor from which the binary stream is read
+ * @out_fd:     file descriptor to which the log lines are written
+ *
+ * Read the binary stream written by mm_log_binary_start() from @in_fd
+ * until its end and write the log lines it contains on @out_fd, formatted
+ * as mm_log() does. The stream must have been produced on a platform of
+ * the same architecture.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_binary_decode(int in_fd, int out_fd)
+{
+	struct decoder dec = {.strings = NULL};
+	struct wrbuf* wr;
+	uint32_t i;
+	int rv;
+
+	wr = malloc(sizeof(*wr));
+	if (!wr)
+		return mm_raise_from_errno("Cannot allocate output buffer");
+
+	wr->fd = out_fd;
+	wr->binary = 0;
+	wr->len = 0;
+
+	rv = decode_stream(&dec, in_fd, wr);
+	wrbuf_flush(wr);
+
+	for (i = 0; i < dec.num_strings; i++)
+		free(dec.strings[i]);
+
+	free(dec.strings);
+	free(dec.payload);
+	free(wr);
+	return rv;
+}
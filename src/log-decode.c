@@ -0,0 +1,55 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mmargparse.h"
+#include "mmerrno.h"
+#include "mmlog.h"
+#include "mmsysio.h"
+
+#define STDIN_FD        0
+#define STDOUT_FD       1
+
+int main(int argc, char* argv[])
+{
+	int arg_index, fd = STDIN_FD, rv;
+	const char* path = NULL;
+	struct mm_arg_parser parser = {
+		.doc = "Print the log lines contained in the binary log stream "
+		       "FILE written by mm_log_binary_start(). The stream is "
+		       "read from standard input if FILE is not supplied.",
+		.args_doc = "[FILE]",
+		.execname = argv[0],
+	};
+
+	arg_index = mm_arg_parse(&parser, argc, argv);
+	if (arg_index < argc-1) {
+		fprintf(stderr, "%s: too many arguments\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (arg_index == argc-1) {
+		path = argv[arg_index];
+		fd = mm_open(path, O_RDONLY, 0);
+		if (fd < 0) {
+			mm_print_lasterror("Cannot open %s", path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	rv = mm_log_binary_decode(fd, STDOUT_FD);
+	if (rv)
+		mm_print_lasterror("Cannot decode %s",
+		                   path ? path : "standard input");
+
+	if (path)
+		mm_close(fd);
+
+	return rv ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef LOG_INTERNAL_H
+#define LOG_INTERNAL_H
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "mmtime.h"
+
+#ifndef MM_LOG_LINE_MAXLEN
+#define MM_LOG_LINE_MAXLEN 256
+#endif
+
+#ifdef _MSC_VER
+#  define restrict __restrict
+#endif
+
+int get_log_timestamp(struct mm_timespec* ts);
+size_t format_log_header(char* restrict buff, size_t blen, int format,
+                         const struct mm_timespec* ts,
+                         int lvl, const char* restrict location);
+void write_log_str(const char* buff, size_t len);
+int parse_log_level(const char* name);
+size_t parse_log_size(const char* str);
+
+int write_log_files(int lvl, const char* buff, size_t len);
+void flush_log_files(void);
+
+extern atomic_int binlog_active;
+
+void binlog_record(int lvl, const char* location, const char* msg,
+                   va_list args);
+void binlog_flush(void);
+
+extern atomic_int recorder_maxlvl;
+
+void set_recorder_maxlvl(int lvl);
+void recorder_write(const char* buff, size_t len);
+void recorder_dump_fatal(void);
+
+#endif /* ifndef LOG_INTERNAL_H */
@@ -0,0 +1,58 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mmargparse.h"
+#include "mmerrno.h"
+#include "mmlog.h"
+#include "mmsysio.h"
+
+#define STDOUT_FD       1
+
+static const char* unlink_flag;
+
+static
+struct mm_arg_opt cmdline_optv[] = {
+	{"u|unlink", MM_OPT_NOVAL, "set", {.sptr = &unlink_flag},
+	 "Remove the shared memory object NAME after reading it, e.g. once "
+	 "the recording process has crashed."},
+};
+
+
+int main(int argc, char* argv[])
+{
+	int arg_index, rv;
+	const char* name;
+	struct mm_arg_parser parser = {
+		.doc = "Print the log lines held by the flight recorder NAME "
+		       "started by mm_log_recorder_start() (or by the "
+		       "MM_LOG_RECORDER environment variable). The recording "
+		       "process may be running or may have crashed.",
+		.args_doc = "NAME",
+		.optv = cmdline_optv,
+		.num_opt = MM_NELEM(cmdline_optv),
+		.execname = argv[0],
+	};
+
+	arg_index = mm_arg_parse(&parser, argc, argv);
+	if (arg_index != argc-1) {
+		fprintf(stderr, "%s: a single NAME argument is expected\n",
+		        argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	name = argv[arg_index];
+	rv = mm_log_recorder_read(name, STDOUT_FD);
+	if (rv)
+		mm_print_lasterror("Cannot read log flight recorder %s", name);
+	else if (unlink_flag)
+		rv = mm_shm_unlink(name);
+
+	return rv ? EXIT_FAILURE : EXIT_SUCCESS;
+}
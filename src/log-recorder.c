@@ -0,0 +1,585 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log-internal.h"
+#include "mmerrno.h"
+#include "mmlib.h"
+#include "mmlog.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "mmtime.h"
+
+#ifdef _WIN32
+#  include <io.h>
+#  define raw_write(fd, buf, len)       _write(fd, buf, (unsigned int)(len))
+#else
+#  include <unistd.h>
+#  define raw_write(fd, buf, len)       write(fd, buf, len)
+#endif
+
+/**
+ * DOC:
+ * The flight recorder keeps the most recent log lines in a circular buffer
+ * mapped from a shared memory object. Recording a line takes no lock and no
+ * system call: the logging thread reserves its place in the buffer by
+ * incrementing atomically the write position @head of the buffer header and
+ * copies the formatted line there. Hence all levels can be recorded at a
+ * small cost while only the important ones are written on the sinks.
+ *
+ * The buffer can be read by an other process while the recording process is
+ * alive, or after it has crashed (a named shared memory object persists
+ * until it is unlinked). The layout of the shared memory object is a struct
+ * recorder_header of RECORDER_HDR_SIZE bytes followed by the data area. The
+ * byte at position pos (counted since the start of the recording) is stored
+ * at offset pos & (size-1) of the data area.
+ *
+ * A reader cannot know whether the lines being written at the time it reads
+ * the buffer are complete, so the last lines of a dump may be truncated or
+ * mixed with older data. The lines overwritten while the reader copies the
+ * buffer are detected by comparing @head before and after the copy.
+ */
+
+#define RECORDER_MAGIC          "MMLOGREC"
+#define RECORDER_HDR_SIZE       64
+#define RECORDER_MIN_SIZE       4096
+#define RECORDER_DEFAULT_SIZE   (1024*1024)
+#define STDERR_FD               2
+
+/**
+ * struct recorder_header - header of the flight recorder shared memory
+ * @magic:      RECORDER_MAGIC
+ * @size:       size of the data area (power of 2)
+ * @head:       number of bytes written since the start of the recording
+ */
+struct recorder_header {
+	char magic[8];
+	uint64_t size;
+	atomic_uint_least64_t head;
+};
+
+/**
+ * struct flight_recorder - state of the flight recorder of the process
+ * @hdr:        mapped shared memory object, NULL if not recording
+ * @num_writers: number of threads possibly accessing @hdr
+ * @mtx:        mutex serializing the start and stop of the recording,
+ *              protecting the fields below
+ * @map_len:    length of the mapping of @hdr
+ * @name:       name of the shared memory object (NULL if anonymous)
+ * @dump_signal: signal on which the buffer is dumped (0 if none)
+ * @prev_handler: handler of @dump_signal before the recording
+ */
+struct flight_recorder {
+	_Atomic(struct recorder_header*) hdr;
+	atomic_int num_writers;
+	mm_thr_mutex_t mtx;
+	size_t map_len;
+	char* name;
+	int dump_signal;
+	void (* prev_handler)(int);
+};
+
+static struct flight_recorder recorder = {
+	.mtx = MM_THR_MUTEX_INITIALIZER,
+};
+
+
+static
+char* get_data(const struct recorder_header* hdr)
+{
+	return (char*)hdr + RECORDER_HDR_SIZE;
+}
+
+
+/**
+ * write_data() - write all the data of a buffer on a file
+ * @fd:         file descriptor to write to
+ * @data:       data to write
+ * @len:        length of @data
+ *
+ * This function is async-signal-safe: it does not touch the error state.
+ *
+ * Return: 0 in case of success, -1 otherwise with errno set.
+ */
+static
+int write_data(int fd, const char* data, size_t len)
+{
+	ssize_t rsz;
+
+	while (len > 0) {
+		rsz = raw_write(fd, data, len);
+		if (rsz < 0)
+			return -1;
+
+		data += rsz;
+		len -= rsz;
+	}
+
+	return 0;
+}
+
+
+/**
+ * write_ring() - write the lines of a circular buffer on a file
+ * @fd:         file descriptor to write to
+ * @data:       data area of the circular buffer
+ * @size:       size of @data (power of 2)
+ * @start:      position of the first byte to write
+ * @end:        position after the last byte to write
+ *
+ * If the data does not start at the beginning of the recording, the
+ * (possibly partial) first line is skipped.
+ *
+ * This function is async-signal-safe: it does not touch the error state.
+ *
+ * Return: 0 in case of success, -1 otherwise with errno set.
+ */
+static
+int write_ring(int fd, const char* data, uint64_t size,
+               uint64_t start, uint64_t end)
+{
+	uint64_t mask = size - 1;
+	size_t len;
+
+	if (start > 0) {
+		while (start < end && data[start & mask] != '\n')
+			start++;
+
+		start++;
+	}
+
+	while (start < end) {
+		len = end - start;
+		if (len > size - (start & mask))
+			len = size - (start & mask);
+
+		if (write_data(fd, data + (start & mask), len))
+			return -1;
+
+		start += len;
+	}
+
+	return 0;
+}
+
+
+/**
+ * dump_recorder() - write the recorded lines of the process on a file
+ * @fd:         file descriptor to write to
+ *
+ * This function is async-signal-safe.
+ */
+static
+void dump_recorder(int fd)
+{
+	struct recorder_header* hdr;
+	uint64_t head, size;
+
+	static const char begin_line[] = "---- begin of log flight recorder ----\n";
+	static const char end_line[] = "---- end of log flight recorder ----\n";
+
+	atomic_fetch_add(&recorder.num_writers, 1);
+
+	hdr = atomic_load(&recorder.hdr);
+	if (hdr) {
+		size = hdr->size;
+		head = atomic_load(&hdr->head);
+		write_data(fd, begin_line, sizeof(begin_line) - 1);
+		write_ring(fd, get_data(hdr), size,
+		           head > size ? head - size : 0, head);
+		write_data(fd, end_line, sizeof(end_line) - 1);
+	}
+
+	atomic_fetch_sub(&recorder.num_writers, 1);
+}
+
+
+static
+void dump_signal_handler(int signum)
+{
+	(void)signum;
+
+	dump_recorder(STDERR_FD);
+}
+
+
+/**
+ * recorder_write() - record a log line in the flight recorder
+ * @buff:       formatted log line
+ * @len:        length of @buff
+ */
+LOCAL_SYMBOL
+void recorder_write(const char* buff, size_t len)
+{
+	struct recorder_header* hdr;
+	uint64_t pos, mask;
+	size_t first;
+	char* data;
+
+	atomic_fetch_add(&recorder.num_writers, 1);
+
+	hdr = atomic_load(&recorder.hdr);
+	if (hdr) {
+		mask = hdr->size - 1;
+		data = get_data(hdr);
+
+		pos = atomic_fetch_add_explicit(&hdr->head, len,
+		                                memory_order_relaxed);
+		first = hdr->size - (pos & mask);
+		if (first > len)
+			first = len;
+
+		memcpy(data + (pos & mask), buff, first);
+		memcpy(data, buff + first, len - first);
+	}
+
+	atomic_fetch_sub(&recorder.num_writers, 1);
+}
+
+
+/**
+ * recorder_dump_fatal() - dump the flight recorder after a fatal log
+ */
+LOCAL_SYMBOL
+void recorder_dump_fatal(void)
+{
+	dump_recorder(STDERR_FD);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                                  API                                   *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_log_recorder_start() - start recording the log lines in memory
+ * @name:       name of the shared memory object holding the recorded lines
+ *              (see mm_shm_open()), NULL for an anonymous one
+ * @opts:       options of the recording (NULL for default)
+ *
+ * Start the flight recorder of the process: the log lines are recorded in a
+ * circular buffer in shared memory, overwriting the oldest ones when full.
+ * A line is recorded without lock nor system call, so the recorder can keep
+ * the debug log lines while the sinks only write the important ones: the
+ * levels enabled by mm_log_set_maxlvl() and mm_log_set_module_maxlvl() do
+ * not apply to the recorder.
+ *
+ * The recorded lines are written on the standard error when a log line of
+ * level MM_LOG_FATAL is written (hence by mm_crash() and mm_check()), on
+ * the signal @dump_signal if set and by mm_log_recorder_dump(). If @name is
+ * not NULL, they can be read by an other process with
+ * mm_log_recorder_read() or the mmlog-recorder tool, while the recording
+ * process is running or after it has crashed. The shared memory object is
+ * unlinked by mm_log_recorder_stop() and when the process exits normally.
+ *
+ * @opts defines the following options of the recording (all set to 0 if
+ * @opts is NULL, except @maxlvl set to MM_LOG_DEBUG):
+ *
+ * @maxlvl
+ *   maximum level of the log lines recorded
+ * @size
+ *   size in bytes of the circular buffer, rounded up to a power of 2 (0 for
+ *   1MiB)
+ * @dump_signal
+ *   signal on which the recorded lines are written on the standard error
+ *   (0 for none). The previous handler of the signal is restored by
+ *   mm_log_recorder_stop().
+ *
+ * The flight recorder can also be started by environment with the
+ * following variables, read when the library is loaded:
+ *
+ * MM_LOG_RECORDER
+ *   name of the shared memory object (empty for an anonymous one)
+ * MM_LOG_RECORDER_MAXLEVEL
+ *   name of maximum level (FATAL, ERROR, WARN, INFO or DEBUG)
+ * MM_LOG_RECORDER_SIZE
+ *   size with optional k, M or G suffix
+ * MM_LOG_RECORDER_SIGNAL
+ *   number of the signal dumping the recorded lines
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_recorder_start(const char* name,
+                          const struct mm_log_recorder_opts* opts)
+{
+	struct mm_log_recorder_opts default_opts = {.maxlvl = MM_LOG_DEBUG};
+	struct recorder_header* hdr = NULL;
+	char* name_copy = NULL;
+	size_t size, map_len = 0;
+	int fd = -1, rv = -1;
+
+	if (!opts)
+		opts = &default_opts;
+
+	if (opts->maxlvl < MM_LOG_NONE || opts->maxlvl > MM_LOG_DEBUG
+	    || opts->dump_signal < 0)
+		return mm_raise_error(EINVAL, "Invalid log recorder options");
+
+	size = opts->size ? opts->size : RECORDER_DEFAULT_SIZE;
+	if (size > SIZE_MAX/2 - RECORDER_HDR_SIZE)
+		return mm_raise_error(EINVAL, "Log recorder size too big");
+
+	for (map_len = RECORDER_MIN_SIZE; map_len < size; map_len *= 2)
+		;
+
+	size = map_len;
+	map_len += RECORDER_HDR_SIZE;
+
+	mm_thr_mutex_lock(&recorder.mtx);
+
+	if (atomic_load(&recorder.hdr)) {
+		mm_raise_error(EBUSY, "Log flight recorder already started");
+		goto exit;
+	}
+
+	if (name) {
+		name_copy = strdup(name);
+		if (!name_copy) {
+			mm_raise_from_errno("Cannot allocate log recorder");
+			goto exit;
+		}
+
+		fd = mm_shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	} else {
+		fd = mm_anon_shm();
+	}
+
+	if (fd < 0
+	    || mm_ftruncate(fd, map_len)
+	    || !(hdr = mm_mapfile(fd, 0, map_len, MM_MAP_RDWR|MM_MAP_SHARED)))
+		goto exit;
+
+	memcpy(hdr->magic, RECORDER_MAGIC, sizeof(hdr->magic));
+	hdr->size = size;
+	atomic_init(&hdr->head, 0);
+
+	recorder.map_len = map_len;
+	recorder.name = name_copy;
+	recorder.dump_signal = opts->dump_signal;
+	atomic_store(&recorder.hdr, hdr);
+
+	if (opts->dump_signal)
+		recorder.prev_handler = signal(opts->dump_signal,
+		                               dump_signal_handler);
+
+	set_recorder_maxlvl(opts->maxlvl);
+
+	name_copy = NULL;
+	rv = 0;
+
+exit:
+	if (rv && name && fd >= 0)
+		mm_shm_unlink(name);
+
+	mm_thr_mutex_unlock(&recorder.mtx);
+
+	if (fd >= 0)
+		mm_close(fd);
+
+	free(name_copy);
+	return rv;
+}
+
+
+/**
+ * mm_log_recorder_stop() - stop recording the log lines in memory
+ *
+ * Stop the flight recorder started by mm_log_recorder_start() and unlink
+ * its shared memory object.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_recorder_stop(void)
+{
+	struct recorder_header* hdr;
+
+	mm_thr_mutex_lock(&recorder.mtx);
+
+	hdr = atomic_load(&recorder.hdr);
+	if (!hdr) {
+		mm_thr_mutex_unlock(&recorder.mtx);
+		return mm_raise_error(EINVAL, "Log flight recorder not started");
+	}
+
+	set_recorder_maxlvl(MM_LOG_NONE);
+
+	if (recorder.dump_signal)
+		signal(recorder.dump_signal, recorder.prev_handler);
+
+	// Wait for the threads still writing to the buffer
+	atomic_store(&recorder.hdr, NULL);
+	while (atomic_load(&recorder.num_writers))
+		mm_relative_sleep_ms(1);
+
+	mm_unmap(hdr);
+	if (recorder.name)
+		mm_shm_unlink(recorder.name);
+
+	free(recorder.name);
+	recorder.name = NULL;
+	recorder.dump_signal = 0;
+
+	mm_thr_mutex_unlock(&recorder.mtx);
+	return 0;
+}
+
+
+/**
+ * mm_log_recorder_dump() - write the recorded log lines on a file
+ * @fd:         file descriptor to write to
+ *
+ * Write on @fd the lines held by the flight recorder of the process, from
+ * the oldest to the most recent one, between a begin and an end marker
+ * line. This does nothing if the recorder is not started.
+ *
+ * This function is async-signal-safe, hence it can be called from a signal
+ * handler.
+ */
+API_EXPORTED
+void mm_log_recorder_dump(int fd)
+{
+	dump_recorder(fd);
+}
+
+
+/**
+ * mm_log_recorder_read() - write the log lines recorded by a process
+ * @name:       name of the shared memory object of the flight recorder
+ * @fd:         file descriptor to write to
+ *
+ * Write on @fd the lines held by the flight recorder started by
+ * mm_log_recorder_start() with @name, possibly in an other process which
+ * may have crashed. The buffer is copied before being written, so the
+ * recording process is not slowed down by the writes on @fd.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_recorder_read(const char* name, int fd)
+{
+	struct recorder_header* hdr;
+	struct mm_stat stat;
+	uint64_t size, start, end;
+	char* data = NULL;
+	int shm_fd, rv = -1;
+
+	shm_fd = mm_shm_open(name, O_RDONLY, 0);
+	if (shm_fd < 0)
+		return -1;
+
+	if (mm_fstat(shm_fd, &stat))
+		goto exit;
+
+	if ((size_t)stat.size < RECORDER_HDR_SIZE + RECORDER_MIN_SIZE) {
+		mm_raise_error(MM_EBADFMT, "%s is not a log flight recorder",
+		               name);
+		goto exit;
+	}
+
+	hdr = mm_mapfile(shm_fd, 0, stat.size, MM_MAP_READ|MM_MAP_SHARED);
+	if (!hdr)
+		goto exit;
+
+	size = hdr->size;
+	if (memcmp(hdr->magic, RECORDER_MAGIC, sizeof(hdr->magic))
+	    || size < RECORDER_MIN_SIZE || (size & (size - 1))
+	    || size > (uint64_t)stat.size - RECORDER_HDR_SIZE) {
+		mm_raise_error(MM_EBADFMT, "%s is not a log flight recorder",
+		               name);
+		goto exit_unmap;
+	}
+
+	data = malloc(size);
+	if (!data) {
+		mm_raise_from_errno("Cannot allocate log recorder copy");
+		goto exit_unmap;
+	}
+
+	// Only keep the bytes which have not been overwritten during the copy
+	end = atomic_load(&hdr->head);
+	memcpy(data, get_data(hdr), size);
+	start = atomic_load(&hdr->head);
+	start = start > size ? start - size : 0;
+
+	if (write_ring(fd, data, size, start, end)) {
+		mm_raise_from_errno("Cannot write recorded log lines");
+		goto exit_unmap;
+	}
+
+	rv = 0;
+
+exit_unmap:
+	mm_unmap(hdr);
+exit:
+	free(data);
+	mm_close(shm_fd);
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Configuration by environment                      *
+ *                                                                        *
+ **************************************************************************/
+
+MM_CONSTRUCTOR(log_recorder)
+{
+	struct mm_log_recorder_opts opts = {.maxlvl = MM_LOG_DEBUG};
+	const char* val;
+	const char* name;
+
+	name = getenv("MM_LOG_RECORDER");
+	if (!name)
+		return;
+
+	val = getenv("MM_LOG_RECORDER_MAXLEVEL");
+	if (val)
+		opts.maxlvl = parse_log_level(val);
+
+	val = getenv("MM_LOG_RECORDER_SIZE");
+	if (val)
+		opts.size = parse_log_size(val);
+
+	val = getenv("MM_LOG_RECORDER_SIGNAL");
+	if (val)
+		opts.dump_signal = atoi(val);
+
+	if (mm_log_recorder_start(name[0] ? name : NULL, &opts))
+		mm_log_error("Cannot start log flight recorder: %s",
+		             mm_get_lasterror_desc());
+}
+
+
+MM_DESTRUCTOR(log_recorder)
+{
+	// Other threads may still be recording a line: the buffer is only
+	// detached, it is unmapped by the exit of the process
+	mm_thr_mutex_lock(&recorder.mtx);
+
+	if (atomic_load(&recorder.hdr)) {
+		set_recorder_maxlvl(MM_LOG_NONE);
+		atomic_store(&recorder.hdr, NULL);
+		if (recorder.name)
+			mm_shm_unlink(recorder.name);
+	}
+
+	mm_thr_mutex_unlock(&recorder.mtx);
+}
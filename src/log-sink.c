@@ -0,0 +1,797 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log-internal.h"
+#include "mmerrno.h"
+#include "mmlib.h"
+#include "mmlog.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "mmtime.h"
+
+/**
+ * DOC:
+ * Besides the standard error, the log lines can be written on files. The
+ * log lines written on a file sink are appended to a buffer in memory by
+ * the logging thread and written at once by a background thread every
+ * flush period or when the buffer is half full. The file is opened with
+ * O_APPEND, so it can be safely shared with other writers.
+ *
+ * Each file sink has 2 buffers: the background thread swaps them before
+ * writing the filled one, hence the logging threads only wait for the file
+ * if the buffer fills up before being written. The rotation of the file
+ * (rename and reopen) is done by the thread writing the buffer, so it does
+ * not block the logging threads either.
+ *
+ * The mutex @mtx of a sink protects its buffers while @io_mtx serializes
+ * the writes and rotations of its file. A thread holding @io_mtx owns the
+ * spare buffer.
+ */
+
+#define LOG_SINK_MAX            8
+#define LOG_SINK_BUFSIZE        (64*1024)
+#define LOG_FLUSH_DEFAULT_MS    100
+#define LOG_FLUSH_MAX_WAIT_MS   1000
+#define ROTATED_SUFFIX_MAXLEN   16
+#define SINK_UNUSED             (MM_LOG_NONE - 1)
+
+/**
+ * struct log_sink - file sink
+ * @maxlvl:     maximum level of the log lines written on the sink,
+ *              SINK_UNUSED if the slot is not in use
+ * @flush_requested: true if the buffer must be written without waiting
+ *              for the flush period
+ * @mtx:        mutex protecting @active, @buf, @len, @flush_period and
+ *              @next_flush
+ * @io_mtx:     mutex serializing the writes and rotations of the file,
+ *              protecting the fields below
+ * @active:     true if the sink is in use
+ * @buf:        buffer receiving the log lines
+ * @len:        length of the data in @buf
+ * @spare:      buffer written on the file while the logging threads fill @buf
+ * @fd:         file descriptor of the file
+ * @path:       path of the file
+ * @file_size:  size of the file
+ * @max_size:   size over which the file is rotated (0 if no limit)
+ * @rotate_period: period of rotation in seconds (0 if no time rotation)
+ * @next_rotation: time of the next rotation in seconds
+ * @max_files:  number of rotated files kept
+ * @flush_period: maximum delay in ms before a line is written on the file
+ *              (negative if each line is written immediately)
+ * @next_flush: time of the next periodic write in ms (flusher thread)
+ */
+struct log_sink {
+	atomic_int maxlvl;
+	atomic_int flush_requested;
+	mm_thr_mutex_t mtx;
+	mm_thr_mutex_t io_mtx;
+	int active;
+	char* buf;
+	size_t len;
+	char* spare;
+	int fd;
+	char* path;
+	size_t file_size;
+	size_t max_size;
+	int rotate_period;
+	int64_t next_rotation;
+	int max_files;
+	int flush_period;
+	int64_t next_flush;
+};
+
+/**
+ * struct log_flusher - state of the background thread writing the sinks
+ * @mtx:        mutex protecting the fields below and the sink slots
+ * @cond:       condition signalled to wake up the thread
+ * @running:    true if the thread is running
+ * @stop:       true if the thread must exit
+ * @thread:     background thread
+ */
+struct log_flusher {
+	mm_thr_mutex_t mtx;
+	mm_thr_cond_t cond;
+	int running;
+	int stop;
+	mm_thread_t thread;
+};
+
+static struct log_sink file_sinks[LOG_SINK_MAX];
+static struct log_flusher flusher = {
+	.mtx = MM_THR_MUTEX_INITIALIZER,
+	.cond = MM_THR_COND_INITIALIZER,
+};
+static mm_thr_once_t sinks_once = MM_THR_ONCE_INIT;
+static atomic_int num_file_sinks;
+static atomic_int stderr_maxlvl = MM_LOG_DEBUG;
+static atomic_int sinks_sync;
+
+
+static
+void init_sinks(void)
+{
+	struct log_sink* sink;
+	int i;
+
+	for (i = 0; i < LOG_SINK_MAX; i++) {
+		sink = &file_sinks[i];
+		mm_thr_mutex_init(&sink->mtx, 0);
+		mm_thr_mutex_init(&sink->io_mtx, 0);
+		atomic_init(&sink->maxlvl, SINK_UNUSED);
+		sink->fd = -1;
+	}
+}
+
+
+static
+int64_t get_time_ms(int clk)
+{
+	struct mm_timespec ts;
+
+	mm_gettime(clk, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static
+void write_all(int fd, const char* data, size_t len)
+{
+	ssize_t rsz;
+
+	while (len) {
+		rsz = mm_write(fd, data, len);
+		if (rsz < 0)
+			return;
+
+		data += rsz;
+		len -= rsz;
+	}
+}
+
+
+/**
+ * rotate_sink() - rename the file of a sink and reopen it
+ * @sink:       file sink whose @io_mtx is held
+ *
+ * The file is renamed into @path.1, the previous @path.1 into @path.2 and
+ * so on until @path.@max_files which is overwritten. If @max_files is 0,
+ * the file is truncated instead. The error state of the calling thread is
+ * preserved.
+ */
+static
+void rotate_sink(struct log_sink* sink)
+{
+	struct mm_error_state errstate;
+	size_t len = strlen(sink->path) + ROTATED_SUFFIX_MAXLEN;
+	char* src = mm_malloca(len);
+	char* dst = mm_malloca(len);
+	int i, oflag = O_WRONLY|O_CREAT|O_APPEND;
+
+	mm_save_errorstate(&errstate);
+
+	if (sink->fd >= 0)
+		mm_close(sink->fd);
+
+	if (sink->max_files > 0 && src && dst) {
+		for (i = sink->max_files; i > 0; i--) {
+			if (i > 1)
+				snprintf(src, len, "%s.%i", sink->path, i-1);
+			else
+				strcpy(src, sink->path);
+
+			snprintf(dst, len, "%s.%i", sink->path, i);
+			if (!mm_check_access(src, F_OK))
+				mm_rename(src, dst);
+		}
+	} else {
+		oflag |= O_TRUNC;
+	}
+
+	sink->fd = mm_open(sink->path, oflag, 0666);
+	sink->file_size = 0;
+	if (sink->rotate_period > 0)
+		sink->next_rotation = get_time_ms(MM_CLK_REALTIME) / 1000
+		                      + sink->rotate_period;
+
+	mm_freea(dst);
+	mm_freea(src);
+	mm_set_errorstate(&errstate);
+}
+
+
+/**
+ * get_fitting_len() - get the size of the log lines fitting in a file
+ * @sink:       file sink whose @io_mtx is held
+ * @data:       log lines to write
+ * @len:        length of @data
+ *
+ * Return: the length of the longest sequence of complete lines at the
+ * beginning of @data that can be written without exceeding the maximum
+ * size of the file, 0 if none.
+ */
+static
+size_t get_fitting_len(const struct log_sink* sink, const char* data,
+                       size_t len)
+{
+	size_t room;
+
+	if (!sink->max_size || sink->file_size + len <= sink->max_size)
+		return len;
+
+	if (sink->file_size >= sink->max_size)
+		return 0;
+
+	room = sink->max_size - sink->file_size;
+	while (room && data[room-1] != '\n')
+		room--;
+
+	return room;
+}
+
+
+/**
+ * flush_sink() - write the buffered log lines of a sink on its file
+ * @sink:       file sink
+ *
+ * Rotate the file beforehand if its rotation period has elapsed, and
+ * whenever it would exceed its maximum size.
+ */
+static
+void flush_sink(struct log_sink* sink)
+{
+	char *data, *end;
+	size_t len, pos, chunk;
+	int64_t now;
+	int flags;
+
+	mm_thr_mutex_lock(&sink->io_mtx);
+
+	// Swap the buffers: the logging threads fill the spare one while the
+	// other is being written
+	mm_thr_mutex_lock(&sink->mtx);
+	if (!sink->active) {
+		mm_thr_mutex_unlock(&sink->mtx);
+		mm_thr_mutex_unlock(&sink->io_mtx);
+		return;
+	}
+
+	data = sink->buf;
+	len = sink->len;
+	sink->buf = sink->spare;
+	sink->len = 0;
+	atomic_store(&sink->flush_requested, 0);
+	mm_thr_mutex_unlock(&sink->mtx);
+
+	// An error must not be logged: this could end up here again
+	flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_NOLOG);
+
+	if (sink->rotate_period > 0) {
+		now = get_time_ms(MM_CLK_REALTIME) / 1000;
+		if (now >= sink->next_rotation)
+			rotate_sink(sink);
+	}
+
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = get_fitting_len(sink, data + pos, len - pos);
+		if (!chunk && sink->file_size) {
+			rotate_sink(sink);
+			continue;
+		}
+
+		// Line longer than the maximum size: write it alone
+		if (!chunk) {
+			end = memchr(data + pos, '\n', len - pos);
+			chunk = end ? (size_t)(end - data) + 1 - pos : len - pos;
+		}
+
+		if (sink->fd >= 0)
+			write_all(sink->fd, data + pos, chunk);
+
+		sink->file_size += chunk;
+	}
+
+	mm_error_set_flags(flags, MM_ERROR_NOLOG);
+	sink->spare = data;
+	mm_thr_mutex_unlock(&sink->io_mtx);
+}
+
+
+static
+void wake_flusher(void)
+{
+	mm_thr_mutex_lock(&flusher.mtx);
+	mm_thr_cond_signal(&flusher.cond);
+	mm_thr_mutex_unlock(&flusher.mtx);
+}
+
+
+/**
+ * append_sink() - add a log line to the buffer of a sink
+ * @sink:       file sink
+ * @buff:       log line (not null terminated)
+ * @len:        length of @buff
+ */
+static
+void append_sink(struct log_sink* sink, const char* buff, size_t len)
+{
+	int sync, need_wake = 0;
+
+	mm_thr_mutex_lock(&sink->mtx);
+
+	// Buffer full: write it now
+	while (sink->active && sink->len + len > LOG_SINK_BUFSIZE) {
+		mm_thr_mutex_unlock(&sink->mtx);
+		flush_sink(sink);
+		mm_thr_mutex_lock(&sink->mtx);
+	}
+
+	if (!sink->active) {
+		mm_thr_mutex_unlock(&sink->mtx);
+		return;
+	}
+
+	memcpy(sink->buf + sink->len, buff, len);
+	sink->len += len;
+	sync = sink->flush_period < 0 || atomic_load(&sinks_sync);
+	if (sink->len > LOG_SINK_BUFSIZE/2
+	    && !atomic_exchange(&sink->flush_requested, 1))
+		need_wake = 1;
+
+	mm_thr_mutex_unlock(&sink->mtx);
+
+	if (sync)
+		flush_sink(sink);
+	else if (need_wake)
+		wake_flusher();
+}
+
+
+/**
+ * write_log_files() - write a log line on the file sinks
+ * @lvl:        level of the log line
+ * @buff:       log line (not null terminated)
+ * @len:        length of @buff
+ *
+ * Return: 1 if the log line must also be written on the standard error,
+ * 0 otherwise.
+ */
+LOCAL_SYMBOL
+int write_log_files(int lvl, const char* buff, size_t len)
+{
+	struct log_sink* sink;
+	int i;
+
+	if (atomic_load_explicit(&num_file_sinks, memory_order_relaxed)) {
+		for (i = 0; i < LOG_SINK_MAX; i++) {
+			sink = &file_sinks[i];
+			if (lvl <= atomic_load_explicit(&sink->maxlvl,
+			                                memory_order_relaxed))
+				append_sink(sink, buff, len);
+		}
+	}
+
+	return lvl <= atomic_load_explicit(&stderr_maxlvl,
+	                                   memory_order_relaxed);
+}
+
+
+/**
+ * flush_log_files() - write the buffered log lines of all file sinks
+ */
+LOCAL_SYMBOL
+void flush_log_files(void)
+{
+	int i;
+
+	if (!atomic_load(&num_file_sinks))
+		return;
+
+	for (i = 0; i < LOG_SINK_MAX; i++) {
+		if (atomic_load(&file_sinks[i].maxlvl) != SINK_UNUSED)
+			flush_sink(&file_sinks[i]);
+	}
+}
+
+
+static
+void* flusher_thread(void* arg)
+{
+	struct log_sink* sink;
+	struct mm_timespec ts;
+	int64_t now, wait_ms, next_flush;
+	int i, flush, stop = 0;
+
+	(void)arg;
+
+	while (!stop) {
+		now = get_time_ms(MM_CLK_MONOTONIC);
+		wait_ms = LOG_FLUSH_MAX_WAIT_MS;
+		for (i = 0; i < LOG_SINK_MAX; i++) {
+			sink = &file_sinks[i];
+			if (atomic_load(&sink->maxlvl) == SINK_UNUSED)
+				continue;
+
+			// The sink may be reconfigured by mm_log_add_file()
+			mm_thr_mutex_lock(&sink->mtx);
+			flush = now >= sink->next_flush
+			        || atomic_load(&sink->flush_requested);
+			if (flush) {
+				// Lines are written immediately if the period
+				// is negative: only check the sink from time
+				// to time
+				sink->next_flush = now + (sink->flush_period > 0
+				                          ? sink->flush_period
+				                          : LOG_FLUSH_MAX_WAIT_MS);
+			}
+
+			next_flush = sink->next_flush;
+			mm_thr_mutex_unlock(&sink->mtx);
+
+			if (flush)
+				flush_sink(sink);
+
+			if (next_flush - now < wait_ms)
+				wait_ms = next_flush - now;
+		}
+
+		mm_thr_mutex_lock(&flusher.mtx);
+		stop = flusher.stop;
+		if (!stop && wait_ms > 0) {
+			mm_gettime(MM_CLK_REALTIME, &ts);
+			mm_timeadd_ms(&ts, wait_ms);
+			mm_thr_cond_timedwait(&flusher.cond, &flusher.mtx, &ts);
+		}
+
+		mm_thr_mutex_unlock(&flusher.mtx);
+	}
+
+	return NULL;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                                  API                                   *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_log_add_file() - write the log lines on a file
+ * @path:       path of the log file
+ * @opts:       options of the file sink (NULL for default)
+ *
+ * Add a sink writing the log lines on the file at @path. The file is
+ * created if it does not exist and opened in append mode. The log lines
+ * are buffered in memory and written by a background thread (see the
+ * @flush_period option).
+ *
+ * @opts defines the following options of the sink (all set to 0 if
+ * @opts is NULL, except @maxlvl set to MM_LOG_DEBUG):
+ *
+ * @maxlvl
+ *   maximum level of the log lines written on the file. This filtering
+ *   applies in addition to the one of mm_log_set_maxlvl().
+ * @max_size
+ *   size in bytes over which the file is rotated (0 for no limit)
+ * @rotate_period
+ *   period in seconds at which the file is rotated (0 for no rotation)
+ * @max_files
+ *   number of rotated files kept: when rotated, the file is renamed into
+ *   @path.1, the previous @path.1 into @path.2 and so on up to
+ *   @path.@max_files which is overwritten. If 0, the file is truncated
+ *   instead.
+ * @flush_period
+ *   maximum time in ms a log line may stay in memory before being written
+ *   (0 for 100ms). If negative, each log line is written immediately by
+ *   the logging thread.
+ *
+ * A log line of level MM_LOG_FATAL, mm_log_flush() and the exit of the
+ * process write all the buffered log lines. If the buffer fills up before
+ * the background thread writes it, the logging thread writes it.
+ *
+ * A file sink can also be set by environment with the following
+ * variables, read when the library is loaded:
+ *
+ * MM_LOG_FILE
+ *   path of the log file
+ * MM_LOG_FILE_MAXLEVEL
+ *   name of maximum level (FATAL, ERROR, WARN, INFO or DEBUG)
+ * MM_LOG_FILE_MAXSIZE
+ *   maximum size with optional k, M or G suffix
+ * MM_LOG_FILE_PERIOD
+ *   rotation period in seconds
+ * MM_LOG_FILE_MAXFILES
+ *   number of rotated files kept
+ * MM_LOG_FILE_FLUSH
+ *   flush period in ms
+ *
+ * Return: identifier of the sink (positive) in case of success, -1
+ * otherwise with error state set accordingly.
+ */
+API_EXPORTED
+int mm_log_add_file(const char* path, const struct mm_log_file_opts* opts)
+{
+	struct mm_log_file_opts default_opts = {.maxlvl = MM_LOG_DEBUG};
+	struct log_sink* sink = NULL;
+	struct mm_stat stat;
+	char *buf, *spare, *path_copy;
+	int i, fd, rv = -1;
+
+	if (!opts)
+		opts = &default_opts;
+
+	if (opts->maxlvl < MM_LOG_NONE || opts->maxlvl > MM_LOG_DEBUG
+	    || opts->max_files < 0 || opts->rotate_period < 0)
+		return mm_raise_error(EINVAL, "Invalid log file options");
+
+	mm_thr_once(&sinks_once, init_sinks);
+
+	fd = mm_open(path, O_WRONLY|O_CREAT|O_APPEND, 0666);
+	if (fd < 0)
+		return -1;
+
+	buf = malloc(LOG_SINK_BUFSIZE);
+	spare = malloc(LOG_SINK_BUFSIZE);
+	path_copy = strdup(path);
+	if (!buf || !spare || !path_copy) {
+		mm_raise_from_errno("Cannot allocate log file sink");
+		goto exit;
+	}
+
+	mm_thr_mutex_lock(&flusher.mtx);
+
+	for (i = 0; i < LOG_SINK_MAX; i++) {
+		if (atomic_load(&file_sinks[i].maxlvl) == SINK_UNUSED) {
+			sink = &file_sinks[i];
+			break;
+		}
+	}
+
+	if (!sink) {
+		mm_raise_error(EMFILE, "Too many log file sinks");
+		goto exit_unlock;
+	}
+
+	if (!flusher.running
+	    && !atomic_load(&sinks_sync)
+	    && mm_thr_create(&flusher.thread, flusher_thread, NULL))
+		goto exit_unlock;
+
+	flusher.running = 1;
+
+	mm_thr_mutex_lock(&sink->io_mtx);
+	mm_thr_mutex_lock(&sink->mtx);
+	sink->fd = fd;
+	sink->path = path_copy;
+	sink->buf = buf;
+	sink->spare = spare;
+	sink->len = 0;
+	sink->file_size = mm_fstat(fd, &stat) ? 0 : (size_t)stat.size;
+	sink->max_size = opts->max_size;
+	sink->rotate_period = opts->rotate_period;
+	sink->next_rotation = get_time_ms(MM_CLK_REALTIME) / 1000
+	                      + opts->rotate_period;
+	sink->max_files = opts->max_files;
+	sink->flush_period = opts->flush_period ?
+	                     opts->flush_period : LOG_FLUSH_DEFAULT_MS;
+	sink->next_flush = 0;
+	sink->active = 1;
+	mm_thr_mutex_unlock(&sink->mtx);
+	mm_thr_mutex_unlock(&sink->io_mtx);
+
+	atomic_store(&sink->maxlvl, opts->maxlvl);
+	atomic_fetch_add(&num_file_sinks, 1);
+	rv = i + 1;
+	buf = spare = path_copy = NULL;
+	fd = -1;
+
+exit_unlock:
+	mm_thr_mutex_unlock(&flusher.mtx);
+exit:
+	free(buf);
+	free(spare);
+	free(path_copy);
+	if (fd >= 0)
+		mm_close(fd);
+
+	return rv;
+}
+
+
+/**
+ * mm_log_remove_sink() - stop writing the log lines on a file
+ * @sink_id:    identifier returned by mm_log_add_file()
+ *
+ * Write the log lines buffered for the file sink @sink_id, close the file
+ * and remove the sink.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_remove_sink(int sink_id)
+{
+	struct log_sink* sink;
+	char *buf, *spare, *path;
+	size_t len;
+	int fd;
+
+	if (sink_id < 1 || sink_id > LOG_SINK_MAX)
+		return mm_raise_error(EINVAL, "Invalid log sink %i", sink_id);
+
+	sink = &file_sinks[sink_id - 1];
+
+	mm_thr_mutex_lock(&flusher.mtx);
+	if (atomic_load(&sink->maxlvl) == SINK_UNUSED) {
+		mm_thr_mutex_unlock(&flusher.mtx);
+		return mm_raise_error(EINVAL, "Log sink %i not used", sink_id);
+	}
+
+	atomic_store(&sink->maxlvl, SINK_UNUSED);
+
+	mm_thr_mutex_lock(&sink->io_mtx);
+	mm_thr_mutex_lock(&sink->mtx);
+	sink->active = 0;
+	buf = sink->buf;
+	len = sink->len;
+	spare = sink->spare;
+	path = sink->path;
+	fd = sink->fd;
+	sink->buf = sink->spare = sink->path = NULL;
+	sink->len = 0;
+	sink->fd = -1;
+	mm_thr_mutex_unlock(&sink->mtx);
+	mm_thr_mutex_unlock(&sink->io_mtx);
+
+	atomic_fetch_sub(&num_file_sinks, 1);
+	mm_thr_mutex_unlock(&flusher.mtx);
+
+	if (fd >= 0) {
+		write_all(fd, buf, len);
+		mm_close(fd);
+	}
+
+	free(buf);
+	free(spare);
+	free(path);
+	return 0;
+}
+
+
+/**
+ * mm_log_set_sink_maxlvl() - set the maximum log level of a sink
+ * @sink_id:    identifier returned by mm_log_add_file() or
+ *              MM_LOG_SINK_STDERR
+ * @lvl:        log level to set (MM_LOG_NONE to write nothing)
+ *
+ * This filtering applies in addition to the one of mm_log_set_maxlvl().
+ * The initial level of the standard error sink is MM_LOG_DEBUG, or the
+ * value of the MM_LOG_STDERR_MAXLEVEL environment variable.
+ *
+ * Return: previous log level of the sink, -1 in case of error with error
+ * state set accordingly.
+ */
+API_EXPORTED
+int mm_log_set_sink_maxlvl(int sink_id, int lvl)
+{
+	struct log_sink* sink;
+	int rv;
+
+	if (lvl < MM_LOG_NONE || lvl > MM_LOG_DEBUG)
+		return mm_raise_error(EINVAL, "Invalid log level %i", lvl);
+
+	if (sink_id == MM_LOG_SINK_STDERR)
+		return atomic_exchange(&stderr_maxlvl, lvl);
+
+	if (sink_id < 1 || sink_id > LOG_SINK_MAX)
+		return mm_raise_error(EINVAL, "Invalid log sink %i", sink_id);
+
+	sink = &file_sinks[sink_id - 1];
+	mm_thr_mutex_lock(&flusher.mtx);
+	rv = atomic_load(&sink->maxlvl);
+	if (rv == SINK_UNUSED)
+		rv = mm_raise_error(EINVAL, "Log sink %i not used", sink_id);
+	else
+		atomic_store(&sink->maxlvl, lvl);
+
+	mm_thr_mutex_unlock(&flusher.mtx);
+
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Configuration by environment                      *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * parse_log_size() - parse a size from configuration
+ * @str:        number of bytes, with an optional k, M or G suffix
+ *
+ * Return: the size in bytes
+ */
+LOCAL_SYMBOL
+size_t parse_log_size(const char* str)
+{
+	char* end;
+	size_t size;
+
+	size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': return size << 10;
+	case 'm': case 'M': return size << 20;
+	case 'g': case 'G': return (size_t)((unsigned long long)size << 30);
+	default:            return size;
+	}
+}
+
+
+MM_CONSTRUCTOR(log_sinks)
+{
+	struct mm_log_file_opts opts = {.maxlvl = MM_LOG_DEBUG};
+	const char* val;
+
+	val = getenv("MM_LOG_STDERR_MAXLEVEL");
+	if (val)
+		stderr_maxlvl = parse_log_level(val);
+
+	val = getenv("MM_LOG_FILE_MAXLEVEL");
+	if (val)
+		opts.maxlvl = parse_log_level(val);
+
+	val = getenv("MM_LOG_FILE_MAXSIZE");
+	if (val)
+		opts.max_size = parse_log_size(val);
+
+	val = getenv("MM_LOG_FILE_PERIOD");
+	if (val)
+		opts.rotate_period = atoi(val);
+
+	val = getenv("MM_LOG_FILE_MAXFILES");
+	if (val)
+		opts.max_files = atoi(val);
+
+	val = getenv("MM_LOG_FILE_FLUSH");
+	if (val)
+		opts.flush_period = atoi(val);
+
+	val = getenv("MM_LOG_FILE");
+	if (!val)
+		return;
+
+	if (mm_log_add_file(val, &opts) < 0)
+		mm_log_error("Cannot log to %s: %s", val, mm_get_lasterror_desc());
+}
+
+
+MM_DESTRUCTOR(log_sinks)
+{
+	int running;
+
+	mm_thr_mutex_lock(&flusher.mtx);
+	running = flusher.running;
+	flusher.stop = 1;
+	mm_thr_cond_signal(&flusher.cond);
+	mm_thr_mutex_unlock(&flusher.mtx);
+
+	if (running)
+		mm_thr_join(flusher.thread, NULL);
+
+	// The lines logged from now on (by other destructors) are written
+	// immediately
+	atomic_store(&sinks_sync, 1);
+	flush_log_files();
+}
@@ -5,14 +5,21 @@
 # include <config.h>
 #endif
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <time.h>
 
+#include "log-internal.h"
+#include "mmerrno.h"
 #include "mmsysio.h"
 #include "mmlog.h"
+#include "mmthread.h"
+#include "mmtime.h"
+#include "tls-internal.h"
 
 // Define STDERR_FILENO if not (may happen with some compiler for Windows)
 #ifndef STDERR_FILENO
@@ -20,7 +27,6 @@
 #endif
 
 #ifdef _MSC_VER
-#  define restrict __restrict
 #  define ssize_t int
 #endif
 
@@ -32,11 +38,9 @@
 #  endif
 #endif
 
-#ifndef MM_LOG_LINE_MAXLEN
-#define MM_LOG_LINE_MAXLEN 256
-#endif
-
-static int maxloglvl = MM_LOG_INFO;
+static atomic_int maxloglvl = MM_LOG_INFO;
+LOCAL_SYMBOL atomic_int recorder_maxlvl = MM_LOG_NONE;
+static atomic_int ts_format = MM_LOG_TS_DEFAULT;
 
 static
 const char* const loglevel[] = {
@@ -48,25 +52,225 @@ const char* const loglevel[] = {
 };
 #define NLEVEL (sizeof(loglevel)/sizeof(loglevel[0]))
 
+static
+const char* const ts_format_names[] = {
+	[MM_LOG_TS_DEFAULT] = "default",
+	[MM_LOG_TS_USEC] = "usec",
+	[MM_LOG_TS_MONOTONIC] = "monotonic",
+};
+#define NTS_FORMAT (sizeof(ts_format_names)/sizeof(ts_format_names[0]))
+
+static void parse_maxlevel_env(const char* env);
+
 MM_CONSTRUCTOR(init_log)
 {
 	int i;
 	const char* envlvl;
+	const char* envts;
+
+	envts = getenv("MM_LOG_TIMESTAMP");
+	for (i = 0; envts && i < (int)NTS_FORMAT; i++) {
+		if (!strcmp(ts_format_names[i], envts))
+			ts_format = i;
+	}
 
 	envlvl = getenv("MM_LOG_MAXLEVEL");
 	if (!envlvl)
 		return;
 
+	parse_maxlevel_env(envlvl);
+}
+
+
+/**
+ * parse_log_level() - get the log level from its name
+ * @name:       name of the level ("FATAL", "ERROR", "WARN", "INFO" or
+ *              "DEBUG")
+ *
+ * Return: the log level named @name, MM_LOG_NONE if @name is unknown (an
+ * unknown level set through environment should be equivalent to no log).
+ */
+LOCAL_SYMBOL
+int parse_log_level(const char* name)
+{
+	int i;
+
 	for (i = 0; i < (int)NLEVEL; i++) {
-		if (!strcmp(loglevel[i], envlvl)) {
-			maxloglvl = i;
-			return;
-		}
+		if (!strcmp(loglevel[i], name))
+			return i;
+	}
+
+	return MM_LOG_NONE;
+}
+
+
+/**
+ * get_log_timestamp() - get the time of a log about to be written
+ * @ts:         timestamp receiving the current time
+ *
+ * Return: the timestamp format (MM_LOG_TS_*) with which @ts must be
+ * printed. The time is read from the monotonic clock if the format is
+ * MM_LOG_TS_MONOTONIC, from the realtime clock otherwise.
+ */
+LOCAL_SYMBOL
+int get_log_timestamp(struct mm_timespec* ts)
+{
+	int format = atomic_load_explicit(&ts_format, memory_order_relaxed);
+
+	if (format == MM_LOG_TS_MONOTONIC)
+		mm_gettime(MM_CLK_MONOTONIC, ts);
+	else
+		mm_gettime(MM_CLK_REALTIME, ts);
+
+	return format;
+}
+
+
+/**
+ * struct ts_prefix_cache - last time stamp formatted by a thread
+ * @sec:        second of the time stamp formatted in @str
+ * @len:        length of @str
+ * @str:        formatted date and time (to the second)
+ */
+struct ts_prefix_cache {
+	time_t sec;
+	size_t len;
+	char str[32];
+};
+
+static thread_local struct ts_prefix_cache ts_prefix = {.sec = -1};
+
+
+/**
+ * format_digits() - write a zero padded decimal number
+ * @buff:       buffer receiving the digits
+ * @value:      non negative value to write
+ * @ndigits:    number of digits to write
+ */
+static
+void format_digits(char* buff, long value, int ndigits)
+{
+	while (ndigits--) {
+		buff[ndigits] = '0' + value % 10;
+		value /= 10;
 	}
+}
 
-	// If we reach each, unknown level has been set through environment
-	// In that case, it should be equivalent to no log
-	maxloglvl = MM_LOG_NONE;
+
+/**
+ * format_monotonic_timestamp() - write a monotonic time stamp
+ * @buff:       buffer that must receive the time stamp
+ * @blen:       maximum size of @buffer
+ * @ts:         monotonic time of the log
+ *
+ * Equivalent to snprintf() with "%10lld.%06ld" format, without its cost.
+ *
+ * Return: the number of byte written on @buffer (not null terminated).
+ */
+static
+size_t format_monotonic_timestamp(char* restrict buff, size_t blen,
+                                  const struct mm_timespec* ts)
+{
+	char digits[24];
+	long long sec = ts->tv_sec;
+	size_t i, len, ndigits = 0;
+
+	do {
+		digits[ndigits++] = '0' + sec % 10;
+		sec /= 10;
+	} while (sec);
+
+	len = (ndigits < 10) ? 10 : ndigits;
+	if (len + 7 >= blen)
+		return 0;
+
+	memset(buff, ' ', len - ndigits);
+	for (i = 0; i < ndigits; i++)
+		buff[len - 1 - i] = digits[i];
+
+	buff[len] = '.';
+	format_digits(buff + len + 1, ts->tv_nsec / 1000, 6);
+
+	return len + 7;
+}
+
+
+/**
+ * format_log_timestamp() - generate the time stamp of a log line
+ * @buff:       buffer that must receive the time stamp
+ * @blen:       maximum size of @buffer
+ * @format:     timestamp format (MM_LOG_TS_*)
+ * @ts:         time of the log (in the clock matching @format)
+ *
+ * localtime_r() and strftime() are costly (localtime_r() may even take a
+ * global lock to check the timezone) while consecutive logs of a thread are
+ * most of the time emitted during the same second: the date and time is
+ * formatted once per second and per thread.
+ *
+ * Return: the number of byte written on @buffer (not null terminated).
+ */
+static
+size_t format_log_timestamp(char* restrict buff, size_t blen, int format,
+                            const struct mm_timespec* ts)
+{
+	struct ts_prefix_cache* cache = &ts_prefix;
+	struct tm tm;
+	time_t sec = ts->tv_sec;
+	size_t len;
+
+	if (format == MM_LOG_TS_MONOTONIC)
+		return format_monotonic_timestamp(buff, blen, ts);
+
+	if (sec != cache->sec) {
+		localtime_r(&sec, &tm);
+		cache->len = strftime(cache->str, sizeof(cache->str),
+		                      "%d/%m/%y %H:%M:%S", &tm);
+		cache->sec = sec;
+	}
+
+	len = cache->len;
+	if (format == MM_LOG_TS_USEC)
+		len += 7;
+
+	if (len >= blen)
+		return 0;
+
+	memcpy(buff, cache->str, cache->len);
+	if (format == MM_LOG_TS_USEC) {
+		buff[cache->len] = '.';
+		format_digits(buff + cache->len + 1, ts->tv_nsec / 1000, 6);
+	}
+
+	return len;
+}
+
+
+/**
+ * format_log_header() - generate the header of a log line
+ * @buff:       buffer that must receive the header
+ * @blen:       maximum size of @buffer
+ * @format:     timestamp format (MM_LOG_TS_*)
+ * @ts:         time of the log (in the clock matching @format)
+ * @lvl:        level of the log line
+ * @location:   module name at the origin of the log
+ *
+ * Return: the number of byte written on @buffer (not null terminated).
+ */
+LOCAL_SYMBOL
+size_t format_log_header(char* restrict buff, size_t blen, int format,
+                         const struct mm_timespec* ts,
+                         int lvl, const char* restrict location)
+{
+	size_t len;
+
+	// format time stamp
+	len = format_log_timestamp(buff, blen, format, ts);
+
+	// format message header message
+	len += snprintf(buff+len, blen-len-1, " %-5s %-16s : ",
+	                loglevel[lvl], location);
+
+	return len;
 }
 
 
@@ -94,21 +298,14 @@ size_t format_log_str(char* restrict buff, size_t blen,
                       int lvl, const char* restrict location,
                       const char* restrict msg, va_list args)
 {
-	time_t ts;
-	struct tm tm;
+	struct mm_timespec ts;
 	size_t len, rlen;
+	int format;
 
 	rlen = blen;
 
-	// format time stamp
-	ts = time(NULL);
-	localtime_r(&ts, &tm);
-	len = strftime(buff, blen, "%d/%m/%y %H:%M:%S", &tm);
-	buff += len;
-	rlen -= len;
-
-	// format message header message
-	len = snprintf(buff, rlen-1, " %-5s %-16s : ", loglevel[lvl], location);
+	format = get_log_timestamp(&ts);
+	len = format_log_header(buff, blen, format, &ts, lvl, location);
 	buff += len;
 	rlen -= len;
 
@@ -123,6 +320,749 @@ size_t format_log_str(char* restrict buff, size_t blen,
 }
 
 
+static
+size_t format_log_line(char* restrict buff, size_t blen,
+                       int lvl, const char* restrict location,
+                       const char* restrict msg, ...)
+{
+	size_t len;
+	va_list args;
+
+	va_start(args, msg);
+	len = format_log_str(buff, blen, lvl, location, msg, args);
+	va_end(args);
+
+	return len;
+}
+
+
+/**
+ * write_log_str() - write log string on standard error
+ * @buff:       log string (not null terminated)
+ * @len:        length of @buff
+ */
+LOCAL_SYMBOL
+void write_log_str(const char* buff, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		if ((r = mm_write(STDERR_FILENO, buff, len)) < 0)
+			return;
+
+		len -= r;
+		buff += r;
+	}
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                         Per-module log levels                          *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * Each module named by a log call site or by the configuration has an
+ * entry holding its effective maximum level: the level set for the module
+ * if any, the global maximum level otherwise. The entries are never freed,
+ * so a call site can keep a pointer to the level of its module (see struct
+ * mm_log_site). The entries are only added (at the head of the list) and
+ * modified with @modules_mtx held, hence they are looked up without lock.
+ *
+ * The level cached by the call sites (@sitelvl) also accounts for the level
+ * of the flight recorder, which takes the log lines regardless of the level
+ * of their module.
+ */
+
+#define MODULE_INHERIT          (MM_LOG_NONE - 1)
+#define MODULE_NAME_MAXLEN      64
+
+/**
+ * struct log_module - log level of a module
+ * @next:       next module in the list
+ * @sitelvl:    maximum level of the log lines of the module taken by any
+ *              output (the sinks or the flight recorder)
+ * @maxlvl:     effective maximum level of the module
+ * @setlvl:     maximum level set for the module, MODULE_INHERIT if the
+ *              global level applies
+ * @name:       name of the module
+ */
+struct log_module {
+	struct log_module* next;
+	atomic_int sitelvl;
+	atomic_int maxlvl;
+	int setlvl;
+	char name[];
+};
+
+static _Atomic(struct log_module*) modules;
+static atomic_int num_module_levels;
+static atomic_int global_sitelvl = MM_LOG_INFO;
+static mm_thr_mutex_t modules_mtx = MM_THR_MUTEX_INITIALIZER;
+
+
+static
+int get_site_level(int maxlvl)
+{
+	int reclvl = atomic_load(&recorder_maxlvl);
+
+	return maxlvl > reclvl ? maxlvl : reclvl;
+}
+
+
+/**
+ * update_site_levels() - update the levels cached by the call sites
+ *
+ * Must be called with @modules_mtx held, after a change of the level of a
+ * module, of the global level or of the flight recorder.
+ */
+static
+void update_site_levels(void)
+{
+	struct log_module* mod;
+
+	atomic_store(&global_sitelvl, get_site_level(atomic_load(&maxloglvl)));
+
+	for (mod = atomic_load(&modules); mod; mod = mod->next)
+		atomic_store(&mod->sitelvl,
+		             get_site_level(atomic_load(&mod->maxlvl)));
+}
+
+
+static
+struct log_module* find_module(const char* name)
+{
+	struct log_module* mod;
+
+	mod = atomic_load_explicit(&modules, memory_order_acquire);
+	for (; mod; mod = mod->next) {
+		if (!strcmp(mod->name, name))
+			return mod;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * get_module() - get the entry of a module, create it if needed
+ * @name:       name of the module
+ *
+ * Must be called with @modules_mtx held.
+ *
+ * Return: the entry of the module, NULL in case of allocation failure
+ */
+static
+struct log_module* get_module(const char* name)
+{
+	struct log_module* mod;
+	size_t len;
+
+	mod = find_module(name);
+	if (mod)
+		return mod;
+
+	len = strlen(name);
+	mod = malloc(sizeof(*mod) + len + 1);
+	if (!mod)
+		return NULL;
+
+	memcpy(mod->name, name, len + 1);
+	mod->setlvl = MODULE_INHERIT;
+	atomic_init(&mod->maxlvl, atomic_load(&maxloglvl));
+	atomic_init(&mod->sitelvl, atomic_load(&global_sitelvl));
+	mod->next = atomic_load(&modules);
+	atomic_store_explicit(&modules, mod, memory_order_release);
+
+	return mod;
+}
+
+
+/**
+ * get_module_maxlvl() - get the maximum log level of a module
+ * @name:       name of the module
+ *
+ * Return: the maximum level of the module @name
+ */
+static inline
+int get_module_maxlvl(const char* name)
+{
+	struct log_module* mod;
+
+	if (LIKELY(!atomic_load_explicit(&num_module_levels,
+	                                 memory_order_relaxed)))
+		return atomic_load_explicit(&maxloglvl, memory_order_relaxed);
+
+	mod = find_module(name);
+	if (!mod)
+		return atomic_load_explicit(&maxloglvl, memory_order_relaxed);
+
+	return atomic_load_explicit(&mod->maxlvl, memory_order_relaxed);
+}
+
+
+static
+int set_module_maxlvl(const char* name, int lvl)
+{
+	struct log_module* mod;
+	int rv;
+
+	mm_thr_mutex_lock(&modules_mtx);
+
+	mod = get_module(name);
+	if (!mod) {
+		mm_thr_mutex_unlock(&modules_mtx);
+		return mm_raise_from_errno("Cannot allocate log module");
+	}
+
+	if (mod->setlvl == MODULE_INHERIT)
+		atomic_fetch_add(&num_module_levels, 1);
+
+	mod->setlvl = lvl;
+	rv = atomic_exchange(&mod->maxlvl, lvl);
+	update_site_levels();
+
+	mm_thr_mutex_unlock(&modules_mtx);
+	return rv;
+}
+
+
+/**
+ * parse_maxlevel_env() - apply the value of MM_LOG_MAXLEVEL
+ * @env:        comma separated list of LEVEL (setting the global level) or
+ *              module=LEVEL (setting the level of module) items
+ */
+static
+void parse_maxlevel_env(const char* env)
+{
+	char item[MODULE_NAME_MAXLEN + 8];
+	const char* end;
+	char* sep;
+	size_t len;
+
+	while (*env) {
+		end = strchr(env, ',');
+		len = end ? (size_t)(end - env) : strlen(env);
+		if (len < sizeof(item)) {
+			memcpy(item, env, len);
+			item[len] = '\0';
+
+			sep = strchr(item, '=');
+			if (sep) {
+				*sep = '\0';
+				set_module_maxlvl(item, parse_log_level(sep+1));
+			} else {
+				mm_log_set_maxlvl(parse_log_level(item));
+			}
+		}
+
+		env += end ? len + 1 : len;
+	}
+}
+
+
+/**
+ * mm_log_site_resolve() - look up the log level of a call site
+ * @site:       cache of the call site
+ * @module:     module name of the call site
+ *
+ * This function is called by the mm_log_*() macros (through
+ * mm_log_site_enabled()) the first time a call site is executed. It stores
+ * in @site the location of the maximum level of @module, which is updated
+ * whenever the level of the module changes.
+ *
+ * Return: the location of the maximum level of @module
+ */
+API_EXPORTED
+const int* mm_log_site_resolve(struct mm_log_site* site, const char* module)
+{
+	struct log_module* mod;
+	const int* maxlvl;
+
+	mm_thr_mutex_lock(&modules_mtx);
+	mod = get_module(module);
+	mm_thr_mutex_unlock(&modules_mtx);
+
+	// Fallback to the global level if the module cannot be allocated
+	maxlvl = (const int*)(mod ? &mod->sitelvl : &global_sitelvl);
+	atomic_store_explicit((_Atomic(const int*)*)&site->maxlvl, maxlvl,
+	                      memory_order_release);
+
+	return maxlvl;
+}
+
+
+/**
+ * mm_log_enabled() - test whether a log would be written
+ * @lvl:        level of the log
+ * @module:     module name of the log
+ *
+ * This allows to skip the preparation of data only meant to be logged. The
+ * mm_log_*() macros do this check for the call site (and cache the lookup
+ * of @module) before evaluating their arguments.
+ *
+ * Return: non zero if mm_log() would write a log of level @lvl from
+ * @module, 0 otherwise.
+ */
+API_EXPORTED
+int mm_log_enabled(int lvl, const char* module)
+{
+	return lvl >= 0
+	       && (lvl <= get_module_maxlvl(module)
+	           || lvl <= atomic_load(&recorder_maxlvl));
+}
+
+
+/**
+ * mm_log_set_module_maxlvl() - set maximum log level of a module
+ * @module:     name of the module (as set by MM_LOG_MODULE_NAME)
+ * @lvl:        log level to set
+ *
+ * Set the maximum level of the logs of @module, regardless of the global
+ * level set by mm_log_set_maxlvl(). The levels of modules can also be set
+ * at startup with the MM_LOG_MAXLEVEL environment variable (see mm_log()).
+ *
+ * Return: previous log level of @module in case of success, -1 otherwise
+ * with error state set accordingly.
+ */
+API_EXPORTED
+int mm_log_set_module_maxlvl(const char* module, int lvl)
+{
+	if (lvl < MM_LOG_NONE || lvl > MM_LOG_DEBUG)
+		return mm_raise_error(EINVAL, "Invalid log level %i", lvl);
+
+	if (strlen(module) > MODULE_NAME_MAXLEN)
+		return mm_raise_error(ENAMETOOLONG, "Module name too long");
+
+	return set_module_maxlvl(module, lvl);
+}
+
+
+/**
+ * set_recorder_maxlvl() - set the maximum level of the flight recorder
+ * @lvl:        maximum level of the log lines recorded, MM_LOG_NONE if the
+ *              flight recorder is stopped
+ */
+LOCAL_SYMBOL
+void set_recorder_maxlvl(int lvl)
+{
+	mm_thr_mutex_lock(&modules_mtx);
+	atomic_store(&recorder_maxlvl, lvl);
+	update_site_levels();
+	mm_thr_mutex_unlock(&modules_mtx);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                         Asynchronous logging                           *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * In asynchronous mode, mm_log() formats the log line on the stack of the
+ * calling thread and copies it in a ring of fixed size records. A
+ * background thread writes the records in batches on the log file
+ * descriptor, hence a slow log output does not stall the logging threads.
+ *
+ * The ring is a bounded lock-free queue in which each record holds a
+ * sequence number telling whether it is free for the position being
+ * produced or holds a line ready to be consumed at the position being
+ * consumed. Producers claim a position by advancing @tail with a CAS, fill
+ * the record and publish it by updating its sequence number. The writer
+ * thread consumes by advancing @head the same way, which allows producers
+ * to also consume (and discard) the oldest record when the queue is full
+ * with the MM_LOG_ASYNC_DROP_OLDEST policy.
+ *
+ * The mutex and condition variables are only used to put the writer
+ * thread to sleep when the queue is empty and to wait for the records to
+ * be written (mm_log_flush() or MM_LOG_ASYNC_BLOCK policy when the queue
+ * is full): a producer only takes the mutex if the writer thread is idle.
+ */
+
+#define LOG_QUEUE_DEFAULT_SIZE  1024
+#define LOG_QUEUE_MAX_SIZE      (1024*1024)
+#define LOG_BATCH_SIZE          64
+#define LOG_IDLE_WAIT_MS        100
+#define LOG_DONE_WAIT_MS        10
+
+/**
+ * struct log_record - record of the asynchronous log queue
+ * @seq:        sequence number: position of the record if it is free for a
+ *              producer, position plus 1 if it holds a line to consume
+ * @lvl:        level of the log line
+ * @len:        length of the log line in @data
+ * @data:       formatted log line (not null terminated)
+ */
+struct log_record {
+	atomic_size_t seq;
+	int lvl;
+	size_t len;
+	char data[MM_LOG_LINE_MAXLEN];
+};
+
+
+/**
+ * struct log_queue - state of the asynchronous logging
+ * @records:    ring of @mask+1 records
+ * @mask:       number of records minus 1 (which is a power of 2)
+ * @policy:     MM_LOG_ASYNC_* policy applied when the queue is full
+ * @head:       position of the next record to consume
+ * @tail:       position of the next record to produce
+ * @num_dropped: number of log lines dropped due to full queue
+ * @writer_idle: true when the writer thread is about to wait for records
+ * @mtx:        mutex protecting @written, @stop and the waits
+ * @wake_cond:  condition signalled to wake up the writer thread
+ * @done_cond:  condition broadcast when records have been written
+ * @written:    position up to which the records have been written or
+ *              dropped
+ * @stop:       true if the writer thread must exit once the queue is empty
+ * @thread:     writer thread
+ * @batch:      buffer in which the writer thread gathers the records to
+ *              write at once
+ */
+struct log_queue {
+	struct log_record* records;
+	size_t mask;
+	int policy;
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_size_t num_dropped;
+	atomic_int writer_idle;
+	mm_thr_mutex_t mtx;
+	mm_thr_cond_t wake_cond;
+	mm_thr_cond_t done_cond;
+	size_t written;
+	int stop;
+	mm_thread_t thread;
+	char* batch;
+};
+
+static _Atomic(struct log_queue*) async_queue;
+static mm_thr_mutex_t async_mtx = MM_THR_MUTEX_INITIALIZER;
+
+
+static
+void wake_writer(struct log_queue* q)
+{
+	mm_thr_mutex_lock(&q->mtx);
+	mm_thr_cond_signal(&q->wake_cond);
+	mm_thr_mutex_unlock(&q->mtx);
+}
+
+
+/**
+ * wait_written() - wait for the writer thread to progress
+ * @q:          asynchronous log queue
+ * @target:     position up to which the records must be written
+ *
+ * Wait until the records before @target have been consumed or until the
+ * writer thread has written a batch if @target is (size_t)-1.
+ *
+ * Return: true if the writer thread has been requested to stop, in which
+ * case it may have exited without waiting for the next records.
+ */
+static
+int wait_written(struct log_queue* q, size_t target)
+{
+	struct mm_timespec ts;
+	size_t written;
+	int stop;
+
+	mm_thr_mutex_lock(&q->mtx);
+
+	written = q->written;
+	while ((target == SIZE_MAX && q->written == written)
+	       || (target != SIZE_MAX && (intptr_t)(q->written - target) < 0)) {
+		mm_thr_cond_signal(&q->wake_cond);
+
+		// Timed wait in case the writer thread has exited
+		mm_gettime(MM_CLK_REALTIME, &ts);
+		mm_timeadd_ms(&ts, LOG_DONE_WAIT_MS);
+		mm_thr_cond_timedwait(&q->done_cond, &q->mtx, &ts);
+		if (q->stop && target == SIZE_MAX)
+			break;
+	}
+
+	stop = q->stop;
+	mm_thr_mutex_unlock(&q->mtx);
+
+	return stop;
+}
+
+
+/**
+ * dequeue_record() - consume the oldest record of the queue
+ * @q:          asynchronous log queue
+ * @buff:       buffer receiving the log line (NULL to discard it)
+ * @lvl:        pointer receiving the level of the log line (may be NULL)
+ *
+ * Return: the length of the log line consumed, 0 if the queue is empty.
+ */
+static
+size_t dequeue_record(struct log_queue* q, char* buff, int* lvl)
+{
+	struct log_record* rec;
+	size_t seq, len, pos;
+	intptr_t dif;
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	while (1) {
+		rec = &q->records[pos & q->mask];
+		seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos+1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak(&q->head, &pos, pos+1))
+				break;
+		} else if (dif < 0) {
+			return 0;
+		} else {
+			pos = atomic_load_explicit(&q->head,
+			                           memory_order_relaxed);
+		}
+	}
+
+	len = rec->len;
+	if (buff)
+		memcpy(buff, rec->data, len);
+
+	if (lvl)
+		*lvl = rec->lvl;
+
+	// Make the record available to producers of the next lap
+	atomic_store_explicit(&rec->seq, pos + q->mask + 1,
+	                      memory_order_release);
+	return len;
+}
+
+
+/**
+ * enqueue_record() - add a log line in the queue
+ * @q:          asynchronous log queue
+ * @lvl:        level of the log line
+ * @buff:       log line to add
+ * @len:        length of @buff (at most MM_LOG_LINE_MAXLEN)
+ * @policy:     MM_LOG_ASYNC_* policy to apply if the queue is full
+ */
+static
+void enqueue_record(struct log_queue* q, int lvl, const char* buff,
+                    size_t len, int policy)
+{
+	struct log_record* rec;
+	size_t seq, pos;
+	intptr_t dif;
+
+	pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	while (1) {
+		rec = &q->records[pos & q->mask];
+		seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak(&q->tail, &pos, pos+1))
+				break;
+
+			continue;
+		}
+
+		if (dif < 0) {
+			// The queue is full
+			if (policy == MM_LOG_ASYNC_DROP_NEWEST) {
+				atomic_fetch_add(&q->num_dropped, 1);
+				return;
+			}
+
+			if (policy == MM_LOG_ASYNC_DROP_OLDEST) {
+				if (dequeue_record(q, NULL, NULL))
+					atomic_fetch_add(&q->num_dropped, 1);
+			} else if (wait_written(q, SIZE_MAX)) {
+				// The writer thread may be gone (at exit): the
+				// queue would never be emptied
+				if (write_log_files(lvl, buff, len))
+					write_log_str(buff, len);
+
+				return;
+			}
+		}
+
+		pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	}
+
+	memcpy(rec->data, buff, len);
+	rec->lvl = lvl;
+	rec->len = len;
+	atomic_store(&rec->seq, pos+1);
+
+	if (atomic_load(&q->writer_idle))
+		wake_writer(q);
+}
+
+
+static
+int is_queue_empty(struct log_queue* q)
+{
+	size_t pos = atomic_load(&q->head);
+
+	return atomic_load(&q->records[pos & q->mask].seq) != pos+1;
+}
+
+
+/**
+ * log_writer_thread() - write the records of the asynchronous log queue
+ * @arg:        asynchronous log queue
+ *
+ * Return: NULL
+ */
+static
+void* log_writer_thread(void* arg)
+{
+	struct log_queue* q = arg;
+	struct mm_timespec ts;
+	size_t n, len, rlen, head, num_dropped, num_reported = 0;
+	int lvl, done = 0;
+
+	while (!done) {
+		// Gather the lines to write on standard error, the file sinks
+		// buffer them on their own
+		len = 0;
+		for (n = 0; n < LOG_BATCH_SIZE; n++) {
+			rlen = dequeue_record(q, q->batch + len, &lvl);
+			if (!rlen)
+				break;
+
+			if (write_log_files(lvl, q->batch + len, rlen))
+				len += rlen;
+		}
+
+		head = atomic_load(&q->head);
+
+		num_dropped = atomic_load(&q->num_dropped);
+		if (num_dropped != num_reported) {
+			rlen = format_log_line(q->batch + len, MM_LOG_LINE_MAXLEN,
+			                       MM_LOG_WARN, "mmlog",
+			                       "%zu log messages dropped",
+			                       num_dropped - num_reported);
+			if (write_log_files(MM_LOG_WARN, q->batch + len, rlen))
+				len += rlen;
+
+			num_reported = num_dropped;
+		}
+
+		write_log_str(q->batch, len);
+
+		mm_thr_mutex_lock(&q->mtx);
+		q->written = head;
+		mm_thr_cond_broadcast(&q->done_cond);
+
+		if (n < LOG_BATCH_SIZE) {
+			// Exit only when the producers have published all
+			// the positions they have claimed
+			if (q->stop)
+				done = (head == atomic_load(&q->tail));
+
+			atomic_store(&q->writer_idle, 1);
+			if (!done && is_queue_empty(q)) {
+				mm_gettime(MM_CLK_REALTIME, &ts);
+				mm_timeadd_ms(&ts, LOG_IDLE_WAIT_MS);
+				mm_thr_cond_timedwait(&q->wake_cond, &q->mtx,
+				                      &ts);
+			}
+
+			atomic_store(&q->writer_idle, 0);
+		}
+
+		mm_thr_mutex_unlock(&q->mtx);
+	}
+
+	return NULL;
+}
+
+
+static
+void destroy_log_queue(struct log_queue* q)
+{
+	mm_thr_cond_deinit(&q->done_cond);
+	mm_thr_cond_deinit(&q->wake_cond);
+	mm_thr_mutex_deinit(&q->mtx);
+	free(q->batch);
+	free(q->records);
+	free(q);
+}
+
+
+static
+struct log_queue* create_log_queue(size_t num_records, int policy)
+{
+	struct log_queue* q;
+	size_t i, size;
+
+	// Round up to the next power of 2
+	for (size = 1; size < num_records; size *= 2)
+		;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->records = malloc(size * sizeof(*q->records));
+	q->batch = malloc((LOG_BATCH_SIZE+1) * MM_LOG_LINE_MAXLEN);
+	if (!q->records || !q->batch) {
+		free(q->batch);
+		free(q->records);
+		free(q);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++)
+		atomic_init(&q->records[i].seq, i);
+
+	q->mask = size-1;
+	q->policy = policy;
+	mm_thr_mutex_init(&q->mtx, 0);
+	mm_thr_cond_init(&q->wake_cond, 0);
+	mm_thr_cond_init(&q->done_cond, 0);
+
+	return q;
+}
+
+
+/**
+ * stop_async_log() - stop the writer thread after the queue is drained
+ *
+ * Return: the queue that was used, NULL if asynchronous mode was not
+ * active.
+ */
+static
+struct log_queue* stop_async_log(void)
+{
+	struct log_queue* q;
+
+	mm_thr_mutex_lock(&async_mtx);
+
+	// The next log lines are written synchronously
+	q = atomic_exchange(&async_queue, NULL);
+	if (q) {
+		mm_thr_mutex_lock(&q->mtx);
+		q->stop = 1;
+		mm_thr_cond_signal(&q->wake_cond);
+		mm_thr_mutex_unlock(&q->mtx);
+
+		mm_thr_join(q->thread, NULL);
+	}
+
+	mm_thr_mutex_unlock(&async_mtx);
+	return q;
+}
+
+
+MM_DESTRUCTOR(async_log)
+{
+	// Drain the queue at exit. It is not freed since the threads still
+	// running may not have finished to use it.
+	stop_async_log();
+}
+
+
 /**
  * mm_log() - Add a formatted message to the log file
  * @lvl:        log level.
@@ -169,6 +1109,14 @@ size_t format_log_str(char* restrict buff, size_t blen,
  * A value different from the one listed above, the maximum level output on the
  * log is WARN.
  *
+ * The maximum level can also be set per module, by a comma separated list of
+ * items in the form module=LEVEL, where module is the name defined by
+ * MM_LOG_MODULE_NAME at the call site. An item without module name sets the
+ * level of the modules not listed. For example "WARN,net=DEBUG,ipc=ERROR"
+ * writes the logs up to DEBUG from the module "net", up to ERROR from "ipc"
+ * and up to WARN from any other module. The levels can be changed at runtime
+ * by mm_log_set_maxlvl() and mm_log_set_module_maxlvl().
+ *
  * mm_log() is thread-safe.
  *
  * See: sprintf(), mm_log_fatal(), mm_log_error(), mm_log_warn(),
@@ -177,30 +1125,232 @@ size_t format_log_str(char* restrict buff, size_t blen,
 API_EXPORTED
 void mm_log(int lvl, const char* location, const char* msg, ...)
 {
-	ssize_t r;
 	size_t len;
-	char* cbuf;
 	va_list args;
 	char buff[MM_LOG_LINE_MAXLEN];
+	struct log_queue* q;
+	int out, rec, binary;
 
-	// Do not log something higher than the max level set by environment
-	if (lvl > maxloglvl || lvl < 0)
+	if (lvl < 0)
 		return;
 
-	// Format log string onto buffer
-	va_start(args, msg);
-	len = format_log_str(buff, sizeof(buff), lvl, location, msg, args);
-	va_end(args);
+	// Do not log something higher than the max level set by environment,
+	// unless the flight recorder takes it
+	out = (lvl <= get_module_maxlvl(location));
+	rec = (lvl <= atomic_load_explicit(&recorder_maxlvl,
+	                                   memory_order_relaxed));
+	if (!out && !rec)
+		return;
 
-	// Write message on log file descriptor
-	cbuf = buff;
-	do {
-		if ((r = mm_write(STDERR_FILENO, cbuf, len)) < 0)
-			return;
+	// In binary mode, the formatting is deferred to the consumer, except
+	// for the flight recorder which stores formatted lines
+	binary = atomic_load_explicit(&binlog_active, memory_order_relaxed);
+	if (rec || !binary) {
+		va_start(args, msg);
+		len = format_log_str(buff, sizeof(buff), lvl, location, msg, args);
+		va_end(args);
 
-		len -= r;
-		cbuf += r;
-	} while (len);
+		if (rec)
+			recorder_write(buff, len);
+	}
+
+	if (!out)
+		return;
+
+	if (binary) {
+		va_start(args, msg);
+		binlog_record(lvl, location, msg, args);
+		va_end(args);
+
+		if (lvl == MM_LOG_FATAL) {
+			mm_log_flush();
+			recorder_dump_fatal();
+		}
+
+		return;
+	}
+
+	q = atomic_load_explicit(&async_queue, memory_order_acquire);
+	if (!q) {
+		if (write_log_files(lvl, buff, len))
+			write_log_str(buff, len);
+
+		if (lvl == MM_LOG_FATAL) {
+			flush_log_files();
+			recorder_dump_fatal();
+		}
+
+		return;
+	}
+
+	// A fatal log is likely followed by abort(): it must not be dropped
+	// and all the pending lines must be written before returning
+	if (lvl == MM_LOG_FATAL) {
+		enqueue_record(q, lvl, buff, len, MM_LOG_ASYNC_BLOCK);
+		mm_log_flush();
+		recorder_dump_fatal();
+		return;
+	}
+
+	enqueue_record(q, lvl, buff, len, q->policy);
+}
+
+
+/**
+ * mm_log_async_start() - write the log from a background thread
+ * @num_records: number of log lines that can be pending (0 for default)
+ * @policy:     behavior when @num_records log lines are pending
+ *
+ * Switch the logging to asynchronous mode: mm_log() no longer writes the
+ * log line itself but queues it (without taking any lock) for a
+ * background thread that writes the pending lines in batches. This keeps
+ * the threads that log from being stalled when the log output is slow
+ * (pipe, terminal or file on a loaded disk).
+ *
+ * Up to @num_records log lines (rounded up to a power of 2, 1024 if 0 is
+ * passed) can be pending. When the queue is full, mm_log() applies
+ * @policy which must be one of:
+ *
+ * - MM_LOG_ASYNC_BLOCK: wait for the background thread to make room
+ * - MM_LOG_ASYNC_DROP_NEWEST: discard the new log line
+ * - MM_LOG_ASYNC_DROP_OLDEST: discard the oldest pending log line
+ *
+ * The number of dropped lines is reported in the log. A log of level
+ * MM_LOG_FATAL is never dropped and is written along with all pending
+ * lines before mm_log() returns. The pending lines are also written when
+ * the process exits normally. Use mm_log_flush() to wait for the pending
+ * lines to be written.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_log_async_start(size_t num_records, int policy)
+{
+	struct log_queue* q;
+	int rv = 0;
+
+	if (policy != MM_LOG_ASYNC_BLOCK
+	    && policy != MM_LOG_ASYNC_DROP_NEWEST
+	    && policy != MM_LOG_ASYNC_DROP_OLDEST)
+		return mm_raise_error(EINVAL, "Invalid overflow policy (%i)",
+		                      policy);
+
+	if (num_records > LOG_QUEUE_MAX_SIZE)
+		return mm_raise_error(EINVAL, "Too many log records (%zu), "
+		                      "maximum is %i",
+		                      num_records, LOG_QUEUE_MAX_SIZE);
+
+	if (!num_records)
+		num_records = LOG_QUEUE_DEFAULT_SIZE;
+
+	mm_thr_mutex_lock(&async_mtx);
+
+	if (atomic_load(&async_queue)) {
+		rv = mm_raise_error(EALREADY, "Asynchronous log already "
+		                    "started");
+		goto exit;
+	}
+
+	q = create_log_queue(num_records, policy);
+	if (!q) {
+		rv = mm_raise_from_errno("Cannot allocate log queue");
+		goto exit;
+	}
+
+	if (mm_thr_create(&q->thread, log_writer_thread, q)) {
+		destroy_log_queue(q);
+		rv = -1;
+		goto exit;
+	}
+
+	atomic_store(&async_queue, q);
+
+exit:
+	mm_thr_mutex_unlock(&async_mtx);
+	return rv;
+}
+
+
+/**
+ * mm_log_async_stop() - write the log from the calling thread again
+ *
+ * Write all the pending log lines, stop the background thread started by
+ * mm_log_async_start() and revert to the synchronous mode. No other thread
+ * may call mm_log() concurrently. Nothing is done if the asynchronous mode
+ * is not active.
+ *
+ * Return: 0
+ */
+API_EXPORTED
+int mm_log_async_stop(void)
+{
+	struct log_queue* q;
+
+	q = stop_async_log();
+	if (q)
+		destroy_log_queue(q);
+
+	return 0;
+}
+
+
+/**
+ * mm_log_flush() - wait for the pending log lines to be written
+ *
+ * In asynchronous mode, wait until the log lines queued before the call
+ * have been written (or dropped). In binary mode (see
+ * mm_log_binary_start()), wait until the records logged before the call
+ * have been written. In synchronous mode, the function returns
+ * immediately.
+ *
+ * Return: 0
+ */
+API_EXPORTED
+int mm_log_flush(void)
+{
+	struct log_queue* q;
+
+	q = atomic_load(&async_queue);
+	if (q)
+		wait_written(q, atomic_load(&q->tail));
+
+	binlog_flush();
+	flush_log_files();
+
+	return 0;
+}
+
+
+/**
+ * mm_log_set_timestamp() - set the format of the log time stamps
+ * @format:     timestamp format to set
+ *
+ * Select how the time of the logs is printed at the beginning of the log
+ * lines. @format can be one of the following:
+ *
+ * MM_LOG_TS_DEFAULT
+ *   local date and time to the second, ie "dd/mm/yy HH:MM:SS"
+ * MM_LOG_TS_USEC
+ *   local date and time to the microsecond, ie "dd/mm/yy HH:MM:SS.uuuuuu"
+ * MM_LOG_TS_MONOTONIC
+ *   seconds and microseconds elapsed on the monotonic clock (MM_CLK_MONOTONIC)
+ *
+ * The two last formats are meant for latency debugging. The initial format
+ * can also be set by the MM_LOG_TIMESTAMP environment variable to
+ * "default", "usec" or "monotonic".
+ *
+ * Return: previous timestamp format, -1 if @format is invalid (with error
+ * state set accordingly).
+ */
+API_EXPORTED
+int mm_log_set_timestamp(int format)
+{
+	if (format < 0 || format >= (int)NTS_FORMAT)
+		return mm_raise_error(EINVAL, "Invalid timestamp format %i",
+		                      format);
+
+	return atomic_exchange(&ts_format, format);
 }
 
 
@@ -213,7 +1363,21 @@ void mm_log(int lvl, const char* location, const char* msg, ...)
 API_EXPORTED
 int mm_log_set_maxlvl(int lvl)
 {
-	int rv = maxloglvl;
-	maxloglvl = lvl;
+	struct log_module* mod;
+	int rv;
+
+	mm_thr_mutex_lock(&modules_mtx);
+
+	rv = atomic_exchange(&maxloglvl, lvl);
+
+	// Update the modules whose level has not been set
+	for (mod = atomic_load(&modules); mod; mod = mod->next) {
+		if (mod->setlvl == MODULE_INHERIT)
+			atomic_store(&mod->maxlvl, lvl);
+	}
+
+	update_site_levels();
+	mm_thr_mutex_unlock(&modules_mtx);
+
 	return rv;
 }
@@ -75,6 +75,150 @@ MMLIB_API int mm_dirname(char* dst, const char* path);
 
 MMLIB_API void* mm_aligned_alloc(size_t alignment, size_t size);
 MMLIB_API void mm_aligned_free(void* ptr);
+MMLIB_API void* mm_aligned_realloc(void* ptr, size_t alignment, size_t size);
+
+#define MM_ALLOC_HUGEPAGE       0x1
+#define MM_ALLOC_THP_HINT       0x2
+
+MMLIB_API void* mm_aligned_alloc_ex(size_t alignment, size_t size, int flags);
+MMLIB_API size_t mm_aligned_get_pagesize(const void* ptr);
+
+
+/*************************************************************************
+ *                                                                       *
+ *                      allocation instrumentation                       *
+ *                                                                       *
+ *************************************************************************/
+
+/**
+ * struct mm_allocator - user allocator used by mmlib
+ * @alloc:      allocate a block of @size bytes aligned on @alignment
+ * @free:       release a block returned by @alloc
+ * @data:       user data passed to @alloc and @free
+ */
+struct mm_allocator {
+	void* (*alloc)(void* data, size_t alignment, size_t size);
+	void (*free)(void* data, void* ptr);
+	void* data;
+};
+
+/**
+ * struct mm_alloc_site_stats - allocation statistics of a mmlib call site
+ * @file:       source file of the call site
+ * @line:       line of the call site
+ * @desc:       short description of what is allocated at the call site
+ * @num_alloc:  number of allocations performed so far
+ * @num_bytes:  number of bytes allocated so far
+ * @live_count: number of blocks currently allocated
+ * @live_bytes: number of bytes currently allocated
+ * @peak_bytes: maximum number of bytes allocated at the same time
+ */
+struct mm_alloc_site_stats {
+	const char* file;
+	int line;
+	const char* desc;
+	uint64_t num_alloc;
+	uint64_t num_bytes;
+	size_t live_count;
+	size_t live_bytes;
+	size_t peak_bytes;
+};
+
+MMLIB_API int mm_set_allocator(const struct mm_allocator* allocator);
+MMLIB_API int mm_alloc_stats_enable(void);
+MMLIB_API int mm_alloc_get_stats(struct mm_alloc_site_stats* stats,
+                                 int max_num);
+MMLIB_API void mm_alloc_print_stats(int fd);
+
+
+/*************************************************************************
+ *                                                                       *
+ *                        NUMA memory placement                          *
+ *                                                                       *
+ *************************************************************************/
+
+#define MM_NUMA_MOVE    0x1
+
+MMLIB_API int mm_numa_get_num_nodes(void);
+MMLIB_API int mm_numa_get_node_of_cpu(int cpu);
+MMLIB_API int mm_numa_get_current_node(void);
+MMLIB_API void* mm_numa_alloc_onnode(size_t alignment, size_t size, int node);
+MMLIB_API void* mm_numa_alloc_interleaved(size_t alignment, size_t size);
+MMLIB_API int mm_numa_bind(void* addr, size_t len, int node, int flags);
+MMLIB_API int mm_numa_get_node_of_addr(const void* addr);
+
+
+/*************************************************************************
+ *                                                                       *
+ *                       fixed-size object pool                          *
+ *                                                                       *
+ *************************************************************************/
+
+struct mm_pool;
+
+/**
+ * struct mm_pool_stats - usage statistics of an object pool
+ * @objsize:    size of objects (including padding for alignment)
+ * @hits:       number of allocations served directly by a thread cache
+ * @misses:     number of allocations that have required to refill a thread
+ *              cache from the shared depot
+ * @drains:     number of batches of objects sent back from a thread cache
+ *              to the shared depot
+ * @num_tcaches: number of thread caches currently associated with the pool
+ * @bytes_held: total amount of memory held by the pool
+ * @bytes_depot: amount of memory available in the shared depot (not
+ *              accounting the objects cached by the threads)
+ */
+struct mm_pool_stats {
+	size_t objsize;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t drains;
+	int num_tcaches;
+	size_t bytes_held;
+	size_t bytes_depot;
+};
+
+MMLIB_API struct mm_pool* mm_pool_create(size_t objsize, size_t alignment);
+MMLIB_API void mm_pool_destroy(struct mm_pool* pool);
+MMLIB_API void* mm_pool_alloc(struct mm_pool* pool);
+MMLIB_API void mm_pool_free(struct mm_pool* pool, void* ptr);
+MMLIB_API int mm_pool_get_stats(struct mm_pool* pool,
+                                struct mm_pool_stats* stats);
+
+
+/*************************************************************************
+ *                                                                       *
+ *                       region allocator (arena)                        *
+ *                                                                       *
+ *************************************************************************/
+
+struct mm_arena;
+
+#define MM_ARENA_GUARD  0x1
+
+/**
+ * struct mm_arena_pos - allocation state of an arena
+ * @chunk:      chunk of the arena used at the time of the mark
+ * @ptr:        allocation pointer at the time of the mark
+ *
+ * The fields of this structure are private and should not be accessed
+ * directly. Use mm_arena_mark() and mm_arena_rewind() instead.
+ */
+struct mm_arena_pos {
+	void* chunk;
+	void* ptr;
+};
+
+MMLIB_API struct mm_arena* mm_arena_create(size_t chunk_size, int flags);
+MMLIB_API void mm_arena_destroy(struct mm_arena* arena);
+MMLIB_API void* mm_arena_alloc(struct mm_arena* arena, size_t alignment,
+                               size_t size);
+MMLIB_API void mm_arena_mark(struct mm_arena* arena,
+                             struct mm_arena_pos* pos);
+MMLIB_API void mm_arena_rewind(struct mm_arena* arena,
+                               const struct mm_arena_pos* pos);
+MMLIB_API void mm_arena_reset(struct mm_arena* arena);
 
 
 /*************************************************************************
@@ -94,6 +238,22 @@ MMLIB_API void mm_aligned_free(void* ptr);
 // mm_malloca() and mm_freea()
 MMLIB_API void* _mm_malloca_on_heap(size_t size);
 MMLIB_API void _mm_freea_on_heap(void* ptr);
+MMLIB_API int _mm_malloca_fits_stack(size_t size);
+
+/**
+ * struct mm_malloca_stats - statistics of mm_malloca() beyond stack
+ * @scratch_allocs: number of allocations served by the scratch stacks of
+ *              the threads
+ * @heap_fallbacks: number of allocations that have been served by the heap
+ * @scratch_mapped: amount of memory currently mapped for the scratch stacks
+ */
+struct mm_malloca_stats {
+	uint64_t scratch_allocs;
+	uint64_t heap_fallbacks;
+	size_t scratch_mapped;
+};
+
+MMLIB_API int mm_malloca_get_stats(struct mm_malloca_stats* stats);
 
 
 /**
@@ -135,7 +295,9 @@ MMLIB_API void _mm_freea_on_heap(void* ptr);
  * @size:       size of memory to be allocated
  *
  * This macro allocates @size bytes from the stack if not too big (lower or
- * equal to MM_STACK_ALLOC_THRESHOLD) or on the heap. The returned pointer
+ * equal to MM_STACK_ALLOC_THRESHOLD). Otherwise the memory is taken from a
+ * scratch stack private to the calling thread, or on the heap if the scratch
+ * stack cannot serve the request. The returned pointer
  * is ensured to be aligned on a boundary suitable for any data type. If
  * @size is 0, mm_malloca() allocates a zero-length item and returns a valid
  * pointer to that item.
@@ -149,10 +311,40 @@ MMLIB_API void _mm_freea_on_heap(void* ptr);
  * case of successful allocation, the returned pointer must be passed to
  * mm_freea() before calling function returns to its caller.
  */
+#ifndef MM_MALLOCA_ADAPTIVE
 #define mm_malloca(size) \
 	( (size) > MM_STACK_ALLOC_THRESHOLD \
 	  ? _mm_malloca_on_heap(size) \
 	  : mm_aligned_alloca(2*MM_STK_ALIGN, (size)))
+#else
+#define mm_malloca(size) mm_malloca_adaptive(size)
+#endif
+
+
+/**
+ * mm_malloca_adaptive() - allocates memory on the stack if headroom allows
+ * @size:       size of memory to be allocated
+ *
+ * This macro behaves like mm_malloca() excepting that the limit of stack
+ * allocation is not fixed: if @size is bigger than MM_STACK_ALLOC_THRESHOLD,
+ * the bounds of the stack of the calling thread and the current stack
+ * pointer are inspected. The allocation is then done on stack if it
+ * consumes at most half of the remaining stack space (keeping a safety
+ * margin before the guard page). Otherwise (or if the stack bounds cannot
+ * be determined on the platform), it falls back to the same allocation as
+ * mm_malloca().
+ *
+ * Defining MM_MALLOCA_ADAPTIVE before including mmlib.h makes mm_malloca()
+ * behave like mm_malloca_adaptive().
+ *
+ * Return: pointer to the allocated space in case success, NULL otherwise.
+ * The returned pointer must be passed to mm_freea() before calling function
+ * returns to its caller.
+ */
+#define mm_malloca_adaptive(size) \
+	( (size) > MM_STACK_ALLOC_THRESHOLD && !_mm_malloca_fits_stack(size) \
+	  ? _mm_malloca_on_heap(size) \
+	  : mm_aligned_alloca(2*MM_STK_ALIGN, (size)))
 
 
 /**
@@ -163,7 +355,10 @@ MMLIB_API void _mm_freea_on_heap(void* ptr);
  * when this function returns, the memory might not be reusable yet. If @ptr
  * has been allocated on stack, the memory will be reclaimed (hence
  * reusable) only when the function that has called mm_malloca() for
- * allocating @ptr will return to its caller.
+ * allocating @ptr will return to its caller. Blocks should be freed in the
+ * reverse order of their allocation: the memory of a block taken from the
+ * scratch stack of the thread is reclaimed only once all the blocks
+ * allocated after it have been freed.
  */
 static inline
 void mm_freea(void* ptr)
@@ -172,7 +367,8 @@ void mm_freea(void* ptr)
 	// @ptr address. If @ptr is:
 	//  - NULL: the allocation failed
 	//  - 0 mod (2*MM_STK_ALIGN): allocated on stack
-	//  - MM_STK_ALIGN mod (2*MM_STK_ALIGN): allocated on heap
+	//  - MM_STK_ALIGN mod (2*MM_STK_ALIGN): allocated on thread scratch
+	//    stack or on heap
 	if ((uintptr_t)ptr & (2*MM_STK_ALIGN-1))
 		_mm_freea_on_heap(ptr);
 }
@@ -15,6 +15,16 @@
 #define MM_LOG_INFO 3
 #define MM_LOG_DEBUG 4
 
+#define MM_LOG_ASYNC_BLOCK       0
+#define MM_LOG_ASYNC_DROP_NEWEST 1
+#define MM_LOG_ASYNC_DROP_OLDEST 2
+
+#define MM_LOG_TS_DEFAULT   0
+#define MM_LOG_TS_USEC      1
+#define MM_LOG_TS_MONOTONIC 2
+
+#define MM_LOG_SINK_STDERR  0
+
 #ifndef MM_LOG_MAXLEVEL
 #  define MM_LOG_MAXLEVEL MM_LOG_DEBUG
 #endif
@@ -27,37 +37,76 @@
 #endif
 
 
+/**
+ * struct mm_log_site - cache of the log level of a call site
+ * @maxlvl:     maximum level of the module of the call site (NULL until the
+ *              module has been looked up)
+ *
+ * The mm_log_*() macros declare one per call site so that checking whether
+ * a log is enabled is a single load and compare (once the site has been
+ * resolved): the arguments of a disabled log are not evaluated.
+ */
+struct mm_log_site {
+	const int* maxlvl;
+};
+
+#if defined (__GNUC__) || defined (__clang__)
+#  define MM_LOG_LOAD_SITE(site) \
+	__atomic_load_n(&(site)->maxlvl, __ATOMIC_ACQUIRE)
+#  define MM_LOG_LOAD_LVL(ptr)   __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#else
+#  define MM_LOG_LOAD_SITE(site) \
+	(*(const int* const volatile*)&(site)->maxlvl)
+#  define MM_LOG_LOAD_LVL(ptr)   (*(const volatile int*)(ptr))
+#endif
+
+/*
+ * The mm_log_*() macros expand to a void expression, like when they are
+ * disabled at build time. The call site cache needs a static variable, hence
+ * a statement expression: without compiler support, the module level is
+ * looked up at each call instead.
+ */
+#if defined (__GNUC__) || defined (__clang__)
+#define mm_log_at_site(lvl, ...) \
+	__extension__ ({ \
+		static struct mm_log_site mm_log_site_; \
+		mm_log_site_enabled(&mm_log_site_, lvl, MM_LOG_MODULE_NAME) \
+		? mm_log(lvl, MM_LOG_MODULE_NAME, __VA_ARGS__) \
+		: MM_LOG_VOID_CAST(0); \
+	})
+#else
+#define mm_log_at_site(lvl, ...) \
+	(mm_log_enabled(lvl, MM_LOG_MODULE_NAME) \
+	 ? mm_log(lvl, MM_LOG_MODULE_NAME, __VA_ARGS__) \
+	 : MM_LOG_VOID_CAST(0))
+#endif
+
 #if MM_LOG_MAXLEVEL >= MM_LOG_FATAL
-#define mm_log_fatal(...) \
-	mm_log(MM_LOG_FATAL, MM_LOG_MODULE_NAME, __VA_ARGS__)
+#define mm_log_fatal(...) mm_log_at_site(MM_LOG_FATAL, __VA_ARGS__)
 #else
 #define mm_log_fatal(...) MM_LOG_VOID_CAST(0)
 #endif
 
 #if MM_LOG_MAXLEVEL >= MM_LOG_ERROR
-#define mm_log_error(...) \
-	mm_log(MM_LOG_ERROR, MM_LOG_MODULE_NAME, __VA_ARGS__)
+#define mm_log_error(...) mm_log_at_site(MM_LOG_ERROR, __VA_ARGS__)
 #else
 #define mm_log_error(...) MM_LOG_VOID_CAST(0)
 #endif
 
 #if MM_LOG_MAXLEVEL >= MM_LOG_WARN
-#define mm_log_warn(...) \
-	mm_log(MM_LOG_WARN, MM_LOG_MODULE_NAME, __VA_ARGS__)
+#define mm_log_warn(...) mm_log_at_site(MM_LOG_WARN, __VA_ARGS__)
 #else
 #define mm_log_warn(...) MM_LOG_VOID_CAST(0)
 #endif
 
 #if MM_LOG_MAXLEVEL >= MM_LOG_INFO
-#define mm_log_info(...) \
-	mm_log(MM_LOG_INFO, MM_LOG_MODULE_NAME, __VA_ARGS__)
+#define mm_log_info(...) mm_log_at_site(MM_LOG_INFO, __VA_ARGS__)
 #else
 #define mm_log_info(...) MM_LOG_VOID_CAST(0)
 #endif
 
 #if MM_LOG_MAXLEVEL >= MM_LOG_DEBUG
-#define mm_log_debug(...) \
-	mm_log(MM_LOG_DEBUG, MM_LOG_MODULE_NAME, __VA_ARGS__)
+#define mm_log_debug(...) mm_log_at_site(MM_LOG_DEBUG, __VA_ARGS__)
 #else
 #define mm_log_debug(...) MM_LOG_VOID_CAST(0)
 #endif
@@ -79,6 +128,39 @@
 		} \
 	} while (0)
 
+/**
+ * struct mm_log_file_opts - options of a log file sink
+ * @maxlvl:     maximum level of the log lines written on the file
+ * @max_size:   size in bytes over which the file is rotated (0 for no limit)
+ * @rotate_period: period in seconds at which the file is rotated (0 for no
+ *              rotation)
+ * @max_files:  number of rotated files kept
+ * @flush_period: maximum time in ms a log line stays in memory before being
+ *              written (0 for default, negative to write it immediately)
+ *
+ * See mm_log_add_file().
+ */
+struct mm_log_file_opts {
+	int maxlvl;
+	size_t max_size;
+	int rotate_period;
+	int max_files;
+	int flush_period;
+};
+
+/**
+ * struct mm_log_recorder_opts - options of the log flight recorder
+ * @maxlvl:     maximum level of the log lines recorded
+ * @size:       size in bytes of the circular buffer (0 for default)
+ * @dump_signal: signal on which the recorded lines are written on the
+ *              standard error (0 for none)
+ */
+struct mm_log_recorder_opts {
+	int maxlvl;
+	size_t size;
+	int dump_signal;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -86,6 +168,48 @@ extern "C" {
 MMLIB_API void mm_log(int lvl, const char* location, const char* msg, ...);
 
 MMLIB_API int mm_log_set_maxlvl(int lvl);
+MMLIB_API int mm_log_set_module_maxlvl(const char* module, int lvl);
+MMLIB_API int mm_log_enabled(int lvl, const char* module);
+MMLIB_API const int* mm_log_site_resolve(struct mm_log_site* site,
+                                         const char* module);
+MMLIB_API int mm_log_set_timestamp(int format);
+
+MMLIB_API int mm_log_async_start(size_t num_records, int policy);
+MMLIB_API int mm_log_async_stop(void);
+MMLIB_API int mm_log_flush(void);
+MMLIB_API int mm_log_binary_start(int fd);
+MMLIB_API int mm_log_binary_stop(void);
+MMLIB_API int mm_log_binary_decode(int in_fd, int out_fd);
+
+MMLIB_API int mm_log_add_file(const char* path,
+                              const struct mm_log_file_opts* opts);
+MMLIB_API int mm_log_remove_sink(int sink_id);
+MMLIB_API int mm_log_set_sink_maxlvl(int sink_id, int lvl);
+
+MMLIB_API int mm_log_recorder_start(const char* name,
+                                    const struct mm_log_recorder_opts* opts);
+MMLIB_API int mm_log_recorder_stop(void);
+MMLIB_API void mm_log_recorder_dump(int fd);
+MMLIB_API int mm_log_recorder_read(const char* name, int fd);
+
+/**
+ * mm_log_site_enabled() - test whether a log call site is enabled
+ * @site:       cache of the call site
+ * @lvl:        level of the log
+ * @module:     module name of the call site
+ *
+ * Return: non zero if a log of level @lvl from @module must be written
+ */
+static inline
+int mm_log_site_enabled(struct mm_log_site* site, int lvl, const char* module)
+{
+	const int* maxlvl = MM_LOG_LOAD_SITE(site);
+
+	if (UNLIKELY(!maxlvl))
+		maxlvl = mm_log_site_resolve(site, module);
+
+	return lvl <= MM_LOG_LOAD_LVL(maxlvl);
+}
 
 #ifdef __cplusplus
 }
@@ -11,15 +11,31 @@
 #define PROF_MAX        0x04
 #define PROF_MEAN       0x08
 #define PROF_MEDIAN     0x10
+#define PROF_P90        0x20
+#define PROF_P99        0x40
+#define PROF_P999       0x80
 #define PROF_DEFAULT    (PROF_MIN|PROF_MAX|PROF_MEAN|PROF_MEDIAN)
 #define PROF_FORCE_NSEC 0x100
 #define PROF_FORCE_USEC 0x200
 #define PROF_FORCE_MSEC 0x300
 #define PROF_FORCE_SEC  0x400
+#define PROF_CYCLES     0x800
+#define PROF_INSTR      0x1000
+#define PROF_IPC        0x2000
+#define PROF_CACHE_MISS 0x4000
+#define PROF_BRANCH_MISS 0x8000
 
 #define PROF_RESET_CPUCLOCK  0x01
 #define PROF_RESET_KEEPLABEL 0x02
+#define PROF_RESET_TSC       0x04
+#define PROF_RESET_PERFCNT   0x08
 
+#define PROF_SLOW_MAX_POINTS    32
+
+#define PROF_SAMPLE_COLLAPSED   0
+#define PROF_SAMPLE_PPROF       1
+
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -33,6 +49,101 @@ MMLIB_API int mm_profile_print(int mask, int fd);
 MMLIB_API void mm_profile_reset(int reset_flags);
 MMLIB_API int64_t mm_profile_get_data(int measure_point, int type);
 
+/**
+ * struct mm_profile_bucket - bucket of latency histogram
+ * @lower:      lowest value (in ns) counted in the bucket
+ * @upper:      highest value (in ns) counted in the bucket
+ * @count:      number of timings recorded in the bucket
+ */
+struct mm_profile_bucket {
+	int64_t lower;
+	int64_t upper;
+	uint64_t count;
+};
+
+MMLIB_API int mm_profile_get_histogram(int measure_point,
+                                       struct mm_profile_bucket* buckets,
+                                       int max_num);
+
+/**
+ * struct mm_profile_slow_iter - iteration exceeding the slow threshold
+ * @timestamp:  time (MM_CLK_REALTIME in ns) at which the iteration ended
+ * @thread_id:  system identifier of the thread that ran the iteration
+ * @iteration:  index of the iteration since the last reset
+ * @num_points: number of points of measure recorded in @timings
+ * @total:      duration of the iteration in ns
+ * @timings:    timings in ns of the points of measure of the iteration
+ */
+struct mm_profile_slow_iter {
+	int64_t timestamp;
+	long thread_id;
+	int iteration;
+	int num_points;
+	int64_t total;
+	int64_t timings[PROF_SLOW_MAX_POINTS];
+};
+
+MMLIB_API int mm_profile_set_slow_threshold(int measure_point,
+                                            int64_t threshold);
+MMLIB_API int mm_profile_get_slow_iters(struct mm_profile_slow_iter* iters,
+                                        int max_num);
+MMLIB_API int mm_profile_print_slow(int mask, int fd);
+
+MMLIB_API void mm_profile_enter(const char* label);
+MMLIB_API void mm_profile_leave(void);
+MMLIB_API int mm_profile_print_tree(int mask, int fd);
+MMLIB_API int mm_profile_print_collapsed(int fd);
+
+MMLIB_API void mm_trace_begin(const char* name);
+MMLIB_API void mm_trace_end(void);
+MMLIB_API void mm_trace_instant(const char* name);
+MMLIB_API void mm_trace_counter(const char* name, int64_t value);
+MMLIB_API int mm_trace_set_thread_name(const char* name);
+MMLIB_API int mm_trace_set_buffer_size(size_t num_events);
+MMLIB_API int mm_trace_flush(int fd);
+
+MMLIB_API int mm_profile_sample_start(int freq);
+MMLIB_API int mm_profile_sample_stop(int fd, int format);
+
+struct mm_profile_ctx;
+
+MMLIB_API struct mm_profile_ctx* mm_profile_ctx_create(int reset_flags);
+MMLIB_API struct mm_profile_ctx* mm_profile_ctx_create_shared(const char* name,
+                                                              int reset_flags);
+MMLIB_API void mm_profile_ctx_destroy(struct mm_profile_ctx* ctx);
+MMLIB_API void mm_profile_ctx_tic(struct mm_profile_ctx* ctx);
+MMLIB_API void mm_profile_ctx_toc(struct mm_profile_ctx* ctx);
+MMLIB_API void mm_profile_ctx_toc_label(struct mm_profile_ctx* ctx,
+                                        const char* label);
+MMLIB_API int mm_profile_ctx_print(struct mm_profile_ctx* ctx,
+                                   int mask, int fd);
+MMLIB_API void mm_profile_ctx_reset(struct mm_profile_ctx* ctx,
+                                    int reset_flags);
+MMLIB_API int64_t mm_profile_ctx_get_data(struct mm_profile_ctx* ctx,
+                                          int measure_point, int type);
+MMLIB_API int mm_profile_ctx_set_precision(struct mm_profile_ctx* ctx,
+                                           int bits);
+MMLIB_API int mm_profile_ctx_get_histogram(struct mm_profile_ctx* ctx,
+                                           int measure_point,
+                                           struct mm_profile_bucket* buckets,
+                                           int max_num);
+MMLIB_API void mm_profile_ctx_enter(struct mm_profile_ctx* ctx,
+                                    const char* label);
+MMLIB_API void mm_profile_ctx_leave(struct mm_profile_ctx* ctx);
+MMLIB_API int mm_profile_ctx_print_tree(struct mm_profile_ctx* ctx,
+                                        int mask, int fd);
+MMLIB_API int mm_profile_ctx_print_collapsed(struct mm_profile_ctx* ctx,
+                                             int fd);
+MMLIB_API int mm_profile_ctx_set_slow_threshold(struct mm_profile_ctx* ctx,
+                                                int measure_point,
+                                                int64_t threshold);
+MMLIB_API int mm_profile_ctx_get_slow_iters(struct mm_profile_ctx* ctx,
+                                            struct mm_profile_slow_iter* iters,
+                                            int max_num);
+MMLIB_API int mm_profile_ctx_print_slow(struct mm_profile_ctx* ctx,
+                                        int mask, int fd);
+MMLIB_API int mm_profile_shm_print(const char* name, int mask, int fd);
+
 #ifdef __cplusplus
 }
 #endif
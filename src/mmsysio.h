@@ -376,12 +376,20 @@ MMLIB_API int mm_wait_process(mm_pid_t pid, int* status);
 #define MM_MAP_EXEC   0x00000004
 #define MM_MAP_SHARED 0x00000008
 
+#define MM_MAP_GUARD  0x00000010
+#define MM_MAP_LAZY   0x00000020
+
 #define MM_MAP_RDWR (MM_MAP_READ | MM_MAP_WRITE)
 #define MM_MAP_PRIVATE 0x00000000
 
+#define MM_MAP_DECOMMIT_DEFER   0x00000001
+
 
 MMLIB_API void* mm_mapfile(int fd, mm_off_t offset, size_t len, int mflags);
 MMLIB_API int mm_unmap(void* addr);
+MMLIB_API void* mm_map_anon(size_t len, int mflags);
+MMLIB_API int mm_map_decommit(void* addr, size_t len, int flags);
+MMLIB_API int mm_map_recommit(void* addr, size_t len);
 
 MMLIB_API int mm_shm_open(const char* name, int oflag, int mode);
 MMLIB_API int mm_anon_shm(void);
@@ -0,0 +1,458 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "mmlib.h"
+#include "mmerrno.h"
+#include "mmpredefs.h"
+#include "alloc-internal.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#  include <dirent.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+/*
+ * The NUMA placement is implemented on Linux only, with the raw mbind,
+ * get_mempolicy, move_pages and getcpu syscalls in order to avoid any
+ * dependency on libnuma. On other platforms, or if the kernel does not allow
+ * the memory policy syscalls (kernel without NUMA support, seccomp
+ * filtering), the system is reported to have a single node and the
+ * placement requests are successful no-ops.
+ */
+
+#define NUMA_MAX_NODES          1024
+#define NODEMASK_NLONG          (NUMA_MAX_NODES / (8*sizeof(unsigned long)))
+
+// Values from linux/mempolicy.h
+#define MPOL_PREFERRED          1
+#define MPOL_BIND               2
+#define MPOL_INTERLEAVE         3
+#define MPOL_MF_MOVE            (1 << 1)
+
+static atomic_int num_numa_nodes;
+
+
+#ifdef __linux__
+
+struct nodemask {
+	unsigned long bits[NODEMASK_NLONG];
+};
+
+
+static
+void nodemask_set(struct nodemask* mask, int node)
+{
+	int nbits = 8*sizeof(unsigned long);
+
+	mask->bits[node / nbits] |= 1UL << (node % nbits);
+}
+
+
+static
+long sys_mbind(void* addr, size_t len, int mode,
+               const struct nodemask* mask, unsigned int flags)
+{
+	// The kernel expects maxnode to be one more than the number of bits
+	return syscall(SYS_mbind, addr, len, mode, mask->bits,
+	               NUMA_MAX_NODES + 1, flags);
+}
+
+
+/**
+ * read_num_nodes() - get the number of NUMA nodes from sysfs
+ *
+ * Return: highest online node id plus one, 1 if it cannot be determined.
+ */
+static
+int read_num_nodes(void)
+{
+	FILE* fp;
+	int node, max_node = 0;
+	char sep;
+
+	fp = fopen("/sys/devices/system/node/online", "r");
+	if (!fp)
+		return 1;
+
+	// Format is a list of ranges, for example "0-1,4"
+	while (fscanf(fp, "%d%c", &node, &sep) >= 1) {
+		if (node > max_node)
+			max_node = node;
+
+		if (sep != '-' && sep != ',')
+			break;
+	}
+
+	fclose(fp);
+
+	if (max_node >= NUMA_MAX_NODES)
+		max_node = NUMA_MAX_NODES - 1;
+
+	return max_node + 1;
+}
+
+
+/**
+ * apply_policy() - apply a memory policy to a range
+ * @addr:       page-aligned start of the range
+ * @len:        length of the range
+ * @mode:       MPOL_* policy
+ * @node:       node to use, or -1 to use all nodes
+ * @flags:      MPOL_MF_* flags
+ *
+ * Return: 0 in case of success, -1 otherwise with errno set.
+ */
+static
+int apply_policy(void* addr, size_t len, int mode, int node, unsigned flags)
+{
+	struct nodemask mask = {.bits = {0}};
+	int i, num_nodes = mm_numa_get_num_nodes();
+
+	// Nothing to place on single node system
+	if (num_nodes == 1)
+		return 0;
+
+	if (node >= 0) {
+		nodemask_set(&mask, node);
+	} else {
+		for (i = 0; i < num_nodes; i++)
+			nodemask_set(&mask, i);
+	}
+
+	return sys_mbind(addr, len, mode, &mask, flags) ? -1 : 0;
+}
+
+#else /* __linux__ */
+
+static
+int read_num_nodes(void)
+{
+	return 1;
+}
+
+
+static
+int apply_policy(void* addr, size_t len, int mode, int node, unsigned flags)
+{
+	(void)addr;
+	(void)len;
+	(void)mode;
+	(void)node;
+	(void)flags;
+
+	return 0;
+}
+
+#endif /* __linux__ */
+
+
+static
+int check_node(int node)
+{
+	if (node < 0 || node >= mm_numa_get_num_nodes()) {
+		mm_raise_error(EINVAL, "Invalid NUMA node %i", node);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * numa_alloc() - allocate memory block with a memory policy
+ * @alignment:  alignment of the block, must be a power of 2
+ * @size:       size of the block
+ * @mode:       MPOL_* policy to apply on the block
+ * @node:       node to use, or -1 to use all nodes
+ *
+ * Return: the allocated block in case of success, NULL otherwise with error
+ * state set accordingly.
+ */
+static
+void* numa_alloc(size_t alignment, size_t size, int mode, int node)
+{
+	struct mapped_block blk;
+	void* ptr;
+
+	if (!MM_IS_POW2(alignment) || alignment < sizeof(void*)) {
+		mm_raise_error(EINVAL, "Invalid alignment (%zu)", alignment);
+		return NULL;
+	}
+
+	// The policy must be set on whole pages, so the memory is mapped
+	// directly (even on single node system, so that the block can be
+	// passed to mm_numa_bind() later whatever the system)
+	if (size == 0)
+		return mm_aligned_alloc(alignment, size);
+
+	ptr = mapped_block_alloc(alignment, size, MAPPED_PLAIN);
+	if (!ptr) {
+		mm_raise_from_errno("Cannot map memory (size=%zu)", size);
+		return NULL;
+	}
+
+	// Set policy before pages are touched
+	mapped_block_lookup(ptr, &blk);
+	if (apply_policy(ptr, blk.len, mode, node, 0)) {
+		mm_raise_from_errno("Cannot set memory policy");
+		mm_aligned_free(ptr);
+		return NULL;
+	}
+
+	return ptr;
+}
+
+
+/**
+ * mm_numa_get_num_nodes() - get number of NUMA nodes of the system
+ *
+ * Return: the number of NUMA nodes (the valid node ids are between 0 and
+ * the returned value minus 1). This is 1 on a system without NUMA or where
+ * the NUMA placement is not supported.
+ */
+API_EXPORTED
+int mm_numa_get_num_nodes(void)
+{
+	int num_nodes;
+
+	num_nodes = atomic_load_explicit(&num_numa_nodes, memory_order_relaxed);
+	if (LIKELY(num_nodes))
+		return num_nodes;
+
+	num_nodes = read_num_nodes();
+
+#ifdef __linux__
+	// Check that memory policy syscalls are allowed: they are not on
+	// kernel without NUMA support or in some sandboxed environment
+	if (num_nodes > 1) {
+		int mode;
+
+		if (syscall(SYS_get_mempolicy, &mode, NULL, 0, NULL, 0))
+			num_nodes = 1;
+	}
+#endif
+
+	atomic_store_explicit(&num_numa_nodes, num_nodes, memory_order_relaxed);
+	return num_nodes;
+}
+
+
+/**
+ * mm_numa_get_node_of_cpu() - get NUMA node of a CPU
+ * @cpu:        id of the CPU
+ *
+ * Return: the node of @cpu in case of success, -1 otherwise with error
+ * state set accordingly.
+ */
+API_EXPORTED
+int mm_numa_get_node_of_cpu(int cpu)
+{
+	if (cpu < 0) {
+		mm_raise_error(EINVAL, "Invalid cpu %i", cpu);
+		return -1;
+	}
+
+	if (mm_numa_get_num_nodes() == 1)
+		return 0;
+
+#ifdef __linux__
+	char path[64];
+	struct dirent* entry;
+	DIR* dir;
+	int node = -1;
+
+	// The sysfs directory of the cpu contains a link nodeN to its node
+	sprintf(path, "/sys/devices/system/cpu/cpu%i", cpu);
+	dir = opendir(path);
+	if (!dir) {
+		mm_raise_from_errno("Cannot get info of cpu %i", cpu);
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+	}
+
+	closedir(dir);
+
+	if (node < 0) {
+		mm_raise_error(ENOENT, "Cannot find node of cpu %i", cpu);
+		return -1;
+	}
+
+	return node;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ * mm_numa_get_current_node() - get NUMA node of the calling thread
+ *
+ * This function returns the node of the CPU on which the calling thread is
+ * running. Unless the thread affinity is restricted to the CPUs of one
+ * node, the result might be outdated as soon as the function returns.
+ *
+ * Return: the node of the CPU running the calling thread in case of
+ * success, -1 otherwise with error state set accordingly.
+ */
+API_EXPORTED
+int mm_numa_get_current_node(void)
+{
+	if (mm_numa_get_num_nodes() == 1)
+		return 0;
+
+#ifdef __linux__
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL)) {
+		mm_raise_from_errno("getcpu failed");
+		return -1;
+	}
+
+	return node;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ * mm_numa_alloc_onnode() - allocate memory on a specific NUMA node
+ * @alignment:  alignment value, must be a power of 2
+ * @size:       size of the requested memory allocation
+ * @node:       node on which the memory must be allocated
+ *
+ * This allocates a block of @size bytes whose address is a multiple of
+ * @alignment and whose pages are taken from the memory of @node. If @node
+ * does not have enough free memory, the pages are taken from other nodes.
+ * The block must be released with mm_aligned_free().
+ *
+ * Return: A pointer to the memory block that was allocated in case of
+ * success. Otherwise NULL is returned and error state set accordingly
+ */
+API_EXPORTED
+void* mm_numa_alloc_onnode(size_t alignment, size_t size, int node)
+{
+	if (check_node(node))
+		return NULL;
+
+	return numa_alloc(alignment, size, MPOL_PREFERRED, node);
+}
+
+
+/**
+ * mm_numa_alloc_interleaved() - allocate memory interleaved over NUMA nodes
+ * @alignment:  alignment value, must be a power of 2
+ * @size:       size of the requested memory allocation
+ *
+ * This allocates a block of @size bytes whose address is a multiple of
+ * @alignment and whose pages are distributed in round-robin over all the
+ * nodes of the system. This is suitable for memory shared by threads
+ * running on all nodes. The block must be released with mm_aligned_free().
+ *
+ * Return: A pointer to the memory block that was allocated in case of
+ * success. Otherwise NULL is returned and error state set accordingly
+ */
+API_EXPORTED
+void* mm_numa_alloc_interleaved(size_t alignment, size_t size)
+{
+	return numa_alloc(alignment, size, MPOL_INTERLEAVE, -1);
+}
+
+
+/**
+ * mm_numa_bind() - bind memory range to a NUMA node
+ * @addr:       start of the memory range, must be aligned on page size
+ * @len:        length of the memory range
+ * @node:       node to which the memory must be bound
+ * @flags:      0 or MM_NUMA_MOVE
+ *
+ * This function sets the memory of the range [@addr, @addr+@len) to be
+ * allocated only from @node. By default, this affects only the pages that
+ * are not yet backed by physical memory (ie, not yet touched). If @flags
+ * contains MM_NUMA_MOVE, the pages already present in the range are
+ * migrated to @node.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_numa_bind(void* addr, size_t len, int node, int flags)
+{
+	unsigned int mflags = 0;
+
+	if (check_node(node))
+		return -1;
+
+	if (flags & ~MM_NUMA_MOVE) {
+		mm_raise_error(EINVAL, "Invalid flags (0x%08x)", flags);
+		return -1;
+	}
+
+	if ((uintptr_t)addr & (get_system_pagesize()-1)) {
+		mm_raise_error(EINVAL, "addr=%p is not page aligned", addr);
+		return -1;
+	}
+
+	if (flags & MM_NUMA_MOVE)
+		mflags |= MPOL_MF_MOVE;
+
+	if (apply_policy(addr, len, MPOL_BIND, node, mflags)) {
+		mm_raise_from_errno("Cannot bind memory to node %i", node);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * mm_numa_get_node_of_addr() - get NUMA node of a memory page
+ * @addr:       address in the page to query
+ *
+ * Return: the node holding the page containing @addr in case of success,
+ * -1 otherwise with error state set accordingly. In particular, the error is
+ * ENOENT if the page is not yet backed by physical memory.
+ */
+API_EXPORTED
+int mm_numa_get_node_of_addr(const void* addr)
+{
+	if (mm_numa_get_num_nodes() == 1)
+		return 0;
+
+#ifdef __linux__
+	void* page;
+	int status;
+
+	page = (void*)((uintptr_t)addr & ~(uintptr_t)(get_system_pagesize()-1));
+
+	// move_pages() with NULL nodes only reports the node of the pages
+	if (syscall(SYS_move_pages, 0, 1, &page, NULL, &status, 0)) {
+		mm_raise_from_errno("Cannot query node of %p", addr);
+		return -1;
+	}
+
+	if (status < 0) {
+		mm_raise_error(-status, "Cannot query node of %p", addr);
+		return -1;
+	}
+
+	return status;
+#else
+	return 0;
+#endif
+}
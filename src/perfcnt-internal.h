@@ -0,0 +1,145 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef PERFCNT_INTERNAL_H
+#define PERFCNT_INTERNAL_H
+
+#include <stdint.h>
+
+#include "mmpredefs.h"
+
+#if defined (__linux__)
+#  include <linux/perf_event.h>
+#  if defined (__x86_64__) || defined (__i386__)
+#    include <x86intrin.h>
+#    define HAVE_RDPMC   1
+#  endif
+#endif
+
+#ifndef HAVE_RDPMC
+#  define HAVE_RDPMC    0
+#endif
+
+/*
+ * The hardware performance counters are read with a group of
+ * perf_event_open() events attached to the calling thread. When the kernel
+ * allows it (cap_user_rdpmc in the mmapped page of the events), the
+ * counters are read from userspace with the rdpmc instruction, which avoids
+ * a system call at each mm_toc(). Otherwise the whole group is read at once
+ * with read().
+ */
+
+enum {
+	PERFCNT_CYCLES,
+	PERFCNT_INSTR,
+	PERFCNT_CACHE_MISS,
+	PERFCNT_BRANCH_MISS,
+	NUM_PERFCNT
+};
+
+/**
+ * struct perfcnt - group of hardware counters of a thread
+ * @num_open:   number of counters opened in the group (0 if the hardware
+ *              counters are not available)
+ * @use_rdpmc:  true if all opened counters can be read with rdpmc
+ * @fds:        file descriptors of the events (-1 if not opened). The
+ *              first one is the group leader.
+ * @read_index: position of the counter in the values returned by read()
+ *              of the group (-1 if not opened)
+ * @pages:      mmapped pages of the events (NULL if not mapped)
+ */
+struct perfcnt {
+	int num_open;
+	int use_rdpmc;
+	int fds[NUM_PERFCNT];
+	int read_index[NUM_PERFCNT];
+	void* pages[NUM_PERFCNT];
+};
+
+int perfcnt_open(struct perfcnt* pc);
+void perfcnt_close(struct perfcnt* pc);
+void perfcnt_read_group(const struct perfcnt* pc, int64_t values[]);
+
+
+static inline
+int perfcnt_is_available(const struct perfcnt* pc, int counter)
+{
+	return pc->num_open && pc->read_index[counter] >= 0;
+}
+
+
+#if HAVE_RDPMC
+
+/**
+ * read_event_rdpmc() - read the value of an event from userspace
+ * @page:       mmapped page of the event
+ *
+ * Return: the current value of the event, -1 if it is not scheduled on the
+ * CPU (in which case the value must be read with read()).
+ */
+static inline
+int64_t read_event_rdpmc(const struct perf_event_mmap_page* page)
+{
+	const volatile struct perf_event_mmap_page* pg = page;
+	uint32_t seq, idx;
+	int64_t count, offset;
+	int shift;
+
+	do {
+		seq = pg->lock;
+		__asm__ __volatile__ ("" ::: "memory");
+
+		idx = pg->index;
+		offset = pg->offset;
+		if (!idx)
+			return -1;
+
+		// Sign-extend the raw counter value to 64 bits
+		shift = 64 - pg->pmc_width;
+		count = (int64_t)((uint64_t)__rdpmc(idx - 1) << shift) >> shift;
+
+		__asm__ __volatile__ ("" ::: "memory");
+	} while (pg->lock != seq);
+
+	return offset + count;
+}
+
+#endif
+
+
+/**
+ * perfcnt_read() - read the counters of a group
+ * @pc:         group of counters opened with perfcnt_open()
+ * @values:     array of NUM_PERFCNT elements receiving the counter values
+ *
+ * The values of the counters which are not available are left untouched.
+ */
+static inline
+void perfcnt_read(const struct perfcnt* pc, int64_t values[])
+{
+#if HAVE_RDPMC
+	int i;
+	int64_t v;
+
+	if (pc->use_rdpmc) {
+		for (i = 0; i < NUM_PERFCNT; i++) {
+			if (!pc->pages[i])
+				continue;
+
+			v = read_event_rdpmc(pc->pages[i]);
+			if (UNLIKELY(v < 0)) {
+				perfcnt_read_group(pc, values);
+				return;
+			}
+
+			values[i] = v;
+		}
+
+		return;
+	}
+#endif
+
+	perfcnt_read_group(pc, values);
+}
+
+#endif /* ifndef PERFCNT_INTERNAL_H */
@@ -0,0 +1,196 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mmpredefs.h"
+#include "perfcnt-internal.h"
+
+#if defined (__linux__)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const uint64_t perfcnt_configs[NUM_PERFCNT] = {
+	[PERFCNT_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+	[PERFCNT_INSTR] = PERF_COUNT_HW_INSTRUCTIONS,
+	[PERFCNT_CACHE_MISS] = PERF_COUNT_HW_CACHE_MISSES,
+	[PERFCNT_BRANCH_MISS] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+
+static
+int open_event(uint64_t config, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	// Only the user part is counted: this is what is allowed with the
+	// default perf_event_paranoid setting
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	// Like the other file descriptors of mmlib, do not leak in children
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+	                    PERF_FLAG_FD_CLOEXEC);
+}
+
+
+/**
+ * map_event_page() - map the page exposing the state of an event
+ * @fd:         file descriptor of the event
+ *
+ * Return: the mapped page if the event can be read with rdpmc, NULL
+ * otherwise.
+ */
+static
+struct perf_event_mmap_page* map_event_page(int fd)
+{
+	struct perf_event_mmap_page* page;
+
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		return NULL;
+
+	if (!HAVE_RDPMC || !page->cap_user_rdpmc) {
+		munmap(page, sysconf(_SC_PAGESIZE));
+		return NULL;
+	}
+
+	return page;
+}
+
+
+/**
+ * perfcnt_open() - open the hardware counters of the calling thread
+ * @pc:         group of counters to initialize
+ *
+ * The counters are opened in a single group so that they are scheduled
+ * together on the PMU. A counter not supported by the CPU is simply not
+ * available. The failure of the open is not reported as an error: in
+ * containers or when kernel.perf_event_paranoid forbids it, the counters
+ * are just not available.
+ *
+ * Return: 0 if at least one counter has been opened, -1 otherwise.
+ */
+LOCAL_SYMBOL
+int perfcnt_open(struct perfcnt* pc)
+{
+	int i, fd, group_fd = -1;
+
+	pc->num_open = 0;
+	pc->use_rdpmc = HAVE_RDPMC;
+	for (i = 0; i < NUM_PERFCNT; i++) {
+		pc->fds[i] = -1;
+		pc->read_index[i] = -1;
+		pc->pages[i] = NULL;
+	}
+
+	for (i = 0; i < NUM_PERFCNT; i++) {
+		fd = open_event(perfcnt_configs[i], group_fd);
+		if (fd < 0) {
+			// Without leader, the other counters cannot be opened
+			if (group_fd < 0)
+				break;
+
+			continue;
+		}
+
+		if (group_fd < 0)
+			group_fd = fd;
+
+		pc->fds[i] = fd;
+		pc->read_index[i] = pc->num_open++;
+		pc->pages[i] = map_event_page(fd);
+		if (!pc->pages[i])
+			pc->use_rdpmc = 0;
+	}
+
+	return pc->num_open ? 0 : -1;
+}
+
+
+/**
+ * perfcnt_close() - close the counters opened by perfcnt_open()
+ * @pc:         group of counters to close
+ */
+LOCAL_SYMBOL
+void perfcnt_close(struct perfcnt* pc)
+{
+	int i;
+
+	// Close the group leader last
+	for (i = NUM_PERFCNT-1; i >= 0 && pc->num_open; i--) {
+		if (pc->pages[i])
+			munmap(pc->pages[i], sysconf(_SC_PAGESIZE));
+
+		if (pc->fds[i] >= 0)
+			close(pc->fds[i]);
+
+		pc->pages[i] = NULL;
+		pc->fds[i] = -1;
+		pc->read_index[i] = -1;
+	}
+
+	pc->num_open = 0;
+	pc->use_rdpmc = 0;
+}
+
+
+/**
+ * perfcnt_read_group() - read the counters with a system call
+ * @pc:         group of counters opened with perfcnt_open()
+ * @values:     array of NUM_PERFCNT elements receiving the counter values
+ */
+LOCAL_SYMBOL
+void perfcnt_read_group(const struct perfcnt* pc, int64_t values[])
+{
+	uint64_t data[NUM_PERFCNT+1];
+	int i;
+
+	// With PERF_FORMAT_GROUP, the number of events comes first followed
+	// by the values in order of creation
+	if (read(pc->fds[PERFCNT_CYCLES], data, sizeof(data)) < 0)
+		return;
+
+	for (i = 0; i < NUM_PERFCNT; i++) {
+		if (pc->read_index[i] >= 0)
+			values[i] = (int64_t)data[pc->read_index[i]+1];
+	}
+}
+
+#else /* !__linux__ */
+
+LOCAL_SYMBOL
+int perfcnt_open(struct perfcnt* pc)
+{
+	memset(pc, 0, sizeof(*pc));
+	return -1;
+}
+
+
+LOCAL_SYMBOL
+void perfcnt_close(struct perfcnt* pc)
+{
+	pc->num_open = 0;
+}
+
+
+LOCAL_SYMBOL
+void perfcnt_read_group(const struct perfcnt* pc, int64_t values[])
+{
+	(void)pc;
+	(void)values;
+}
+
+#endif
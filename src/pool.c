@@ -0,0 +1,752 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "mmlib.h"
+#include "mmerrno.h"
+#include "mmpredefs.h"
+#include "mmthread.h"
+#include "alloc-internal.h"
+#include "tls-internal.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_BATCH_SIZE         32
+#define TCACHE_CAPACITY         (2*POOL_BATCH_SIZE)
+#define NUM_TCACHE_SLOTS        8
+#define SLAB_MIN_SIZE           (16*MM_PAGESZ)
+
+/**************************************************************************
+ *                                                                        *
+ *                          Pool data structures                          *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct free_batch - batch of free objects
+ * @next_obj:   next object in the batch (NULL for the last one)
+ * @next_batch: next batch in the depot (meaningful only in batch head)
+ *
+ * This structure overlays the memory of a free object when it is stored in
+ * the depot. This is why the object size of a pool is at least 2 pointers.
+ */
+struct free_batch {
+	struct free_batch* next_obj;
+	struct free_batch* next_batch;
+};
+
+
+/**
+ * struct slab - header of memory block from which objects are carved
+ * @next:       next slab allocated by the pool
+ */
+struct slab {
+	struct slab* next;
+};
+
+
+/**
+ * struct pool_tcache - per-thread cache of free object of a pool
+ * @objs:       stack of cached free objects
+ * @count:      number of objects in @objs
+ * @pool_id:    unique identifier of the pool the cache is associated with
+ * @pool:       pool the cache is associated with. NULL once the pool has
+ *              been destroyed (modified with tcache_mtx held).
+ * @pool_next:  next cache in the list of cache of @pool (protected by
+ *              tcache_mtx)
+ * @thread_next: next cache in the list of cache owned by the thread
+ * @hits:       number of allocation served by @objs
+ * @misses:     number of allocation that have required a refill
+ * @drains:     number of batch sent back to depot
+ *
+ * Only the owner thread modifies the statistic counters. They are atomic only
+ * to allow mm_pool_get_stats() to read them from a different thread.
+ */
+struct pool_tcache {
+	void* objs[TCACHE_CAPACITY];
+	int count;
+	uint64_t pool_id;
+	struct mm_pool* _Atomic pool;
+	struct pool_tcache* pool_next;
+	struct pool_tcache* thread_next;
+	atomic_uint_least64_t hits;
+	atomic_uint_least64_t misses;
+	atomic_uint_least64_t drains;
+};
+
+
+/**
+ * struct mm_pool - fixed-size object pool
+ * @objsize:    size of object (including padding for alignment)
+ * @alignment:  alignment of objects
+ * @slab_size:  size of the memory block allocated when pool must grow
+ * @slab_hdrsize: size of slab header (rounded to @alignment)
+ * @id:         unique identifier of the pool (never reused)
+ * @mtx:        lock protecting the depot and slabs data
+ * @depot:      stack of full batches of free objects
+ * @depot_nbatch: number of batches in @depot
+ * @partial:    list of free objects not forming a full batch
+ * @partial_count: number of objects in @partial
+ * @slabs:      list of slabs allocated by the pool
+ * @carve_ptr:  pointer to the next object to carve in the current slab
+ * @carve_end:  end of carvable area in the current slab
+ * @bytes_held: total size of slabs
+ * @caches:     list of thread caches (protected by tcache_mtx)
+ * @retired_hits: cumulated hits of caches of exited threads
+ * @retired_misses: cumulated misses of caches of exited threads
+ * @retired_drains: cumulated drains of caches of exited threads
+ */
+struct mm_pool {
+	size_t objsize;
+	size_t alignment;
+	size_t slab_size;
+	size_t slab_hdrsize;
+	uint64_t id;
+
+	mm_thr_mutex_t mtx;
+	struct free_batch* depot;
+	size_t depot_nbatch;
+	struct free_batch* partial;
+	int partial_count;
+	struct slab* slabs;
+	char* carve_ptr;
+	char* carve_end;
+	size_t bytes_held;
+
+	struct pool_tcache* caches;
+	uint64_t retired_hits;
+	uint64_t retired_misses;
+	uint64_t retired_drains;
+};
+
+
+/**
+ * struct tcache_slot - thread local entry to find cache of a pool quickly
+ * @pool_id:    identifier of the pool whose cache is pointed by @cache
+ * @cache:      cache of the thread for the pool of id @pool_id
+ */
+struct tcache_slot {
+	uint64_t pool_id;
+	struct pool_tcache* cache;
+};
+
+// lock protecting the associations between pools and thread caches
+static mm_thr_mutex_t tcache_mtx = MM_THR_MUTEX_INITIALIZER;
+static uint64_t next_pool_id = 1;
+
+static thread_local struct tcache_slot tcache_slots[NUM_TCACHE_SLOTS];
+static thread_local struct pool_tcache* thread_caches;
+
+static tls_key_t tcache_key;
+static int tcache_key_valid;
+static mm_thr_once_t tcache_key_once = MM_THR_ONCE_INIT;
+
+
+static inline
+void counter_inc(atomic_uint_least64_t* cnt)
+{
+	uint64_t val = atomic_load_explicit(cnt, memory_order_relaxed);
+	atomic_store_explicit(cnt, val+1, memory_order_relaxed);
+}
+
+
+static inline
+uint64_t counter_get(atomic_uint_least64_t* cnt)
+{
+	return atomic_load_explicit(cnt, memory_order_relaxed);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                        Depot manipulation                              *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * link_batch() - chain objects together to form a batch
+ * @objs:       array of objects
+ * @num:        number of element in @objs
+ *
+ * Return: the head of the batch
+ */
+static
+struct free_batch* link_batch(void** objs, int num)
+{
+	struct free_batch* head = NULL;
+	struct free_batch* obj;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		obj = objs[i];
+		obj->next_obj = head;
+		head = obj;
+	}
+
+	return head;
+}
+
+
+/**
+ * depot_push_objs() - return free objects to the depot
+ * @pool:       pool to modify
+ * @objs:       array of objects
+ * @num:        number of element in @objs
+ *
+ * Full batches are pushed on the depot stack, the remaining objects are
+ * added to the partial list. The partial list is turned into a batch as
+ * soon as it is full.
+ *
+ * Must be called with @pool->mtx held.
+ */
+static
+void depot_push_objs(struct mm_pool* pool, void** objs, int num)
+{
+	struct free_batch* obj;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		obj = objs[i];
+		obj->next_obj = pool->partial;
+		pool->partial = obj;
+		if (++pool->partial_count < POOL_BATCH_SIZE)
+			continue;
+
+		obj->next_batch = pool->depot;
+		pool->depot = obj;
+		pool->depot_nbatch++;
+		pool->partial = NULL;
+		pool->partial_count = 0;
+	}
+}
+
+
+/**
+ * pool_grow() - allocate a new slab and make it the carving area
+ * @pool:       pool to grow
+ *
+ * Must be called with @pool->mtx held.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int pool_grow(struct mm_pool* pool)
+{
+	static struct alloc_site site = ALLOC_SITE_INIT("pool slab");
+	struct slab* slab;
+	size_t align;
+
+	align = pool->alignment;
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+
+	slab = site_alloc(&site, align, pool->slab_size);
+	if (!slab)
+		return mm_raise_from_errno("Cannot allocate slab of pool");
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->bytes_held += pool->slab_size;
+
+	pool->carve_ptr = (char*)slab + pool->slab_hdrsize;
+	pool->carve_end = (char*)slab + pool->slab_size;
+
+	return 0;
+}
+
+
+/**
+ * depot_refill_tcache() - move a batch of free objects in a thread cache
+ * @pool:       pool from which the objects are taken
+ * @c:          thread cache to refill (must be empty)
+ *
+ * Take a full batch from the depot if any, otherwise the partial list if not
+ * empty. If both are empty, a batch of objects is carved from the current
+ * slab (allocating a new one if necessary). The lock is held only for the
+ * time of a few pointer updates: the batch is unrolled in the thread cache
+ * once the lock has been released.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int depot_refill_tcache(struct mm_pool* pool, struct pool_tcache* c)
+{
+	struct free_batch* batch;
+	char* carved = NULL;
+	int i;
+
+	mm_thr_mutex_lock(&pool->mtx);
+
+	batch = pool->depot;
+	if (batch) {
+		pool->depot = batch->next_batch;
+		pool->depot_nbatch--;
+	} else if (pool->partial) {
+		batch = pool->partial;
+		pool->partial = NULL;
+		pool->partial_count = 0;
+	} else {
+		if (pool->carve_ptr == pool->carve_end
+		    && pool_grow(pool)) {
+			mm_thr_mutex_unlock(&pool->mtx);
+			return -1;
+		}
+
+		carved = pool->carve_ptr;
+		pool->carve_ptr += POOL_BATCH_SIZE * pool->objsize;
+	}
+
+	mm_thr_mutex_unlock(&pool->mtx);
+
+	if (carved) {
+		// Store in reverse order so that objects are allocated in
+		// increasing address order
+		for (i = 0; i < POOL_BATCH_SIZE; i++)
+			c->objs[i] = carved + (POOL_BATCH_SIZE-1-i)*pool->objsize;
+
+		c->count = POOL_BATCH_SIZE;
+		return 0;
+	}
+
+	for (i = 0; batch; i++, batch = batch->next_obj)
+		c->objs[i] = batch;
+
+	c->count = i;
+	return 0;
+}
+
+
+/**
+ * tcache_drain() - send back a batch of objects of thread cache to depot
+ * @pool:       pool to which the objects are returned
+ * @c:          full thread cache
+ */
+static
+void tcache_drain(struct mm_pool* pool, struct pool_tcache* c)
+{
+	struct free_batch* batch;
+
+	c->count -= POOL_BATCH_SIZE;
+	batch = link_batch(c->objs + c->count, POOL_BATCH_SIZE);
+	counter_inc(&c->drains);
+
+	mm_thr_mutex_lock(&pool->mtx);
+	batch->next_batch = pool->depot;
+	pool->depot = batch;
+	pool->depot_nbatch++;
+	mm_thr_mutex_unlock(&pool->mtx);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Thread cache management                           *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * tcache_retire() - give back thread cache content and stats to its pool
+ * @pool:       pool associated with @c
+ * @c:          thread cache being released
+ *
+ * Must be called with tcache_mtx held.
+ */
+static
+void tcache_retire(struct mm_pool* pool, struct pool_tcache* c)
+{
+	struct pool_tcache** pnext;
+
+	mm_thr_mutex_lock(&pool->mtx);
+	depot_push_objs(pool, c->objs, c->count);
+	mm_thr_mutex_unlock(&pool->mtx);
+	c->count = 0;
+
+	pool->retired_hits += counter_get(&c->hits);
+	pool->retired_misses += counter_get(&c->misses);
+	pool->retired_drains += counter_get(&c->drains);
+
+	// Remove cache from the list of cache of the pool
+	for (pnext = &pool->caches; *pnext; pnext = &(*pnext)->pool_next) {
+		if (*pnext == c) {
+			*pnext = c->pool_next;
+			break;
+		}
+	}
+}
+
+
+/**
+ * tcache_thread_exit() - release thread caches of an exiting thread
+ * @arg:        head of list of thread caches
+ *
+ * Registered as destructor of tcache_key, so called at thread exit.
+ */
+static
+void tcache_thread_exit(void* arg)
+{
+	struct pool_tcache* c;
+	struct pool_tcache* next;
+	struct mm_pool* pool;
+
+	mm_thr_mutex_lock(&tcache_mtx);
+
+	for (c = arg; c != NULL; c = next) {
+		next = c->thread_next;
+		pool = atomic_load(&c->pool);
+		if (pool)
+			tcache_retire(pool, c);
+
+		free(c);
+	}
+
+	mm_thr_mutex_unlock(&tcache_mtx);
+
+	// Forget the released caches in case the pool is used again later in
+	// the exit of the thread (by another thread local data destructor)
+	thread_caches = NULL;
+	memset(tcache_slots, 0, sizeof(tcache_slots));
+}
+
+
+static
+void init_tcache_key(void)
+{
+	if (!tls_key_create(&tcache_key, tcache_thread_exit))
+		tcache_key_valid = 1;
+}
+
+
+/**
+ * remove_orphan_tcaches() - free thread caches of destroyed pools
+ *
+ * Walk the thread caches of the calling thread and free those whose pool has
+ * been destroyed.
+ */
+static
+void remove_orphan_tcaches(void)
+{
+	struct pool_tcache** pnext;
+	struct pool_tcache* c;
+	struct pool_tcache* head = thread_caches;
+
+	pnext = &thread_caches;
+	while ((c = *pnext) != NULL) {
+		if (atomic_load(&c->pool)) {
+			pnext = &c->thread_next;
+			continue;
+		}
+
+		*pnext = c->thread_next;
+		free(c);
+	}
+
+	// The key must not keep the freed head, it would be freed again at
+	// thread exit
+	if (thread_caches != head && tcache_key_valid)
+		tls_key_set(tcache_key, thread_caches);
+}
+
+
+/**
+ * get_tcache_slow() - get or create the thread cache of a pool
+ * @pool:       pool whose thread cache must be obtained
+ * @slot:       thread local slot in which the cache must be stored
+ *
+ * Return: pointer to thread cache in case of success, NULL otherwise with
+ * error state set.
+ */
+static NOINLINE
+struct pool_tcache* get_tcache_slow(struct mm_pool* pool,
+                                    struct tcache_slot* slot)
+{
+	struct pool_tcache* c;
+
+	remove_orphan_tcaches();
+
+	// Search if the thread has already a cache for this pool
+	for (c = thread_caches; c != NULL; c = c->thread_next) {
+		if (c->pool_id == pool->id)
+			goto exit;
+	}
+
+	mm_thr_once(&tcache_key_once, init_tcache_key);
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		mm_raise_from_errno("Cannot allocate thread cache of pool");
+		return NULL;
+	}
+
+	c->pool_id = pool->id;
+	atomic_init(&c->pool, pool);
+	c->thread_next = thread_caches;
+	thread_caches = c;
+	if (tcache_key_valid)
+		tls_key_set(tcache_key, thread_caches);
+
+	mm_thr_mutex_lock(&tcache_mtx);
+	c->pool_next = pool->caches;
+	pool->caches = c;
+	mm_thr_mutex_unlock(&tcache_mtx);
+
+exit:
+	slot->pool_id = pool->id;
+	slot->cache = c;
+	return c;
+}
+
+
+static inline
+struct pool_tcache* get_tcache(struct mm_pool* pool)
+{
+	struct tcache_slot* slot;
+
+	slot = &tcache_slots[pool->id % NUM_TCACHE_SLOTS];
+	if (LIKELY(slot->pool_id == pool->id))
+		return slot->cache;
+
+	return get_tcache_slow(pool, slot);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                              Pool API                                  *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_pool_create() - create a pool of fixed-size objects
+ * @objsize:    size of the objects that will be allocated from the pool
+ * @alignment:  alignment of the objects, must be a power of 2. If 0, the
+ *              objects are aligned on a boundary suitable for any data type.
+ *
+ * This function creates an allocator dedicated to objects of the same size.
+ * Allocation and deallocation with mm_pool_alloc() and mm_pool_free() are
+ * served in most cases from a cache specific to the calling thread, hence
+ * without any lock nor atomic operation. When the thread cache is empty (or
+ * full), a whole batch of objects is taken from (or sent back to) a depot
+ * shared by all threads. Thus the lock of the depot is taken at most once
+ * every few dozens of allocations or deallocations, even when objects are
+ * freed by a different thread than the one that has allocated them.
+ *
+ * The memory backing the objects is obtained by slabs with
+ * mm_aligned_alloc() and is given back to the system only when the pool is
+ * destroyed.
+ *
+ * Return: pointer to the created pool in case of success. NULL otherwise
+ * with error state set accordingly.
+ */
+API_EXPORTED
+struct mm_pool* mm_pool_create(size_t objsize, size_t alignment)
+{
+	struct mm_pool* pool;
+	size_t batch_size;
+
+	if (alignment == 0)
+		alignment = MM_STK_ALIGN;
+
+	if (!MM_IS_POW2(alignment)) {
+		mm_raise_error(EINVAL, "alignment (%zu) is not a power of 2",
+		               alignment);
+		return NULL;
+	}
+
+	if (objsize > SIZE_MAX / (8*POOL_BATCH_SIZE)
+	    || alignment > SIZE_MAX / (8*POOL_BATCH_SIZE)) {
+		mm_raise_error(ENOMEM, "objsize=%zu is too big", objsize);
+		return NULL;
+	}
+
+	// A free object must be able to hold a struct free_batch
+	if (objsize < sizeof(struct free_batch))
+		objsize = sizeof(struct free_batch);
+
+	// Round object size to multiple of alignment
+	objsize = (objsize + alignment-1) & ~(alignment-1);
+	batch_size = POOL_BATCH_SIZE * objsize;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		mm_raise_from_errno("Cannot allocate pool");
+		return NULL;
+	}
+
+	pool->objsize = objsize;
+	pool->alignment = alignment;
+	pool->slab_hdrsize = (sizeof(struct slab) + alignment-1)
+	                     & ~(alignment-1);
+
+	// Slab hold an integer number of batches, at least 4 and enough to
+	// fill SLAB_MIN_SIZE
+	pool->slab_size = 4 * batch_size;
+	while (pool->slab_size < SLAB_MIN_SIZE)
+		pool->slab_size += batch_size;
+
+	pool->slab_size += pool->slab_hdrsize;
+
+	mm_thr_mutex_init(&pool->mtx, 0);
+
+	mm_thr_mutex_lock(&tcache_mtx);
+	pool->id = next_pool_id++;
+	mm_thr_mutex_unlock(&tcache_mtx);
+
+	return pool;
+}
+
+
+/**
+ * mm_pool_destroy() - destroy a pool and free all its objects
+ * @pool:       pool to destroy (may be NULL)
+ *
+ * Release all the memory held by @pool. All objects allocated from @pool
+ * become invalid after this call. No other thread may use @pool while
+ * mm_pool_destroy() is running.
+ */
+API_EXPORTED
+void mm_pool_destroy(struct mm_pool* pool)
+{
+	struct pool_tcache* c;
+	struct pool_tcache* next_cache;
+	struct slab* slab;
+	struct slab* next;
+
+	if (!pool)
+		return;
+
+	// Detach all thread caches: their memory is owned by their
+	// respective threads which will free them lazily. A cache may be
+	// freed as soon as it is detached: get the next one before.
+	mm_thr_mutex_lock(&tcache_mtx);
+	for (c = pool->caches; c != NULL; c = next_cache) {
+		next_cache = c->pool_next;
+		atomic_store(&c->pool, NULL);
+	}
+
+	mm_thr_mutex_unlock(&tcache_mtx);
+
+	remove_orphan_tcaches();
+
+	for (slab = pool->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		site_free(slab);
+	}
+
+	mm_thr_mutex_deinit(&pool->mtx);
+	free(pool);
+}
+
+
+/**
+ * mm_pool_alloc() - allocate an object from a pool
+ * @pool:       pool from which the object must be allocated
+ *
+ * Return: pointer to an object of the size and alignment specified at the
+ * creation of @pool in case of success. NULL otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+void* mm_pool_alloc(struct mm_pool* pool)
+{
+	struct pool_tcache* c;
+
+	c = get_tcache(pool);
+	if (UNLIKELY(!c))
+		return NULL;
+
+	if (LIKELY(c->count)) {
+		counter_inc(&c->hits);
+		return c->objs[--c->count];
+	}
+
+	counter_inc(&c->misses);
+	if (depot_refill_tcache(pool, c))
+		return NULL;
+
+	return c->objs[--c->count];
+}
+
+
+/**
+ * mm_pool_free() - give back an object to its pool
+ * @pool:       pool from which @ptr has been allocated
+ * @ptr:        object to deallocate (may be NULL)
+ *
+ * Deallocate an object previously allocated with mm_pool_alloc() from the
+ * same @pool. The object does not need to be freed by the thread that has
+ * allocated it.
+ */
+API_EXPORTED
+void mm_pool_free(struct mm_pool* pool, void* ptr)
+{
+	struct pool_tcache* c;
+
+	if (!ptr)
+		return;
+
+	c = get_tcache(pool);
+	if (UNLIKELY(!c)) {
+		// No thread cache available, put object directly in depot
+		mm_thr_mutex_lock(&pool->mtx);
+		depot_push_objs(pool, &ptr, 1);
+		mm_thr_mutex_unlock(&pool->mtx);
+		return;
+	}
+
+	if (UNLIKELY(c->count == TCACHE_CAPACITY)) {
+		tcache_drain(pool, c);
+	}
+
+	c->objs[c->count++] = ptr;
+}
+
+
+/**
+ * mm_pool_get_stats() - get usage statistics of a pool
+ * @pool:       pool to inspect
+ * @stats:      structure receiving the statistics
+ *
+ * Fill @stats with the statistics of @pool cumulated over all threads since
+ * its creation. The counters of threads that are currently using the pool
+ * are read without synchronisation, thus the result may be slightly
+ * outdated if the pool is concurrently used.
+ *
+ * Return: 0
+ */
+API_EXPORTED
+int mm_pool_get_stats(struct mm_pool* pool, struct mm_pool_stats* stats)
+{
+	struct pool_tcache* c;
+
+	*stats = (struct mm_pool_stats) {.objsize = pool->objsize};
+
+	mm_thr_mutex_lock(&tcache_mtx);
+
+	stats->hits = pool->retired_hits;
+	stats->misses = pool->retired_misses;
+	stats->drains = pool->retired_drains;
+	for (c = pool->caches; c != NULL; c = c->pool_next) {
+		stats->hits += counter_get(&c->hits);
+		stats->misses += counter_get(&c->misses);
+		stats->drains += counter_get(&c->drains);
+		stats->num_tcaches++;
+	}
+
+	mm_thr_mutex_lock(&pool->mtx);
+	stats->bytes_held = pool->bytes_held;
+	stats->bytes_depot = pool->objsize * (pool->partial_count
+	                                      + pool->depot_nbatch
+	                                      * POOL_BATCH_SIZE);
+	stats->bytes_depot += pool->carve_end - pool->carve_ptr;
+	mm_thr_mutex_unlock(&pool->mtx);
+
+	mm_thr_mutex_unlock(&tcache_mtx);
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmargparse.h"
+#include "mmerrno.h"
+#include "mmprofile.h"
+#include "mmsysio.h"
+#include "mmtime.h"
+
+#define STDOUT_FD       1
+
+struct config {
+	unsigned int watch_interval;
+	const char* percentiles;
+	const char* unit;
+};
+
+static
+struct config cfg = {
+	.watch_interval = 0,
+};
+
+static
+struct mm_arg_opt cmdline_optv[] = {
+	{"w|watch", MM_OPT_NEEDUINT, NULL, {.uiptr = &cfg.watch_interval},
+	 "Print the statistics every @SEC seconds until interrupted."},
+	{"p|percentiles", MM_OPT_NOVAL, "set", {.sptr = &cfg.percentiles},
+	 "Print also the 90th, 99th and 99.9th percentiles."},
+	{"u|unit", MM_OPT_NEEDSTR, NULL, {.sptr = &cfg.unit},
+	 "Force display of times in @UNIT (ns, us, ms or s)."},
+};
+
+
+static
+int get_unit_mask(const char* unit)
+{
+	static const struct {
+		const char* name;
+		int mask;
+	} units[] = {
+		{"ns", PROF_FORCE_NSEC},
+		{"us", PROF_FORCE_USEC},
+		{"ms", PROF_FORCE_MSEC},
+		{"s", PROF_FORCE_SEC},
+	};
+	int i;
+
+	for (i = 0; i < MM_NELEM(units); i++) {
+		if (!strcmp(unit, units[i].name))
+			return units[i].mask;
+	}
+
+	return -1;
+}
+
+
+int main(int argc, char* argv[])
+{
+	int arg_index, unit_mask, mask = PROF_DEFAULT;
+	const char* name;
+	struct mm_arg_parser parser = {
+		.doc = "Print the profiling statistics accumulated in the shared "
+		       "memory object NAME by the contexts created with "
+		       "mm_profile_ctx_create_shared().",
+		.args_doc = "[options] NAME",
+		.optv = cmdline_optv,
+		.num_opt = MM_NELEM(cmdline_optv),
+		.execname = argv[0],
+	};
+
+	arg_index = mm_arg_parse(&parser, argc, argv);
+	if (arg_index != argc-1) {
+		fprintf(stderr, "%s: a shared profile name must be supplied\n",
+		        argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	name = argv[arg_index];
+
+	if (cfg.percentiles)
+		mask |= PROF_P90|PROF_P99|PROF_P999;
+
+	if (cfg.unit) {
+		unit_mask = get_unit_mask(cfg.unit);
+		if (unit_mask < 0) {
+			fprintf(stderr, "%s: invalid unit %s\n",
+			        argv[0], cfg.unit);
+			return EXIT_FAILURE;
+		}
+
+		mask |= unit_mask;
+	}
+
+	while (1) {
+		if (mm_profile_shm_print(name, mask, STDOUT_FD)) {
+			mm_print_lasterror("Cannot print profile %s", name);
+			return EXIT_FAILURE;
+		}
+
+		if (!cfg.watch_interval)
+			break;
+
+		mm_relative_sleep_ms(1000 * cfg.watch_interval);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	return EXIT_SUCCESS;
+}
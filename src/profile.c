@@ -5,23 +5,32 @@
 # include <config.h>
 #endif
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include "mmerrno.h"
+#include "mmlib.h"
 #include "mmprofile.h"
 #include "mmpredefs.h"
+#include "mmthread.h"
 #include "mmtime.h"
 #include "mmsysio.h"
+#include "perfcnt-internal.h"
+#include "tls-internal.h"
+#include "tsc-internal.h"
 
 #define SEC_IN_NSEC 1000000000
-#define NUM_TS_MAX          16
+#define NUM_TS_INLINE       16
 #define MAX_LABEL_LEN       64
 #define VALUESTR_LEN         8
 #define UNITSTR_LEN          2
 #define UNIT_MASK  \
 	(PROF_FORCE_NSEC|PROF_FORCE_USEC|PROF_FORCE_MSEC|PROF_FORCE_SEC)
-#define NUM_COL_MAX          5
+#define NUM_COL_MAX          13
 
 #define MIN(a, b) ((a) <= (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -109,32 +118,475 @@ void median_estimator_update(struct median_estimator* me, int64_t data)
 
 
 static
-int64_t median_estimator_getvalue(struct median_estimator* me)
+int64_t median_estimator_getvalue(const struct median_estimator* me)
 {
 	return me->median;
 }
 
+/**************************************************************************
+ *                                                                        *
+ *                          Latency histogram                             *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * The percentiles are computed from a log-linear histogram (the scheme used
+ * by HdrHistogram) kept for each measure point. With a precision of P bits,
+ * the values below 2^P ns have a bucket each. Above, each power of 2 range
+ * [2^k, 2^(k+1)) is split into 2^(P-1) buckets of equal width. Hence the
+ * relative error on a reported value is at most 2^-P (about 1.6% with the
+ * default precision of 6 bits), whatever its magnitude. Recording a value
+ * is a constant time operation that does not allocate memory.
+ */
+
+#define HIST_PREC_MIN           3
+#define HIST_PREC_MAX           10
+#define HIST_PREC_DEFAULT       6
+#define HIST_VALUE_BITS         40      // Values are clamped to 2^40 ns (~18min)
+
+static
+int hist_num_buckets(int prec)
+{
+	int num_sub = 1 << prec;
+
+	return num_sub + (HIST_VALUE_BITS - prec) * (num_sub/2);
+}
+
+
+/**
+ * get_msb() - get index of most significant bit set
+ * @v:          value to test, must be non zero
+ *
+ * Return: the index of the highest bit set in @v
+ */
+static inline
+int get_msb(uint64_t v)
+{
+#if defined (__GNUC__)
+	return 63 - __builtin_clzll(v);
+#else
+	int msb = 0;
+
+	if (v >> 32) { v >>= 32; msb += 32; }
+	if (v >> 16) { v >>= 16; msb += 16; }
+	if (v >> 8) { v >>= 8; msb += 8; }
+	if (v >> 4) { v >>= 4; msb += 4; }
+	if (v >> 2) { v >>= 2; msb += 2; }
+	if (v >> 1) { msb += 1; }
+
+	return msb;
+#endif
+}
+
+
+/**
+ * hist_index() - get the bucket of a value
+ * @prec:       precision of the histogram in bits
+ * @value:      value to record
+ *
+ * Return: index of the bucket holding @value
+ */
+static inline
+int hist_index(int prec, int64_t value)
+{
+	int64_t num_sub = 1 << prec;
+	int shift;
+
+	if (value < num_sub)
+		return (value < 0) ? 0 : (int)value;
+
+	if (value >= (INT64_C(1) << HIST_VALUE_BITS))
+		value = (INT64_C(1) << HIST_VALUE_BITS) - 1;
+
+	shift = get_msb(value) - prec + 1;
+	return num_sub + (shift-1)*(num_sub/2)
+	       + (int)((value >> shift) - num_sub/2);
+}
+
+
+/**
+ * hist_bucket_bounds() - get the range of value held by a bucket
+ * @prec:       precision of the histogram in bits
+ * @index:      index of the bucket
+ * @lower:      location receiving the lowest value of the bucket
+ * @upper:      location receiving the highest value of the bucket
+ */
+static
+void hist_bucket_bounds(int prec, int index, int64_t* lower, int64_t* upper)
+{
+	int num_sub = 1 << prec;
+	int shift, k;
+
+	if (index < num_sub) {
+		*lower = index;
+		*upper = index;
+		return;
+	}
+
+	k = index - num_sub;
+	shift = k / (num_sub/2) + 1;
+	*lower = (int64_t)(k % (num_sub/2) + num_sub/2) << shift;
+	*upper = *lower + (INT64_C(1) << shift) - 1;
+}
+
+
+/**
+ * hist_percentile() - compute a percentile from a histogram
+ * @prec:       precision of the histogram in bits
+ * @buckets:    array of bucket counts
+ * @count:      total number of values recorded in @buckets
+ * @permille:   percentile to compute expressed in per mille
+ *
+ * Return: the middle of the bucket containing the requested percentile, 0
+ * if no value has been recorded.
+ */
+static
+int64_t hist_percentile(int prec, const uint64_t* buckets, uint64_t count,
+                        int permille)
+{
+	uint64_t target, cumul = 0;
+	int64_t lower, upper;
+	int i, num_buckets = hist_num_buckets(prec);
+
+	if (!count)
+		return 0;
+
+	// Smallest rank whose fraction of values is at least permille/1000
+	target = (count * permille + 999) / 1000;
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < num_buckets; i++) {
+		cumul += buckets[i];
+		if (cumul >= target)
+			break;
+	}
+
+	hist_bucket_bounds(prec, i, &lower, &upper);
+	return lower + (upper - lower + 1)/2;
+}
+
+/**************************************************************************
+ *                                                                        *
+ *                           TSC clock source                             *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * When PROF_RESET_TSC is passed to mm_profile_reset(), the timestamps are
+ * read directly from the CPU counter (rdtscp on x86, CNTVCT_EL0 on
+ * aarch64) instead of calling mm_gettime(). This avoids the overhead of a
+ * clock_gettime() call (even when served by the vDSO) at each mm_toc(). The
+ * raw ticks are converted into nanoseconds only when the statistics are
+ * updated, using the frequency of the counter estimated once against
+ * MM_CLK_MONOTONIC.
+ *
+ * The counter is used only if it runs at constant rate whatever the
+ * frequency and power state of the CPU (invariant TSC). Otherwise
+ * MM_CLK_MONOTONIC is used as if PROF_RESET_TSC was not set.
+ */
+
+#define CLK_TSC                 (-1)    // clock_id value selecting the TSC
+
+/**************************************************************************
+ *                                                                        *
+ *                        Hardware counters                               *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * When PROF_RESET_PERFCNT is passed to mm_profile_reset(), each timestamp
+ * is complemented by a snapshot of hardware counters of the thread calling
+ * the reset (cycles, retired instructions, cache misses and branch
+ * misses). They are accumulated per point of measure like the timings, and
+ * the overhead of mm_toc() on them is estimated and removed the same way.
+ * If the counters cannot be opened (no PMU, container, restrictive
+ * perf_event_paranoid...), the profiling works as if the flag was not
+ * set and the counter statistics are simply not reported.
+ */
+
+/**
+ * struct counter_col - statistic derived from the hardware counters
+ * @mask:       flag requesting the statistic
+ * @name:       name of the column in the textual results
+ * @num:        counter accumulated by the statistic
+ * @den:        counter by which @num is divided (-1 to divide by the number
+ *              of iterations)
+ * @scale:      factor applied to the value returned by get_counter_stat()
+ */
+struct counter_col {
+	int mask;
+	const char* name;
+	int num;
+	int den;
+	int scale;
+};
+
+static
+const struct counter_col counter_cols[] = {
+	{PROF_CYCLES, "cycles", PERFCNT_CYCLES, -1, 1},
+	{PROF_INSTR, "instrs", PERFCNT_INSTR, -1, 1},
+	{PROF_IPC, "IPC", PERFCNT_INSTR, PERFCNT_CYCLES, 1000},
+	{PROF_CACHE_MISS, "c-misses", PERFCNT_CACHE_MISS, -1, 1},
+	{PROF_BRANCH_MISS, "b-misses", PERFCNT_BRANCH_MISS, -1, 1},
+};
+
 /**************************************************************************
  *                                                                        *
  *                             Profile data                               *
  *                                                                        *
  **************************************************************************/
-static int clock_id;    // Clock type to use to measure time
-static int num_ts;      // Maximum number of points of measure used so far
-static int next_ts;     // Index of the next point of measure slot. 0 is for
-                        // the measure done by mm_tic()
-
-static int num_iter;            // Number of iteration recorded so far
-static int64_t toc_overhead;    // Overhead of a mm_tic()/mm_toc() call
-static struct mm_timespec timestamps[NUM_TS_MAX];  // current iteration measure
-static int64_t max_diff_ts[NUM_TS_MAX];         // max time difference
-static int64_t min_diff_ts[NUM_TS_MAX];         // min time difference
-static int64_t sum_diff_ts[NUM_TS_MAX];  // sum of time difference overall
-static struct median_estimator median_diff_ts[NUM_TS_MAX];  // approximate
-                                                            // median of time
-                                                            // diff
-static char* labels[NUM_TS_MAX];
-static char label_storage[MAX_LABEL_LEN*NUM_TS_MAX];
+/**
+ * DOC:
+ * The statistics of the first NUM_TS_INLINE points of measure are stored
+ * in arrays embedded in the profiling context, so that the usual case does
+ * not involve any allocation nor indirection. When an iteration uses more
+ * points, the arrays are moved to the heap and grown geometrically. If the
+ * arrays cannot be grown, the points beyond their capacity are dropped and
+ * counted: mm_profile_print() reports them.
+ *
+ * The labels are copied once in a table private to the context and
+ * indexed by the address of the label string passed to mm_toc_label().
+ * Hence a label is only looked up when it is first met at a point of
+ * measure, and the same string literal used at several points or over
+ * several resets is stored only once. The lookup also compares the content
+ * of the label with its copy, so that a buffer reused for a different label
+ * gets a fresh copy instead of the stale one.
+ */
+
+/**
+ * struct point_stats - statistics of a point of measure
+ * @max_diff:   max time difference
+ * @min_diff:   min time difference
+ * @sum_diff:   sum of time difference overall
+ * @median_diff: approximate median of time difference
+ * @hist_count: number of values recorded in the histogram of the point
+ * @sum_cnt:    sum of the hardware counter differences overall
+ * @label:      label of the point of measure (NULL if not labelled)
+ */
+struct point_stats {
+	int64_t max_diff;
+	int64_t min_diff;
+	int64_t sum_diff;
+	struct median_estimator median_diff;
+	uint64_t hist_count;
+	int64_t sum_cnt[NUM_PERFCNT];
+	const char* label;
+};
+
+
+/**
+ * struct label_entry - entry of the label table
+ * @key:        address of the label string supplied by the user
+ * @str:        copy of the label
+ *
+ * A buffer may be reused for different labels: several entries can have
+ * the same @key with different @str.
+ */
+struct label_entry {
+	const char* key;
+	char* str;
+};
+
+
+/**
+ * struct scope_node - node of the call tree of scopes
+ * @key:        address of the label string supplied to mm_profile_enter()
+ * @label:      copy of the label owned by the context
+ * @parent:     enclosing scope (NULL for the root)
+ * @child:      first nested scope
+ * @next:       next scope having the same parent
+ * @depth:      nesting level (0 for the root)
+ * @num_calls:  number of times the scope has been left
+ * @incl_sum:   sum of the inclusive time spent in the scope
+ * @excl_sum:   sum of the time spent in the scope outside nested scopes
+ * @incl_min:   min inclusive time of a call
+ * @incl_max:   max inclusive time of a call
+ * @incl_median: approximate median of the inclusive time of a call
+ * @enter_ts:   timestamp of the ongoing call
+ * @child_time: time spent in nested scopes during the ongoing call
+ * @hist:       histogram of the inclusive time of a call (NULL if the
+ *              histograms are not available in the context)
+ */
+struct scope_node {
+	const char* key;
+	const char* label;
+	struct scope_node* parent;
+	struct scope_node* child;
+	struct scope_node* next;
+	int depth;
+	uint64_t num_calls;
+	int64_t incl_sum;
+	int64_t excl_sum;
+	int64_t incl_min;
+	int64_t incl_max;
+	struct median_estimator incl_median;
+	int64_t enter_ts;
+	int64_t child_time;
+	uint64_t* hist;
+};
+
+
+/**
+ * struct shm_point - statistics of a point of measure in a shared profile
+ * @label_state: SHM_LABEL_* state of @label
+ * @label:      label of the point of measure
+ * @count:      number of timings recorded
+ * @sum:        sum of the timings
+ * @min:        min timing
+ * @max:        max timing
+ * @hist:       latency histogram of the timings
+ */
+struct shm_point {
+	atomic_int label_state;
+	char label[MAX_LABEL_LEN];
+	atomic_int_least64_t count;
+	atomic_int_least64_t sum;
+	atomic_int_least64_t min;
+	atomic_int_least64_t max;
+	atomic_uint_least64_t hist[];
+};
+
+
+/**
+ * struct shm_profile - header of a shared memory profile segment
+ * @magic:      SHM_PROFILE_MAGIC once the segment is initialized
+ * @hist_prec:  precision in bits of the histograms of the points
+ * @max_points: number of points of measure in the segment
+ * @toc_overhead: toc overhead estimated by the creator of the segment
+ * @num_ts:     maximum number of points of measure used so far
+ * @num_procs:  number of contexts attached to the segment
+ * @num_iter:   number of iterations recorded so far
+ * @points:     @max_points consecutive struct shm_point
+ */
+struct shm_profile {
+	atomic_uint_least64_t magic;
+	int32_t hist_prec;
+	int32_t max_points;
+	int64_t toc_overhead;
+	atomic_int num_ts;
+	atomic_int num_procs;
+	atomic_int_least64_t num_iter;
+	_Alignas(8) unsigned char points[];
+};
+
+
+/**
+ * struct mm_profile_ctx - profiling context
+ * @clock_id:   clock type to use to measure time (CLK_TSC for the TSC)
+ * @num_ts:     maximum number of points of measure used so far
+ * @next_ts:    index of the next point of measure slot. 0 is for the
+ *              measure done by mm_tic()
+ * @max_ts:     number of points of measure that can be stored in
+ *              @timestamps and @points
+ * @num_iter:   number of iteration recorded so far
+ * @toc_overhead: overhead of a mm_tic()/mm_toc() call
+ * @timestamps: measures of the current iteration, in ns or in ticks of
+ *              TSC if @clock_id is CLK_TSC
+ * @points:     statistics of the points of measure
+ * @hist_prec:  precision in bits of the latency histograms
+ * @hist:       latency histograms of all points (@max_ts consecutive
+ *              arrays of hist_num_buckets(@hist_prec) buckets). NULL if
+ *              the histograms could not be allocated.
+ * @label_table: open addressing hash table of the labels
+ * @label_table_size: number of slots in @label_table (power of 2)
+ * @num_labels: number of labels stored in @label_table
+ * @scope_root: root of the call tree of scopes
+ * @curr_scope: innermost scope currently entered (@scope_root if none)
+ * @scope_arena: arena from which the nodes of the call tree are allocated
+ * @scope_lost_depth: number of scopes entered but not recorded in the call
+ *              tree because their node could not be allocated (the scopes
+ *              entered within a lost scope are lost too)
+ * @perfcnt:    hardware counters read at each point of measure (none
+ *              opened if PROF_RESET_PERFCNT is not set)
+ * @counters:   hardware counter values of the current iteration
+ *              (NUM_PERFCNT values per point of measure)
+ * @cnt_overhead: overhead of a mm_tic()/mm_toc() call on each counter
+ * @shm:        shared memory segment into which the statistics are also
+ *              accumulated (NULL if the context is not shared)
+ * @shm_size:   size of the mapping of @shm
+ * @slow_threshold: threshold of the slow iteration check, in the unit of
+ *              @timestamps (INT64_MAX if the capture is disabled)
+ * @slow_first: index of the timestamp starting the span checked against
+ *              @slow_threshold
+ * @slow_last:  index of the timestamp ending the span checked against
+ *              @slow_threshold (INT_MAX for the end of the iteration)
+ * @slow_point: measure point whose timing is checked (-1 for the whole
+ *              iteration)
+ * @slow_threshold_ns: threshold set by the user in ns (0 if disabled)
+ * @slow_iters: ring of the last SLOW_RING_SIZE slow iterations
+ * @num_slow:   number of slow iterations recorded so far
+ * @num_dropped: number of points of measure dropped since the last reset
+ *              because the arrays of points could not be grown
+ * @inline_ts:  storage of @timestamps for the first NUM_TS_INLINE points
+ * @inline_points: storage of @points for the first NUM_TS_INLINE points
+ * @inline_counters: storage of @counters for the first NUM_TS_INLINE points
+ */
+struct mm_profile_ctx {
+	int clock_id;
+	int num_ts;
+	int next_ts;
+	int max_ts;
+	int num_iter;
+	int64_t toc_overhead;
+	int64_t* timestamps;
+	struct point_stats* points;
+	int hist_prec;
+	uint64_t* hist;
+	struct label_entry* label_table;
+	int label_table_size;
+	int num_labels;
+	struct scope_node scope_root;
+	struct scope_node* curr_scope;
+	struct mm_arena* scope_arena;
+	int scope_lost_depth;
+	struct perfcnt perfcnt;
+	int64_t* counters;
+	int64_t cnt_overhead[NUM_PERFCNT];
+	struct shm_profile* shm;
+	size_t shm_size;
+	int64_t slow_threshold;
+	int slow_first;
+	int slow_last;
+	int slow_point;
+	int64_t slow_threshold_ns;
+	struct mm_profile_slow_iter* slow_iters;
+	int64_t num_slow;
+	int64_t num_dropped;
+	int64_t inline_ts[NUM_TS_INLINE];
+	struct point_stats inline_points[NUM_TS_INLINE];
+	int64_t inline_counters[NUM_TS_INLINE*NUM_PERFCNT];
+};
+
+
+static inline
+uint64_t* get_point_hist(const struct mm_profile_ctx* ctx, int i)
+{
+	return ctx->hist + (size_t)i * hist_num_buckets(ctx->hist_prec);
+}
+
+
+static inline
+int64_t* get_point_counters(const struct mm_profile_ctx* ctx, int i)
+{
+	return ctx->counters + (size_t)i * NUM_PERFCNT;
+}
+
+
+static inline
+size_t shm_point_size(int prec)
+{
+	return sizeof(struct shm_point)
+	       + hist_num_buckets(prec) * sizeof(atomic_uint_least64_t);
+}
+
+
+static inline
+struct shm_point* get_shm_point(struct shm_profile* shm, int i)
+{
+	return (struct shm_point*)(shm->points
+	                           + i * shm_point_size(shm->hist_prec));
+}
 
 
 /**************************************************************************
@@ -143,8 +595,46 @@ static char label_storage[MAX_LABEL_LEN*NUM_TS_MAX];
  *                                                                        *
  **************************************************************************/
 
+/**
+ * read_timestamp() - read the clock of a context
+ * @ctx:        profiling context
+ *
+ * Return: the current timestamp in ns, or in ticks of TSC if the clock of
+ * @ctx is CLK_TSC.
+ */
+static inline
+int64_t read_timestamp(const struct mm_profile_ctx* ctx)
+{
+	struct mm_timespec tp;
+
+	if (ctx->clock_id == CLK_TSC)
+		return read_tsc();
+
+	mm_gettime(ctx->clock_id, &tp);
+	return (int64_t)tp.tv_sec * SEC_IN_NSEC + tp.tv_nsec;
+}
+
+
+/**
+ * timestamp_diff_to_ns() - convert a difference of timestamps in ns
+ * @ctx:        profiling context
+ * @diff:       difference of 2 values returned by read_timestamp()
+ *
+ * Return: @diff converted in nanoseconds
+ */
+static inline
+int64_t timestamp_diff_to_ns(const struct mm_profile_ctx* ctx, int64_t diff)
+{
+	if (ctx->clock_id == CLK_TSC)
+		return (int64_t)(diff * tsc_nsec_per_tick);
+
+	return diff;
+}
+
+
 /**
  * get_diff_ts() - Estimate the time difference between 2 consecutive points
+ * @ctx:        profiling context
  * @i:  Index of the point. The difference will be computed between the
  *      (i-1)-th and the (i)-th timestamp. (index 0 correspond to mm_tic())
  *
@@ -160,67 +650,221 @@ static char label_storage[MAX_LABEL_LEN*NUM_TS_MAX];
  * Returns: the time differences in nanoseconds
  */
 static
-int64_t get_diff_ts(int i)
+int64_t get_diff_ts(const struct mm_profile_ctx* ctx, int i)
 {
+	const int64_t* ts = ctx->timestamps;
 	int64_t diff;
 
-	diff = (timestamps[i].tv_sec - timestamps[i-1].tv_sec)*SEC_IN_NSEC;
-	diff += timestamps[i].tv_nsec - timestamps[i-1].tv_nsec;
-	diff -= toc_overhead;
+	diff = timestamp_diff_to_ns(ctx, ts[i] - ts[i-1]);
+	diff -= ctx->toc_overhead;
 
 	return diff;
 }
 
 
+/**************************************************************************
+ *                                                                        *
+ *                            Shared profile                              *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * A context created by mm_profile_ctx_create_shared() measures its
+ * iterations as any other context, but the timings of each completed
+ * iteration are also accumulated into a named shared memory segment. The
+ * segment holds for each point of measure a count, sum, min, max and
+ * latency histogram updated with lock-free atomic operations, so several
+ * processes can accumulate concurrently in the same segment and a reader
+ * can take a snapshot at any time without disturbing them. The median is
+ * not kept in the segment: the reader estimates it from the histogram.
+ */
+
+#define SHM_PROFILE_MAGIC       UINT64_C(0x31464f52504d4d)  // "MMPROF1"
+#define SHM_NUM_POINTS          64
+#define SHM_INIT_TIMEOUT_MS     1000
+
+enum {
+	SHM_LABEL_UNSET,
+	SHM_LABEL_WRITING,
+	SHM_LABEL_SET,
+};
+
+
+static
+void atomic_min_i64(atomic_int_least64_t* obj, int64_t value)
+{
+	int_least64_t curr = atomic_load_explicit(obj, memory_order_relaxed);
+
+	while (value < curr
+	       && !atomic_compare_exchange_weak_explicit(obj, &curr, value,
+	                                                 memory_order_relaxed,
+	                                                 memory_order_relaxed))
+		;
+}
+
+
+static
+void atomic_max_i64(atomic_int_least64_t* obj, int64_t value)
+{
+	int_least64_t curr = atomic_load_explicit(obj, memory_order_relaxed);
+
+	while (value > curr
+	       && !atomic_compare_exchange_weak_explicit(obj, &curr, value,
+	                                                 memory_order_relaxed,
+	                                                 memory_order_relaxed))
+		;
+}
+
+
+/**
+ * publish_shm_label() - set the label of a point in a shared profile
+ * @sp:         point of the shared profile
+ * @label:      label of the point in the local context
+ *
+ * Only the first process that manages to set the label writes it.
+ */
+static
+void publish_shm_label(struct shm_point* sp, const char* label)
+{
+	int state = SHM_LABEL_UNSET;
+
+	if (!atomic_compare_exchange_strong(&sp->label_state, &state,
+	                                    SHM_LABEL_WRITING))
+		return;
+
+	strncpy(sp->label, label, sizeof(sp->label)-1);
+	sp->label[sizeof(sp->label)-1] = '\0';
+	atomic_store_explicit(&sp->label_state, SHM_LABEL_SET,
+	                      memory_order_release);
+}
+
+
+/**
+ * update_shm_stats() - accumulate the last iteration in the shared profile
+ * @ctx:        profiling context attached to a shared profile
+ */
+static NOINLINE
+void update_shm_stats(struct mm_profile_ctx* ctx)
+{
+	struct shm_profile* shm = ctx->shm;
+	struct shm_point* sp;
+	const char* label;
+	int i, num_ts, curr_num_ts;
+	int64_t diff;
+
+	num_ts = MIN(ctx->next_ts, shm->max_points);
+	if (num_ts < 2)
+		return;
+
+	for (i = 1; i < num_ts; i++) {
+		sp = get_shm_point(shm, i);
+		diff = get_diff_ts(ctx, i);
+
+		atomic_fetch_add_explicit(&sp->count, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&sp->sum, diff, memory_order_relaxed);
+		atomic_min_i64(&sp->min, diff);
+		atomic_max_i64(&sp->max, diff);
+		atomic_fetch_add_explicit(&sp->hist[hist_index(shm->hist_prec,
+		                                               diff)],
+		                          1, memory_order_relaxed);
+
+		label = ctx->points[i].label;
+		if (UNLIKELY(label && atomic_load_explicit(&sp->label_state,
+		                                           memory_order_relaxed)
+		             == SHM_LABEL_UNSET))
+			publish_shm_label(sp, label);
+	}
+
+	curr_num_ts = atomic_load_explicit(&shm->num_ts, memory_order_relaxed);
+	while (num_ts > curr_num_ts
+	       && !atomic_compare_exchange_weak(&shm->num_ts, &curr_num_ts,
+	                                        num_ts))
+		;
+
+	atomic_fetch_add_explicit(&shm->num_iter, 1, memory_order_relaxed);
+}
+
+
 /**
  * update_diffs() - Update the statistics of timestamp difference
+ * @ctx:        profiling context
  *
  * This function is meant to be called at the end of all tic/toc iteration.
  * It updates the min, max and sum (for mean) of the time difference based
  * on the previous iteration.
  */
 static
-void update_diffs(void)
+void update_diffs(struct mm_profile_ctx* ctx)
 {
-	int i;
+	int i, k;
 	int64_t diff;
+	const int64_t* cnt;
+
+	struct point_stats* pt;
+
+	for (i = 1; i < ctx->next_ts; i++) {
+		pt = &ctx->points[i];
+		diff = get_diff_ts(ctx, i);
+		pt->min_diff = MIN(diff, pt->min_diff);
+		pt->max_diff = MAX(diff, pt->max_diff);
+		pt->sum_diff += diff;
+		median_estimator_update(&pt->median_diff, diff);
+
+		if (ctx->hist) {
+			get_point_hist(ctx, i)[hist_index(ctx->hist_prec,
+			                                  diff)]++;
+			pt->hist_count++;
+		}
 
-	for (i = 1; i < next_ts; i++) {
-		diff = get_diff_ts(i);
-		min_diff_ts[i] = MIN(diff, min_diff_ts[i]);
-		max_diff_ts[i] = MAX(diff, max_diff_ts[i]);
-		sum_diff_ts[i] += diff;
-		median_estimator_update(&median_diff_ts[i], diff);
+		if (ctx->perfcnt.num_open) {
+			cnt = get_point_counters(ctx, i);
+			for (k = 0; k < NUM_PERFCNT; k++)
+				pt->sum_cnt[k] += cnt[k] - cnt[k - NUM_PERFCNT]
+				                  - ctx->cnt_overhead[k];
+		}
 	}
+
+	if (ctx->shm)
+		update_shm_stats(ctx);
 }
 
 
 /**
  * reset_diffs() - reset the statistics of timestamp difference
+ * @ctx:        profiling context
  *
  * Reset the min, max, sum of the time differences. Also the maximum number
  * of timestamps that have been used so far.
  */
 static
-void reset_diffs(void)
+void reset_diffs(struct mm_profile_ctx* ctx)
 {
 	int i;
 
-	next_ts = 0;
-	num_ts = 0;
-	num_iter = 0;
-
-	for (i = 0; i < NUM_TS_MAX; i++) {
-		min_diff_ts[i] = INT64_MAX;
-		max_diff_ts[i] = 0L;
-		sum_diff_ts[i] = 0L;
-		median_estimator_init(&median_diff_ts[i]);
+	ctx->next_ts = 0;
+	ctx->num_ts = 0;
+	ctx->num_iter = 0;
+	ctx->num_dropped = 0;
+
+	for (i = 0; i < ctx->max_ts; i++) {
+		ctx->points[i].min_diff = INT64_MAX;
+		ctx->points[i].max_diff = 0L;
+		ctx->points[i].sum_diff = 0L;
+		median_estimator_init(&ctx->points[i].median_diff);
+		ctx->points[i].hist_count = 0;
+		memset(ctx->points[i].sum_cnt, 0,
+		       sizeof(ctx->points[i].sum_cnt));
 	}
+
+	if (ctx->hist)
+		memset(ctx->hist, 0, ctx->max_ts * sizeof(*ctx->hist)
+		       * hist_num_buckets(ctx->hist_prec));
 }
 
 
 /**
  * estimate_toc_overhead() - Estimate the overhead of call to mm_tic/mm_toc
+ * @ctx:        profiling context
  *
  * The estimation is done by several call to mm_tic mm_toc after resetting the
  * toc overhead to 0. Only the min value provide insight of the actual
@@ -230,81 +874,293 @@ void reset_diffs(void)
  * to mm_toc() and mm_tic() are not optimized, ie, the prologues are not
  * skipped because the functions are in the same dynamic shared object. This
  * is ensured by setting a default visibility (ie API_EXPORTED_RELOCATABLE)
- * to the mm_tic() and mm_toc() functions.
+ * to the mm_profile_ctx_tic() and mm_profile_ctx_toc() functions.
  */
 static
-void estimate_toc_overhead(void)
+void estimate_toc_overhead(struct mm_profile_ctx* ctx)
 {
-	int i;
+	int i, k;
+	int64_t num_updates;
+	const struct point_stats* pts;
+	struct shm_profile* shm = ctx->shm;
 
-	reset_diffs();
-	toc_overhead = 0;
+	// The calibration iterations must not be accounted in shared profile
+	ctx->shm = NULL;
+
+	reset_diffs(ctx);
+	ctx->toc_overhead = 0;
+	memset(ctx->cnt_overhead, 0, sizeof(ctx->cnt_overhead));
 	for (i = 0; i < 1000; i++) {
-		mm_tic();
-		mm_toc();
-		mm_toc();
+		mm_profile_ctx_tic(ctx);
+		mm_profile_ctx_toc(ctx);
+		mm_profile_ctx_toc(ctx);
 
-		mm_tic();
-		mm_toc_label("");
-		mm_toc_label("");
+		mm_profile_ctx_tic(ctx);
+		mm_profile_ctx_toc_label(ctx, "");
+		mm_profile_ctx_toc_label(ctx, "");
 
 		// Remove the first measure to avoid cold cache effect
 		if (i == 0)
-			reset_diffs();
+			reset_diffs(ctx);
+	}
+
+	ctx->toc_overhead = MIN(ctx->points[1].min_diff,
+	                        ctx->points[2].min_diff);
+
+	// The counters are not accumulated in a min: use the mean overhead
+	// (the statistics of the ongoing iteration are not yet accumulated)
+	pts = ctx->points;
+	num_updates = ctx->num_iter - 1;
+	for (k = 0; k < NUM_PERFCNT && num_updates > 0; k++)
+		ctx->cnt_overhead[k] = MIN(pts[1].sum_cnt[k],
+		                           pts[2].sum_cnt[k]) / num_updates;
+
+	ctx->shm = shm;
+}
+
+
+/**
+ * grow_points() - increase the number of points of measure of a context
+ * @ctx:        profiling context
+ *
+ * Double the capacity of the arrays holding the timestamps, statistics and
+ * histograms of the points of measure. The first time, the arrays are
+ * moved from the storage embedded in @ctx to the heap.
+ *
+ * Return: 0 in case of success, -1 if allocation failed. In such a case @ctx
+ * is left untouched.
+ */
+static NOINLINE
+int grow_points(struct mm_profile_ctx* ctx)
+{
+	int i, old_max = ctx->max_ts;
+	int new_max = 2*old_max;
+	int64_t* ts;
+	int64_t* counters;
+	struct point_stats* points;
+	uint64_t* hist = NULL;
+	size_t num_buckets;
+
+	if (old_max > INT_MAX/2)
+		return -1;
+
+	// Zeroed since the slow iteration check may read unused timestamps
+	ts = calloc(new_max, sizeof(*ts));
+	points = calloc(new_max, sizeof(*points));
+	counters = calloc(new_max, NUM_PERFCNT * sizeof(*counters));
+	if (ctx->hist) {
+		num_buckets = hist_num_buckets(ctx->hist_prec);
+		hist = calloc(new_max, num_buckets * sizeof(*hist));
+		if (hist)
+			memcpy(hist, ctx->hist,
+			       old_max * num_buckets * sizeof(*hist));
+	}
+
+	if (!ts || !points || !counters || (ctx->hist && !hist)) {
+		free(ts);
+		free(points);
+		free(counters);
+		free(hist);
+		return -1;
 	}
 
-	toc_overhead = MIN(min_diff_ts[1], min_diff_ts[2]);
+	memcpy(ts, ctx->timestamps, old_max * sizeof(*ts));
+	memcpy(points, ctx->points, old_max * sizeof(*points));
+	memcpy(counters, ctx->counters,
+	       old_max * NUM_PERFCNT * sizeof(*counters));
+	for (i = old_max; i < new_max; i++) {
+		points[i].min_diff = INT64_MAX;
+		points[i].max_diff = 0L;
+		points[i].sum_diff = 0L;
+		median_estimator_init(&points[i].median_diff);
+		points[i].hist_count = 0;
+		memset(points[i].sum_cnt, 0, sizeof(points[i].sum_cnt));
+		points[i].label = NULL;
+	}
+
+	if (ctx->timestamps != ctx->inline_ts) {
+		free(ctx->timestamps);
+		free(ctx->points);
+		free(ctx->counters);
+	}
+
+	free(ctx->hist);
+
+	ctx->timestamps = ts;
+	ctx->points = points;
+	ctx->counters = counters;
+	ctx->hist = hist;
+	ctx->max_ts = new_max;
+
+	return 0;
 }
 
 
 /**
  * local_toc() - Measure the current timestamp
+ * @ctx:        profiling context
  *
  * Measures the current time into the next timestamp and advances it. If
  * applicable, increase the maximum number of timestamps that have been
- * measured within a same iteration.
+ * measured within a same iteration. If the points cannot be grown, the
+ * measure is dropped and accounted.
  */
 static inline
-void local_toc(void)
+void local_toc(struct mm_profile_ctx* ctx)
 {
-	struct mm_timespec ts;
+	int64_t ts;
+	int next_ts = ctx->next_ts;
 
-	mm_gettime(clock_id, &ts);
+	ts = read_timestamp(ctx);
 
-	if (next_ts == NUM_TS_MAX-1)
+	if (UNLIKELY(next_ts == ctx->max_ts) && grow_points(ctx)) {
+		ctx->num_dropped++;
 		return;
+	}
 
-	timestamps[next_ts] = ts;
-	if (next_ts >= num_ts)
-		num_ts = next_ts+1;
+	ctx->timestamps[next_ts] = ts;
+	if (UNLIKELY(ctx->perfcnt.num_open))
+		perfcnt_read(&ctx->perfcnt, get_point_counters(ctx, next_ts));
 
-	next_ts++;
+	if (next_ts >= ctx->num_ts)
+		ctx->num_ts = next_ts+1;
+
+	ctx->next_ts = next_ts+1;
 }
 
 
 /**************************************************************************
  *                                                                        *
- *                           result display helpers                       *
+ *                         Slow iteration capture                         *
  *                                                                        *
  **************************************************************************/
+/**
+ * DOC:
+ * When a slow threshold is set, mm_tic() checks whether the iteration
+ * which has just ended exceeded it, before its timings are merged in the
+ * statistics. This check is done on the raw timestamps with a single
+ * branch: the threshold is converted in the unit of the clock (and
+ * includes the toc overhead) and the indices of the timestamps bounding
+ * the checked span are precomputed. When the checked point of measure has
+ * not been reached during the iteration, stale timestamps may be compared
+ * and the iteration is then rejected by record_slow_iteration(). When the
+ * capture is disabled, the threshold is INT64_MAX and the check never
+ * passes.
+ */
+
+#define SLOW_RING_SIZE          32
+
 
 /**
- * max_label_len() - Get the maximum length of registered labels
+ * update_slow_threshold() - compute the threshold of the slow check
+ * @ctx:        profiling context
  *
- * Returns: the maximum length
+ * Must be called each time the clock or the toc overhead of @ctx changes.
  */
 static
-int max_label_len(void)
+void update_slow_threshold(struct mm_profile_ctx* ctx)
 {
-	int i, max, len;
-
-	max = 0;
-	for (i = 1; i < num_ts; i++) {
-		len = 2;
-		if (labels[i])
-			len = strlen(labels[i]);
+	int64_t threshold = ctx->slow_threshold_ns + ctx->toc_overhead;
 
-		max = MAX(max, len);
+	if (ctx->slow_point < 0) {
+		ctx->slow_first = 0;
+		ctx->slow_last = INT_MAX;
+	} else {
+		ctx->slow_first = ctx->slow_point;
+		ctx->slow_last = ctx->slow_point+1;
+	}
+
+	if (ctx->clock_id == CLK_TSC)
+		threshold = (int64_t)(threshold / tsc_nsec_per_tick);
+
+	if (!ctx->slow_threshold_ns)
+		threshold = INT64_MAX;
+
+	ctx->slow_threshold = threshold;
+}
+
+
+/**
+ * is_slow_iteration() - test whether the ending iteration may be slow
+ * @ctx:        profiling context
+ *
+ * Return: true if the checked span of the current iteration possibly
+ * exceeds the slow threshold.
+ */
+static inline
+int is_slow_iteration(const struct mm_profile_ctx* ctx)
+{
+	const int64_t* ts = ctx->timestamps;
+	int last = MAX(MIN(ctx->slow_last, ctx->next_ts-1), 0);
+
+	return ts[last] - ts[ctx->slow_first] > ctx->slow_threshold;
+}
+
+
+/**
+ * record_slow_iteration() - copy the current iteration in slow ring
+ * @ctx:        profiling context
+ *
+ * Record the timings of all points of measure of the iteration which has
+ * just ended, overwriting the oldest slow iteration if the ring is full.
+ */
+static NOINLINE
+void record_slow_iteration(struct mm_profile_ctx* ctx)
+{
+	struct mm_profile_slow_iter* it;
+	struct mm_timespec now;
+	int i, num_points = ctx->next_ts-1;
+	int64_t diff;
+
+	// Reject the iterations in which the checked point of measure has
+	// not been reached
+	if (num_points < 1
+	    || (ctx->slow_point >= 0 && ctx->next_ts <= ctx->slow_last))
+		return;
+
+	it = &ctx->slow_iters[ctx->num_slow % SLOW_RING_SIZE];
+
+	mm_gettime(MM_CLK_REALTIME, &now);
+	it->timestamp = (int64_t)now.tv_sec * SEC_IN_NSEC + now.tv_nsec;
+	it->thread_id = get_thread_id();
+	it->iteration = ctx->num_iter-1;
+	it->num_points = MIN(num_points, PROF_SLOW_MAX_POINTS);
+	it->total = 0;
+	for (i = 1; i <= num_points; i++) {
+		diff = get_diff_ts(ctx, i);
+		it->total += diff;
+		if (i <= PROF_SLOW_MAX_POINTS)
+			it->timings[i-1] = diff;
+	}
+
+	ctx->num_slow++;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                           result display helpers                       *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * max_label_len() - Get the maximum length of registered labels
+ * @ctx:        profiling context
+ *
+ * Returns: the maximum length
+ */
+static
+int max_label_len(const struct mm_profile_ctx* ctx)
+{
+	int i, max, len;
+
+	max = 0;
+	for (i = 1; i < ctx->num_ts; i++) {
+		len = 2;
+		if (ctx->points[i].label)
+			len = strlen(ctx->points[i].label);
+
+		max = MAX(max, len);
 	}
 
 	// Ensure that return length will not overflow (even by mistake). BTW,
@@ -317,8 +1173,40 @@ int max_label_len(void)
 }
 
 
+static const struct {
+	int mask;
+	int permille;
+	const char* name;
+} percentile_cols[] = {
+	{PROF_P90, 900, "p90"},
+	{PROF_P99, 990, "p99"},
+	{PROF_P999, 999, "p99.9"},
+};
+
+
+/**
+ * get_percentile() - compute a percentile of the timings of a point
+ * @ctx:        profiling context
+ * @i:          index of the timestamp ending the measure
+ * @permille:   percentile to compute expressed in per mille
+ *
+ * Returns: the estimated percentile of the timings, -1 if the latency
+ * histograms are not available in @ctx.
+ */
+static
+int64_t get_percentile(const struct mm_profile_ctx* ctx, int i, int permille)
+{
+	if (!ctx->hist)
+		return -1;
+
+	return hist_percentile(ctx->hist_prec, get_point_hist(ctx, i),
+	                       ctx->points[i].hist_count, permille);
+}
+
+
 /**
  * compute_requested_timings() - Compute and store result in an array
+ * @ctx:        profiling context
  * @mask:       mask of the requested timings computation
  * @num_points: number of time measure (ie number of call to mm_toc())
  * @data:       array (num_col x @num_points) receiving the results
@@ -327,15 +1215,16 @@ int max_label_len(void)
  * number of columns in @data array.
  */
 static
-int compute_requested_timings(int mask, int num_points, int64_t data[])
+int compute_requested_timings(const struct mm_profile_ctx* ctx,
+                              int mask, int num_points, int64_t data[])
 {
-	int i, icol = 0;
+	int i, c, icol = 0;
 	double mean;
 	int64_t median;
 
 	if (mask & PROF_CURR) {
 		for (i = 0; i < num_points; i++) {
-			data[i + icol*num_points] = get_diff_ts(i+1);
+			data[i + icol*num_points] = get_diff_ts(ctx, i+1);
 		}
 
 		icol++;
@@ -343,7 +1232,7 @@ int compute_requested_timings(int mask, int num_points, int64_t data[])
 
 	if (mask & PROF_MEAN) {
 		for (i = 0; i < num_points; i++) {
-			mean = (double)sum_diff_ts[i+1] / num_iter;
+			mean = (double)ctx->points[i+1].sum_diff / ctx->num_iter;
 			data[i + icol*num_points] = mean;
 		}
 
@@ -352,7 +1241,7 @@ int compute_requested_timings(int mask, int num_points, int64_t data[])
 
 	if (mask & PROF_MIN) {
 		for (i = 0; i < num_points; i++) {
-			data[i + icol*num_points] = min_diff_ts[i+1];
+			data[i + icol*num_points] = ctx->points[i+1].min_diff;
 		}
 
 		icol++;
@@ -360,7 +1249,7 @@ int compute_requested_timings(int mask, int num_points, int64_t data[])
 
 	if (mask & PROF_MAX) {
 		for (i = 0; i < num_points; i++) {
-			data[i + icol*num_points] = max_diff_ts[i+1];
+			data[i + icol*num_points] = ctx->points[i+1].max_diff;
 		}
 
 		icol++;
@@ -368,14 +1257,104 @@ int compute_requested_timings(int mask, int num_points, int64_t data[])
 
 	if (mask & PROF_MEDIAN) {
 		for (i = 0; i < num_points; i++) {
-			median =
-				median_estimator_getvalue(&median_diff_ts[i+1]);
+			median = median_estimator_getvalue(
+				&ctx->points[i+1].median_diff);
 			data[i + icol*num_points] = median;
 		}
 
 		icol++;
 	}
 
+	for (c = 0; c < MM_NELEM(percentile_cols); c++) {
+		if (!(mask & percentile_cols[c].mask))
+			continue;
+
+		for (i = 0; i < num_points; i++)
+			data[i + icol*num_points] = get_percentile(ctx, i+1,
+			                        percentile_cols[c].permille);
+
+		icol++;
+	}
+
+	return icol;
+}
+
+
+/**
+ * is_counter_col_available() - test whether a counter statistic is measured
+ * @ctx:        profiling context
+ * @col:        statistic derived from the hardware counters
+ *
+ * Returns: 1 if the counters needed by @col are read in @ctx, 0 otherwise
+ */
+static
+int is_counter_col_available(const struct mm_profile_ctx* ctx,
+                             const struct counter_col* col)
+{
+	if (!perfcnt_is_available(&ctx->perfcnt, col->num))
+		return 0;
+
+	if (col->den >= 0 && !perfcnt_is_available(&ctx->perfcnt, col->den))
+		return 0;
+
+	return 1;
+}
+
+
+/**
+ * get_counter_stat() - compute a statistic of the counters of a point
+ * @ctx:        profiling context
+ * @col:        statistic derived from the hardware counters
+ * @i:          index of the timestamp ending the measure
+ *
+ * Returns: the value of @col per iteration multiplied by @col->scale
+ */
+static
+int64_t get_counter_stat(const struct mm_profile_ctx* ctx,
+                         const struct counter_col* col, int i)
+{
+	const int64_t* sum = ctx->points[i].sum_cnt;
+
+	if (col->den < 0)
+		return ctx->num_iter ? sum[col->num] / ctx->num_iter : 0;
+
+	if (sum[col->den] <= 0)
+		return 0;
+
+	return (int64_t)((double)sum[col->num] * col->scale / sum[col->den]);
+}
+
+
+/**
+ * compute_requested_counters() - Compute counter statistics in an array
+ * @ctx:        profiling context
+ * @mask:       mask of the requested statistics
+ * @num_points: number of time measure (ie number of call to mm_toc())
+ * @data:       array (num_col x @num_points) receiving the results
+ *
+ * The statistics requested in @mask whose counters are not available in
+ * @ctx are skipped.
+ *
+ * Returns: the number of columns written in @data array.
+ */
+static
+int compute_requested_counters(const struct mm_profile_ctx* ctx,
+                               int mask, int num_points, int64_t data[])
+{
+	int i, c, icol = 0;
+
+	for (c = 0; c < MM_NELEM(counter_cols); c++) {
+		if (!(mask & counter_cols[c].mask)
+		    || !is_counter_col_available(ctx, &counter_cols[c]))
+			continue;
+
+		for (i = 0; i < num_points; i++)
+			data[i + icol*num_points] = get_counter_stat(ctx,
+			                                &counter_cols[c], i+1);
+
+		icol++;
+	}
+
 	return icol;
 }
 
@@ -404,147 +1383,1854 @@ int get_display_unit(int num_points, int num_cols, int64_t data[], int mask)
 	minval = INT64_MAX;
 	maxval = 0;
 
-	for (i = 0; i < num_cols*num_points; i++) {
-		minval = MIN(minval, data[i]);
-		maxval = MAX(maxval, data[i]);
-	}
+	for (i = 0; i < num_cols*num_points; i++) {
+		minval = MIN(minval, data[i]);
+		maxval = MAX(maxval, data[i]);
+	}
+
+	// select the most suitable unit based on the min and max value
+	for (i = 0; i < NUM_UNIT-1; i++) {
+		scale = unit_list[i].scale;
+		if ((minval < scale*100 && maxval < scale*10000)
+		    || (maxval - minval) < scale)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * get_value_unit() - Get the most suitable unit to display a duration
+ * @value:      duration in ns
+ * @mask:       mask supplied by user to possibly force use of a unit
+ *
+ * Returns: index of the suitable unit in unit_list array
+ */
+static
+int get_value_unit(int64_t value, int mask)
+{
+	int i;
+
+	for (i = 0; i < NUM_UNIT; i++) {
+		if (unit_list[i].forcemask == (mask & UNIT_MASK))
+			return i;
+	}
+
+	for (i = NUM_UNIT-1; i > 0; i--) {
+		if (value >= unit_list[i].scale)
+			break;
+	}
+
+	return i;
+}
+
+
+/**
+ * format_header_line() - print the result table header in string
+ * @ctx:                profiling context
+ * @mask:               the requested timing computations
+ * @label_width:        maximum length of a registered label
+ * @str:                output string
+ *
+ * Returns: number of bytes written in the output string
+ */
+static
+int format_header_line(const struct mm_profile_ctx* ctx, int mask,
+                       int label_width, char str[])
+{
+	int c, len;
+
+	len = sprintf(str, "%*s |", label_width, "");
+
+	if (mask & PROF_CURR) {
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, "current",
+		               UNITSTR_LEN, "");
+	}
+
+	if (mask & PROF_MEAN) {
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, "mean",
+		               UNITSTR_LEN, "");
+	}
+
+	if (mask & PROF_MIN) {
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, "min",
+		               UNITSTR_LEN, "");
+	}
+
+	if (mask & PROF_MAX) {
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, "max",
+		               UNITSTR_LEN, "");
+	}
+
+	if (mask & PROF_MEDIAN) {
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, "median",
+		               UNITSTR_LEN, "");
+	}
+
+	for (c = 0; c < MM_NELEM(percentile_cols); c++) {
+		if (!(mask & percentile_cols[c].mask))
+			continue;
+
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, percentile_cols[c].name,
+		               UNITSTR_LEN, "");
+	}
+
+	for (c = 0; c < MM_NELEM(counter_cols); c++) {
+		if (!(mask & counter_cols[c].mask)
+		    || !is_counter_col_available(ctx, &counter_cols[c]))
+			continue;
+
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, counter_cols[c].name,
+		               UNITSTR_LEN, "");
+	}
+
+	str[len++] = '\n';
+	memset(str+len, '-', len-1);
+	len += len-1;
+	str[len++] = '\n';
+
+	return len;
+}
+
+
+/**
+ * format_result_line() - print a line of the result table
+ * @ctx:        profiling context
+ * @mask:       the requested timing computations
+ * @ncol:       number of timing columns in @data
+ * @num_points: number of rows in @data (number of call to mm_toc())
+ * @v:          index of the desired line in the table (first is 0)
+ * @unit_index: index of the unit to use to display the result
+ * @label_width:        maximum length of a registered label
+ * @data:       array (num_col x @num_points) containing the results: the
+ *              @ncol timing columns followed by the counter columns
+ * @str:        output string
+ *
+ * Returns: number of bytes written in the output string
+ */
+static
+int format_result_line(const struct mm_profile_ctx* ctx, int mask,
+                       int ncol, int num_points, int v, int unit_index,
+                       int label_width, const int64_t data[], char str[])
+{
+	int i, c, len;
+	double value, scale = unit_list[unit_index].scale;
+	const char* unitname = unit_list[unit_index].name;
+
+	if (ctx->points[v+1].label)
+		len = sprintf(str, "%*s |", label_width, ctx->points[v+1].label);
+	else
+		len = sprintf(str, "%*i |", label_width, v+1);
+
+	for (i = 0; i < ncol; i++) {
+		value = data[i*num_points+v]/scale;
+		len += sprintf(str+len, "%*.2f %*s |",
+		               VALUESTR_LEN, value,
+		               UNITSTR_LEN, unitname);
+	}
+
+	for (c = 0; c < MM_NELEM(counter_cols); c++) {
+		if (!(mask & counter_cols[c].mask)
+		    || !is_counter_col_available(ctx, &counter_cols[c]))
+			continue;
+
+		value = (double)data[i*num_points+v] / counter_cols[c].scale;
+		len += sprintf(str+len, "%*.2f %*s |",
+		               VALUESTR_LEN, value,
+		               UNITSTR_LEN, "");
+		i++;
+	}
+
+	str[len++] = '\n';
+	return len;
+}
+
+
+/**
+ * full_mm_write() - full write of buffer succeed or error is reported
+ * @fd:         file descriptor to write to
+ * @buf:        buffer to transfer
+ * @len:        size of @buf
+ *
+ * Return: 0 if full buffer has been written to @fd, -1 otherwise with error
+ * state set accordingly
+ */
+static
+int full_mm_write(int fd, const void* buf, size_t len)
+{
+	const char* cbuf = buf;
+	ssize_t rsz;
+
+	while (len) {
+		rsz = mm_write(fd, cbuf, len);
+		if (rsz < 0)
+			return -1;
+
+		len -= rsz;
+		cbuf += rsz;
+	}
+
+	return 0;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Context storage and labels                        *
+ *                                                                        *
+ **************************************************************************/
+
+#define LABEL_TABLE_MIN_SIZE    32
+
+static inline
+unsigned int hash_label_ptr(const char* key)
+{
+	uintptr_t v = (uintptr_t)key;
+
+	// Fibonacci hashing: the low bits of the address are poorly
+	// distributed (alignment of string literals)
+	v ^= v >> 16;
+	return (unsigned int)(v * 0x9E3779B1u);
+}
+
+
+/**
+ * label_table_find() - find the slot of a label in the table
+ * @table:      label table
+ * @size:       number of slots in @table (power of 2)
+ * @key:        address of the label supplied by the user
+ * @label:      current content of the label
+ *
+ * Return: the slot holding @key with the content @label (up to
+ * MAX_LABEL_LEN-1 characters) if present, or the empty slot where it must
+ * be inserted otherwise.
+ */
+static
+struct label_entry* label_table_find(struct label_entry* table, int size,
+                                     const char* key, const char* label)
+{
+	unsigned int i, mask = size - 1;
+
+	i = hash_label_ptr(key) & mask;
+	while (table[i].key
+	       && (table[i].key != key
+	           || strncmp(table[i].str, label, MAX_LABEL_LEN-1)))
+		i = (i + 1) & mask;
+
+	return &table[i];
+}
+
+
+/**
+ * label_table_grow() - double the size of the label table
+ * @ctx:        profiling context
+ *
+ * Return: 0 in case of success, -1 otherwise.
+ */
+static
+int label_table_grow(struct mm_profile_ctx* ctx)
+{
+	struct label_entry* table;
+	struct label_entry* entry;
+	int i, size;
+
+	size = ctx->label_table_size ? 2*ctx->label_table_size
+	       : LABEL_TABLE_MIN_SIZE;
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -1;
+
+	for (i = 0; i < ctx->label_table_size; i++) {
+		if (!ctx->label_table[i].key)
+			continue;
+
+		entry = label_table_find(table, size, ctx->label_table[i].key,
+		                         ctx->label_table[i].str);
+		*entry = ctx->label_table[i];
+	}
+
+	free(ctx->label_table);
+	ctx->label_table = table;
+	ctx->label_table_size = size;
+
+	return 0;
+}
+
+
+/**
+ * intern_label() - get the copy of a label owned by the context
+ * @ctx:        profiling context
+ * @label:      label supplied by the user
+ *
+ * Return: the copy of @label, truncated to MAX_LABEL_LEN-1 characters, or
+ * NULL if it could not be allocated.
+ */
+static NOINLINE
+const char* intern_label(struct mm_profile_ctx* ctx, const char* label)
+{
+	struct label_entry* entry;
+	size_t len;
+
+	// Keep load factor below 1/2
+	if (2*(ctx->num_labels+1) > ctx->label_table_size
+	    && label_table_grow(ctx))
+		return NULL;
+
+	entry = label_table_find(ctx->label_table, ctx->label_table_size,
+	                         label, label);
+	if (entry->key)
+		return entry->str;
+
+	len = strlen(label);
+	if (len > MAX_LABEL_LEN-1)
+		len = MAX_LABEL_LEN-1;
+
+	entry->str = malloc(len+1);
+	if (!entry->str)
+		return NULL;
+
+	memcpy(entry->str, label, len);
+	entry->str[len] = '\0';
+	entry->key = label;
+	ctx->num_labels++;
+
+	return entry->str;
+}
+
+
+/**
+ * init_ctx_storage() - setup the initial storage of a context
+ * @ctx:        zero-initialized profiling context
+ */
+static
+void init_ctx_storage(struct mm_profile_ctx* ctx)
+{
+	ctx->timestamps = ctx->inline_ts;
+	ctx->points = ctx->inline_points;
+	ctx->counters = ctx->inline_counters;
+	ctx->max_ts = NUM_TS_INLINE;
+	ctx->curr_scope = &ctx->scope_root;
+	ctx->slow_threshold = INT64_MAX;
+	ctx->slow_point = -1;
+}
+
+
+/**
+ * cleanup_ctx_storage() - free the memory allocated by a context
+ * @ctx:        profiling context
+ */
+static
+void cleanup_ctx_storage(struct mm_profile_ctx* ctx)
+{
+	int i;
+
+	if (ctx->timestamps != ctx->inline_ts) {
+		free(ctx->timestamps);
+		free(ctx->points);
+		free(ctx->counters);
+	}
+
+	perfcnt_close(&ctx->perfcnt);
+
+	if (ctx->shm) {
+		atomic_fetch_sub(&ctx->shm->num_procs, 1);
+		mm_unmap(ctx->shm);
+	}
+
+	for (i = 0; i < ctx->label_table_size; i++)
+		free(ctx->label_table[i].str);
+
+	free(ctx->label_table);
+	free(ctx->hist);
+	free(ctx->slow_iters);
+	mm_arena_destroy(ctx->scope_arena);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                        Scoped call tree profiler                       *
+ *                                                                        *
+ **************************************************************************/
+/**
+ * DOC:
+ * mm_profile_enter() and mm_profile_leave() delimit nested scopes. Each
+ * distinct path of scopes is a node of a call tree aggregating the calls
+ * over time: the number of calls, the inclusive time (time between enter
+ * and leave) and the exclusive time (inclusive time minus the inclusive
+ * time of the nested scopes). The timestamps are taken with the clock of
+ * the context and the toc overhead is removed from each measure, as done
+ * for mm_toc().
+ *
+ * The children of a node are identified by the address of the label
+ * passed to mm_profile_enter(), so the lookup is only a pointer
+ * comparison. The nodes are allocated from an arena released at reset.
+ */
+
+#define SCOPE_ARENA_CHUNK_SIZE  (64*1024)
+#define COLLAPSED_SEP           ';'
+
+// Per call statistics of a scope in the order of compute_scope_timings()
+static const struct {
+	int mask;
+	const char* name;
+} tree_cols[] = {
+	{PROF_MEAN, "mean"},
+	{PROF_MIN, "min"},
+	{PROF_MAX, "max"},
+	{PROF_MEDIAN, "median"},
+	{PROF_P90, "p90"},
+	{PROF_P99, "p99"},
+	{PROF_P999, "p99.9"},
+};
+
+static
+void reset_scope_tree(struct mm_profile_ctx* ctx)
+{
+	ctx->scope_root = (struct scope_node) {.label = ""};
+	ctx->curr_scope = &ctx->scope_root;
+	ctx->scope_lost_depth = 0;
+	if (ctx->scope_arena)
+		mm_arena_reset(ctx->scope_arena);
+}
+
+
+/**
+ * create_scope_node() - add a new scope in the call tree
+ * @ctx:        profiling context
+ * @parent:     scope enclosing the new one
+ * @key:        label supplied to mm_profile_enter()
+ *
+ * Return: the new node, or NULL if it could not be allocated.
+ */
+static NOINLINE
+struct scope_node* create_scope_node(struct mm_profile_ctx* ctx,
+                                     struct scope_node* parent,
+                                     const char* key)
+{
+	struct scope_node* node;
+	struct scope_node** plast;
+	size_t hist_size = 0;
+	const char* label;
+	int err;
+
+	// Allocation failures are not reported as error: the scope is
+	// simply not measured
+	err = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_IGNORE);
+
+	if (!ctx->scope_arena) {
+		ctx->scope_arena = mm_arena_create(SCOPE_ARENA_CHUNK_SIZE, 0);
+		if (!ctx->scope_arena)
+			goto error;
+	}
+
+	label = intern_label(ctx, key);
+	if (!label)
+		goto error;
+
+	if (ctx->hist)
+		hist_size = hist_num_buckets(ctx->hist_prec) * sizeof(uint64_t);
+
+	node = mm_arena_alloc(ctx->scope_arena, 0, sizeof(*node) + hist_size);
+	if (!node)
+		goto error;
+
+	*node = (struct scope_node) {
+		.key = key,
+		.label = label,
+		.parent = parent,
+		.depth = parent->depth + 1,
+		.incl_min = INT64_MAX,
+		.hist = hist_size ? (uint64_t*)(node + 1) : NULL,
+	};
+	median_estimator_init(&node->incl_median);
+	if (hist_size)
+		memset(node->hist, 0, hist_size);
+
+	// Append at the end of the children to print them in order of
+	// appearance
+	for (plast = &parent->child; *plast; plast = &(*plast)->next)
+		;
+
+	*plast = node;
+
+	mm_error_set_flags(err, MM_ERROR_IGNORE);
+	return node;
+
+error:
+	mm_error_set_flags(err, MM_ERROR_IGNORE);
+	return NULL;
+}
+
+
+static inline
+struct scope_node* get_child_scope(struct mm_profile_ctx* ctx,
+                                   struct scope_node* parent,
+                                   const char* key)
+{
+	struct scope_node* node;
+
+	for (node = parent->child; node; node = node->next) {
+		if (node->key == key)
+			return node;
+	}
+
+	return create_scope_node(ctx, parent, key);
+}
+
+
+/**
+ * next_scope_node() - get next node of the call tree in depth-first order
+ * @node:       current node
+ *
+ * Return: node following @node, NULL if @node was the last one.
+ */
+static
+const struct scope_node* next_scope_node(const struct scope_node* node)
+{
+	if (node->child)
+		return node->child;
+
+	while (node && !node->next)
+		node = node->parent;
+
+	return node ? node->next : NULL;
+}
+
+
+/**
+ * compute_scope_timings() - compute the statistics of a scope
+ * @ctx:        profiling context
+ * @node:       scope whose statistics must be computed
+ * @mask:       mask of the requested statistics (per call)
+ * @data:       array receiving the total inclusive time, the total
+ *              exclusive time, followed by the requested statistics
+ *
+ * Return: number of values written in @data
+ */
+static
+int compute_scope_timings(const struct mm_profile_ctx* ctx,
+                          const struct scope_node* node, int mask,
+                          int64_t data[])
+{
+	int c, n = 0;
+
+	data[n++] = node->incl_sum;
+	data[n++] = node->excl_sum;
+
+	if (mask & PROF_MEAN)
+		data[n++] = node->num_calls ?
+		            node->incl_sum / (int64_t)node->num_calls : 0;
+
+	if (mask & PROF_MIN)
+		data[n++] = node->num_calls ? node->incl_min : 0;
+
+	if (mask & PROF_MAX)
+		data[n++] = node->incl_max;
+
+	if (mask & PROF_MEDIAN)
+		data[n++] = median_estimator_getvalue(&node->incl_median);
+
+	for (c = 0; c < MM_NELEM(percentile_cols); c++) {
+		if (!(mask & percentile_cols[c].mask))
+			continue;
+
+		if (!node->hist)
+			data[n++] = -1;
+		else
+			data[n++] = hist_percentile(ctx->hist_prec, node->hist,
+			                            node->num_calls,
+			                            percentile_cols[c].permille);
+	}
+
+	return n;
+}
+
+
+/**
+ * format_tree_header() - print the call tree table header in string
+ * @mask:               the requested statistics
+ * @label_width:        width of the label column
+ * @str:                output string
+ *
+ * Returns: number of bytes written in the output string
+ */
+static
+int format_tree_header(int mask, int label_width, char str[])
+{
+	int c, len;
+
+	len = sprintf(str, "%-*s |%*s |", label_width, "scope",
+	              VALUESTR_LEN, "calls");
+	len += sprintf(str+len, "%*s %*s |", VALUESTR_LEN, "total",
+	               UNITSTR_LEN, "");
+	len += sprintf(str+len, "%*s %*s |", VALUESTR_LEN, "self",
+	               UNITSTR_LEN, "");
+
+	for (c = 0; c < MM_NELEM(tree_cols); c++) {
+		if (!(mask & tree_cols[c].mask))
+			continue;
+
+		len += sprintf(str+len, "%*s %*s |",
+		               VALUESTR_LEN, tree_cols[c].name,
+		               UNITSTR_LEN, "");
+	}
+
+	str[len++] = '\n';
+	memset(str+len, '-', len-1);
+	len += len-1;
+	str[len++] = '\n';
+
+	return len;
+}
+
+
+/**
+ * print_scope_tree() - print the call tree of a context
+ * @ctx:        profiling context
+ * @mask:       combination of flags indicating statistics must be printed
+ * @fd:         file descriptor to which the tree must be printed
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int print_scope_tree(const struct mm_profile_ctx* ctx, int mask, int fd)
+{
+	const struct scope_node* node;
+	int64_t data[NUM_COL_MAX+2], range[2] = {INT64_MAX, 0};
+	int i, ncol, len, unit_index, label_width = 0;
+	double scale;
+	char str[1024];
+	const char* unitname;
+
+	// Determine width of label column and display unit
+	for (node = next_scope_node(&ctx->scope_root); node;
+	     node = next_scope_node(node)) {
+		len = 2*(node->depth-1) + strlen(node->label);
+		label_width = MAX(label_width, len);
+
+		ncol = compute_scope_timings(ctx, node, mask, data);
+		for (i = 0; i < ncol; i++) {
+			range[0] = MIN(range[0], data[i]);
+			range[1] = MAX(range[1], data[i]);
+		}
+	}
+
+	// Same bound as max_label_len() to prevent line overflow
+	label_width = MIN(MAX(label_width, 5), 2*MAX_LABEL_LEN);
+	unit_index = get_display_unit(2, 1, range, mask);
+	scale = unit_list[unit_index].scale;
+	unitname = unit_list[unit_index].name;
+
+	len = format_tree_header(mask, label_width, str);
+	if (full_mm_write(fd, str, len))
+		return -1;
+
+	for (node = next_scope_node(&ctx->scope_root); node;
+	     node = next_scope_node(node)) {
+		len = sprintf(str, "%*s%-*s |%*"PRIu64" |",
+		              MIN(2*(node->depth-1), MAX_LABEL_LEN), "",
+		              MAX(label_width - 2*(node->depth-1), 1),
+		              node->label, VALUESTR_LEN, node->num_calls);
+
+		ncol = compute_scope_timings(ctx, node, mask, data);
+		for (i = 0; i < ncol; i++) {
+			len += sprintf(str+len, "%*.2f %*s |",
+			               VALUESTR_LEN, data[i]/scale,
+			               UNITSTR_LEN, unitname);
+		}
+
+		str[len++] = '\n';
+		if (full_mm_write(fd, str, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * format_collapsed_stack() - write the path of a scope in collapsed format
+ * @node:       scope to print
+ * @str:        output string of at least node->depth*MAX_LABEL_LEN + 32
+ *
+ * Write the labels of the scopes from the root to @node separated by ';'
+ * followed by the total exclusive time of @node in nanoseconds. The
+ * characters that would break the format (separator, spaces and newlines)
+ * are replaced by '_'.
+ *
+ * Return: number of bytes written in @str
+ */
+static
+int format_collapsed_stack(const struct scope_node* node, char str[])
+{
+	const struct scope_node* n;
+	int len, pos, i, lbl_len;
+	char c;
+
+	// Compute the length of the path (labels and separators) to fill it
+	// from the end
+	len = -1;
+	for (n = node; n->parent; n = n->parent)
+		len += strlen(n->label) + 1;
+
+	pos = len - 1;
+	for (n = node; n->parent; n = n->parent) {
+		if (n != node)
+			str[pos--] = COLLAPSED_SEP;
+
+		lbl_len = strlen(n->label);
+		for (i = lbl_len-1; i >= 0; i--) {
+			c = n->label[i];
+			if (c == COLLAPSED_SEP || c == ' ' || c == '\n')
+				c = '_';
+
+			str[pos--] = c;
+		}
+	}
+
+	len += sprintf(str+len, " %"PRIi64"\n", MAX(node->excl_sum, 0));
+	return len;
+}
+
+
+/**
+ * print_collapsed_stacks() - print the call tree in collapsed stack format
+ * @ctx:        profiling context
+ * @fd:         file descriptor to which the stacks must be printed
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int print_collapsed_stacks(const struct mm_profile_ctx* ctx, int fd)
+{
+	const struct scope_node* node;
+	char* str;
+	int len, max_depth = 0, rv = 0;
+
+	for (node = next_scope_node(&ctx->scope_root); node;
+	     node = next_scope_node(node))
+		max_depth = MAX(max_depth, node->depth);
+
+	str = mm_malloca(max_depth*MAX_LABEL_LEN + 32);
+	if (!str)
+		return -1;
+
+	for (node = next_scope_node(&ctx->scope_root); node;
+	     node = next_scope_node(node)) {
+		len = format_collapsed_stack(node, str);
+		rv = full_mm_write(fd, str, len);
+		if (rv)
+			break;
+	}
+
+	mm_freea(str);
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                        Thread default context                          *
+ *                                                                        *
+ **************************************************************************/
+
+/*
+ * The context used by mm_tic(), mm_toc() and the other functions without
+ * explicit context is private to each thread: it is allocated at the
+ * first use in the thread and released when the thread exits. If this
+ * cannot be done, a context shared by all such threads is used (which was
+ * the behavior of the previous versions).
+ */
+static thread_local struct mm_profile_ctx* thread_ctx;
+static struct mm_profile_ctx fallback_ctx;
+static mm_thr_once_t fallback_ctx_once = MM_THR_ONCE_INIT;
+static mm_thr_once_t ctx_key_once = MM_THR_ONCE_INIT;
+static tls_key_t ctx_key;
+static int ctx_key_valid;
+
+
+/**
+ * alloc_hist() - allocate the latency histograms of a context
+ * @ctx:        profiling context
+ * @prec:       precision in bits of the histograms
+ *
+ * Replace the histograms of @ctx by new empty ones of precision @prec. In
+ * case of failure, @ctx is left untouched.
+ *
+ * Return: 0 in case of success, -1 otherwise with errno set.
+ */
+static
+int alloc_hist(struct mm_profile_ctx* ctx, int prec)
+{
+	uint64_t* hist;
+	size_t num_buckets;
+	int i;
+
+	num_buckets = ctx->max_ts * hist_num_buckets(prec);
+	hist = calloc(num_buckets, sizeof(*hist));
+	if (!hist)
+		return -1;
+
+	free(ctx->hist);
+	ctx->hist = hist;
+	ctx->hist_prec = prec;
+	for (i = 0; i < ctx->max_ts; i++)
+		ctx->points[i].hist_count = 0;
+
+	return 0;
+}
+
+
+static
+void profile_thread_exit(void* arg)
+{
+	struct mm_profile_ctx* ctx = arg;
+
+	cleanup_ctx_storage(ctx);
+	free(ctx);
+	thread_ctx = NULL;
+}
+
+
+static
+void init_ctx_key(void)
+{
+	if (!tls_key_create(&ctx_key, profile_thread_exit))
+		ctx_key_valid = 1;
+}
+
+
+static
+void init_fallback_ctx(void)
+{
+	init_ctx_storage(&fallback_ctx);
+	mm_profile_ctx_reset(&fallback_ctx, 0);
+}
+
+
+static
+struct mm_profile_ctx* get_fallback_ctx(void)
+{
+	mm_thr_once(&fallback_ctx_once, init_fallback_ctx);
+	return &fallback_ctx;
+}
+
+
+static NOINLINE
+struct mm_profile_ctx* create_thread_ctx(void)
+{
+	struct mm_profile_ctx* ctx;
+
+	mm_thr_once(&ctx_key_once, init_ctx_key);
+	if (!ctx_key_valid)
+		return get_fallback_ctx();
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return get_fallback_ctx();
+
+	init_ctx_storage(ctx);
+
+	// Percentiles will not be available if this fails, but the other
+	// statistics will still be
+	alloc_hist(ctx, HIST_PREC_DEFAULT);
+
+	mm_profile_ctx_reset(ctx, 0);
+	tls_key_set(ctx_key, ctx);
+	thread_ctx = ctx;
+
+	return ctx;
+}
+
+
+static inline
+struct mm_profile_ctx* get_thread_ctx(void)
+{
+	struct mm_profile_ctx* ctx = thread_ctx;
+
+	if (UNLIKELY(!ctx))
+		ctx = create_thread_ctx();
+
+	return ctx;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Shared profile segment mapping                    *
+ *                                                                        *
+ **************************************************************************/
+
+static
+size_t shm_profile_size(int prec, int max_points)
+{
+	return sizeof(struct shm_profile) + max_points * shm_point_size(prec);
+}
+
+
+/**
+ * init_shm_profile() - initialize a newly created shared profile
+ * @shm:        mapping of the zero-filled segment
+ * @toc_overhead: toc overhead estimated by the creator
+ */
+static
+void init_shm_profile(struct shm_profile* shm, int64_t toc_overhead)
+{
+	int i;
+
+	shm->hist_prec = HIST_PREC_DEFAULT;
+	shm->max_points = SHM_NUM_POINTS;
+	shm->toc_overhead = toc_overhead;
+	for (i = 0; i < SHM_NUM_POINTS; i++)
+		atomic_init(&get_shm_point(shm, i)->min, INT64_MAX);
+
+	// Publish the initialized segment to the other processes
+	atomic_store_explicit(&shm->magic, SHM_PROFILE_MAGIC,
+	                      memory_order_release);
+}
+
+
+/**
+ * open_existing_shm_profile() - map a shared profile created by another
+ * @fd:         file descriptor of the shared memory object
+ * @mflags:     flags of the mapping
+ * @size:       location receiving the size of the mapping
+ *
+ * Wait for the creator of the segment to have sized and initialized it,
+ * and check it is compatible with this version of mmlib.
+ *
+ * Return: the mapped segment, NULL in case of failure with error state set
+ */
+static
+struct shm_profile* open_existing_shm_profile(int fd, int mflags,
+                                              size_t* size)
+{
+	struct shm_profile* shm;
+	struct mm_stat st;
+	int i;
+
+	for (i = 0; i < SHM_INIT_TIMEOUT_MS; i++) {
+		if (mm_fstat(fd, &st))
+			return NULL;
+
+		if ((size_t)st.size >= sizeof(*shm))
+			break;
+
+		mm_relative_sleep_ms(1);
+	}
+
+	if ((size_t)st.size < sizeof(*shm)) {
+		mm_raise_error(ETIMEDOUT, "Shared profile not initialized");
+		return NULL;
+	}
+
+	shm = mm_mapfile(fd, 0, st.size, mflags);
+	if (!shm)
+		return NULL;
+
+	for (i = 0; i < SHM_INIT_TIMEOUT_MS; i++) {
+		if (atomic_load_explicit(&shm->magic, memory_order_acquire)
+		    == SHM_PROFILE_MAGIC)
+			break;
+
+		mm_relative_sleep_ms(1);
+	}
+
+	if (atomic_load(&shm->magic) != SHM_PROFILE_MAGIC
+	    || shm->hist_prec < HIST_PREC_MIN || shm->hist_prec > HIST_PREC_MAX
+	    || shm->max_points <= 0 || shm->max_points > SHM_NUM_POINTS
+	    || shm_profile_size(shm->hist_prec, shm->max_points)
+	       != (size_t)st.size) {
+		mm_raise_error(EPROTO, "Invalid or incompatible shared profile");
+		mm_unmap(shm);
+		return NULL;
+	}
+
+	*size = st.size;
+	return shm;
+}
+
+
+/**
+ * attach_shm_profile() - create or open a shared profile for writing
+ * @ctx:        context to attach to the shared profile
+ * @name:       name of the shared memory object
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int attach_shm_profile(struct mm_profile_ctx* ctx, const char* name)
+{
+	struct shm_profile* shm = NULL;
+	size_t size = shm_profile_size(HIST_PREC_DEFAULT, SHM_NUM_POINTS);
+	int fd, prev_flags;
+
+	// The first process to create the segment initializes it
+	prev_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_NOLOG);
+	fd = mm_shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0666);
+	mm_error_set_flags(prev_flags, MM_ERROR_NOLOG);
+
+	if (fd >= 0) {
+		if (!mm_ftruncate(fd, size)) {
+			shm = mm_mapfile(fd, 0, size, MM_MAP_RDWR|MM_MAP_SHARED);
+			if (shm)
+				init_shm_profile(shm, ctx->toc_overhead);
+		}
+	} else if (mm_get_lasterror_number() == EEXIST) {
+		fd = mm_shm_open(name, O_RDWR, 0);
+		if (fd >= 0)
+			shm = open_existing_shm_profile(fd, MM_MAP_RDWR
+			                                |MM_MAP_SHARED, &size);
+	} else {
+		mm_raise_from_errno("Cannot create shared profile %s", name);
+	}
+
+	if (fd >= 0)
+		mm_close(fd);
+
+	if (!shm)
+		return -1;
+
+	if (!atomic_is_lock_free(&shm->num_iter)) {
+		mm_unmap(shm);
+		return mm_raise_error(ENOTSUP, "64-bit atomic operations are "
+		                      "not lock-free on this platform");
+	}
+
+	atomic_fetch_add(&shm->num_procs, 1);
+	ctx->shm = shm;
+	ctx->shm_size = size;
+	return 0;
+}
+
+
+/**
+ * load_shm_snapshot() - copy the statistics of a shared profile in context
+ * @ctx:        empty profiling context receiving the statistics
+ * @shm:        shared profile to read
+ *
+ * Return: 0 in case of success, -1 otherwise
+ */
+static
+int load_shm_snapshot(struct mm_profile_ctx* ctx, struct shm_profile* shm)
+{
+	struct shm_point* sp;
+	struct point_stats* pt;
+	uint64_t* hist;
+	int i, b, num_ts, num_buckets;
+
+	num_ts = MIN(atomic_load(&shm->num_ts), shm->max_points);
+	while (ctx->max_ts < num_ts) {
+		if (grow_points(ctx))
+			return -1;
+	}
+
+	if (alloc_hist(ctx, shm->hist_prec))
+		return -1;
+
+	num_buckets = hist_num_buckets(shm->hist_prec);
+	ctx->num_ts = num_ts;
+	ctx->num_iter = atomic_load(&shm->num_iter);
+	ctx->toc_overhead = shm->toc_overhead;
+
+	for (i = 1; i < num_ts; i++) {
+		sp = get_shm_point(shm, i);
+		pt = &ctx->points[i];
+		pt->min_diff = atomic_load_explicit(&sp->min,
+		                                    memory_order_relaxed);
+		pt->max_diff = atomic_load_explicit(&sp->max,
+		                                    memory_order_relaxed);
+		pt->sum_diff = atomic_load_explicit(&sp->sum,
+		                                    memory_order_relaxed);
+
+		hist = get_point_hist(ctx, i);
+		pt->hist_count = 0;
+		for (b = 0; b < num_buckets; b++) {
+			hist[b] = atomic_load_explicit(&sp->hist[b],
+			                               memory_order_relaxed);
+			pt->hist_count += hist[b];
+		}
+
+		// The median is not kept in the segment, estimate it from
+		// the histogram
+		pt->median_diff.median = hist_percentile(shm->hist_prec, hist,
+		                                         pt->hist_count, 500);
+		pt->median_diff.step = 0;
+
+		if (atomic_load_explicit(&sp->label_state, memory_order_acquire)
+		    == SHM_LABEL_SET)
+			pt->label = intern_label(ctx, sp->label);
+	}
+
+	return 0;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                           API implementation                           *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_profile_ctx_create() - create a profiling context
+ * @reset_flags: flags controlling the initial setting of the context
+ *
+ * This function creates a context holding its own points of measure,
+ * labels and timing statistics. The context is initialized as if
+ * mm_profile_ctx_reset() has been called with @reset_flags.
+ *
+ * A context can be used by only one thread at a time, but several contexts
+ * can be used concurrently. This allows one to profile different loops
+ * or different threads independently. If the measure must span over
+ * several threads, those must serialize their use of the context (the
+ * measure points are then the ones of a shared timeline).
+ *
+ * Return: pointer to the new context in case of success, NULL otherwise
+ * with error state set accordingly.
+ */
+API_EXPORTED
+struct mm_profile_ctx* mm_profile_ctx_create(int reset_flags)
+{
+	struct mm_profile_ctx* ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		mm_raise_from_errno("Cannot allocate profiling context");
+		return NULL;
+	}
+
+	init_ctx_storage(ctx);
+	if (alloc_hist(ctx, HIST_PREC_DEFAULT)) {
+		mm_raise_from_errno("Cannot allocate profiling context");
+		free(ctx);
+		return NULL;
+	}
+
+	mm_profile_ctx_reset(ctx, reset_flags);
+	return ctx;
+}
+
+
+/**
+ * mm_profile_ctx_create_shared() - create a context shared between processes
+ * @name:       name of the shared memory object holding the statistics
+ * @reset_flags: flags controlling the initial setting of the context
+ *
+ * This function creates a profiling context as mm_profile_ctx_create()
+ * does, whose statistics are additionally accumulated into the shared
+ * memory object @name (see mm_shm_open()). The object is created if it
+ * does not exist yet. Several processes (or several contexts) can attach
+ * to the same @name: the timings of the iterations measured by all of them
+ * are accumulated into the same count, mean, min, max and latency
+ * histogram of each point of measure (up to 63 points). The shared
+ * statistics can be printed at any time, possibly by another process, with
+ * mm_profile_shm_print() or the mmprofile-reader tool.
+ *
+ * The functions operating on the returned context (mm_profile_ctx_print()
+ * for instance) only report the iterations measured by this context.
+ * Resetting it does not clear the shared statistics. The shared memory
+ * object persists after the processes exit, until it is removed with
+ * mm_shm_unlink(). All contexts attached to a same object should use the
+ * same labels at the same points of measure.
+ *
+ * Return: pointer to the new context in case of success, NULL otherwise
+ * with error state set accordingly.
+ */
+API_EXPORTED
+struct mm_profile_ctx* mm_profile_ctx_create_shared(const char* name,
+                                                    int reset_flags)
+{
+	struct mm_profile_ctx* ctx;
+
+	ctx = mm_profile_ctx_create(reset_flags);
+	if (!ctx)
+		return NULL;
+
+	if (attach_shm_profile(ctx, name)) {
+		mm_profile_ctx_destroy(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+
+/**
+ * mm_profile_shm_print() - Print the statistics of a shared profile
+ * @name:       name of the shared memory object holding the statistics
+ * @mask:       combination of flags indicating statistics must be printed
+ * @fd:         file descriptor to which the statistics must be printed
+ *
+ * Take a snapshot of the statistics accumulated in @name by the contexts
+ * created with mm_profile_ctx_create_shared() and print it on @fd like
+ * mm_profile_print() does. The processes accumulating into @name are not
+ * disturbed. PROF_CURR is not supported and the median is estimated from
+ * the latency histograms.
+ *
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
+ */
+API_EXPORTED
+int mm_profile_shm_print(const char* name, int mask, int fd)
+{
+	struct mm_profile_ctx* ctx;
+	struct shm_profile* shm;
+	size_t size;
+	char str[128];
+	int shm_fd, rv = -1;
+
+	shm_fd = mm_shm_open(name, O_RDONLY, 0);
+	if (shm_fd < 0)
+		return -1;
+
+	shm = open_existing_shm_profile(shm_fd, MM_MAP_READ|MM_MAP_SHARED,
+	                                &size);
+	mm_close(shm_fd);
+	if (!shm)
+		return -1;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		mm_raise_from_errno("Cannot allocate profiling context");
+		goto exit;
+	}
+
+	init_ctx_storage(ctx);
+	if (load_shm_snapshot(ctx, shm)) {
+		mm_raise_from_errno("Cannot load shared profile");
+		goto exit;
+	}
+
+	sprintf(str, "%"PRIi64" iterations, %i contexts attached\n",
+	        (int64_t)ctx->num_iter, atomic_load(&shm->num_procs));
+	if (full_mm_write(fd, str, strlen(str)))
+		goto exit;
+
+	rv = mm_profile_ctx_print(ctx, mask & ~PROF_CURR, fd);
+
+exit:
+	if (ctx) {
+		cleanup_ctx_storage(ctx);
+		free(ctx);
+	}
+
+	mm_unmap(shm);
+	return rv;
+}
+
+
+/**
+ * mm_profile_ctx_destroy() - destroy a profiling context
+ * @ctx:        context to destroy (may be NULL)
+ */
+API_EXPORTED
+void mm_profile_ctx_destroy(struct mm_profile_ctx* ctx)
+{
+	if (!ctx)
+		return;
+
+	// Account the ongoing iteration in the shared profile
+	if (ctx->shm)
+		update_shm_stats(ctx);
+
+	cleanup_ctx_storage(ctx);
+	free(ctx);
+}
+
+
+/**
+ * mm_profile_ctx_set_precision() - set precision of percentile estimation
+ * @ctx:        profiling context
+ * @bits:       number of significant bits kept in the latency histograms
+ *
+ * The percentiles reported by PROF_P90, PROF_P99 and PROF_P999 are
+ * estimated from a log-linear histogram of the timings of each point of
+ * measure. With @bits of precision, the relative error of an estimated
+ * value is at most 2^-@bits. @bits must be between 3 and 10 (default is
+ * 6, i.e. less than 2% of error). Increasing it makes the histograms larger
+ * but does not change the cost of mm_toc().
+ *
+ * Changing the precision clears the histograms already recorded in @ctx
+ * as well as the call tree of scopes.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_profile_ctx_set_precision(struct mm_profile_ctx* ctx, int bits)
+{
+	if (bits < HIST_PREC_MIN || bits > HIST_PREC_MAX)
+		return mm_raise_error(EINVAL, "Invalid histogram precision "
+		                      "(%i), must be between %i and %i",
+		                      bits, HIST_PREC_MIN, HIST_PREC_MAX);
+
+	if (alloc_hist(ctx, bits))
+		return mm_raise_from_errno("Cannot allocate histograms");
+
+	// Histograms of the scopes must be reallocated with the new size
+	reset_scope_tree(ctx);
+	return 0;
+}
+
+
+/**
+ * mm_profile_ctx_get_histogram() - get latency histogram of a measure point
+ * @ctx:                profiling context
+ * @measure_point:      measure point whose histogram must be get
+ * @buckets:            array receiving the non empty buckets
+ * @max_num:            number of element in @buckets
+ *
+ * Fill @buckets with the non empty buckets of the histogram of the timings
+ * of @measure_point, in increasing order of value. Each bucket reports the
+ * range of values (in nanoseconds) it covers and the number of timings
+ * recorded in it. If there are more than @max_num non empty buckets, only
+ * the @max_num first ones are written. @buckets may be NULL if @max_num is
+ * 0, which allows one to query the size of array needed.
+ *
+ * Return: the number of non empty buckets in the histogram (which may be
+ * larger than @max_num), -1 in case of error with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_profile_ctx_get_histogram(struct mm_profile_ctx* ctx,
+                                 int measure_point,
+                                 struct mm_profile_bucket* buckets,
+                                 int max_num)
+{
+	const uint64_t* hist;
+	int i, num_buckets, num = 0;
+
+	if (measure_point < 0 || measure_point >= ctx->num_ts-1
+	    || max_num < 0 || (max_num && !buckets))
+		return mm_raise_error(EINVAL, "Invalid argument");
+
+	if (!ctx->hist)
+		return mm_raise_error(ENOMEM, "Histograms not allocated");
+
+	hist = get_point_hist(ctx, measure_point+1);
+	num_buckets = hist_num_buckets(ctx->hist_prec);
+	for (i = 0; i < num_buckets; i++) {
+		if (!hist[i])
+			continue;
+
+		if (num < max_num) {
+			hist_bucket_bounds(ctx->hist_prec, i,
+			                   &buckets[num].lower,
+			                   &buckets[num].upper);
+			buckets[num].count = hist[i];
+		}
+
+		num++;
+	}
+
+	return num;
+}
+
+
+/**
+ * mm_profile_ctx_tic() - Start a iteration of profiling in a context
+ * @ctx:        profiling context
+ *
+ * Same as mm_tic() but operates on @ctx.
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_ctx_tic(struct mm_profile_ctx* ctx)
+{
+	if (UNLIKELY(is_slow_iteration(ctx)))
+		record_slow_iteration(ctx);
+
+	update_diffs(ctx);
+	ctx->next_ts = 0;
+	ctx->num_iter++;
+	local_toc(ctx);
+}
+
+
+/**
+ * mm_profile_ctx_toc() - Add a new point of measure in a context
+ * @ctx:        profiling context
+ *
+ * Same as mm_toc() but operates on @ctx.
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_ctx_toc(struct mm_profile_ctx* ctx)
+{
+	local_toc(ctx);
+}
+
+
+/**
+ * mm_profile_ctx_toc_label() - Add a labelled point of measure in a context
+ * @ctx:        profiling context
+ * @label:      string to appear in front of measure point at result display
+ *
+ * Same as mm_toc_label() but operates on @ctx.
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_ctx_toc_label(struct mm_profile_ctx* ctx, const char* label)
+{
+	int next_ts = ctx->next_ts;
+
+	if (UNLIKELY(next_ts == ctx->max_ts) && grow_points(ctx)) {
+		local_toc(ctx);
+		return;
+	}
+
+	// Set label if it the first time to appear
+	if (UNLIKELY(!ctx->points[next_ts].label))
+		ctx->points[next_ts].label = intern_label(ctx, label);
+
+	local_toc(ctx);
+}
+
+
+/**
+ * mm_profile_ctx_enter() - Enter a scope in a context
+ * @ctx:        profiling context
+ * @label:      name of the scope
+ *
+ * Same as mm_profile_enter() but operates on @ctx.
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_ctx_enter(struct mm_profile_ctx* ctx, const char* label)
+{
+	struct scope_node* node;
+
+	// Inside a lost scope, the next mm_profile_leave() calls must match
+	// the lost scopes: the nested ones cannot be recorded either
+	if (UNLIKELY(ctx->scope_lost_depth)) {
+		ctx->scope_lost_depth++;
+		return;
+	}
+
+	node = get_child_scope(ctx, ctx->curr_scope, label);
+	if (UNLIKELY(!node)) {
+		ctx->scope_lost_depth++;
+		return;
+	}
+
+	ctx->curr_scope = node;
+	node->child_time = 0;
+	node->enter_ts = read_timestamp(ctx);
+}
+
+
+/**
+ * mm_profile_ctx_leave() - Leave the current scope in a context
+ * @ctx:        profiling context
+ *
+ * Same as mm_profile_leave() but operates on @ctx.
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_ctx_leave(struct mm_profile_ctx* ctx)
+{
+	struct scope_node* node = ctx->curr_scope;
+	int64_t ts, diff, incl;
+
+	ts = read_timestamp(ctx);
+
+	if (UNLIKELY(ctx->scope_lost_depth)) {
+		ctx->scope_lost_depth--;
+		return;
+	}
+
+	// Ignore unbalanced call
+	if (UNLIKELY(!node->parent))
+		return;
+
+	diff = timestamp_diff_to_ns(ctx, ts - node->enter_ts);
+	incl = diff - ctx->toc_overhead;
+
+	node->num_calls++;
+	node->incl_sum += incl;
+	node->excl_sum += incl - node->child_time;
+	node->incl_min = MIN(incl, node->incl_min);
+	node->incl_max = MAX(incl, node->incl_max);
+	median_estimator_update(&node->incl_median, incl);
+	if (node->hist)
+		node->hist[hist_index(ctx->hist_prec, incl)]++;
+
+	// The enclosing scope has also spent the time of the measure
+	node->parent->child_time += diff + ctx->toc_overhead;
+	ctx->curr_scope = node->parent;
+}
+
+
+/**
+ * mm_profile_ctx_print_tree() - Print the call tree of scopes of a context
+ * @ctx:        profiling context
+ * @mask:       combination of flags indicating statistics must be printed
+ * @fd:         file descriptor to which the tree must be printed
+ *
+ * Same as mm_profile_print_tree() but operates on @ctx.
+ *
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
+ */
+API_EXPORTED
+int mm_profile_ctx_print_tree(struct mm_profile_ctx* ctx, int mask, int fd)
+{
+	return print_scope_tree(ctx, mask, fd);
+}
+
+
+/**
+ * mm_profile_ctx_print_collapsed() - Print scopes of a context for flame graph
+ * @ctx:        profiling context
+ * @fd:         file descriptor to which the stacks must be printed
+ *
+ * Same as mm_profile_print_collapsed() but operates on @ctx.
+ *
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
+ */
+API_EXPORTED
+int mm_profile_ctx_print_collapsed(struct mm_profile_ctx* ctx, int fd)
+{
+	return print_collapsed_stacks(ctx, fd);
+}
+
+
+/**
+ * mm_profile_ctx_set_slow_threshold() - set threshold of slow iterations
+ * @ctx:        profiling context
+ * @measure_point: measure point whose timing is checked, -1 to check the
+ *              duration of the whole iteration
+ * @threshold:  duration in ns above which an iteration is recorded, 0 to
+ *              disable the capture
+ *
+ * Same as mm_profile_set_slow_threshold() but operates on @ctx.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_profile_ctx_set_slow_threshold(struct mm_profile_ctx* ctx,
+                                      int measure_point, int64_t threshold)
+{
+	struct mm_profile_slow_iter* ring;
+
+	if (measure_point < -1 || measure_point > INT_MAX/2
+	    || threshold < 0)
+		return mm_raise_error(EINVAL, "Invalid measure point (%i) or "
+		                      "slow threshold (%"PRIi64")",
+		                      measure_point, threshold);
+
+	// The timestamps bounding the checked point must be allocated since
+	// they are read at each mm_tic()
+	while (measure_point+1 >= ctx->max_ts) {
+		if (grow_points(ctx))
+			return mm_raise_error(ENOMEM, "Cannot allocate points "
+			                      "of measure");
+	}
+
+	if (threshold && !ctx->slow_iters) {
+		ring = calloc(SLOW_RING_SIZE, sizeof(*ring));
+		if (!ring)
+			return mm_raise_from_errno("Cannot allocate slow "
+			                           "iteration ring");
+
+		ctx->slow_iters = ring;
+	}
+
+	ctx->slow_point = measure_point;
+	ctx->slow_threshold_ns = threshold;
+	ctx->num_slow = 0;
+	update_slow_threshold(ctx);
+
+	return 0;
+}
+
+
+/**
+ * mm_profile_ctx_get_slow_iters() - get the slow iterations of a context
+ * @ctx:        profiling context
+ * @iters:      array receiving the slow iterations
+ * @max_num:    number of elements in @iters
+ *
+ * Same as mm_profile_get_slow_iters() but operates on @ctx.
+ *
+ * Return: the number of slow iterations written in @iters.
+ */
+API_EXPORTED
+int mm_profile_ctx_get_slow_iters(struct mm_profile_ctx* ctx,
+                                  struct mm_profile_slow_iter* iters,
+                                  int max_num)
+{
+	int64_t first;
+	int i, num;
+
+	num = (int)MIN(ctx->num_slow, SLOW_RING_SIZE);
+	num = MIN(num, max_num);
+
+	// Keep the most recent ones
+	first = ctx->num_slow - num;
+	for (i = 0; i < num; i++)
+		iters[i] = ctx->slow_iters[(first + i) % SLOW_RING_SIZE];
+
+	return num;
+}
+
+
+/**
+ * mm_profile_ctx_print_slow() - Print the slow iterations of a context
+ * @ctx:        profiling context
+ * @mask:       PROF_FORCE_* flag to force the unit of the timings (0 to let
+ *              it adapt to the timings of each iteration)
+ * @fd:         file descriptor to which the iterations must be printed
+ *
+ * Same as mm_profile_print_slow() but operates on @ctx.
+ *
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
+ */
+API_EXPORTED
+int mm_profile_ctx_print_slow(struct mm_profile_ctx* ctx, int mask, int fd)
+{
+	const struct mm_profile_slow_iter* it;
+	const char* label;
+	char str[256];
+	int i, v, u, num, len, label_width;
+	int64_t first;
+
+	if (!ctx->slow_threshold_ns) {
+		strcpy(str, "slow iteration capture disabled\n");
+		return full_mm_write(fd, str, strlen(str));
+	}
+
+	u = get_value_unit(ctx->slow_threshold_ns, mask);
+	len = sprintf(str, "%"PRIi64" slow iterations (threshold %.2f %s on ",
+	              ctx->num_slow,
+	              (double)ctx->slow_threshold_ns / unit_list[u].scale,
+	              unit_list[u].name);
+	label = ctx->slow_point >= 0 ? ctx->points[ctx->slow_point+1].label
+	        : "whole iteration";
+	if (label)
+		len += sprintf(str+len, "%.*s)\n", MAX_LABEL_LEN, label);
+	else
+		len += sprintf(str+len, "point %i)\n", ctx->slow_point+1);
+
+	if (full_mm_write(fd, str, len))
+		return -1;
+
+	label_width = max_label_len(ctx);
+	num = (int)MIN(ctx->num_slow, SLOW_RING_SIZE);
+	first = ctx->num_slow - num;
+	for (i = 0; i < num; i++) {
+		it = &ctx->slow_iters[(first + i) % SLOW_RING_SIZE];
+		u = get_value_unit(it->total, mask);
+		len = sprintf(str, "iteration %i (thread %li, at %"PRIi64
+		              ".%06i): total %.2f %s\n", it->iteration,
+		              it->thread_id, it->timestamp / SEC_IN_NSEC,
+		              (int)(it->timestamp % SEC_IN_NSEC) / 1000,
+		              (double)it->total / unit_list[u].scale,
+		              unit_list[u].name);
+
+		for (v = 0; v < it->num_points; v++) {
+			label = ctx->points[v+1].label;
+			if (label)
+				len += sprintf(str+len, "%*s |", label_width,
+				               label);
+			else
+				len += sprintf(str+len, "%*i |", label_width,
+				               v+1);
+
+			len += sprintf(str+len, "%*.2f %*s\n", VALUESTR_LEN,
+			               (double)it->timings[v]
+			               / unit_list[u].scale,
+			               UNITSTR_LEN, unit_list[u].name);
+
+			if (full_mm_write(fd, str, len))
+				return -1;
+
+			len = 0;
+		}
 
-	// select the most suitable unit based on the min and max value
-	for (i = 0; i < NUM_UNIT-1; i++) {
-		scale = unit_list[i].scale;
-		if ((minval < scale*100 && maxval < scale*10000)
-		    || (maxval - minval) < scale)
-			break;
+		if (len && full_mm_write(fd, str, len))
+			return -1;
 	}
 
-	return i;
+	return 0;
 }
 
 
 /**
- * format_header_line() - print the result table header in string
- * @mask:               the requested timing computations
- * @label_width:        maximum length of a registered label
- * @str:                output string
+ * mm_profile_ctx_print() - Print the timing statistics of a context
+ * @ctx:        profiling context
+ * @mask:       combination of flags indicating statistics must be printed
+ * @fd:         file descriptor to which the statistics must be printed
  *
- * Returns: number of bytes written in the output string
+ * Same as mm_profile_print() but operates on @ctx.
+ *
+ * Returns: 0 in case of success, -1 otherwise with errno set accordingly
  */
-static
-int format_header_line(int mask, int label_width, char str[])
+API_EXPORTED
+int mm_profile_ctx_print(struct mm_profile_ctx* ctx, int mask, int fd)
 {
-	int len;
+	int i, ncol, num_points, label_width, unit_index;
+	int cnt_mask;
+	char str[512];
+	size_t len;
+	int64_t* data;
+	int rv = -1;
 
-	len = sprintf(str, "%*s |", label_width, "");
+	update_diffs(ctx);
 
-	if (mask & PROF_CURR) {
-		len += sprintf(str+len, "%*s %*s |",
-		               VALUESTR_LEN, "current",
-		               UNITSTR_LEN, "");
-	}
+	label_width = max_label_len(ctx);
+	num_points = ctx->num_ts-1;
+	data = mm_malloca(NUM_COL_MAX * MAX(num_points, 1) * sizeof(*data));
+	if (!data)
+		return -1;
 
-	if (mask & PROF_MEAN) {
-		len += sprintf(str+len, "%*s %*s |",
-		               VALUESTR_LEN, "mean",
-		               UNITSTR_LEN, "");
-	}
+	ncol = compute_requested_timings(ctx, mask, num_points, data);
+	unit_index = get_display_unit(ncol, num_points, data, mask);
+	compute_requested_counters(ctx, mask, num_points,
+	                           data + ncol*num_points);
 
-	if (mask & PROF_MIN) {
-		len += sprintf(str+len, "%*s %*s |",
-		               VALUESTR_LEN, "min",
-		               UNITSTR_LEN, "");
-	}
+	for (i = 0; i < ctx->num_ts; i++) {
+		if (i == 0)
+			len = format_header_line(ctx, mask, label_width, str);
+		else
+			len = format_result_line(ctx, mask, ncol, num_points,
+			                         i-1, unit_index, label_width,
+			                         data, str);
 
-	if (mask & PROF_MAX) {
-		len += sprintf(str+len, "%*s %*s |",
-		               VALUESTR_LEN, "max",
-		               UNITSTR_LEN, "");
-	}
 
-	if (mask & PROF_MEDIAN) {
-		len += sprintf(str+len, "%*s %*s |",
-		               VALUESTR_LEN, "median",
-		               UNITSTR_LEN, "");
+		// Write line to file
+		if (full_mm_write(fd, str, len))
+			goto exit;
 	}
 
-	str[len++] = '\n';
-	memset(str+len, '-', len-1);
-	len += len-1;
-	str[len++] = '\n';
+	sprintf(str, "toc overhead = %li ns\n", (long)ctx->toc_overhead);
+	cnt_mask = PROF_CYCLES|PROF_INSTR|PROF_IPC
+	           |PROF_CACHE_MISS|PROF_BRANCH_MISS;
+	if ((mask & cnt_mask) && !ctx->perfcnt.num_open)
+		strcat(str, "hardware counters not available\n");
 
-	return len;
+	if (ctx->num_dropped)
+		sprintf(str + strlen(str), "%"PRIi64" points of measure "
+		        "dropped (allocation failure)\n", ctx->num_dropped);
+
+	rv = full_mm_write(fd, str, strlen(str));
+
+exit:
+	mm_freea(data);
+	return rv;
 }
 
 
 /**
- * format_result_line() - print a line of the result table
- * @ncol:       number of columns in @data
- * @num_points: number of rows in @data (number of call to mm_toc())
- * @v:          index of the desired line in the table (first is 0)
- * @unit_index: index of the unit to use to display the result
- * @label_width:        maximum length of a registered label
- * @data:       array (num_col x @num_points) containing the results
- * @str:        output string
+ * mm_profile_ctx_get_data() - Retrieve profile result of a context
+ * @ctx:                profiling context
+ * @measure_point:      measure point whose statistic must be get
+ * @type:               type of statistic (PROF_[CURR|MIN|MEAN|MAX|MEDIAN],
+ *                      PROF_[P90|P99|P999] or a hardware counter statistic)
  *
- * Returns: number of bytes written in the output string
+ * Same as mm_profile_get_data() but operates on @ctx.
+ *
+ * Return: statistic value in nanosecond (or value of counter statistic)
  */
-static
-int format_result_line(int ncol, int num_points, int v, int unit_index,
-                       int label_width, const int64_t data[], char str[])
+API_EXPORTED
+int64_t mm_profile_ctx_get_data(struct mm_profile_ctx* ctx,
+                                int measure_point, int type)
 {
-	int i, len;
-	double value, scale = unit_list[unit_index].scale;
-	const char* unitname = unit_list[unit_index].name;
+	int64_t* data;
+	int64_t value;
+	int c, num_points, mask;
 
-	if (labels[v+1])
-		len = sprintf(str, "%*s |", label_width, labels[v+1]);
-	else
-		len = sprintf(str, "%*i |", label_width, v+1);
+	if (measure_point < 0 || measure_point >= ctx->num_ts-1)
+		return -1;
 
-	for (i = 0; i < ncol; i++) {
-		value = data[i*num_points+v]/scale;
-		len += sprintf(str+len, "%*.2f %*s |",
-		               VALUESTR_LEN, value,
-		               UNITSTR_LEN, unitname);
+	for (c = 0; c < MM_NELEM(counter_cols); c++) {
+		if (type != counter_cols[c].mask)
+			continue;
+
+		if (!is_counter_col_available(ctx, &counter_cols[c]))
+			return -1;
+
+		return get_counter_stat(ctx, &counter_cols[c], measure_point+1);
 	}
 
-	str[len++] = '\n';
-	return len;
+	// Validate input type (can be only one measure type, not
+	// combination of multiple flags)
+	switch (type) {
+	case PROF_CURR:
+	case PROF_MIN:
+	case PROF_MEAN:
+	case PROF_MAX:
+	case PROF_MEDIAN:
+	case PROF_P90:
+	case PROF_P99:
+	case PROF_P999:
+		break;
+
+	default:
+		return -1;
+	}
+
+	num_points = ctx->num_ts-1;
+	data = mm_malloca(num_points * sizeof(*data));
+	if (!data)
+		return -1;
+
+	mask = type|PROF_FORCE_NSEC;
+	compute_requested_timings(ctx, mask, num_points, data);
+	value = data[measure_point];
+	mm_freea(data);
+
+	return value;
 }
 
 
 /**
- * full_mm_write() - full write of buffer succeed or error is reported
- * @fd:         file descriptor to write to
- * @buf:        buffer to transfer
- * @len:        size of @buf
+ * mm_profile_ctx_reset() - Reset the statistics of a context
+ * @ctx:        profiling context
+ * @flags:	bit-OR combination of flags influencing the reset behavior.
  *
- * Return: 0 if full buffer has been written to @fd, -1 otherwise with error
- * state set accordingly
+ * Same as mm_profile_reset() but operates on @ctx.
  */
-static
-int full_mm_write(int fd, const void* buf, size_t len)
+API_EXPORTED
+void mm_profile_ctx_reset(struct mm_profile_ctx* ctx, int flags)
 {
-	const char* cbuf = buf;
-	ssize_t rsz;
+	int i;
 
-	while (len) {
-		rsz = mm_write(fd, cbuf, len);
-		if (rsz < 0)
-			return -1;
+	if (!(flags & PROF_RESET_PERFCNT))
+		perfcnt_close(&ctx->perfcnt);
+	else if (!ctx->perfcnt.num_open)
+		perfcnt_open(&ctx->perfcnt);
 
-		len -= rsz;
-		cbuf += rsz;
-	}
+	if (flags & PROF_RESET_CPUCLOCK)
+		ctx->clock_id = MM_CLK_CPU_PROCESS;
+	else if ((flags & PROF_RESET_TSC) && tsc_is_usable())
+		ctx->clock_id = CLK_TSC;
+	else
+		ctx->clock_id = MM_CLK_MONOTONIC;
 
-	return 0;
-}
+	// No slow iteration must be recorded during the calibration
+	ctx->slow_threshold = INT64_MAX;
 
+	estimate_toc_overhead(ctx);
+	reset_diffs(ctx);
+	reset_scope_tree(ctx);
+	update_slow_threshold(ctx);
+	ctx->num_slow = 0;
+
+	if (!(flags & PROF_RESET_KEEPLABEL)) {
+		for (i = 0; i < ctx->max_ts; i++)
+			ctx->points[i].label = NULL;
+	}
+}
 
-/**************************************************************************
- *                                                                        *
- *                           API implementation                           *
- *                                                                        *
- **************************************************************************/
 
 /**
  * mm_tic() - Start a iteration of profiling
@@ -553,6 +3239,11 @@ int full_mm_write(int fd, const void* buf, size_t len)
  * reset the metadata for a new timing iteration. Finally measure the
  * timestamp of the iteration start.
  *
+ * mm_tic(), mm_toc(), mm_toc_label(), mm_profile_print(),
+ * mm_profile_get_data() and mm_profile_reset() operate on a context
+ * private to the calling thread. Use a context created with
+ * mm_profile_ctx_create() if the measure must be shared between threads.
+ *
  * NOTE: Contrary to the usual API functions, mm_tic() uses the attribute
  * API_EXPORTED_RELOCATABLE. This is done on purpose. See NOTE of
  * estimate_toc_overhead().
@@ -560,10 +3251,7 @@ int full_mm_write(int fd, const void* buf, size_t len)
 API_EXPORTED_RELOCATABLE
 void mm_tic(void)
 {
-	update_diffs();
-	next_ts = 0;
-	num_iter++;
-	local_toc();
+	mm_profile_ctx_tic(get_thread_ctx());
 }
 
 
@@ -577,7 +3265,7 @@ void mm_tic(void)
 API_EXPORTED_RELOCATABLE
 void mm_toc(void)
 {
-	local_toc();
+	local_toc(get_thread_ctx());
 }
 
 
@@ -598,13 +3286,7 @@ void mm_toc(void)
 API_EXPORTED_RELOCATABLE
 void mm_toc_label(const char* label)
 {
-	// Copy label if it the first time to appear
-	if (!labels[next_ts]) {
-		labels[next_ts] = &label_storage[next_ts*MAX_LABEL_LEN];
-		strncpy(labels[next_ts], label, MAX_LABEL_LEN-1);
-	}
-
-	local_toc();
+	mm_profile_ctx_toc_label(get_thread_ctx(), label);
 }
 
 
@@ -622,11 +3304,28 @@ void mm_toc_label(const char* label)
  * - PROF_MIN:  display the min value since the last reset
  * - PROF_MAX:  display the max value since the last reset
  * - PROF_MEDIAN: display the median value since the last reset
+ * - PROF_P90: display the 90th percentile since the last reset
+ * - PROF_P99: display the 99th percentile since the last reset
+ * - PROF_P999: display the 99.9th percentile since the last reset
+ * - PROF_CYCLES: display the mean number of CPU cycles
+ * - PROF_INSTR: display the mean number of retired instructions
+ * - PROF_IPC: display the number of instructions per cycle
+ * - PROF_CACHE_MISS: display the mean number of cache misses
+ * - PROF_BRANCH_MISS: display the mean number of branch mispredictions
  * - PROF_FORCE_NSEC: force result display in nanoseconds
  * - PROF_FORCE_USEC: force result display in microseconds
  * - PROF_FORCE_MSEC: force result display in milliseconds
  * - PROF_FORCE_SEC: force result display in seconds
  *
+ * The hardware counter statistics (PROF_CYCLES, PROF_INSTR, PROF_IPC,
+ * PROF_CACHE_MISS and PROF_BRANCH_MISS) are displayed only if the counters
+ * have been enabled with PROF_RESET_PERFCNT and could be opened. Otherwise
+ * their columns are omitted and a note is printed after the table.
+ *
+ * There is no limit to the number of points of measure in an iteration. If
+ * the memory needed by additional points cannot be allocated however, those
+ * points are dropped and their number is printed after the table.
+ *
  * Returns: 0 in case of success, -1 otherwise with errno set accordingly
  *
  * See: mm_profile_reset(), mm_tic(), write()
@@ -634,72 +3333,208 @@ void mm_toc_label(const char* label)
 API_EXPORTED
 int mm_profile_print(int mask, int fd)
 {
-	int i, ncol, num_points, label_width, unit_index;
-	char str[512];
-	size_t len;
-	int64_t data[NUM_COL_MAX*NUM_TS_MAX];
+	return mm_profile_ctx_print(get_thread_ctx(), mask, fd);
+}
 
-	update_diffs();
 
-	label_width = max_label_len();
-	num_points = num_ts-1;
-	ncol = compute_requested_timings(mask, num_points, data);
-	unit_index = get_display_unit(ncol, num_points, data, mask);
+/**
+ * mm_profile_get_data - Retrieve profile result programmatically
+ * @measure_point:      measure point whose statistic must be get
+ * @type:               type of statistic (PROF_[CURR|MIN|MEAN|MAX|MEDIAN]
+ *                      or PROF_[P90|P99|P999])
+ *
+ * The percentiles (PROF_P90, PROF_P99 and PROF_P999) are estimated from a
+ * histogram of the timings, see mm_profile_ctx_set_precision().
+ *
+ * @type can also be one of the hardware counter statistics listed in
+ * mm_profile_print(). PROF_CYCLES, PROF_INSTR, PROF_CACHE_MISS and
+ * PROF_BRANCH_MISS return the mean count per iteration, PROF_IPC returns
+ * the number of instructions per cycle multiplied by 1000.
+ *
+ * Return: statistic value in nanosecond (or value of the counter
+ * statistic), -1 if @type is not valid or if the hardware counters are not
+ * available.
+ */
+API_EXPORTED
+int64_t mm_profile_get_data(int measure_point, int type)
+{
+	return mm_profile_ctx_get_data(get_thread_ctx(), measure_point, type);
+}
 
-	for (i = 0; i < num_ts; i++) {
-		if (i == 0)
-			len = format_header_line(mask, label_width, str);
-		else
-			len = format_result_line(ncol, num_points, i-1,
-			                         unit_index, label_width,
-			                         data, str);
 
+/**
+ * mm_profile_get_histogram() - get latency histogram of a measure point
+ * @measure_point:      measure point whose histogram must be get
+ * @buckets:            array receiving the non empty buckets
+ * @max_num:            number of element in @buckets
+ *
+ * Same as mm_profile_ctx_get_histogram() but operates on the context of
+ * the calling thread.
+ *
+ * Return: the number of non empty buckets in the histogram, -1 in case of
+ * error with error state set accordingly.
+ */
+API_EXPORTED
+int mm_profile_get_histogram(int measure_point,
+                             struct mm_profile_bucket* buckets, int max_num)
+{
+	return mm_profile_ctx_get_histogram(get_thread_ctx(), measure_point,
+	                                    buckets, max_num);
+}
 
-		// Write line to file
-		if (full_mm_write(fd, str, len))
-			return -1;
-	}
 
-	sprintf(str, "toc overhead = %li ns\n", (long)toc_overhead);
-	return full_mm_write(fd, str, strlen(str));
+/**
+ * mm_profile_enter() - Enter a profiled scope
+ * @label:      name of the scope
+ *
+ * Start the measure of a scope nested in the scope currently entered by
+ * the calling thread (if any). The scope ends at the matching call to
+ * mm_profile_leave(). The scopes form a call tree aggregating the calls of
+ * the same path of scopes: each node of the tree records the number of
+ * calls, the inclusive time (including the nested scopes) and exclusive
+ * time (excluding them) spent in the scope.
+ *
+ * The scopes are identified by the address of @label, not by its content:
+ * the same string (typically a literal) must be used at each call. Like
+ * mm_toc(), the measure uses the clock selected by mm_profile_reset() and
+ * the overhead of the measure is removed from the reported times.
+ *
+ * NOTE: Contrary to the usual API functions, mm_profile_enter() uses the
+ * attribute API_EXPORTED_RELOCATABLE. See NOTE of estimate_toc_overhead().
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_enter(const char* label)
+{
+	mm_profile_ctx_enter(get_thread_ctx(), label);
 }
 
 
 /**
- * mm_profile_get_data - Retrieve profile result programmatically
- * @measure_point:      measure point whose statistic must be get
- * @type:               type of statistic (PROF_[CURR|MIN|MEAN|MAX|MEDIAN])
+ * mm_profile_leave() - Leave the current profiled scope
+ *
+ * End the scope started by the last call to mm_profile_enter() not yet
+ * left by the calling thread. A call without matching mm_profile_enter()
+ * is ignored.
+ *
+ * NOTE: Contrary to the usual API functions, mm_profile_leave() uses the
+ * attribute API_EXPORTED_RELOCATABLE. See NOTE of estimate_toc_overhead().
+ */
+API_EXPORTED_RELOCATABLE
+void mm_profile_leave(void)
+{
+	mm_profile_ctx_leave(get_thread_ctx());
+}
+
+
+/**
+ * mm_profile_print_tree() - Print the call tree of scopes
+ * @mask:       combination of flags indicating statistics must be printed
+ * @fd:         file descriptor to which the tree must be printed
+ *
+ * Print the call tree of the scopes measured by the calling thread with
+ * mm_profile_enter() and mm_profile_leave(). Each line shows a scope,
+ * indented according to its nesting level, with its number of calls, its
+ * total inclusive time and its total exclusive time ("self"). Per call
+ * statistics of inclusive time can be added with the PROF_MEAN, PROF_MIN,
+ * PROF_MAX, PROF_MEDIAN, PROF_P90, PROF_P99 and PROF_P999 flags in @mask.
+ * The unit can be forced like in mm_profile_print().
  *
- * Return: statistic value in nanosecond
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
  */
 API_EXPORTED
-int64_t mm_profile_get_data(int measure_point, int type)
+int mm_profile_print_tree(int mask, int fd)
 {
-	int64_t data[NUM_TS_MAX];
-	int num_points, mask;
+	return mm_profile_ctx_print_tree(get_thread_ctx(), mask, fd);
+}
 
-	if (measure_point >= num_ts-1)
-		return -1;
 
-	// Validate input type (can be only one measure type, not
-	// combination of multiple flags)
-	switch (type) {
-	case PROF_CURR:
-	case PROF_MIN:
-	case PROF_MEAN:
-	case PROF_MAX:
-	case PROF_MEDIAN:
-		break;
+/**
+ * mm_profile_print_collapsed() - Print scopes in collapsed stack format
+ * @fd:         file descriptor to which the stacks must be printed
+ *
+ * Print the call tree of the scopes measured by the calling thread in the
+ * "collapsed stack" format read by flame graph tools (such as
+ * flamegraph.pl or speedscope): one line per scope made of the labels of
+ * the enclosing scopes separated by ';' followed by the total exclusive
+ * time in nanoseconds.
+ *
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
+ */
+API_EXPORTED
+int mm_profile_print_collapsed(int fd)
+{
+	return mm_profile_ctx_print_collapsed(get_thread_ctx(), fd);
+}
 
-	default:
-		return -1;
-	}
 
-	num_points = num_ts-1;
-	mask = type|PROF_FORCE_NSEC;
-	compute_requested_timings(mask, num_points, data);
+/**
+ * mm_profile_set_slow_threshold() - capture the iterations above a threshold
+ * @measure_point: measure point whose timing is checked, -1 to check the
+ *              duration of the whole iteration
+ * @threshold:  duration in ns above which an iteration is recorded, 0 to
+ *              disable the capture
+ *
+ * The mean, median or even p99 of a point of measure do not tell anything
+ * about the rare iteration which took much longer than the others. When a
+ * threshold is set, each iteration of the calling thread whose duration
+ * (or the timing of @measure_point) exceeds @threshold is recorded with
+ * the timings of all its points of measure, the time at which it ended and
+ * the thread which ran it. The last 32 slow iterations are kept and can be
+ * retrieved with mm_profile_get_slow_iters() or printed with
+ * mm_profile_print_slow(). Only the first PROF_SLOW_MAX_POINTS points of
+ * measure of an iteration are recorded.
+ *
+ * The check is done by mm_tic() when the iteration ends and costs a single
+ * comparison, whether the capture is enabled or not. Setting the threshold
+ * clears the slow iterations recorded so far, so does mm_profile_reset().
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_profile_set_slow_threshold(int measure_point, int64_t threshold)
+{
+	return mm_profile_ctx_set_slow_threshold(get_thread_ctx(),
+	                                         measure_point, threshold);
+}
+
+
+/**
+ * mm_profile_get_slow_iters() - get the iterations above the slow threshold
+ * @iters:      array receiving the slow iterations
+ * @max_num:    number of elements in @iters
+ *
+ * Copy in @iters the most recent slow iterations recorded in the calling
+ * thread (see mm_profile_set_slow_threshold()), the oldest first.
+ *
+ * Return: the number of slow iterations written in @iters.
+ */
+API_EXPORTED
+int mm_profile_get_slow_iters(struct mm_profile_slow_iter* iters, int max_num)
+{
+	return mm_profile_ctx_get_slow_iters(get_thread_ctx(), iters, max_num);
+}
 
-	return data[measure_point];
+
+/**
+ * mm_profile_print_slow() - Print the iterations above the slow threshold
+ * @mask:       PROF_FORCE_* flag to force the unit of the timings (0 to let
+ *              it adapt to the timings of each iteration)
+ * @fd:         file descriptor to which the iterations must be printed
+ *
+ * Print the number of slow iterations recorded in the calling thread since
+ * the threshold has been set (see mm_profile_set_slow_threshold()) and the
+ * timings of each point of measure of the most recent ones.
+ *
+ * Returns: 0 in case of success, -1 otherwise with error state set
+ * accordingly
+ */
+API_EXPORTED
+int mm_profile_print_slow(int mask, int fd)
+{
+	return mm_profile_ctx_print_slow(get_thread_ctx(), mask, fd);
 }
 
 
@@ -709,6 +3544,7 @@ int64_t mm_profile_get_data(int measure_point, int type)
  *
  * Reset the timing statistics, ie, reset the min, max, mean values as well
  * as the number of point used in one iteration and the associated labels.
+ * The call tree of scopes (see mm_profile_enter()) is also cleared.
  * Additionally it provides a ways to change the type of timer used for
  * measure.
  *
@@ -724,6 +3560,23 @@ int64_t mm_profile_get_data(int measure_point, int type)
  * nanoseconds) and report time spent at sleeping. The indicates the
  * realtime update will performing certain task.
  *
+ * If PROF_RESET_TSC is set (and PROF_RESET_CPUCLOCK is not), the timer
+ * will read directly the CPU timestamp counter. It measures the same time
+ * as the wall clock timer but the overhead of mm_toc() is much smaller
+ * (typically few nanoseconds instead of few tens), which matters when
+ * profiling very short sections. If the CPU does not provide an invariant
+ * timestamp counter, the wall clock timer is used instead.
+ *
+ * If PROF_RESET_PERFCNT is set, the hardware performance counters of the
+ * calling thread (cycles, instructions, cache misses and branch misses) are
+ * also read at each point of measure (with perf_event_open() on Linux), so
+ * that mm_profile_print() can report them per iteration. This increases the
+ * overhead of mm_toc() (a system call per measure if the counters cannot
+ * be read from userspace). The counters only account for the thread that
+ * called the reset. If they are not available, for example in a container
+ * or due to the kernel.perf_event_paranoid setting, the profiling proceeds
+ * without them. Resetting without PROF_RESET_PERFCNT releases them.
+ *
  * If the PROF_RESET_KEEPLABEL flag is set in the @flags argument, the
  * labels associated with each measure point will be kept over the reset.
  * In practice, this provides a way to avoid the overhead of of label copy
@@ -732,26 +3585,12 @@ int64_t mm_profile_get_data(int measure_point, int type)
  * label. Then the subsequent call to mm_toc_label() will not be affected by
  * the string copy overhead.
  *
- * At startup, the function are configured to use CPU based timer.
+ * At startup, the function are configured to use wall clock based timer.
  *
  * See: mm_profile_print(), mm_tic(), mm_toc_label()
  */
 API_EXPORTED
 void mm_profile_reset(int flags)
 {
-	unsigned int i;
-
-	if (flags & PROF_RESET_CPUCLOCK)
-		clock_id = MM_CLK_CPU_PROCESS;
-	else
-		clock_id = MM_CLK_MONOTONIC;
-
-	estimate_toc_overhead();
-	reset_diffs();
-
-	if (!(flags & PROF_RESET_KEEPLABEL)) {
-		labels[0] = label_storage;
-		for (i = 1; i < sizeof(labels)/sizeof(labels[0]); i++)
-			labels[i] = NULL;
-	}
+	mm_profile_ctx_reset(get_thread_ctx(), flags);
 }
@@ -0,0 +1,693 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for dladdr()
+#endif
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmerrno.h"
+#include "mmlib.h"
+#include "mmprofile.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "mmtime.h"
+
+#if !defined (_WIN32) && defined (HAVE_EXECINFO_H) && defined (HAVE_DLOPEN)
+#  define HAVE_SAMPLER  1
+#  include <dlfcn.h>
+#  include <errno.h>
+#  include <execinfo.h>
+#  include <signal.h>
+#  include <time.h>
+#  include <ucontext.h>
+#else
+#  define HAVE_SAMPLER  0
+#endif
+
+/**
+ * DOC:
+ * The sampling profiler arms a timer on the CPU time consumed by the
+ * process (CLOCK_PROCESS_CPUTIME_ID). At each expiration, SIGPROF is
+ * delivered to a thread of the process that is running and its handler
+ * records the backtrace of the interrupted code. Threads that sleep or
+ * wait are hence not sampled: the profile shows where the CPU time is
+ * spent.
+ *
+ * The signal handler can neither allocate nor lock: the samples are stored
+ * in a buffer allocated when the profiler starts, whose slots are claimed
+ * with an atomic increment. If the buffer is full, the samples are dropped
+ * and counted. The samples are aggregated by identical backtrace and
+ * symbolized only when the profiler is stopped.
+ */
+
+#define SAMPLE_MAX_DEPTH        64
+#define SAMPLE_SKIP_FRAMES      2       // handler and trampoline if no pc
+#define SAMPLE_NUM_DEFAULT      (32*1024)
+#define SAMPLE_FREQ_DEFAULT     99
+#define SAMPLE_FREQ_MAX         10000
+#define SEC_IN_NSEC             1000000000
+#define WRBUF_SIZE              4096
+#define SYMBOL_LEN              256
+
+#define MIN(a, b) ((a) <= (b) ? (a) : (b))
+
+/**
+ * struct sample - backtrace recorded at a timer expiration
+ * @depth:      number of frames in @pcs (0 if the sample is not complete)
+ * @pcs:        addresses of the frames, innermost first: the interrupted
+ *              instruction followed by the return addresses
+ */
+struct sample {
+	atomic_int depth;
+	void* pcs[SAMPLE_MAX_DEPTH];
+};
+
+
+#if HAVE_SAMPLER
+
+static mm_thr_mutex_t sampler_mtx = MM_THR_MUTEX_INITIALIZER;
+static timer_t sampler_timer;
+static struct sigaction prev_sigprof_action;
+static int sampler_freq;
+static struct sample* samples;
+static size_t num_samples;
+static atomic_size_t next_sample;
+static atomic_size_t num_dropped;
+static atomic_int sampler_running;
+static atomic_int num_active_handlers;
+
+
+/**
+ * get_interrupted_pc() - get the address of the interrupted instruction
+ * @context:    context passed to the signal handler
+ *
+ * Return: the program counter at the time of the signal, NULL if it cannot
+ * be read on this platform.
+ */
+static
+void* get_interrupted_pc(void* context)
+{
+	ucontext_t* uc = context;
+
+#if defined (__x86_64__) && defined (REG_RIP)
+	return (void*)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined (__i386__) && defined (REG_EIP)
+	return (void*)uc->uc_mcontext.gregs[REG_EIP];
+#elif defined (__aarch64__) && defined (__linux__)
+	return (void*)uc->uc_mcontext.pc;
+#else
+	(void)uc;
+	return NULL;
+#endif
+}
+
+
+/**
+ * get_first_frame() - get the frame of the interrupted code in a backtrace
+ * @pcs:        backtrace captured in the signal handler
+ * @depth:      number of frames in @pcs
+ * @pc:         interrupted instruction (NULL if unknown)
+ *
+ * The backtrace starts with the frames of the signal handler and of the
+ * signal trampoline (and possibly of an interceptor of backtrace() in
+ * instrumented builds): those must not appear in the profile.
+ *
+ * Return: the index of the frame of @pc in @pcs.
+ */
+static
+int get_first_frame(void* const * pcs, int depth, void* pc)
+{
+	int i;
+
+	for (i = 0; i < depth && pc; i++) {
+		if (pcs[i] == pc)
+			return i;
+	}
+
+	return SAMPLE_SKIP_FRAMES;
+}
+
+
+static
+void sigprof_handler(int signum, siginfo_t* info, void* context)
+{
+	struct sample* s;
+	size_t i;
+	int depth, first, saved_errno = errno;
+
+	(void)signum;
+	(void)info;
+
+	atomic_fetch_add(&num_active_handlers, 1);
+	if (!atomic_load(&sampler_running))
+		goto exit;
+
+	i = atomic_fetch_add_explicit(&next_sample, 1, memory_order_relaxed);
+	if (i >= num_samples) {
+		atomic_fetch_add_explicit(&num_dropped, 1, memory_order_relaxed);
+		goto exit;
+	}
+
+	s = &samples[i];
+	depth = backtrace(s->pcs, SAMPLE_MAX_DEPTH);
+	first = get_first_frame(s->pcs, depth, get_interrupted_pc(context));
+	if (first >= depth)
+		goto exit;
+
+	depth -= first;
+	memmove(s->pcs, s->pcs + first, depth * sizeof(s->pcs[0]));
+	atomic_store_explicit(&s->depth, depth, memory_order_release);
+
+exit:
+	atomic_fetch_sub(&num_active_handlers, 1);
+	errno = saved_errno;
+}
+
+
+static
+int start_sampling(int freq)
+{
+	struct sigaction sa;
+	struct sigevent sev;
+	struct itimerspec its;
+	void* dummy[1];
+
+	samples = calloc(SAMPLE_NUM_DEFAULT, sizeof(*samples));
+	if (!samples)
+		return mm_raise_from_errno("Cannot allocate sample buffer");
+
+	num_samples = SAMPLE_NUM_DEFAULT;
+	atomic_store(&next_sample, 0);
+	atomic_store(&num_dropped, 0);
+
+	// The first call to backtrace() may load libgcc, which must not
+	// happen in the signal handler
+	backtrace(dummy, 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sigprof_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, &prev_sigprof_action)) {
+		mm_raise_from_errno("Cannot install SIGPROF handler");
+		goto error;
+	}
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGPROF;
+	if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &sampler_timer)) {
+		mm_raise_from_errno("Cannot create sampling timer");
+		sigaction(SIGPROF, &prev_sigprof_action, NULL);
+		goto error;
+	}
+
+	sampler_freq = freq;
+	atomic_store(&sampler_running, 1);
+
+	its.it_interval.tv_sec = (SEC_IN_NSEC / freq) / SEC_IN_NSEC;
+	its.it_interval.tv_nsec = (SEC_IN_NSEC / freq) % SEC_IN_NSEC;
+	its.it_value = its.it_interval;
+	timer_settime(sampler_timer, 0, &its, NULL);
+
+	return 0;
+
+error:
+	free(samples);
+	samples = NULL;
+	return -1;
+}
+
+
+static
+void stop_sampling(void)
+{
+	atomic_store(&sampler_running, 0);
+	timer_delete(sampler_timer);
+
+	// Wait for the handlers that may still run in other threads
+	while (atomic_load(&num_active_handlers))
+		mm_relative_sleep_us(100);
+
+	sigaction(SIGPROF, &prev_sigprof_action, NULL);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                          Sample aggregation                            *
+ *                                                                        *
+ **************************************************************************/
+
+static
+int cmp_sample(const void* a, const void* b)
+{
+	const struct sample* sa = a;
+	const struct sample* sb = b;
+	int da = atomic_load_explicit(&sa->depth, memory_order_relaxed);
+	int db = atomic_load_explicit(&sb->depth, memory_order_relaxed);
+	int i;
+
+	if (da != db)
+		return da < db ? -1 : 1;
+
+	for (i = 0; i < da; i++) {
+		if (sa->pcs[i] != sb->pcs[i])
+			return (uintptr_t)sa->pcs[i] < (uintptr_t)sb->pcs[i]
+			       ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+static
+int get_depth(const struct sample* s)
+{
+	return atomic_load_explicit(&s->depth, memory_order_acquire);
+}
+
+
+/**
+ * struct wrbuf - output buffer of the serialization
+ * @fd:         file descriptor to which the data is written
+ * @len:        number of bytes pending in @data
+ * @err:        true if a write has failed
+ * @data:       pending data
+ */
+struct wrbuf {
+	int fd;
+	size_t len;
+	int err;
+	char data[WRBUF_SIZE];
+};
+
+
+static
+void wrbuf_flush(struct wrbuf* wr)
+{
+	const char* ptr = wr->data;
+	ssize_t rsz;
+
+	while (wr->len && !wr->err) {
+		rsz = mm_write(wr->fd, ptr, wr->len);
+		if (rsz < 0) {
+			wr->err = 1;
+			break;
+		}
+
+		ptr += rsz;
+		wr->len -= rsz;
+	}
+
+	wr->len = 0;
+}
+
+
+static
+void wrbuf_write(struct wrbuf* wr, const void* data, size_t len)
+{
+	const char* cdata = data;
+	size_t chunk;
+
+	while (len) {
+		if (wr->len == sizeof(wr->data))
+			wrbuf_flush(wr);
+
+		chunk = MIN(len, sizeof(wr->data) - wr->len);
+		memcpy(wr->data + wr->len, cdata, chunk);
+		wr->len += chunk;
+		cdata += chunk;
+		len -= chunk;
+	}
+}
+
+
+static
+void wrbuf_puts(struct wrbuf* wr, const char* str)
+{
+	wrbuf_write(wr, str, strlen(str));
+}
+
+
+/**
+ * format_frame() - get a printable name of a frame
+ * @pc:         address in the frame
+ * @is_leaf:    true if @pc is the interrupted instruction, false if it is a
+ *              return address
+ * @str:        output string of SYMBOL_LEN bytes
+ *
+ * The frame is named after the function symbol if found, after the module
+ * and offset otherwise. The characters that would break the collapsed
+ * stack format are replaced.
+ */
+static
+void format_frame(void* pc, int is_leaf, char str[])
+{
+	Dl_info info;
+	const char* module;
+	char* c;
+	// A return address may be past the end of the calling function
+	uintptr_t addr = (uintptr_t)pc - (is_leaf ? 0 : 1);
+
+	if (!dladdr((void*)addr, &info) || !info.dli_fname) {
+		snprintf(str, SYMBOL_LEN, "0x%"PRIxPTR, addr);
+	} else if (info.dli_sname) {
+		snprintf(str, SYMBOL_LEN, "%s", info.dli_sname);
+	} else {
+		module = strrchr(info.dli_fname, '/');
+		module = module ? module+1 : info.dli_fname;
+		snprintf(str, SYMBOL_LEN, "%s+0x%"PRIxPTR, module,
+		         addr - (uintptr_t)info.dli_fbase);
+	}
+
+	for (c = str; *c; c++) {
+		if (*c == ';' || *c == ' ' || *c == '\n')
+			*c = '_';
+	}
+}
+
+
+static
+void write_collapsed_stack(struct wrbuf* wr, const struct sample* s,
+                           size_t count)
+{
+	char str[SYMBOL_LEN];
+	int i, depth = get_depth(s);
+
+	// Root first
+	for (i = depth-1; i >= 0; i--) {
+		format_frame(s->pcs[i], i == 0, str);
+		wrbuf_puts(wr, str);
+		if (i != 0)
+			wrbuf_puts(wr, ";");
+	}
+
+	sprintf(str, " %zu\n", count);
+	wrbuf_puts(wr, str);
+}
+
+
+static
+void write_word(struct wrbuf* wr, uintptr_t word)
+{
+	wrbuf_write(wr, &word, sizeof(word));
+}
+
+
+static
+void write_pprof_stack(struct wrbuf* wr, const struct sample* s,
+                       size_t count)
+{
+	int i, depth = get_depth(s);
+
+	write_word(wr, count);
+	write_word(wr, depth);
+	for (i = 0; i < depth; i++)
+		write_word(wr, (uintptr_t)s->pcs[i]);
+}
+
+
+/**
+ * write_pprof_maps() - write the memory mappings of the process
+ * @wr:         output buffer
+ *
+ * The legacy pprof CPU profile ends with the content of /proc/self/maps,
+ * which is used to symbolize the addresses offline.
+ */
+static
+void write_pprof_maps(struct wrbuf* wr)
+{
+	char buf[1024];
+	ssize_t rsz;
+	int fd;
+
+	fd = mm_open("/proc/self/maps", O_RDONLY, 0);
+	if (fd < 0)
+		return;
+
+	while ((rsz = mm_read(fd, buf, sizeof(buf))) > 0)
+		wrbuf_write(wr, buf, rsz);
+
+	mm_close(fd);
+}
+
+
+/**
+ * write_profile() - aggregate and write the recorded samples
+ * @fd:         file descriptor to which the profile must be written
+ * @format:     PROF_SAMPLE_COLLAPSED or PROF_SAMPLE_PPROF
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int write_profile(int fd, int format)
+{
+	struct wrbuf* wr;
+	size_t first, num, count;
+	char str[64];
+	int rv = 0;
+
+	wr = malloc(sizeof(*wr));
+	if (!wr)
+		return mm_raise_from_errno("Cannot allocate output buffer");
+
+	wr->fd = fd;
+	wr->len = 0;
+	wr->err = 0;
+
+	num = MIN(atomic_load(&next_sample), num_samples);
+	qsort(samples, num, sizeof(*samples), cmp_sample);
+
+	if (format == PROF_SAMPLE_PPROF) {
+		// Header: 0, header size, version, period in us, padding
+		write_word(wr, 0);
+		write_word(wr, 3);
+		write_word(wr, 0);
+		write_word(wr, 1000000 / sampler_freq);
+		write_word(wr, 0);
+	}
+
+	for (first = 0; first < num; first += count) {
+		count = 1;
+		while (first + count < num
+		       && !cmp_sample(&samples[first], &samples[first+count]))
+			count++;
+
+		// Skip the samples whose backtrace could not be captured
+		if (!get_depth(&samples[first]))
+			continue;
+
+		if (format == PROF_SAMPLE_PPROF)
+			write_pprof_stack(wr, &samples[first], count);
+		else
+			write_collapsed_stack(wr, &samples[first], count);
+	}
+
+	if (format == PROF_SAMPLE_PPROF) {
+		// Trailer: a record of 1 sample with a single 0 frame
+		write_word(wr, 0);
+		write_word(wr, 1);
+		write_word(wr, 0);
+		write_pprof_maps(wr);
+	} else if (atomic_load(&num_dropped)) {
+		sprintf(str, "[dropped samples] %zu\n", atomic_load(&num_dropped));
+		wrbuf_puts(wr, str);
+	}
+
+	wrbuf_flush(wr);
+	if (wr->err)
+		rv = mm_raise_from_errno("Cannot write sampling profile");
+
+	free(wr);
+	return rv;
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Start from environment                            *
+ *                                                                        *
+ **************************************************************************/
+
+static char* env_output_path;
+
+
+MM_CONSTRUCTOR(sampler_from_env)
+{
+	const char* path;
+	const char* freqstr;
+	int freq = SAMPLE_FREQ_DEFAULT;
+
+	path = getenv("MM_PROFILE_SAMPLE");
+	if (!path || !path[0])
+		return;
+
+	freqstr = getenv("MM_PROFILE_SAMPLE_FREQ");
+	if (freqstr)
+		freq = atoi(freqstr);
+
+	env_output_path = strdup(path);
+	if (!env_output_path
+	    || mm_profile_sample_start(freq)) {
+		free(env_output_path);
+		env_output_path = NULL;
+		mm_print_lasterror("Cannot start sampling profiler");
+	}
+}
+
+
+MM_DESTRUCTOR(sampler_from_env)
+{
+	const char* ext;
+	int fd, format = PROF_SAMPLE_COLLAPSED;
+
+	if (!env_output_path)
+		return;
+
+	ext = strrchr(env_output_path, '.');
+	if (ext && (!strcmp(ext, ".prof") || !strcmp(ext, ".pprof")))
+		format = PROF_SAMPLE_PPROF;
+
+	fd = mm_open(env_output_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0 || mm_profile_sample_stop(fd, format))
+		mm_print_lasterror("Cannot write sampling profile");
+
+	if (fd >= 0)
+		mm_close(fd);
+	free(env_output_path);
+	env_output_path = NULL;
+}
+
+#endif /* HAVE_SAMPLER */
+
+
+/**************************************************************************
+ *                                                                        *
+ *                               API                                      *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_profile_sample_start() - start the sampling profiler
+ * @freq:       number of samples per second of CPU time (0 for default)
+ *
+ * Start recording periodically the backtrace of the code being executed by
+ * the process, without requiring any instrumentation. The samples are
+ * taken @freq times per second of CPU time consumed by the process (99 if
+ * @freq is 0), in whatever thread is running. They are aggregated and
+ * written when the profiler is stopped with mm_profile_sample_stop().
+ *
+ * The profiler installs a handler of SIGPROF: the application must not use
+ * this signal while profiling. Up to 32768 samples are kept, the next ones
+ * are dropped.
+ *
+ * The profiler can also be started without modifying the application by
+ * setting the environment variable MM_PROFILE_SAMPLE to the path of a file.
+ * The profiling then starts when mmlib is loaded and the profile is
+ * written in the file when the process exits, in pprof format if the file
+ * name ends with ".prof" or ".pprof", in collapsed stack format otherwise.
+ * The frequency can be set with MM_PROFILE_SAMPLE_FREQ.
+ *
+ * This is only supported on platforms providing backtrace() (such as
+ * glibc).
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_profile_sample_start(int freq)
+{
+#if HAVE_SAMPLER
+	int rv;
+
+	if (freq == 0)
+		freq = SAMPLE_FREQ_DEFAULT;
+
+	if (freq < 0 || freq > SAMPLE_FREQ_MAX)
+		return mm_raise_error(EINVAL, "Invalid sampling frequency (%i), "
+		                      "must be between 1 and %i",
+		                      freq, SAMPLE_FREQ_MAX);
+
+	mm_thr_mutex_lock(&sampler_mtx);
+
+	if (samples)
+		rv = mm_raise_error(EALREADY, "Sampling profiler already "
+		                    "started");
+	else
+		rv = start_sampling(freq);
+
+	mm_thr_mutex_unlock(&sampler_mtx);
+	return rv;
+#else
+	(void)freq;
+	return mm_raise_error(ENOTSUP, "Sampling profiler not supported on "
+	                      "this platform");
+#endif
+}
+
+
+/**
+ * mm_profile_sample_stop() - stop the sampling profiler and write profile
+ * @fd:         file descriptor to which the profile must be written
+ * @format:     format of the profile
+ *
+ * Stop the profiler started by mm_profile_sample_start() and write the
+ * samples recorded on @fd, aggregated by identical backtrace. @format can
+ * be one of:
+ *
+ * - PROF_SAMPLE_COLLAPSED: one line per backtrace made of the names of the
+ *   functions from the outermost to the innermost separated by ';'
+ *   followed by the number of samples. This is the format read by flame
+ *   graph tools (flamegraph.pl, speedscope...). The function names are the
+ *   ones of the dynamic symbol table: the executable must be linked with
+ *   -rdynamic for its functions to be named.
+ * - PROF_SAMPLE_PPROF: legacy binary CPU profile of gperftools, readable by
+ *   pprof which symbolizes the addresses with the debug information of the
+ *   binaries.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_profile_sample_stop(int fd, int format)
+{
+#if HAVE_SAMPLER
+	int rv;
+
+	if (format != PROF_SAMPLE_COLLAPSED && format != PROF_SAMPLE_PPROF)
+		return mm_raise_error(EINVAL, "Invalid profile format (%i)",
+		                      format);
+
+	mm_thr_mutex_lock(&sampler_mtx);
+
+	if (!samples) {
+		rv = mm_raise_error(EINVAL, "Sampling profiler not started");
+	} else {
+		stop_sampling();
+		rv = write_profile(fd, format);
+		free(samples);
+		samples = NULL;
+	}
+
+	mm_thr_mutex_unlock(&sampler_mtx);
+	return rv;
+#else
+	(void)fd;
+	(void)format;
+	return mm_raise_error(ENOTSUP, "Sampling profiler not supported on "
+	                      "this platform");
+#endif
+}
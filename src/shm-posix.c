@@ -5,8 +5,14 @@
 # include <config.h>
 #endif
 
+// Needed for MAP_ANONYMOUS, MAP_NORESERVE and MADV_FREE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "mmsysio.h"
 #include "mmerrno.h"
+#include "alloc-internal.h"
 #include "utils-posix.h"
 
 #include <sys/mman.h>
@@ -30,10 +36,17 @@
  * struct map_entry - memory map entry
  * @ptr:        starting address of mapping
  * @len:        length of mapping
+ * @mflags:     flags used to create the mapping
+ * @is_anon:    true if mapping has been created by mm_map_anon()
+ *
+ * If the mapping has been created with MM_MAP_GUARD, @ptr and @len
+ * describe the usable part of the mapping only, ie, without the guard pages.
  */
 struct map_entry {
 	void* ptr;
 	size_t len;
+	int mflags;
+	bool is_anon;
 };
 
 
@@ -62,7 +75,7 @@ struct mapping_list {
 static
 void mapping_list_cleanup(struct mapping_list* list)
 {
-	free(list->entries);
+	site_free(list->entries);
 
 	list->num_entries = 0;
 	list->num_max_entries = 0;
@@ -72,14 +85,15 @@ void mapping_list_cleanup(struct mapping_list* list)
 /**
  * mapping_list_add_entry() - register a new map entry in mapping list
  * @list:       mapping list to modify
- * @ptr:        starting address of mapping
- * @len:        length of mapping
+ * @new_entry:  map entry to register
  *
  * Return: 0 in case of success, -1 otherwise with error state set
  */
 static
-int mapping_list_add_entry(struct mapping_list* list, void* ptr, size_t len)
+int mapping_list_add_entry(struct mapping_list* list,
+                           const struct map_entry* new_entry)
 {
+	static struct alloc_site site = ALLOC_SITE_INIT("mapping list");
 	int retval = 0;
 	int num_max;
 	struct map_entry* entries;
@@ -97,7 +111,8 @@ int mapping_list_add_entry(struct mapping_list* list, void* ptr, size_t len)
 		else
 			num_max *= 2;
 
-		entries = realloc(entries, num_max*sizeof(*entries));
+		entries = site_realloc(&site, entries, SITE_MALLOC_ALIGN,
+		                       num_max*sizeof(*entries));
 		if (!entries) {
 			mm_raise_from_errno("Can't allocate mapping list");
 			retval = -1;
@@ -110,8 +125,7 @@ int mapping_list_add_entry(struct mapping_list* list, void* ptr, size_t len)
 
 	// Add mapping block to the mapping list
 	entry = &entries[list->num_entries++];
-	entry->ptr = ptr;
-	entry->len = len;
+	*entry = *new_entry;
 
 exit:
 	pthread_mutex_unlock(&list->mtx);
@@ -124,16 +138,16 @@ exit:
  * mapping_list_remove_entry() - unregister a map entry from mapping list
  * @list:       mapping list to modify
  * @ptr:        starting address of mapping to remove
+ * @removed:    location receiving the removed entry
  *
- * Return: A non negative integer corresponding to the size of the mapping
- * in case of success, -1 otherwise with error state set
+ * Return: 0 in case of success, -1 otherwise with error state set
  */
 static
-ssize_t mapping_list_remove_entry(struct mapping_list* list, void* ptr)
+int mapping_list_remove_entry(struct mapping_list* list, void* ptr,
+                              struct map_entry* removed)
 {
 	int i;
 	bool found;
-	size_t mapping_size = -1;
 	struct map_entry* entries;
 
 	pthread_mutex_lock(&list->mtx);
@@ -154,7 +168,7 @@ ssize_t mapping_list_remove_entry(struct mapping_list* list, void* ptr)
 		goto exit;
 
 	// Remove mapping for list
-	mapping_size = entries[i].len;
+	*removed = entries[i];
 	memmove(entries + i, entries + i+1,
 	        (list->num_entries-i-1)*sizeof(*entries));
 	list->num_entries--;
@@ -167,7 +181,45 @@ exit:
 		return -1;
 	}
 
-	return mapping_size;
+	return 0;
+}
+
+
+/**
+ * mapping_list_find_range() - find the map entry containing a memory range
+ * @list:       mapping list to search
+ * @ptr:        starting address of the memory range
+ * @len:        length of the memory range
+ * @found:      location receiving the entry containing the range
+ *
+ * Return: 0 if the range is entirely contained in a mapping, -1 otherwise
+ */
+static
+int mapping_list_find_range(struct mapping_list* list, const void* ptr,
+                            size_t len, struct map_entry* found)
+{
+	int i, rv = -1;
+	const char* start = ptr;
+	const char* entry_start;
+	struct map_entry* entries;
+
+	pthread_mutex_lock(&list->mtx);
+
+	entries = list->entries;
+	for (i = 0; i < list->num_entries; i++) {
+		entry_start = entries[i].ptr;
+		if (start >= entry_start
+		    && (size_t)(start - entry_start) <= entries[i].len
+		    && len <= entries[i].len - (size_t)(start - entry_start)) {
+			*found = entries[i];
+			rv = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&list->mtx);
+
+	return rv;
 }
 
 
@@ -184,29 +236,52 @@ MM_DESTRUCTOR(mapping_cleanup)
 
 /**
  * mapblock_add() - register a memory mapping in global mapping list
- * @ptr:        starting address of mapping
- * @len:        length of mapping
+ * @entry:      description of the mapping
  *
  * Return: 0 in case of success, -1 otherwise with error state set
  */
 static
-int mapblock_add(void* ptr, size_t len)
+int mapblock_add(const struct map_entry* entry)
 {
-	return mapping_list_add_entry(&file_mapping_list, ptr, len);
+	return mapping_list_add_entry(&file_mapping_list, entry);
 }
 
 
 /**
  * mapblock_remove() - Remove a mapping from global mapping list
  * @ptr:        starting address of mapping to remove
+ * @removed:    location receiving the description of the removed mapping
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int mapblock_remove(void* ptr, struct map_entry* removed)
+{
+	return mapping_list_remove_entry(&file_mapping_list, ptr, removed);
+}
+
+
+/**
+ * mapblock_find_anon() - get the anonymous mapping containing a range
+ * @ptr:        starting address of the range, must be page aligned
+ * @len:        length of the range
+ * @entry:      location receiving the description of the mapping
  *
- * Return: A non negative integer corresponding to the size of the mapping
- * in case of success, -1 otherwise with error state set
+ * Return: 0 in case of success, -1 otherwise with error state set
  */
 static
-ssize_t mapblock_remove(void* ptr)
+int mapblock_find_anon(void* ptr, size_t len, struct map_entry* entry)
 {
-	return mapping_list_remove_entry(&file_mapping_list, ptr);
+	if ((uintptr_t)ptr & (get_system_pagesize()-1))
+		return mm_raise_error(EINVAL, "%p is not page aligned", ptr);
+
+	if (mapping_list_find_range(&file_mapping_list, ptr, len, entry)
+	    || !entry->is_anon)
+		return mm_raise_error(EFAULT, "[%p, %p) is not in a mapping "
+		                      "created by mm_map_anon()",
+		                      ptr, (char*)ptr + len);
+
+	return 0;
 }
 
 /**************************************************************************
@@ -295,6 +370,9 @@ int get_mmap_flags(int mflags)
  * MM_MAP_RDWR
  *   alias to MM_MAP_READ|MM_MAP_WRITE
  *
+ * MM_MAP_GUARD is only supported by mm_map_anon(): mm_mapfile() fails with
+ * EINVAL if it is set.
+ *
  * The mm_mapfile() function adds an extra reference to the file associated
  * with the file descriptor @fd which is not removed by a subsequent
  * mm_close() on that file descriptor. This reference will be removed when
@@ -309,9 +387,15 @@ int get_mmap_flags(int mflags)
 API_EXPORTED
 void* mm_mapfile(int fd, mm_off_t offset, size_t len, int mflags)
 {
+	struct map_entry entry;
 	int prot, flags;
 	void* addr;
 
+	if (mflags & MM_MAP_GUARD) {
+		mm_raise_error(EINVAL, "Guard pages need anonymous mapping");
+		return NULL;
+	}
+
 	prot = get_mmap_prot(mflags);
 	flags = get_mmap_flags(mflags);
 
@@ -322,7 +406,8 @@ void* mm_mapfile(int fd, mm_off_t offset, size_t len, int mflags)
 	}
 
 	// Register memory mapping
-	if (mapblock_add(addr, len)) {
+	entry = (struct map_entry) {.ptr = addr, .len = len, .mflags = mflags};
+	if (mapblock_add(&entry)) {
 		munmap(addr, len);
 		return NULL;
 	}
@@ -336,25 +421,35 @@ void* mm_mapfile(int fd, mm_off_t offset, size_t len, int mflags)
  * @addr:       starting address of memory block to unmap
  *
  * Remove a memory mapping previously established. @addr must be NULL or must
- * have been returned by a successful call to mm_mapfile(). If @addr is NULL,
- * mm_unmap() do nothing.
+ * have been returned by a successful call to mm_mapfile() or mm_map_anon().
+ * If @addr is NULL, mm_unmap() do nothing.
  *
  * Return: 0 in case of success, -1 otherwise with error state set.
  */
 API_EXPORTED
 int mm_unmap(void* addr)
 {
-	ssize_t len;
+	struct map_entry entry;
+	size_t pgsz;
+	char* start;
+	size_t len;
 
 	if (!addr)
 		return 0;
 
 	// Get memory mapping, retrieve its size and forget it.
-	len = mapblock_remove(addr);
-	if (len < 0)
+	if (mapblock_remove(addr, &entry))
 		return -1;
 
-	if (munmap(addr, len)) {
+	start = entry.ptr;
+	len = entry.len;
+	if (entry.is_anon && (entry.mflags & MM_MAP_GUARD)) {
+		pgsz = get_system_pagesize();
+		start -= pgsz;
+		len += 2*pgsz;
+	}
+
+	if (munmap(start, len)) {
 		mm_raise_from_errno("munmap failed");
 		return -1;
 	}
@@ -363,6 +458,175 @@ int mm_unmap(void* addr)
 }
 
 
+/**
+ * mm_map_anon() - map anonymous memory
+ * @len:        length of the mapping
+ * @mflags:     control how the mapping is done
+ *
+ * The mm_map_anon() function establishes a private mapping of @len bytes
+ * that is not backed by any file. This is suitable for large buffers that
+ * must be returned to the system independently from the heap. The memory
+ * is initialized to zero.
+ *
+ * @mflags can contain a OR-combination of the following flags :
+ *
+ * MM_MAP_READ, MM_MAP_WRITE, MM_MAP_EXEC, MM_MAP_RDWR
+ *   Access permitted to the mapped pages (see mm_mapfile())
+ * MM_MAP_GUARD
+ *   An inaccessible page is placed before and after the mapping so that
+ *   any underflow or overflow of the buffer faults immediately.
+ * MM_MAP_LAZY
+ *   Only the address space is reserved: no memory is committed and the
+ *   pages are inaccessible until mm_map_recommit() is called on them. This
+ *   allows one to reserve a large contiguous region and to commit it
+ *   progressively.
+ *
+ * The mapping must be released with mm_unmap(). The physical memory used by
+ * a part of the mapping can be returned to the system with
+ * mm_map_decommit().
+ *
+ * Return: The starting address of the mapping in case of success.
+ * Otherwise NULL is returned and error state is set accordingly.
+ */
+API_EXPORTED
+void* mm_map_anon(size_t len, int mflags)
+{
+	struct map_entry entry;
+	size_t pgsz, maplen, guardlen;
+	int prot, flags;
+	char* base;
+	char* addr;
+
+	if (mflags & ~(MM_MAP_RDWR|MM_MAP_EXEC|MM_MAP_GUARD|MM_MAP_LAZY)) {
+		mm_raise_error(EINVAL, "Invalid flags (0x%08x)", mflags);
+		return NULL;
+	}
+
+	pgsz = get_system_pagesize();
+	guardlen = (mflags & MM_MAP_GUARD) ? pgsz : 0;
+	len = (len + pgsz-1) & ~(pgsz-1);
+	maplen = len + 2*guardlen;
+	if (len == 0 || maplen < len) {
+		mm_raise_error(EINVAL, "Invalid length");
+		return NULL;
+	}
+
+	prot = get_mmap_prot(mflags);
+	flags = MAP_PRIVATE|MAP_ANONYMOUS;
+	if (mflags & MM_MAP_LAZY) {
+		prot = PROT_NONE;
+		flags |= MAP_NORESERVE;
+	}
+
+	// With guard pages, map everything inaccessible and open the middle
+	base = mmap(NULL, maplen, guardlen ? PROT_NONE : prot, flags, -1, 0);
+	if (base == MAP_FAILED) {
+		mm_raise_from_errno("mmap failed");
+		return NULL;
+	}
+
+	addr = base + guardlen;
+	if (guardlen && prot != PROT_NONE && mprotect(addr, len, prot)) {
+		mm_raise_from_errno("mprotect failed");
+		goto error;
+	}
+
+	entry = (struct map_entry) {
+		.ptr = addr,
+		.len = len,
+		.mflags = mflags,
+		.is_anon = true,
+	};
+	if (mapblock_add(&entry))
+		goto error;
+
+	return addr;
+
+error:
+	munmap(base, maplen);
+	return NULL;
+}
+
+
+/**
+ * mm_map_decommit() - release physical memory of anonymous mapping
+ * @addr:       starting address of the range, must be page aligned
+ * @len:        length of the range
+ * @flags:      0 or MM_MAP_DECOMMIT_DEFER
+ *
+ * This function returns to the system the physical memory backing the
+ * pages of [@addr, @addr+@len), which must be included in a mapping created
+ * by mm_map_anon(). The address range stays reserved, but its content is
+ * lost. The range must be recommitted with mm_map_recommit() before being
+ * accessed again.
+ *
+ * If @flags contains MM_MAP_DECOMMIT_DEFER, the pages are only marked as
+ * reclaimable: the system frees them when it runs low on memory only. This
+ * is cheaper if the range is likely to be reused soon, but the resident
+ * memory of the process does not decrease immediately.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set.
+ */
+API_EXPORTED
+int mm_map_decommit(void* addr, size_t len, int flags)
+{
+	struct map_entry entry;
+	int advice = MADV_DONTNEED;
+
+	if (flags & ~MM_MAP_DECOMMIT_DEFER)
+		return mm_raise_error(EINVAL, "Invalid flags (0x%08x)", flags);
+
+	if (mapblock_find_anon(addr, len, &entry))
+		return -1;
+
+#ifdef MADV_FREE
+	if (flags & MM_MAP_DECOMMIT_DEFER)
+		advice = MADV_FREE;
+#endif
+
+	if (madvise(addr, len, advice)) {
+		// MADV_FREE is not supported before Linux 4.5
+		if (errno != EINVAL || advice == MADV_DONTNEED
+		    || madvise(addr, len, MADV_DONTNEED))
+			return mm_raise_from_errno("madvise failed");
+	}
+
+	return 0;
+}
+
+
+/**
+ * mm_map_recommit() - commit memory of anonymous mapping
+ * @addr:       starting address of the range, must be page aligned
+ * @len:        length of the range
+ *
+ * This function makes accessible the pages of [@addr, @addr+@len), which
+ * must be included in a mapping created by mm_map_anon(), with the access
+ * permission requested at the creation of the mapping. This must be called
+ * on the range reserved with MM_MAP_LAZY or decommitted with
+ * mm_map_decommit() before accessing it. The pages of a range that was
+ * decommitted are initialized to zero, unless they were decommitted with
+ * MM_MAP_DECOMMIT_DEFER and have not been reclaimed yet by the system: in
+ * such a case they may hold their former content.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set.
+ */
+API_EXPORTED
+int mm_map_recommit(void* addr, size_t len)
+{
+	struct map_entry entry;
+
+	if (mapblock_find_anon(addr, len, &entry))
+		return -1;
+
+	// Pages are committed on demand by the kernel, only protection matters
+	if (mprotect(addr, len, get_mmap_prot(entry.mflags)))
+		return mm_raise_from_errno("mprotect failed");
+
+	return 0;
+}
+
+
 /**
  * mm_anon_shm() - Creates an anonymous memory object
  *
@@ -8,6 +8,7 @@
 #include "mmsysio.h"
 #include "mmlib.h"
 #include "mmerrno.h"
+#include "alloc-internal.h"
 
 #include <windows.h>
 #include <io.h>
@@ -68,6 +69,11 @@ void* mm_mapfile(int fd, mm_off_t offset, size_t len, int mflags)
 	struct mm_stat stat;
 	void* ptr;
 
+	if (mflags & MM_MAP_GUARD) {
+		mm_raise_error(EINVAL, "Guard pages need anonymous mapping");
+		return NULL;
+	}
+
 	if (unwrap_handle_from_fd(&hfile, fd))
 		return NULL;
 
@@ -107,13 +113,166 @@ void* mm_mapfile(int fd, mm_off_t offset, size_t len, int mflags)
 }
 
 
+/**************************************************************************
+ *                                                                        *
+ *                     tracking of anonymous mappings                     *
+ *                                                                        *
+ **************************************************************************/
+#define MIN_NUM_ANON_ENTRIES    16
+
+/**
+ * struct anon_entry - mapping created by mm_map_anon()
+ * @base:       base of the region reserved by VirtualAlloc() (including the
+ *              guard page if any)
+ * @ptr:        starting address of the usable part of the mapping
+ * @len:        length of the usable part of the mapping
+ * @protect:    page protection of the committed pages
+ */
+struct anon_entry {
+	char* base;
+	char* ptr;
+	size_t len;
+	DWORD protect;
+};
+
+
+/**
+ * struct anon_list - list of the mappings created by mm_map_anon()
+ * @num_entries: number of mappings in @entries
+ * @num_max:    length of allocated @entries array
+ * @lock:       lock protecting the list update
+ * @entries:    array of @num_entries mappings
+ */
+struct anon_list {
+	int num_entries;
+	int num_max;
+	SRWLOCK lock;
+	struct anon_entry* entries;
+};
+
+static struct anon_list anon_list = {.lock = SRWLOCK_INIT};
+
+
+/**
+ * anon_list_add() - register a mapping created by mm_map_anon()
+ * @new_entry:  mapping to register
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ */
+static
+int anon_list_add(const struct anon_entry* new_entry)
+{
+	static struct alloc_site site = ALLOC_SITE_INIT("anon mapping list");
+	struct anon_list* list = &anon_list;
+	struct anon_entry* entries;
+	int nmax, retval = 0;
+
+	AcquireSRWLockExclusive(&list->lock);
+
+	if (list->num_entries >= list->num_max) {
+		nmax = list->num_max ? 2*list->num_max : MIN_NUM_ANON_ENTRIES;
+		entries = site_realloc(&site, list->entries, SITE_MALLOC_ALIGN,
+		                       nmax*sizeof(*entries));
+		if (!entries) {
+			retval = mm_raise_from_errno("Can't allocate mapping "
+			                             "list");
+			goto exit;
+		}
+
+		list->entries = entries;
+		list->num_max = nmax;
+	}
+
+	list->entries[list->num_entries++] = *new_entry;
+
+exit:
+	ReleaseSRWLockExclusive(&list->lock);
+	return retval;
+}
+
+
+/**
+ * anon_list_remove() - unregister a mapping created by mm_map_anon()
+ * @ptr:        starting address of the mapping
+ * @removed:    location receiving the removed mapping
+ *
+ * Return: 0 if @ptr was returned by mm_map_anon(), -1 otherwise
+ */
+static
+int anon_list_remove(const void* ptr, struct anon_entry* removed)
+{
+	struct anon_list* list = &anon_list;
+	int i, retval = -1;
+
+	AcquireSRWLockExclusive(&list->lock);
+
+	for (i = 0; i < list->num_entries; i++) {
+		if (list->entries[i].ptr != ptr)
+			continue;
+
+		*removed = list->entries[i];
+		list->entries[i] = list->entries[--list->num_entries];
+		retval = 0;
+		break;
+	}
+
+	ReleaseSRWLockExclusive(&list->lock);
+	return retval;
+}
+
+
+/**
+ * anon_list_find_range() - find the mapping containing a memory range
+ * @ptr:        starting address of the memory range
+ * @len:        length of the memory range
+ * @found:      location receiving the mapping containing the range
+ *
+ * Return: 0 if the range is entirely contained in a mapping created by
+ * mm_map_anon(), -1 otherwise
+ */
+static
+int anon_list_find_range(const void* ptr, size_t len,
+                         struct anon_entry* found)
+{
+	struct anon_list* list = &anon_list;
+	const struct anon_entry* entry;
+	const char* start = ptr;
+	int i, retval = -1;
+
+	AcquireSRWLockShared(&list->lock);
+
+	for (i = 0; i < list->num_entries; i++) {
+		entry = &list->entries[i];
+		if (start >= entry->ptr
+		    && len <= entry->len
+		    && (size_t)(start - entry->ptr) <= entry->len - len) {
+			*found = *entry;
+			retval = 0;
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&list->lock);
+	return retval;
+}
+
+
 /* doc in posix implementation */
 API_EXPORTED
 int mm_unmap(void* addr)
 {
+	struct anon_entry entry;
+
 	if (!addr)
 		return 0;
 
+	if (!anon_list_remove(addr, &entry)) {
+		if (!VirtualFree(entry.base, 0, MEM_RELEASE))
+			return mm_raise_from_w32err("VirtualFree failed");
+
+		return 0;
+	}
+
 	if (!UnmapViewOfFile(addr))
 		return mm_raise_from_w32err("UnmapViewOfFile failed");
 
@@ -121,6 +280,131 @@ int mm_unmap(void* addr)
 }
 
 
+static
+DWORD get_win32_anon_protect(int mflags)
+{
+	DWORD protect = PAGE_NOACCESS;
+
+	if (mflags & MM_MAP_READ)
+		protect = PAGE_READONLY;
+
+	if (mflags & MM_MAP_WRITE)
+		protect = PAGE_READWRITE;
+
+	if (mflags & MM_MAP_EXEC)
+		protect = (protect == PAGE_NOACCESS) ? PAGE_EXECUTE : protect << 4;
+
+	return protect;
+}
+
+
+/* doc in posix implementation */
+API_EXPORTED
+void* mm_map_anon(size_t len, int mflags)
+{
+	struct anon_entry entry;
+	size_t pgsz, maplen, guardlen;
+	DWORD protect;
+	char* base;
+	char* addr;
+
+	if (mflags & ~(MM_MAP_RDWR|MM_MAP_EXEC|MM_MAP_GUARD|MM_MAP_LAZY)) {
+		mm_raise_error(EINVAL, "Invalid flags (0x%08x)", mflags);
+		return NULL;
+	}
+
+	pgsz = get_system_pagesize();
+	guardlen = (mflags & MM_MAP_GUARD) ? pgsz : 0;
+	len = (len + pgsz-1) & ~(pgsz-1);
+	maplen = len + 2*guardlen;
+	if (len == 0 || maplen < len) {
+		mm_raise_error(EINVAL, "Invalid length");
+		return NULL;
+	}
+
+	// The protection set at reservation is used later by recommit
+	protect = get_win32_anon_protect(mflags);
+	base = VirtualAlloc(NULL, maplen, MEM_RESERVE, protect);
+	if (!base) {
+		mm_raise_from_w32err("VirtualAlloc failed");
+		return NULL;
+	}
+
+	// Guard pages are left reserved only, hence inaccessible
+	addr = base + guardlen;
+	if (!(mflags & MM_MAP_LAZY)
+	    && !VirtualAlloc(addr, len, MEM_COMMIT, protect)) {
+		mm_raise_from_w32err("VirtualAlloc failed");
+		goto error;
+	}
+
+	entry = (struct anon_entry) {
+		.base = base,
+		.ptr = addr,
+		.len = len,
+		.protect = protect,
+	};
+	if (anon_list_add(&entry))
+		goto error;
+
+	return addr;
+
+error:
+	VirtualFree(base, 0, MEM_RELEASE);
+	return NULL;
+}
+
+
+/* doc in posix implementation */
+API_EXPORTED
+int mm_map_decommit(void* addr, size_t len, int flags)
+{
+	struct anon_entry entry;
+
+	if (flags & ~MM_MAP_DECOMMIT_DEFER)
+		return mm_raise_error(EINVAL, "Invalid flags (0x%08x)", flags);
+
+	if ((uintptr_t)addr & (get_system_pagesize()-1))
+		return mm_raise_error(EINVAL, "%p is not page aligned", addr);
+
+	if (anon_list_find_range(addr, len, &entry))
+		return mm_raise_error(EFAULT, "%p is not in a mapping created "
+		                      "by mm_map_anon()", addr);
+
+	if (flags & MM_MAP_DECOMMIT_DEFER) {
+		// MEM_RESET keeps pages committed but their content can be
+		// discarded instead of being written to the paging file
+		if (!VirtualAlloc(addr, len, MEM_RESET, PAGE_NOACCESS))
+			return mm_raise_from_w32err("VirtualAlloc failed");
+	} else {
+		if (!VirtualFree(addr, len, MEM_DECOMMIT))
+			return mm_raise_from_w32err("VirtualFree failed");
+	}
+
+	return 0;
+}
+
+
+/* doc in posix implementation */
+API_EXPORTED
+int mm_map_recommit(void* addr, size_t len)
+{
+	struct anon_entry entry;
+
+	if ((uintptr_t)addr & (get_system_pagesize()-1))
+		return mm_raise_error(EINVAL, "%p is not page aligned", addr);
+
+	if (anon_list_find_range(addr, len, &entry))
+		return mm_raise_error(EFAULT, "%p is not in a mapping created "
+		                      "by mm_map_anon()", addr);
+
+	if (!VirtualAlloc(addr, len, MEM_COMMIT, entry.protect))
+		return mm_raise_from_w32err("VirtualAlloc failed");
+
+	return 0;
+}
+
+
 /**************************************************************************
  *                                                                        *
  *                         SHM access per se                              *
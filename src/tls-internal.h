@@ -0,0 +1,99 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef TLS_INTERNAL_H
+#define TLS_INTERNAL_H
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#  include <stdatomic.h>
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#endif
+
+#ifndef thread_local
+#  if defined (__GNUC__)
+#    define thread_local __thread
+#  elif defined (_MSC_VER)
+#    define thread_local __declspec(thread)
+#  else
+#    error Do not know how to specify thread local attribute
+#  endif
+#endif
+
+
+/**************************************************************************
+ *                                                                        *
+ *                    Thread exit notification                            *
+ *                                                                        *
+ **************************************************************************/
+/*
+ * Thread local variables declared with thread_local are fast to access but
+ * do not offer any way to be notified when the thread exits. The tls_key_*
+ * helpers below provide this: a thread setting a non NULL value to a key
+ * will get the destructor associated with the key called with that value
+ * when it terminates. This is meant to be used in combination with a
+ * thread_local variable: the key is not meant to be read, only to trigger
+ * the release of the thread resources.
+ */
+
+#ifdef _WIN32
+
+typedef DWORD tls_key_t;
+
+static inline
+int tls_key_create(tls_key_t* key, void (* dtor)(void*))
+{
+	*key = FlsAlloc((PFLS_CALLBACK_FUNCTION)dtor);
+	return (*key == FLS_OUT_OF_INDEXES) ? -1 : 0;
+}
+
+static inline
+void tls_key_set(tls_key_t key, void* value)
+{
+	FlsSetValue(key, value);
+}
+
+#else /* _WIN32 */
+
+typedef pthread_key_t tls_key_t;
+
+static inline
+int tls_key_create(tls_key_t* key, void (* dtor)(void*))
+{
+	return pthread_key_create(key, dtor) ? -1 : 0;
+}
+
+static inline
+void tls_key_set(tls_key_t key, void* value)
+{
+	pthread_setspecific(key, value);
+}
+
+#endif /* _WIN32 */
+
+
+/**
+ * get_thread_id() - get the system identifier of the calling thread
+ *
+ * Return: the thread id as reported by the system tools (TID on Linux). On
+ * platforms not exposing one, a unique number is returned at each call:
+ * the caller is expected to cache it in a thread local variable.
+ */
+static inline
+long get_thread_id(void)
+{
+#if defined (_WIN32)
+	return (long)GetCurrentThreadId();
+#elif defined (SYS_gettid)
+	return (long)syscall(SYS_gettid);
+#else
+	static atomic_long next_id = 1;
+
+	return atomic_fetch_add(&next_id, 1);
+#endif
+}
+
+#endif /* ifndef TLS_INTERNAL_H */
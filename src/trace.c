@@ -0,0 +1,631 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alloc-internal.h"
+#include "mmerrno.h"
+#include "mmprofile.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "mmtime.h"
+#include "tls-internal.h"
+#include "tsc-internal.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#endif
+
+/**
+ * DOC:
+ * The trace events are recorded in a ring buffer private to each thread.
+ * The recording thread is the only producer and mm_trace_flush() the only
+ * consumer of a buffer: the producer only advances @head and the consumer
+ * only advances @tail, hence recording an event never takes a lock nor
+ * waits for the consumer. If the buffer is full, the event is dropped and
+ * accounted in @num_dropped.
+ *
+ * The events are timestamped with the TSC if it is invariant (using the same
+ * calibration as mm_profile), MM_CLK_MONOTONIC otherwise. In both case, the
+ * times written by mm_trace_flush() are in the time base of MM_CLK_MONOTONIC
+ * (as returned by mm_gettime()), hence they can be compared with the
+ * timestamps obtained elsewhere in the process.
+ */
+
+#define TRACE_BUFSIZE_DEFAULT   (64*1024)
+#define THREAD_NAME_LEN         64
+#define CACHELINE_SIZE          64
+#define WRBUF_SIZE              4096
+#define SEC_IN_NSEC             1000000000
+
+enum trace_type {
+	TRACE_BEGIN,
+	TRACE_END,
+	TRACE_INSTANT,
+	TRACE_COUNTER,
+};
+
+/**
+ * struct trace_event - event recorded in a trace buffer
+ * @ts:         timestamp (TSC ticks or ns depending on trace_use_tsc)
+ * @name:       name of the event supplied by the user
+ * @value:      value of a counter event
+ * @type:       type of event (one of the TRACE_* value)
+ */
+struct trace_event {
+	int64_t ts;
+	const char* name;
+	int64_t value;
+	int type;
+};
+
+
+/**
+ * struct trace_buffer - ring buffer of the events of a thread
+ * @next:       next buffer in the registry
+ * @tid:        system identifier of the thread
+ * @name:       name of the thread (empty if not set)
+ * @exited:     true once the thread has terminated
+ * @mask:       number of events in @events minus 1
+ * @num_dropped: number of events dropped because the buffer was full
+ * @head:       index of the next event to write (written by the thread)
+ * @tail:       index of the next event to read (written by the flush)
+ * @events:     storage of the events
+ */
+struct trace_buffer {
+	struct trace_buffer* next;
+	long tid;
+	char name[THREAD_NAME_LEN];
+	atomic_int exited;
+	size_t mask;
+	atomic_size_t num_dropped;
+	_Alignas(CACHELINE_SIZE) atomic_size_t head;
+	_Alignas(CACHELINE_SIZE) atomic_size_t tail;
+	_Alignas(CACHELINE_SIZE) struct trace_event events[];
+};
+
+
+static thread_local struct trace_buffer* thread_buffer;
+static mm_thr_mutex_t registry_mtx = MM_THR_MUTEX_INITIALIZER;
+static struct trace_buffer* registry;
+static size_t trace_bufsize = TRACE_BUFSIZE_DEFAULT;
+static mm_thr_once_t trace_once = MM_THR_ONCE_INIT;
+static tls_key_t trace_key;
+static int trace_key_valid;
+static int trace_use_tsc;
+
+
+static
+void trace_thread_exit(void* arg)
+{
+	struct trace_buffer* buf = arg;
+
+	// The buffer is released at the next flush
+	atomic_store_explicit(&buf->exited, 1, memory_order_release);
+	thread_buffer = NULL;
+}
+
+
+static
+void init_trace(void)
+{
+	if (!tls_key_create(&trace_key, trace_thread_exit))
+		trace_key_valid = 1;
+
+	trace_use_tsc = tsc_is_usable();
+}
+
+
+static
+long get_process_id(void)
+{
+#if defined (_WIN32)
+	return (long)GetCurrentProcessId();
+#else
+	return (long)getpid();
+#endif
+}
+
+
+/**
+ * create_thread_buffer() - allocate and register the buffer of a thread
+ *
+ * Return: the buffer of the calling thread, NULL if it cannot be allocated
+ * (in which case the events of the thread are not recorded).
+ */
+static NOINLINE
+struct trace_buffer* create_thread_buffer(void)
+{
+	static struct alloc_site site = ALLOC_SITE_INIT("trace buffer");
+	struct trace_buffer* buf;
+	size_t num_events;
+
+	mm_thr_once(&trace_once, init_trace);
+	if (!trace_key_valid)
+		return NULL;
+
+	mm_thr_mutex_lock(&registry_mtx);
+	num_events = trace_bufsize;
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	buf = site_alloc(&site, CACHELINE_SIZE,
+	                 sizeof(*buf) + num_events*sizeof(buf->events[0]));
+	if (!buf)
+		return NULL;
+
+	buf->tid = get_thread_id();
+	buf->name[0] = '\0';
+	buf->mask = num_events - 1;
+	atomic_init(&buf->exited, 0);
+	atomic_init(&buf->num_dropped, 0);
+	atomic_init(&buf->head, 0);
+	atomic_init(&buf->tail, 0);
+
+	mm_thr_mutex_lock(&registry_mtx);
+	buf->next = registry;
+	registry = buf;
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	tls_key_set(trace_key, buf);
+	thread_buffer = buf;
+
+	return buf;
+}
+
+
+static inline
+struct trace_buffer* get_thread_buffer(void)
+{
+	struct trace_buffer* buf = thread_buffer;
+
+	if (UNLIKELY(!buf))
+		buf = create_thread_buffer();
+
+	return buf;
+}
+
+
+static inline
+int64_t trace_timestamp(void)
+{
+	struct mm_timespec ts;
+
+	if (trace_use_tsc)
+		return read_tsc();
+
+	mm_gettime(MM_CLK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * SEC_IN_NSEC + ts.tv_nsec;
+}
+
+
+/**
+ * record_event() - write an event in the buffer of the calling thread
+ * @type:       type of event
+ * @name:       name of the event
+ * @value:      value associated with the event
+ */
+static inline
+void record_event(int type, const char* name, int64_t value)
+{
+	struct trace_buffer* buf;
+	struct trace_event* ev;
+	size_t head, tail;
+
+	buf = get_thread_buffer();
+	if (UNLIKELY(!buf))
+		return;
+
+	head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+	if (UNLIKELY(head - tail > buf->mask)) {
+		atomic_fetch_add_explicit(&buf->num_dropped, 1,
+		                          memory_order_relaxed);
+		return;
+	}
+
+	ev = &buf->events[head & buf->mask];
+	ev->ts = trace_timestamp();
+	ev->name = name;
+	ev->value = value;
+	ev->type = type;
+
+	// Publish the event to the consumer
+	atomic_store_explicit(&buf->head, head+1, memory_order_release);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                      Chrome trace JSON serialization                   *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * struct wrbuf - output buffer of the serialization
+ * @fd:         file descriptor to which the data is written
+ * @len:        number of bytes pending in @data
+ * @err:        true if a write has failed
+ * @data:       pending data
+ */
+struct wrbuf {
+	int fd;
+	size_t len;
+	int err;
+	char data[WRBUF_SIZE];
+};
+
+
+static
+void wrbuf_flush(struct wrbuf* wr)
+{
+	const char* ptr = wr->data;
+	ssize_t rsz;
+
+	while (wr->len && !wr->err) {
+		rsz = mm_write(wr->fd, ptr, wr->len);
+		if (rsz < 0) {
+			wr->err = 1;
+			break;
+		}
+
+		ptr += rsz;
+		wr->len -= rsz;
+	}
+
+	wr->len = 0;
+}
+
+
+static
+void wrbuf_putc(struct wrbuf* wr, char c)
+{
+	if (wr->len == sizeof(wr->data))
+		wrbuf_flush(wr);
+
+	wr->data[wr->len++] = c;
+}
+
+
+static
+void wrbuf_puts(struct wrbuf* wr, const char* str)
+{
+	while (*str)
+		wrbuf_putc(wr, *str++);
+}
+
+
+/**
+ * wrbuf_put_json_string() - write a quoted and escaped JSON string
+ * @wr:         output buffer
+ * @str:        string to write (NULL is written as empty string)
+ */
+static
+void wrbuf_put_json_string(struct wrbuf* wr, const char* str)
+{
+	char esc[8];
+	unsigned char c;
+
+	wrbuf_putc(wr, '"');
+	for (; str && *str; str++) {
+		c = *str;
+		if (c == '"' || c == '\\') {
+			wrbuf_putc(wr, '\\');
+			wrbuf_putc(wr, c);
+		} else if (c < 0x20) {
+			sprintf(esc, "\\u%04x", c);
+			wrbuf_puts(wr, esc);
+		} else {
+			wrbuf_putc(wr, c);
+		}
+	}
+
+	wrbuf_putc(wr, '"');
+}
+
+
+static
+int64_t event_time_ns(const struct trace_event* ev)
+{
+	if (trace_use_tsc)
+		return tsc_to_monotonic_ns(ev->ts);
+
+	return ev->ts;
+}
+
+
+/**
+ * write_event() - serialize an event in Chrome trace event format
+ * @wr:         output buffer
+ * @pid:        process id
+ * @tid:        thread id
+ * @ev:         event to serialize
+ */
+static
+void write_event(struct wrbuf* wr, long pid, long tid,
+                 const struct trace_event* ev)
+{
+	static const char phases[] = {
+		[TRACE_BEGIN] = 'B',
+		[TRACE_END] = 'E',
+		[TRACE_INSTANT] = 'i',
+		[TRACE_COUNTER] = 'C',
+	};
+	char str[128];
+	int64_t ns = event_time_ns(ev);
+
+	wrbuf_puts(wr, ",\n{\"name\":");
+	wrbuf_put_json_string(wr, ev->name);
+
+	// Chrome trace timestamps are in microseconds
+	sprintf(str, ",\"ph\":\"%c\",\"ts\":%"PRIi64".%03i,\"pid\":%li,\"tid\":%li",
+	        phases[ev->type], ns / 1000, (int)(ns % 1000), pid, tid);
+	wrbuf_puts(wr, str);
+
+	if (ev->type == TRACE_INSTANT) {
+		wrbuf_puts(wr, ",\"s\":\"t\"");
+	} else if (ev->type == TRACE_COUNTER) {
+		sprintf(str, ",\"args\":{\"value\":%"PRIi64"}", ev->value);
+		wrbuf_puts(wr, str);
+	}
+
+	wrbuf_putc(wr, '}');
+}
+
+
+/**
+ * write_thread_metadata() - serialize the name of a thread
+ * @wr:         output buffer
+ * @pid:        process id
+ * @buf:        trace buffer of the thread
+ */
+static
+void write_thread_metadata(struct wrbuf* wr, long pid,
+                           const struct trace_buffer* buf)
+{
+	char str[128];
+	char name[THREAD_NAME_LEN];
+
+	if (buf->name[0])
+		strcpy(name, buf->name);
+	else
+		sprintf(name, "thread %li", buf->tid);
+
+	sprintf(str, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%li,"
+	        "\"tid\":%li,\"args\":{\"name\":", pid, buf->tid);
+	wrbuf_puts(wr, str);
+	wrbuf_put_json_string(wr, name);
+	wrbuf_puts(wr, "}}");
+
+	if (atomic_load(&buf->num_dropped)) {
+		sprintf(str, ",\n{\"name\":\"dropped events\",\"ph\":\"C\","
+		        "\"ts\":0,\"pid\":%li,\"tid\":%li,"
+		        "\"args\":{\"value\":%zu}}",
+		        pid, buf->tid, atomic_load(&buf->num_dropped));
+		wrbuf_puts(wr, str);
+	}
+}
+
+
+/**
+ * write_buffer_events() - consume and serialize the events of a buffer
+ * @wr:         output buffer
+ * @pid:        process id
+ * @buf:        trace buffer whose events must be written
+ */
+static
+void write_buffer_events(struct wrbuf* wr, long pid, struct trace_buffer* buf)
+{
+	size_t i, head, tail;
+
+	head = atomic_load_explicit(&buf->head, memory_order_acquire);
+	tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+
+	for (i = tail; i != head; i++)
+		write_event(wr, pid, buf->tid, &buf->events[i & buf->mask]);
+
+	// Give the slots back to the producer
+	atomic_store_explicit(&buf->tail, head, memory_order_release);
+}
+
+
+/**************************************************************************
+ *                                                                        *
+ *                               API                                      *
+ *                                                                        *
+ **************************************************************************/
+
+/**
+ * mm_trace_begin() - record the beginning of a duration event
+ * @name:       name of the event
+ *
+ * Record in the trace buffer of the calling thread the start of a slice
+ * named @name. The slice ends at the matching call to mm_trace_end(). Slices
+ * can be nested.
+ *
+ * Like the other trace recording functions, this takes only few
+ * nanoseconds, never blocks nor takes a lock: the event is written in a
+ * ring buffer private to the thread. If the buffer is full (because it has
+ * not been flushed for too long), the event is dropped.
+ *
+ * The string @name is not copied: it must remain valid until the trace is
+ * flushed with mm_trace_flush() (typically a string literal).
+ */
+API_EXPORTED
+void mm_trace_begin(const char* name)
+{
+	record_event(TRACE_BEGIN, name, 0);
+}
+
+
+/**
+ * mm_trace_end() - record the end of a duration event
+ *
+ * Close the slice started by the last call to mm_trace_begin() in the
+ * calling thread.
+ */
+API_EXPORTED
+void mm_trace_end(void)
+{
+	record_event(TRACE_END, NULL, 0);
+}
+
+
+/**
+ * mm_trace_instant() - record an instant event
+ * @name:       name of the event (must remain valid until flush)
+ */
+API_EXPORTED
+void mm_trace_instant(const char* name)
+{
+	record_event(TRACE_INSTANT, name, 0);
+}
+
+
+/**
+ * mm_trace_counter() - record the value of a counter
+ * @name:       name of the counter (must remain valid until flush)
+ * @value:      value of the counter
+ *
+ * The successive values of a counter are displayed as a graph by the trace
+ * viewers.
+ */
+API_EXPORTED
+void mm_trace_counter(const char* name, int64_t value)
+{
+	record_event(TRACE_COUNTER, name, value);
+}
+
+
+/**
+ * mm_trace_set_thread_name() - set the name of the calling thread in traces
+ * @name:       name of the thread
+ *
+ * Set the name displayed for the calling thread in the trace written by
+ * mm_trace_flush(). If not set, the thread is named after its id. @name is
+ * copied and truncated to 63 characters.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_trace_set_thread_name(const char* name)
+{
+	struct trace_buffer* buf;
+
+	buf = get_thread_buffer();
+	if (!buf)
+		return mm_raise_error(ENOMEM, "Cannot allocate trace buffer");
+
+	mm_thr_mutex_lock(&registry_mtx);
+	strncpy(buf->name, name, sizeof(buf->name)-1);
+	buf->name[sizeof(buf->name)-1] = '\0';
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	return 0;
+}
+
+
+/**
+ * mm_trace_set_buffer_size() - set size of the trace buffers
+ * @num_events: number of events that a buffer can hold
+ *
+ * Set the number of events that the trace buffer of a thread can hold
+ * between 2 flushes. This applies to the threads that have not recorded
+ * any event yet. @num_events must be a power of 2. The default is 65536
+ * events.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_trace_set_buffer_size(size_t num_events)
+{
+	if (num_events < 2 || !MM_IS_POW2(num_events))
+		return mm_raise_error(EINVAL, "Invalid number of events (%zu), "
+		                      "must be a power of 2", num_events);
+
+	mm_thr_mutex_lock(&registry_mtx);
+	trace_bufsize = num_events;
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	return 0;
+}
+
+
+/**
+ * mm_trace_flush() - write the recorded events in Chrome trace format
+ * @fd:         file descriptor to which the trace must be written
+ *
+ * Consume the events recorded so far by all threads and write them on
+ * @fd as a JSON document in the Chrome trace event format. This can be
+ * loaded in chrome://tracing or in the Perfetto UI (https://ui.perfetto.dev).
+ * Each thread is displayed with its name (see mm_trace_set_thread_name())
+ * and the number of dropped events is reported if any.
+ *
+ * The timestamps are the ones of MM_CLK_MONOTONIC expressed in
+ * microseconds. The threads can keep recording while the trace is flushed:
+ * the events recorded after the flush started will be written at the next
+ * flush. The buffers of the terminated threads are released once flushed.
+ *
+ * Return: 0 in case of success, -1 otherwise with error state set
+ * accordingly.
+ */
+API_EXPORTED
+int mm_trace_flush(int fd)
+{
+	struct wrbuf wr;
+	struct trace_buffer* buf;
+	struct trace_buffer** pbuf;
+	long pid = get_process_id();
+	int exited;
+	char str[128];
+
+	mm_thr_mutex_lock(&registry_mtx);
+
+	wr.fd = fd;
+	wr.len = 0;
+	wr.err = 0;
+	wrbuf_puts(&wr, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	sprintf(str, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%li,"
+	        "\"args\":{\"name\":\"process %li\"}}", pid, pid);
+	wrbuf_puts(&wr, str);
+
+	pbuf = &registry;
+	while ((buf = *pbuf)) {
+		// Read exited before consuming the events: if set, all
+		// the events of the thread are visible
+		exited = atomic_load_explicit(&buf->exited,
+		                              memory_order_acquire);
+
+		write_thread_metadata(&wr, pid, buf);
+		write_buffer_events(&wr, pid, buf);
+
+		if (exited) {
+			*pbuf = buf->next;
+			site_free(buf);
+		} else {
+			pbuf = &buf->next;
+		}
+	}
+
+	wrbuf_puts(&wr, "\n]}\n");
+	wrbuf_flush(&wr);
+
+	mm_thr_mutex_unlock(&registry_mtx);
+
+	if (wr.err)
+		return mm_raise_from_errno("Cannot write trace");
+
+	return 0;
+}
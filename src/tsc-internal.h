@@ -0,0 +1,86 @@
+/*
+ * @mindmaze_header@
+ */
+#ifndef TSC_INTERNAL_H
+#define TSC_INTERNAL_H
+
+#include <stdint.h>
+
+#include "mmpredefs.h"
+
+#if defined (_MSC_VER)
+#  include <intrin.h>
+#elif defined (__x86_64__) || defined (__i386__)
+#  include <x86intrin.h>
+#endif
+
+/*
+ * The timestamp counter (TSC) of the CPU is used by the profiling and
+ * tracing facilities to timestamp events without the overhead of a call
+ * to mm_gettime(). Its frequency is estimated once against
+ * MM_CLK_MONOTONIC at the first call to tsc_is_usable(), which also sets
+ * a reference point to express TSC values in the time base of
+ * MM_CLK_MONOTONIC.
+ */
+
+#if defined (__x86_64__) || defined (__i386__) \
+	|| defined (_M_X64) || defined (_M_IX86)
+#  define HAVE_TSC      1
+
+static inline
+int64_t read_tsc(void)
+{
+	unsigned int tsc_aux;
+
+	// rdtscp waits for the previous instructions to complete, hence the
+	// measured section cannot leak after the timestamp
+	return (int64_t)__rdtscp(&tsc_aux);
+}
+
+#elif defined (__aarch64__) && defined (__GNUC__)
+#  define HAVE_TSC      1
+
+static inline
+int64_t read_tsc(void)
+{
+	uint64_t cnt;
+
+	// isb prevents the counter read to be speculated before the
+	// previous instructions
+	__asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r" (cnt) :: "memory");
+	return (int64_t)cnt;
+}
+
+#else
+#  define HAVE_TSC      0
+
+static inline
+int64_t read_tsc(void)
+{
+	return 0;
+}
+
+#endif
+
+extern double tsc_nsec_per_tick;
+extern int64_t tsc_ref_ticks;
+extern int64_t tsc_ref_nsec;
+
+int tsc_is_usable(void);
+
+
+/**
+ * tsc_to_monotonic_ns() - convert a TSC value in MM_CLK_MONOTONIC time
+ * @ticks:      value returned by read_tsc()
+ *
+ * tsc_is_usable() must have returned 1 before using this function.
+ *
+ * Return: the time of MM_CLK_MONOTONIC in ns corresponding to @ticks
+ */
+static inline
+int64_t tsc_to_monotonic_ns(int64_t ticks)
+{
+	return tsc_ref_nsec + (int64_t)((ticks - tsc_ref_ticks) * tsc_nsec_per_tick);
+}
+
+#endif /* ifndef TSC_INTERNAL_H */
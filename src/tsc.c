@@ -0,0 +1,151 @@
+/*
+ * @mindmaze_header@
+ */
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+
+#include "mmpredefs.h"
+#include "mmthread.h"
+#include "mmtime.h"
+#include "tsc-internal.h"
+
+#if !defined (_MSC_VER) && (defined (__x86_64__) || defined (__i386__))
+#  include <cpuid.h>
+#endif
+
+#define SEC_IN_NSEC             1000000000
+#define TSC_CALIBRATION_NSEC    10000000
+
+#if defined (__x86_64__) || defined (__i386__) \
+	|| defined (_M_X64) || defined (_M_IX86)
+
+// To get the value that must be passed to cpuid, see the ISA documentation
+#define CPUID_LEAF_EXTENDED     0x80000001
+#define RDTSCP_EDX_MASK         (1<<27)
+#define CPUID_LEAF_TSC          0x80000007
+#define INVARIANT_TSC_EDX_MASK  (1<<8)
+
+/**
+ * get_cpuid_edx() - get EDX register returned by cpuid instruction
+ * @leaf:       value passed in EAX to cpuid
+ * @edx:        location receiving the value of EDX register
+ *
+ * Return: 0 in case of success, -1 if @leaf is not supported by the CPU
+ */
+static
+int get_cpuid_edx(unsigned int leaf, unsigned int* edx)
+{
+#if defined (_MSC_VER)
+	int cpu_regs[4];
+
+	__cpuid(cpu_regs, leaf);
+	*edx = cpu_regs[3];
+	return 0;
+#else
+	unsigned int eax, ebx, ecx;
+
+	return __get_cpuid(leaf, &eax, &ebx, &ecx, edx) ? 0 : -1;
+#endif
+}
+
+
+static
+int is_tsc_invariant(void)
+{
+	unsigned int edx;
+
+	if (get_cpuid_edx(CPUID_LEAF_EXTENDED, &edx)
+	    || !(edx & RDTSCP_EDX_MASK))
+		return 0;
+
+	if (get_cpuid_edx(CPUID_LEAF_TSC, &edx)
+	    || !(edx & INVARIANT_TSC_EDX_MASK))
+		return 0;
+
+	return 1;
+}
+
+#elif HAVE_TSC
+
+static
+int is_tsc_invariant(void)
+{
+	// The generic timer of ARMv8 runs always at a fixed frequency
+	return 1;
+}
+
+#else
+
+static
+int is_tsc_invariant(void)
+{
+	return 0;
+}
+
+#endif
+
+
+LOCAL_SYMBOL double tsc_nsec_per_tick;
+LOCAL_SYMBOL int64_t tsc_ref_ticks;
+LOCAL_SYMBOL int64_t tsc_ref_nsec;
+
+static mm_thr_once_t tsc_once = MM_THR_ONCE_INIT;
+
+
+static
+int64_t get_monotonic_nsec(void)
+{
+	struct mm_timespec ts;
+
+	mm_gettime(MM_CLK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * SEC_IN_NSEC + ts.tv_nsec;
+}
+
+
+/**
+ * calibrate_tsc() - estimate the frequency of the TSC
+ *
+ * Measure the number of ticks of TSC elapsed during a busy-wait of
+ * TSC_CALIBRATION_NSEC on MM_CLK_MONOTONIC. If the TSC cannot be used,
+ * tsc_nsec_per_tick is left to 0.
+ */
+static
+void calibrate_tsc(void)
+{
+	int64_t start_tsc, start_ns, end_tsc, end_ns;
+
+	if (!HAVE_TSC || !is_tsc_invariant())
+		return;
+
+	start_ns = get_monotonic_nsec();
+	start_tsc = read_tsc();
+	do {
+		end_ns = get_monotonic_nsec();
+		end_tsc = read_tsc();
+	} while (end_ns - start_ns < TSC_CALIBRATION_NSEC);
+
+	if (end_tsc <= start_tsc)
+		return;
+
+	tsc_ref_ticks = end_tsc;
+	tsc_ref_nsec = end_ns;
+	tsc_nsec_per_tick = (double)(end_ns - start_ns)
+	                    / (double)(end_tsc - start_tsc);
+}
+
+
+/**
+ * tsc_is_usable() - test whether the TSC clock source can be used
+ *
+ * Return: 1 if the TSC is usable, 0 otherwise. The TSC is calibrated at the
+ * first call.
+ */
+LOCAL_SYMBOL
+int tsc_is_usable(void)
+{
+	mm_thr_once(&tsc_once, calibrate_tsc);
+	return tsc_nsec_per_tick > 0.0;
+}
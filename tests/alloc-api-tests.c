@@ -7,12 +7,15 @@
 
 #include <check.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "api-testcases.h"
 #include "mmlib.h"
 #include "mmlog.h"
 #include "mmerrno.h"
 #include "mmpredefs.h"
+#include "mmthread.h"
 
 #define NUM_ALLOC	30
 
@@ -77,6 +80,214 @@ START_TEST(aligned_heap_allocation_error)
 END_TEST
 
 
+static const int alloc_ex_flags[] = {
+	0, MM_ALLOC_THP_HINT, MM_ALLOC_HUGEPAGE,
+	MM_ALLOC_HUGEPAGE | MM_ALLOC_THP_HINT,
+};
+
+static const size_t alloc_ex_sizes[] = {
+	0, 1, 100, 4096, 10000, 3*1024*1024, 16*1024*1024,
+};
+
+START_TEST(aligned_heap_allocation_ex)
+{
+	int flags = alloc_ex_flags[_i];
+	size_t align, size, pgsz;
+	void* ptr;
+	int i;
+
+	for (i = 0; i < MM_NELEM(alloc_ex_sizes); i++) {
+		size = alloc_ex_sizes[i];
+		for (align = sizeof(void*); align <= 16*MM_PAGESZ; align *= 4) {
+			ptr = mm_aligned_alloc_ex(align, size, flags);
+			ck_assert(ptr != NULL);
+			ck_assert_int_eq((uintptr_t)ptr & (align-1), 0);
+			memset(ptr, 'x', size);
+
+			pgsz = mm_aligned_get_pagesize(ptr);
+			ck_assert(pgsz >= MM_PAGESZ);
+			ck_assert(MM_IS_POW2(pgsz));
+
+			mm_aligned_free(ptr);
+		}
+	}
+}
+END_TEST
+
+
+START_TEST(aligned_heap_allocation_ex_error)
+{
+	struct mm_error_state errstate;
+
+	mm_save_errorstate(&errstate);
+
+	ck_assert(mm_aligned_alloc_ex(64, 4096, ~MM_ALLOC_HUGEPAGE) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	ck_assert(mm_aligned_alloc_ex(48, 4096, MM_ALLOC_THP_HINT) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
+static const size_t realloc_aligns[] = {
+	sizeof(void*), 16, 64, 256, 4096, 65536,
+};
+
+static
+void fill_pattern(unsigned char* ptr, size_t from, size_t to)
+{
+	size_t i;
+
+	for (i = from; i < to; i++)
+		ptr[i] = (unsigned char)(i * 7 + (i >> 12));
+}
+
+
+static
+void check_pattern(const unsigned char* ptr, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (ptr[i] != (unsigned char)(i * 7 + (i >> 12)))
+			ck_abort_msg("content mismatch at offset %zu", i);
+	}
+}
+
+
+START_TEST(aligned_heap_reallocation)
+{
+	size_t align = realloc_aligns[_i];
+	size_t size, prev_size;
+	unsigned char* ptr;
+
+	// Grow from small to large blocks
+	ptr = NULL;
+	prev_size = 0;
+	for (size = 24; size <= 16*1024*1024; size = size*3 + 5) {
+		ptr = mm_aligned_realloc(ptr, align, size);
+		ck_assert(ptr != NULL);
+		ck_assert_int_eq((uintptr_t)ptr & (align-1), 0);
+		check_pattern(ptr, prev_size);
+		fill_pattern(ptr, prev_size, size);
+		prev_size = size;
+	}
+
+	// Shrink back to small block
+	for (size = prev_size; size > 16; size /= 5) {
+		ptr = mm_aligned_realloc(ptr, align, size);
+		ck_assert(ptr != NULL);
+		ck_assert_int_eq((uintptr_t)ptr & (align-1), 0);
+		check_pattern(ptr, size);
+	}
+
+	ptr = mm_aligned_realloc(ptr, align, 0);
+	ck_assert(ptr != NULL);
+	mm_aligned_free(ptr);
+}
+END_TEST
+
+
+START_TEST(aligned_heap_reallocation_error)
+{
+	struct mm_error_state errstate;
+	void* ptr;
+
+	mm_save_errorstate(&errstate);
+
+	ptr = mm_aligned_alloc(64, 100);
+	ck_assert(mm_aligned_realloc(ptr, 48, 200) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+#if !defined(__SANITIZE_ADDRESS__)
+	ck_assert(mm_aligned_realloc(ptr, 64, SIZE_MAX - 4096) == NULL);
+	ck_assert(mm_get_lasterror_number() == ENOMEM);
+#endif
+
+	mm_aligned_free(ptr);
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
+#define NUMA_BUFFER_SIZE        (4*1024*1024)
+
+START_TEST(numa_placement)
+{
+	int node, num_nodes;
+	char* buf;
+
+	num_nodes = mm_numa_get_num_nodes();
+	ck_assert_int_ge(num_nodes, 1);
+
+	node = mm_numa_get_node_of_cpu(0);
+	ck_assert(node >= 0 && node < num_nodes);
+
+	node = mm_numa_get_current_node();
+	ck_assert(node >= 0 && node < num_nodes);
+
+	for (node = 0; node < num_nodes; node++) {
+		buf = mm_numa_alloc_onnode(64, NUMA_BUFFER_SIZE, node);
+		ck_assert(buf != NULL);
+		ck_assert_int_eq((uintptr_t)buf & 63, 0);
+		memset(buf, 'x', NUMA_BUFFER_SIZE);
+
+		// Preferred node may not have memory left, so the node of
+		// the pages cannot be checked
+		ck_assert_int_ge(mm_numa_get_node_of_addr(buf), 0);
+		ck_assert_int_ge(mm_numa_get_node_of_addr(buf + NUMA_BUFFER_SIZE-1), 0);
+
+		ck_assert(mm_numa_bind(buf, NUMA_BUFFER_SIZE, node,
+		                       MM_NUMA_MOVE) == 0);
+		mm_aligned_free(buf);
+	}
+
+	buf = mm_numa_alloc_interleaved(MM_PAGESZ, NUMA_BUFFER_SIZE);
+	ck_assert(buf != NULL);
+	ck_assert_int_eq((uintptr_t)buf & (MM_PAGESZ-1), 0);
+	memset(buf, 'x', NUMA_BUFFER_SIZE);
+	mm_aligned_free(buf);
+}
+END_TEST
+
+
+START_TEST(numa_placement_error)
+{
+	struct mm_error_state errstate;
+	int num_nodes = mm_numa_get_num_nodes();
+	char* buf;
+
+	mm_save_errorstate(&errstate);
+
+	ck_assert(mm_numa_alloc_onnode(64, 4096, num_nodes) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	ck_assert(mm_numa_alloc_onnode(64, 4096, -1) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	ck_assert(mm_numa_alloc_interleaved(24, 4096) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	ck_assert(mm_numa_get_node_of_cpu(-1) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	buf = mm_aligned_alloc(MM_PAGESZ, 2*MM_PAGESZ);
+	ck_assert(mm_numa_bind(buf, MM_PAGESZ, num_nodes, 0) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	ck_assert(mm_numa_bind(buf+1, MM_PAGESZ, 0, 0) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	ck_assert(mm_numa_bind(buf, MM_PAGESZ, 0, ~MM_NUMA_MOVE) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	mm_aligned_free(buf);
+
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
 static size_t stack_alloc_sizes[] = {
 	1, 3, sizeof(double), 64, 57, 256, 950, 2044, 2048, 2056, 4032,
 };
@@ -145,6 +356,642 @@ START_TEST(safe_stack_allocation_error)
 END_TEST
 
 
+#define NUM_SCRATCH_BLOCK       32
+#define SCRATCH_BLOCK_SIZE      (64*1024)
+
+static
+void fill_malloca_blocks(void** ptrs, int num, size_t size)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		ptrs[i] = mm_malloca(size);
+		ck_assert(ptrs[i] != NULL);
+		ck_assert_int_eq((uintptr_t)ptrs[i] & (MM_STK_ALIGN-1), 0);
+		memset(ptrs[i], i, size);
+	}
+
+	for (i = 0; i < num; i++) {
+		unsigned char* data = ptrs[i];
+		ck_assert_int_eq(data[0], i);
+		ck_assert_int_eq(data[size-1], i);
+	}
+}
+
+
+START_TEST(scratch_allocation)
+{
+	struct mm_malloca_stats stats_before, stats;
+	void* ptrs[NUM_SCRATCH_BLOCK];
+	void* huge;
+	void* first;
+	int i, round;
+
+	mm_malloca_get_stats(&stats_before);
+
+	first = mm_malloca(SCRATCH_BLOCK_SIZE);
+	ck_assert(first != NULL);
+	mm_freea(first);
+
+	for (round = 0; round < 3; round++) {
+		// Released in LIFO order
+		fill_malloca_blocks(ptrs, NUM_SCRATCH_BLOCK, SCRATCH_BLOCK_SIZE);
+		for (i = NUM_SCRATCH_BLOCK-1; i >= 0; i--)
+			mm_freea(ptrs[i]);
+
+		// Released out of order
+		fill_malloca_blocks(ptrs, NUM_SCRATCH_BLOCK, SCRATCH_BLOCK_SIZE);
+		for (i = 0; i < NUM_SCRATCH_BLOCK; i++)
+			mm_freea(ptrs[i]);
+	}
+
+	// Once all blocks are released, the memory must be reused
+	ptrs[0] = mm_malloca(SCRATCH_BLOCK_SIZE);
+	ck_assert(ptrs[0] == first);
+	mm_freea(ptrs[0]);
+
+	// Allocations too big for scratch stack must use the heap
+	huge = mm_malloca(64*1024*1024);
+	ck_assert(huge != NULL);
+	mm_freea(huge);
+
+	mm_malloca_get_stats(&stats);
+	ck_assert(stats.scratch_allocs - stats_before.scratch_allocs
+	          == 2 + 6*NUM_SCRATCH_BLOCK);
+	ck_assert(stats.heap_fallbacks - stats_before.heap_fallbacks == 1);
+	ck_assert(stats.scratch_mapped >= NUM_SCRATCH_BLOCK*SCRATCH_BLOCK_SIZE);
+}
+END_TEST
+
+
+static
+void* scratch_thread_routine(void* arg)
+{
+	void* ptrs[NUM_SCRATCH_BLOCK];
+	int i;
+
+	fill_malloca_blocks(ptrs, NUM_SCRATCH_BLOCK, SCRATCH_BLOCK_SIZE);
+	for (i = NUM_SCRATCH_BLOCK-1; i >= 0; i--)
+		mm_freea(ptrs[i]);
+
+	return arg;
+}
+
+
+START_TEST(scratch_allocation_threads)
+{
+	struct mm_malloca_stats stats_before, stats;
+	mm_thread_t thids[4];
+	int i;
+
+	mm_malloca_get_stats(&stats_before);
+
+	for (i = 0; i < MM_NELEM(thids); i++)
+		ck_assert(mm_thr_create(&thids[i], scratch_thread_routine, NULL) == 0);
+
+	for (i = 0; i < MM_NELEM(thids); i++)
+		mm_thr_join(thids[i], NULL);
+
+	// Counters of exited threads must be kept
+	mm_malloca_get_stats(&stats);
+	ck_assert(stats.scratch_allocs - stats_before.scratch_allocs
+	          == MM_NELEM(thids)*NUM_SCRATCH_BLOCK);
+	ck_assert(stats.heap_fallbacks == stats_before.heap_fallbacks);
+}
+END_TEST
+
+
+#define ADAPTIVE_RECURSION_DEPTH        64
+#define ADAPTIVE_BLOCK_SIZE             (512*1024)
+
+/*
+ * Allocate a large block with mm_malloca_adaptive() at each recursion level
+ * and touch all its pages. Without proper limitation, this would overflow
+ * the stack of the thread. Return the number of blocks allocated on stack.
+ */
+static NOINLINE
+int adaptive_recursion(int depth)
+{
+	unsigned char* ptr;
+	int num_on_stack;
+
+	if (depth == 0)
+		return 0;
+
+	ptr = mm_malloca_adaptive(ADAPTIVE_BLOCK_SIZE);
+	ck_assert(ptr != NULL);
+	ck_assert_int_eq((uintptr_t)ptr & (MM_STK_ALIGN-1), 0);
+	memset(ptr, depth, ADAPTIVE_BLOCK_SIZE);
+
+	num_on_stack = adaptive_recursion(depth - 1);
+
+	ck_assert_int_eq(ptr[0], depth);
+	ck_assert_int_eq(ptr[ADAPTIVE_BLOCK_SIZE-1], depth);
+
+	// Stack allocations are recognised by their alignment
+	if (((uintptr_t)ptr & (2*MM_STK_ALIGN-1)) == 0)
+		num_on_stack++;
+
+	mm_freea(ptr);
+
+	return num_on_stack;
+}
+
+
+static
+void* adaptive_recursion_thread(void* arg)
+{
+	int* num_on_stack = arg;
+
+	*num_on_stack = adaptive_recursion(ADAPTIVE_RECURSION_DEPTH);
+
+	return NULL;
+}
+
+
+START_TEST(adaptive_stack_allocation)
+{
+	mm_thread_t thid;
+	int num_on_stack;
+
+	num_on_stack = adaptive_recursion(ADAPTIVE_RECURSION_DEPTH);
+	ck_assert_int_lt(num_on_stack, ADAPTIVE_RECURSION_DEPTH);
+
+	ck_assert(mm_thr_create(&thid, adaptive_recursion_thread,
+	                        &num_on_stack) == 0);
+	mm_thr_join(thid, NULL);
+	ck_assert_int_lt(num_on_stack, ADAPTIVE_RECURSION_DEPTH);
+
+#if defined (__linux__) && !defined (__SANITIZE_ADDRESS__)
+	// With default stacks of several MiB, the first levels must have
+	// been allocated on stack
+	ck_assert_int_gt(num_on_stack, 0);
+#endif
+}
+END_TEST
+
+
+static const struct {
+	size_t objsize;
+	size_t align;
+} pool_params[] = {
+	{1, 0}, {8, 8}, {13, 0}, {24, 8}, {64, 64}, {100, 32}, {4000, 4096},
+};
+
+#define NUM_POOL_OBJ    1000
+
+START_TEST(pool_allocation)
+{
+	struct mm_pool* pool;
+	struct mm_pool_stats stats;
+	size_t objsize = pool_params[_i].objsize;
+	size_t align = pool_params[_i].align;
+	unsigned char* objs[NUM_POOL_OBJ];
+	int i, j, round;
+
+	pool = mm_pool_create(objsize, align);
+	ck_assert(pool != NULL);
+
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < NUM_POOL_OBJ; i++) {
+			objs[i] = mm_pool_alloc(pool);
+			ck_assert(objs[i] != NULL);
+			if (align)
+				ck_assert_int_eq((uintptr_t)objs[i] & (align-1), 0);
+
+			memset(objs[i], i & 0xFF, objsize);
+		}
+
+		// Check no object overlap another
+		for (i = 0; i < NUM_POOL_OBJ; i++) {
+			for (j = 0; j < (int)objsize; j++)
+				ck_assert_int_eq(objs[i][j], i & 0xFF);
+		}
+
+		for (i = 0; i < NUM_POOL_OBJ; i++)
+			mm_pool_free(pool, objs[i]);
+	}
+
+	ck_assert(mm_pool_get_stats(pool, &stats) == 0);
+	ck_assert(stats.objsize >= objsize);
+	ck_assert(stats.hits + stats.misses == 3*NUM_POOL_OBJ);
+	ck_assert(stats.hits > stats.misses);
+	ck_assert(stats.bytes_held >= NUM_POOL_OBJ*objsize);
+	ck_assert_int_eq(stats.num_tcaches, 1);
+
+	mm_pool_destroy(pool);
+}
+END_TEST
+
+
+#define NUM_POOL_XTHREAD_OBJ    20000
+
+struct pool_xthread_data {
+	struct mm_pool* pool;
+	void* objs[NUM_POOL_XTHREAD_OBJ];
+};
+
+
+static
+void* pool_alloc_thread(void* arg)
+{
+	struct pool_xthread_data* data = arg;
+	int i;
+
+	for (i = 0; i < NUM_POOL_XTHREAD_OBJ; i++) {
+		data->objs[i] = mm_pool_alloc(data->pool);
+		if (!data->objs[i])
+			return NULL;
+
+		memset(data->objs[i], 'a', 48);
+	}
+
+	return data;
+}
+
+
+static
+void* pool_free_thread(void* arg)
+{
+	struct pool_xthread_data* data = arg;
+	int i;
+
+	for (i = 0; i < NUM_POOL_XTHREAD_OBJ; i++)
+		mm_pool_free(data->pool, data->objs[i]);
+
+	return data;
+}
+
+
+START_TEST(pool_cross_thread_free)
+{
+	struct pool_xthread_data* data;
+	struct mm_pool_stats stats;
+	mm_thread_t thid;
+	void* retval;
+	size_t bytes_held = 0;
+	int round;
+
+	data = malloc(sizeof(*data));
+	data->pool = mm_pool_create(48, 16);
+	ck_assert(data->pool != NULL);
+
+	for (round = 0; round < 4; round++) {
+		// Allocate in one thread, free in a different one
+		ck_assert(mm_thr_create(&thid, pool_alloc_thread, data) == 0);
+		mm_thr_join(thid, &retval);
+		ck_assert(retval == data);
+
+		ck_assert(mm_thr_create(&thid, pool_free_thread, data) == 0);
+		mm_thr_join(thid, &retval);
+		ck_assert(retval == data);
+
+		// Objects released by the exited threads must have been
+		// recycled: the pool must not have grown after first round
+		mm_pool_get_stats(data->pool, &stats);
+		if (round == 0)
+			bytes_held = stats.bytes_held;
+
+		ck_assert(stats.bytes_held == bytes_held);
+		ck_assert_int_eq(stats.num_tcaches, 0);
+		ck_assert(stats.drains > 0);
+	}
+
+	mm_pool_destroy(data->pool);
+	free(data);
+}
+END_TEST
+
+
+static
+void* pool_lifetime_thread(void* arg)
+{
+	struct mm_pool* pool;
+	void* obj;
+
+	(void)arg;
+
+	pool = mm_pool_create(64, 0);
+	if (!pool)
+		return NULL;
+
+	obj = mm_pool_alloc(pool);
+	if (obj)
+		mm_pool_free(pool, obj);
+
+	mm_pool_destroy(pool);
+
+	// The thread caches are released again at exit
+	return obj;
+}
+
+
+START_TEST(pool_destroy_in_thread)
+{
+	mm_thread_t thid;
+	void* retval;
+
+	ck_assert(mm_thr_create(&thid, pool_lifetime_thread, NULL) == 0);
+	mm_thr_join(thid, &retval);
+	ck_assert(retval != NULL);
+}
+END_TEST
+
+
+START_TEST(pool_create_error)
+{
+	struct mm_error_state errstate;
+
+	mm_save_errorstate(&errstate);
+
+	ck_assert(mm_pool_create(32, 3) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	ck_assert(mm_pool_create(SIZE_MAX/2, 0) == NULL);
+	ck_assert(mm_get_lasterror_number() == ENOMEM);
+
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
+#define NUM_ARENA_ALLOC         2000
+#define ARENA_CHUNK_SIZE        4096
+
+static const int arena_flags[] = {0, MM_ARENA_GUARD};
+
+static
+unsigned char* arena_alloc_filled(struct mm_arena* arena, int i)
+{
+	unsigned char* ptr;
+	size_t align = (size_t)1 << (i % 8);
+	size_t size = 1 + (i * 37) % 300;
+
+	ptr = mm_arena_alloc(arena, align, size);
+	ck_assert(ptr != NULL);
+	ck_assert_int_eq((uintptr_t)ptr & (align-1), 0);
+	memset(ptr, i & 0xFF, size);
+
+	return ptr;
+}
+
+
+static
+void arena_check_filled(unsigned char* ptr, int i)
+{
+	size_t size = 1 + (i * 37) % 300;
+	size_t j;
+
+	for (j = 0; j < size; j++)
+		ck_assert_int_eq(ptr[j], i & 0xFF);
+}
+
+
+START_TEST(arena_allocation)
+{
+	struct mm_arena* arena;
+	struct mm_arena_pos pos;
+	unsigned char* ptrs[NUM_ARENA_ALLOC];
+	unsigned char* first;
+	void* large;
+	int i, round;
+
+	arena = mm_arena_create(ARENA_CHUNK_SIZE, arena_flags[_i]);
+	ck_assert(arena != NULL);
+
+	first = arena_alloc_filled(arena, 0);
+
+	// Allocations before the mark must survive the rewinds
+	for (i = 1; i < NUM_ARENA_ALLOC/2; i++)
+		ptrs[i] = arena_alloc_filled(arena, i);
+
+	mm_arena_mark(arena, &pos);
+
+	for (round = 0; round < 3; round++) {
+		for (i = NUM_ARENA_ALLOC/2; i < NUM_ARENA_ALLOC; i++) {
+			unsigned char* ptr = arena_alloc_filled(arena, i);
+
+			// Same sequence after rewind must give same blocks
+			if (round > 0)
+				ck_assert(ptrs[i] == ptr);
+
+			ptrs[i] = ptr;
+		}
+
+		// allocation bigger than a chunk
+		large = mm_arena_alloc(arena, 64, 4*ARENA_CHUNK_SIZE);
+		ck_assert(large != NULL);
+		ck_assert_int_eq((uintptr_t)large & 63, 0);
+		memset(large, 0xAA, 4*ARENA_CHUNK_SIZE);
+
+		for (i = 1; i < NUM_ARENA_ALLOC; i++)
+			arena_check_filled(ptrs[i], i);
+
+		mm_arena_rewind(arena, &pos);
+	}
+
+	arena_check_filled(first, 0);
+
+	mm_arena_reset(arena);
+	ck_assert(arena_alloc_filled(arena, 0) == first);
+
+	mm_arena_destroy(arena);
+}
+END_TEST
+
+
+START_TEST(arena_error)
+{
+	struct mm_error_state errstate;
+	struct mm_arena* arena;
+
+	mm_save_errorstate(&errstate);
+
+	ck_assert(mm_arena_create(0, ~MM_ARENA_GUARD) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	arena = mm_arena_create(0, 0);
+	ck_assert(arena != NULL);
+
+	ck_assert(mm_arena_alloc(arena, 24, 16) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	ck_assert(mm_arena_alloc(arena, 0, SIZE_MAX - 16) == NULL);
+	ck_assert(mm_get_lasterror_number() == ENOMEM);
+
+	// arena must still be usable after failures
+	ck_assert(mm_arena_alloc(arena, 0, 16) != NULL);
+
+	mm_arena_destroy(arena);
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
+static
+struct mm_alloc_site_stats* find_site_stats(struct mm_alloc_site_stats* stats,
+                                            int num, const char* desc)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (strcmp(stats[i].desc, desc) == 0)
+			return &stats[i];
+	}
+
+	return NULL;
+}
+
+
+START_TEST(alloc_instrumentation)
+{
+	struct mm_error_state errstate;
+	struct mm_alloc_site_stats stats[64];
+	struct mm_alloc_site_stats* site;
+	size_t live_count;
+	void* ptr;
+	int num, enabled;
+
+	mm_save_errorstate(&errstate);
+
+	// Instrumentation can be enabled only if mmlib has not allocated yet
+	// in the test process
+	enabled = (mm_alloc_stats_enable() == 0);
+	if (!enabled)
+		ck_assert(mm_get_lasterror_number() == EBUSY);
+
+	ptr = mm_aligned_alloc(64, 1000);
+	ck_assert(ptr != NULL);
+	ck_assert(((uintptr_t)ptr & 63) == 0);
+	memset(ptr, 0xff, 1000);
+
+	ck_assert(mm_alloc_stats_enable() == -1);
+	ck_assert(mm_get_lasterror_number() == EBUSY);
+
+	num = mm_alloc_get_stats(stats, MM_NELEM(stats));
+	if (num > (int)MM_NELEM(stats))
+		num = MM_NELEM(stats);
+
+	site = find_site_stats(stats, num, "mm_aligned_alloc");
+	if (enabled)
+		ck_assert(site != NULL);
+
+	if (site) {
+		ck_assert(site->num_alloc >= 1);
+		ck_assert(site->num_bytes >= 1000);
+		ck_assert(site->live_count >= 1);
+		ck_assert(site->live_bytes >= 1000);
+		ck_assert(site->peak_bytes >= site->live_bytes);
+		live_count = site->live_count;
+	}
+
+	mm_aligned_free(ptr);
+
+	num = mm_alloc_get_stats(stats, MM_NELEM(stats));
+	if (num > (int)MM_NELEM(stats))
+		num = MM_NELEM(stats);
+
+	if (site) {
+		site = find_site_stats(stats, num, "mm_aligned_alloc");
+		ck_assert(site != NULL);
+		ck_assert(site->live_count == live_count - 1);
+	}
+
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
+struct test_allocator_data {
+	int num_alloc;
+	int num_free;
+};
+
+
+static
+void* test_allocator_alloc(void* data, size_t alignment, size_t size)
+{
+	struct test_allocator_data* tdata = data;
+	char* base;
+	uintptr_t aligned;
+
+	base = malloc(size + alignment + sizeof(void*));
+	if (!base)
+		return NULL;
+
+	// Keep pointer to the malloc'ed block just before aligned block
+	aligned = (uintptr_t)(base + sizeof(void*) + alignment-1);
+	aligned &= ~(uintptr_t)(alignment-1);
+	((void**)aligned)[-1] = base;
+
+	tdata->num_alloc++;
+	return (void*)aligned;
+}
+
+
+static
+void test_allocator_free(void* data, void* ptr)
+{
+	struct test_allocator_data* tdata = data;
+
+	tdata->num_free++;
+	free(((void**)ptr)[-1]);
+}
+
+
+START_TEST(alloc_user_allocator)
+{
+	static struct test_allocator_data tdata;
+	struct mm_allocator allocator = {
+		.alloc = test_allocator_alloc,
+		.free = test_allocator_free,
+		.data = &tdata,
+	};
+	struct mm_allocator invalid = {.alloc = test_allocator_alloc};
+	struct mm_error_state errstate;
+	void* ptr;
+	int hooked;
+
+	mm_save_errorstate(&errstate);
+
+	ck_assert(mm_set_allocator(NULL) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	ck_assert(mm_set_allocator(&invalid) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	// Allocator can be set only if mmlib has not allocated yet in the
+	// test process
+	hooked = (mm_set_allocator(&allocator) == 0);
+	if (!hooked)
+		ck_assert(mm_get_lasterror_number() == EBUSY);
+
+	ptr = mm_aligned_alloc(256, 100);
+	ck_assert(ptr != NULL);
+	ck_assert(((uintptr_t)ptr & 255) == 0);
+	memset(ptr, 0xff, 100);
+
+	ptr = mm_aligned_realloc(ptr, 256, 200);
+	ck_assert(ptr != NULL);
+	ck_assert(((uintptr_t)ptr & 255) == 0);
+	ck_assert(((unsigned char*)ptr)[99] == 0xff);
+
+	if (hooked)
+		ck_assert(tdata.num_alloc == tdata.num_free + 1);
+
+	mm_aligned_free(ptr);
+
+	if (hooked)
+		ck_assert(tdata.num_alloc == tdata.num_free);
+
+	ck_assert(mm_set_allocator(&allocator) == -1);
+	ck_assert(mm_get_lasterror_number() == EBUSY);
+
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
+
 /**************************************************************************
  *                                                                        *
  *                          Test suite setup                              *
@@ -158,11 +1005,30 @@ TCase* create_allocation_tcase(void)
 
 	tcase_add_test(tc, aligned_heap_allocation);
 	tcase_add_test(tc, aligned_heap_allocation_error);
+	tcase_add_loop_test(tc, aligned_heap_allocation_ex,
+	                    0, MM_NELEM(alloc_ex_flags));
+	tcase_add_test(tc, aligned_heap_allocation_ex_error);
+	tcase_add_loop_test(tc, aligned_heap_reallocation,
+	                    0, MM_NELEM(realloc_aligns));
+	tcase_add_test(tc, aligned_heap_reallocation_error);
+	tcase_add_test(tc, numa_placement);
+	tcase_add_test(tc, numa_placement_error);
 	tcase_add_loop_test(tc, aligned_stack_allocation,
 	                    0, MM_NELEM(stack_alloc_sizes));
 	tcase_add_loop_test(tc, safe_stack_allocation,
 	                    0, MM_NELEM(malloca_sizes));
 	tcase_add_test(tc, safe_stack_allocation_error);
+	tcase_add_test(tc, scratch_allocation);
+	tcase_add_test(tc, scratch_allocation_threads);
+	tcase_add_test(tc, adaptive_stack_allocation);
+	tcase_add_loop_test(tc, pool_allocation, 0, MM_NELEM(pool_params));
+	tcase_add_test(tc, pool_cross_thread_free);
+	tcase_add_test(tc, pool_destroy_in_thread);
+	tcase_add_test(tc, pool_create_error);
+	tcase_add_loop_test(tc, arena_allocation, 0, MM_NELEM(arena_flags));
+	tcase_add_test(tc, arena_error);
+	tcase_add_test(tc, alloc_instrumentation);
+	tcase_add_test(tc, alloc_user_allocator);
 
 	return tc;
 }
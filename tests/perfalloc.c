@@ -0,0 +1,300 @@
+/*
+   @mindmaze_header@
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mmlib.h"
+#include "mmpredefs.h"
+#include "mmthread.h"
+#include "mmtime.h"
+
+/*************************************************************************
+ *                                                                       *
+ *                          Performance tests                            *
+ *                                                                       *
+ *************************************************************************/
+
+#define NUM_ITERATION           2000
+#define NUM_OBJ_PER_ITER        64
+#define NUM_THREAD_DEFAULT      4
+#define NUM_THREAD_MAX          128
+#define OBJSIZE_DEFAULT         64
+#define OBJ_ALIGN               16
+
+static int num_thread = NUM_THREAD_DEFAULT;
+static size_t objsize = OBJSIZE_DEFAULT;
+
+struct alloc_ops {
+	const char* name;
+	void* (*alloc)(void* data);
+	void (*free)(void* data, void* ptr);
+	void* data;
+};
+
+
+static
+void* aligned_alloc_op(void* data)
+{
+	(void)data;
+	return mm_aligned_alloc(OBJ_ALIGN, objsize);
+}
+
+
+static
+void aligned_free_op(void* data, void* ptr)
+{
+	(void)data;
+	mm_aligned_free(ptr);
+}
+
+
+static
+void* pool_alloc_op(void* data)
+{
+	return mm_pool_alloc(data);
+}
+
+
+static
+void pool_free_op(void* data, void* ptr)
+{
+	mm_pool_free(data, ptr);
+}
+
+
+static
+int64_t diff_ns(const struct mm_timespec* start, const struct mm_timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * NS_IN_SEC
+	       + (end->tv_nsec - start->tv_nsec);
+}
+
+
+/*
+ * Each thread allocates a set of objects and free them in the next
+ * iteration. Half of the objects of the set are exchanged with the
+ * neighbour thread before being freed, so that a fair amount of
+ * deallocations are done on objects allocated by a different thread.
+ */
+struct thread_data {
+	const struct alloc_ops* ops;
+	void* objs[NUM_OBJ_PER_ITER];
+	mm_thr_mutex_t mtx;
+	struct thread_data* neighbour;
+	int64_t duration;
+	char pad[64];
+};
+
+static struct thread_data thread_data[NUM_THREAD_MAX];
+
+
+static
+void* alloc_perf_routine(void* arg)
+{
+	struct thread_data* data = arg;
+	const struct alloc_ops* ops = data->ops;
+	struct thread_data* neighbour = data->neighbour;
+	struct mm_timespec start, end;
+	void* exchanged[NUM_OBJ_PER_ITER/2];
+	int i, j;
+
+	mm_gettime(MM_CLK_MONOTONIC, &start);
+
+	for (i = 0; i < NUM_ITERATION; i++) {
+		mm_thr_mutex_lock(&data->mtx);
+		for (j = 0; j < NUM_OBJ_PER_ITER; j++) {
+			ops->free(ops->data, data->objs[j]);
+			data->objs[j] = ops->alloc(ops->data);
+			memset(data->objs[j], 0, sizeof(void*));
+		}
+
+		mm_thr_mutex_unlock(&data->mtx);
+
+		// Swap half of the object set with the neighbour thread
+		if (neighbour == data)
+			continue;
+
+		mm_thr_mutex_lock(&data->mtx);
+		memcpy(exchanged, data->objs, sizeof(exchanged));
+		mm_thr_mutex_unlock(&data->mtx);
+
+		mm_thr_mutex_lock(&neighbour->mtx);
+		for (j = 0; j < NUM_OBJ_PER_ITER/2; j++) {
+			void* tmp = neighbour->objs[j];
+			neighbour->objs[j] = exchanged[j];
+			exchanged[j] = tmp;
+		}
+		mm_thr_mutex_unlock(&neighbour->mtx);
+
+		mm_thr_mutex_lock(&data->mtx);
+		memcpy(data->objs, exchanged, sizeof(exchanged));
+		mm_thr_mutex_unlock(&data->mtx);
+	}
+
+	mm_gettime(MM_CLK_MONOTONIC, &end);
+	data->duration = diff_ns(&start, &end);
+
+	return NULL;
+}
+
+
+static
+void run_perf_alloc(const struct alloc_ops* ops)
+{
+	mm_thread_t thids[NUM_THREAD_MAX];
+	int64_t sum = 0;
+	double ns_per_op;
+	int i, j;
+
+	for (i = 0; i < num_thread; i++) {
+		thread_data[i].ops = ops;
+		thread_data[i].neighbour = &thread_data[(i+1) % num_thread];
+		mm_thr_mutex_init(&thread_data[i].mtx, 0);
+		for (j = 0; j < NUM_OBJ_PER_ITER; j++)
+			thread_data[i].objs[j] = ops->alloc(ops->data);
+	}
+
+	for (i = 0; i < num_thread; i++)
+		mm_thr_create(&thids[i], alloc_perf_routine, &thread_data[i]);
+
+	for (i = 0; i < num_thread; i++) {
+		mm_thr_join(thids[i], NULL);
+		sum += thread_data[i].duration;
+	}
+
+	for (i = 0; i < num_thread; i++) {
+		for (j = 0; j < NUM_OBJ_PER_ITER; j++)
+			ops->free(ops->data, thread_data[i].objs[j]);
+
+		mm_thr_mutex_deinit(&thread_data[i].mtx);
+	}
+
+	// Each inner iteration is one free and one allocation
+	ns_per_op = (double)sum / (2.0 * num_thread * NUM_ITERATION
+	                           * NUM_OBJ_PER_ITER);
+	printf("%-18s: %8.2f ns per alloc or free\n", ops->name, ns_per_op);
+}
+
+
+#define NUM_MALLOCA_ITERATION  100000
+
+static const size_t malloca_bench_sizes[] = {4096, 16384, 65536};
+
+static NOINLINE
+void use_buffer(void* buf, size_t size)
+{
+	memset(buf, 0, 64);
+	((char*)buf)[size-1] = 0;
+}
+
+
+static NOINLINE
+void malloca_fixed(size_t size)
+{
+	void* buf = mm_malloca(size);
+
+	use_buffer(buf, size);
+	mm_freea(buf);
+}
+
+
+static NOINLINE
+void malloca_adaptive(size_t size)
+{
+	void* buf = mm_malloca_adaptive(size);
+
+	use_buffer(buf, size);
+	mm_freea(buf);
+}
+
+
+/*
+ * Compare the number of allocations of mm_malloca() that are not served
+ * by the stack with the fixed and the adaptive threshold.
+ */
+static
+void run_perf_malloca(const char* name, void (*fn)(size_t), size_t size)
+{
+	struct mm_malloca_stats before, after;
+	struct mm_timespec start, end;
+	uint64_t num_off_stack;
+	int i;
+
+	mm_malloca_get_stats(&before);
+	mm_gettime(MM_CLK_MONOTONIC, &start);
+
+	for (i = 0; i < NUM_MALLOCA_ITERATION; i++)
+		fn(size);
+
+	mm_gettime(MM_CLK_MONOTONIC, &end);
+	mm_malloca_get_stats(&after);
+
+	num_off_stack = (after.scratch_allocs - before.scratch_allocs)
+	                + (after.heap_fallbacks - before.heap_fallbacks);
+	printf("%-19s (%6zu): %8.2f ns per call, %llu/%i not on stack\n",
+	       name, size,
+	       (double)diff_ns(&start, &end) / NUM_MALLOCA_ITERATION,
+	       (unsigned long long)num_off_stack, NUM_MALLOCA_ITERATION);
+}
+
+
+int main(int argc, char* argv[])
+{
+	struct mm_pool_stats stats;
+	struct mm_pool* pool;
+	int i;
+	struct alloc_ops aligned_ops = {
+		.name = "mm_aligned_alloc",
+		.alloc = aligned_alloc_op,
+		.free = aligned_free_op,
+	};
+	struct alloc_ops pool_ops = {
+		.name = "mm_pool_alloc",
+		.alloc = pool_alloc_op,
+		.free = pool_free_op,
+	};
+
+	if (argc > 1)
+		num_thread = atoi(argv[1]);
+
+	if (argc > 2)
+		objsize = atoi(argv[2]);
+
+	if (num_thread < 1 || num_thread > NUM_THREAD_MAX) {
+		fprintf(stderr, "num_thread must be between 1 and %i\n",
+		        NUM_THREAD_MAX);
+		return EXIT_FAILURE;
+	}
+
+	printf("num_thread=%i objsize=%zu\n", num_thread, objsize);
+
+	run_perf_alloc(&aligned_ops);
+
+	pool = mm_pool_create(objsize, OBJ_ALIGN);
+	pool_ops.data = pool;
+	run_perf_alloc(&pool_ops);
+
+	mm_pool_get_stats(pool, &stats);
+	printf("pool stats: hits=%llu misses=%llu drains=%llu "
+	       "bytes_held=%zu\n",
+	       (unsigned long long)stats.hits,
+	       (unsigned long long)stats.misses,
+	       (unsigned long long)stats.drains,
+	       stats.bytes_held);
+	mm_pool_destroy(pool);
+
+	for (i = 0; i < MM_NELEM(malloca_bench_sizes); i++) {
+		run_perf_malloca("mm_malloca", malloca_fixed,
+		                 malloca_bench_sizes[i]);
+		run_perf_malloca("mm_malloca_adaptive", malloca_adaptive,
+		                 malloca_bench_sizes[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+   @mindmaze_header@
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "mmerrno.h"
+#include "mmlib.h"
+#include "mmpredefs.h"
+#include "mmtime.h"
+
+/*************************************************************************
+ *                                                                       *
+ *                          Performance tests                            *
+ *                                                                       *
+ *************************************************************************/
+
+#define TABLE_SIZE_MB_DEFAULT   512
+#define NUM_ACCESS              (16*1024*1024)
+
+struct alloc_mode {
+	const char* name;
+	int flags;
+};
+
+static const struct alloc_mode alloc_modes[] = {
+	{"default", 0},
+	{"thp hint", MM_ALLOC_THP_HINT},
+	{"hugepage", MM_ALLOC_HUGEPAGE},
+};
+
+
+static
+int64_t diff_ns(const struct mm_timespec* start, const struct mm_timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * NS_IN_SEC
+	       + (end->tv_nsec - start->tv_nsec);
+}
+
+
+/*
+ * Follow a chain of random indices in the table: each access depends on
+ * the previous one, so the latency of the TLB misses cannot be hidden by
+ * the out-of-order execution.
+ */
+static
+uint64_t random_walk(const uint64_t* table, size_t num_elt)
+{
+	uint64_t idx = 0;
+	int i;
+
+	for (i = 0; i < NUM_ACCESS; i++)
+		idx = table[idx % num_elt];
+
+	return idx;
+}
+
+
+static
+void run_perf_hugepage(const struct alloc_mode* mode, size_t table_size)
+{
+	struct mm_timespec start, end;
+	size_t i, num_elt = table_size / sizeof(uint64_t);
+	uint64_t* table;
+	uint64_t rnd = 88172645463325252ULL;
+	uint64_t res;
+
+	table = mm_aligned_alloc_ex(MM_PAGESZ, table_size, mode->flags);
+	if (!table) {
+		mm_print_lasterror("cannot allocate table");
+		return;
+	}
+
+	// Fill the table with random indices (xorshift generator)
+	for (i = 0; i < num_elt; i++) {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 7;
+		rnd ^= rnd << 17;
+		table[i] = rnd;
+	}
+
+	mm_gettime(MM_CLK_MONOTONIC, &start);
+	res = random_walk(table, num_elt);
+	mm_gettime(MM_CLK_MONOTONIC, &end);
+
+	printf("%-10s: pagesize=%8zu kiB  %8.2f ns per access (%llx)\n",
+	       mode->name, mm_aligned_get_pagesize(table) / 1024,
+	       (double)diff_ns(&start, &end) / NUM_ACCESS,
+	       (unsigned long long)(res & 0xf));
+
+	mm_aligned_free(table);
+}
+
+
+int main(int argc, char* argv[])
+{
+	size_t table_size_mb = TABLE_SIZE_MB_DEFAULT;
+	int i;
+
+	if (argc > 1)
+		table_size_mb = atoi(argv[1]);
+
+	if (table_size_mb < 1) {
+		fprintf(stderr, "table size must be at least 1 MiB\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("table size=%zu MiB\n", table_size_mb);
+
+	for (i = 0; i < MM_NELEM(alloc_modes); i++)
+		run_perf_hugepage(&alloc_modes[i], table_size_mb * 1024*1024);
+
+	return EXIT_SUCCESS;
+}
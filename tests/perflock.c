@@ -35,6 +35,7 @@ struct perf_data {
 #define NUM_THREAD_PER_LOCK_MAX         128
 #define NUM_LOCK_MAX                    32
 static struct perf_data data_array[32];
+static struct mm_profile_ctx* prof_ctx;
 static int num_lock = NUM_LOCK_DEFAULT;
 static int num_thread_per_lock = NUM_THREAD_PER_LOCK_DEFAULT;
 
@@ -51,12 +52,12 @@ void* lock_perf_routine(void* arg)
 
 		mm_thr_mutex_lock(&data->mtx);
 		if (ind == 0)
-			mm_toc();
+			mm_profile_ctx_toc(prof_ctx);
 
 		data->iter++;
 
 		if (ind == 0)
-			mm_tic();
+			mm_profile_ctx_tic(prof_ctx);
 
 		mm_thr_mutex_unlock(&data->mtx);
 
@@ -76,7 +77,8 @@ int run_perf_lock_contended(int flags)
 	int i;
 	int num_thids = num_thread_per_lock*num_lock;
 
-	mm_profile_reset(0);
+	// Measure points are taken by all threads holding the first lock
+	prof_ctx = mm_profile_ctx_create(0);
 
 	for (i = 0; i < num_lock; i++) {
 		mm_thr_mutex_init(&data_array[i].mtx, flags);
@@ -94,7 +96,7 @@ int run_perf_lock_contended(int flags)
 	// Unlock mutex now
 	for (i = 0; i < num_lock; i++) {
 		if (i == 0)
-			mm_tic();
+			mm_profile_ctx_tic(prof_ctx);
 
 		mm_thr_mutex_unlock(&data_array[i].mtx);
 	}
@@ -108,7 +110,8 @@ int run_perf_lock_contended(int flags)
 
 	printf("\ncontended case with flags=0x%08x:\n", flags);
 	fflush(stdout);
-	mm_profile_print(PROF_DEFAULT, 1);
+	mm_profile_ctx_print(prof_ctx, PROF_DEFAULT, 1);
+	mm_profile_ctx_destroy(prof_ctx);
 	return 0;
 }
 
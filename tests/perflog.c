@@ -0,0 +1,213 @@
+/*
+   @mindmaze_header@
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mmerrno.h"
+#include "mmlog.h"
+#include "mmpredefs.h"
+#include "mmsysio.h"
+#include "mmthread.h"
+#include "mmtime.h"
+
+#undef MM_LOG_MODULE_NAME
+#define MM_LOG_MODULE_NAME "perflog"
+
+#ifdef _WIN32
+#  define NULL_DEVICE   "NUL"
+#  define localtime_r(time, tm) localtime_s((tm), (time))
+#else
+#  define NULL_DEVICE   "/dev/null"
+#endif
+
+#define ERRFD                   2 // STDERR_FILENO
+#define NUM_THREAD_DEFAULT      32
+#define NUM_THREAD_MAX          256
+#define NUM_LINE_DEFAULT        20000
+
+/*************************************************************************
+ *                                                                       *
+ *                          Performance tests                            *
+ *                                                                       *
+ *************************************************************************/
+
+static int num_thread = NUM_THREAD_DEFAULT;
+static int num_line = NUM_LINE_DEFAULT;
+
+
+static
+int64_t diff_ns(const struct mm_timespec* start, const struct mm_timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * NS_IN_SEC
+	       + (end->tv_nsec - start->tv_nsec);
+}
+
+
+/*
+ * Format and write a log line like mm_log() did before the time stamp
+ * caching: time(), localtime_r() and strftime() are called for each line.
+ */
+static
+void reference_log(int lvl, const char* location, const char* msg, ...)
+{
+	char buff[256];
+	struct tm tm;
+	time_t ts;
+	va_list args;
+	size_t len;
+	int rv;
+
+	(void)lvl;
+
+	ts = time(NULL);
+	localtime_r(&ts, &tm);
+	len = strftime(buff, sizeof(buff), "%d/%m/%y %H:%M:%S", &tm);
+	len += snprintf(buff+len, sizeof(buff)-len-1, " %-5s %-16s : ",
+	                "INFO", location);
+
+	va_start(args, msg);
+	rv = vsnprintf(buff+len, sizeof(buff)-len, msg, args);
+	va_end(args);
+
+	len += (rv < (int)(sizeof(buff)-len-1)) ? rv : (int)(sizeof(buff)-len-1);
+	buff[len++] = '\n';
+	mm_write(ERRFD, buff, len);
+}
+
+
+static
+void* reference_log_routine(void* arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < num_line; i++)
+		reference_log(MM_LOG_INFO, MM_LOG_MODULE_NAME,
+		              "log line %i of %s", i, "perflog");
+
+	return NULL;
+}
+
+
+static
+void* mm_log_routine(void* arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < num_line; i++)
+		mm_log_info("log line %i of %s", i, "perflog");
+
+	return NULL;
+}
+
+
+static
+void* mm_log_debug_routine(void* arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < num_line; i++)
+		mm_log_debug("log line %i of %s", i, "perflog");
+
+	return NULL;
+}
+
+
+/*
+ * Run @routine in num_thread threads simultaneously and report the log
+ * throughput.
+ */
+static
+void run_perf_log(const char* name, void* (*routine)(void*))
+{
+	mm_thread_t thids[NUM_THREAD_MAX];
+	struct mm_timespec start, end;
+	double total_ns, num_total;
+	int i;
+
+	mm_gettime(MM_CLK_MONOTONIC, &start);
+
+	for (i = 0; i < num_thread; i++)
+		mm_thr_create(&thids[i], routine, NULL);
+
+	for (i = 0; i < num_thread; i++)
+		mm_thr_join(thids[i], NULL);
+
+	mm_gettime(MM_CLK_MONOTONIC, &end);
+
+	total_ns = diff_ns(&start, &end);
+	num_total = (double)num_thread * num_line;
+	printf("%-32s: %10.0f lines/s (%7.1f ns per line per thread)\n",
+	       name, num_total * 1.0e9 / total_ns,
+	       total_ns * num_thread / num_total);
+}
+
+
+int main(int argc, char* argv[])
+{
+	int fd, stderr_fd;
+
+	if (argc > 1)
+		num_thread = atoi(argv[1]);
+
+	if (argc > 2)
+		num_line = atoi(argv[2]);
+
+	if (num_thread < 1 || num_thread > NUM_THREAD_MAX || num_line < 1) {
+		fprintf(stderr, "usage: %s [num_thread (max %i)] [num_line]\n",
+		        argv[0], NUM_THREAD_MAX);
+		return EXIT_FAILURE;
+	}
+
+	printf("%i threads writing %i log lines each\n", num_thread, num_line);
+	fflush(stdout);
+
+	// Measure the formatting cost, not the one of the log output
+	fd = mm_open(NULL_DEVICE, O_WRONLY, 0);
+	if (fd < 0) {
+		mm_print_lasterror("cannot open " NULL_DEVICE);
+		return EXIT_FAILURE;
+	}
+
+	stderr_fd = mm_dup(ERRFD);
+	mm_dup2(fd, ERRFD);
+	mm_close(fd);
+
+	run_perf_log("uncached strftime (reference)", reference_log_routine);
+
+	mm_log_set_timestamp(MM_LOG_TS_DEFAULT);
+	run_perf_log("mm_log (default timestamp)", mm_log_routine);
+
+	mm_log_set_timestamp(MM_LOG_TS_USEC);
+	run_perf_log("mm_log (usec timestamp)", mm_log_routine);
+
+	mm_log_set_timestamp(MM_LOG_TS_MONOTONIC);
+	run_perf_log("mm_log (monotonic timestamp)", mm_log_routine);
+
+	// Debug lines disabled on the output but kept by the flight recorder
+	mm_log_set_timestamp(MM_LOG_TS_DEFAULT);
+	mm_log_set_maxlvl(MM_LOG_INFO);
+	if (mm_log_recorder_start(NULL, NULL) == 0) {
+		run_perf_log("mm_log_debug (flight recorder)",
+		             mm_log_debug_routine);
+		mm_log_recorder_stop();
+	}
+
+	mm_dup2(stderr_fd, ERRFD);
+	mm_close(stderr_fd);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+   @mindmaze_header@
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mmerrno.h"
+#include "mmlib.h"
+#include "mmpredefs.h"
+#include "mmtime.h"
+
+/*************************************************************************
+ *                                                                       *
+ *                          Performance tests                            *
+ *                                                                       *
+ *************************************************************************/
+
+#define START_SIZE              (4*1024)
+#define MAX_SIZE_MB_DEFAULT     1024
+#define BUF_ALIGN               64
+#define NUM_ROUND               3
+
+static size_t max_size = (size_t)MAX_SIZE_MB_DEFAULT * 1024*1024;
+
+
+static
+int64_t diff_ns(const struct mm_timespec* start, const struct mm_timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * NS_IN_SEC
+	       + (end->tv_nsec - start->tv_nsec);
+}
+
+
+static
+void* grow_alloc_copy(void* ptr, size_t oldsize, size_t newsize)
+{
+	void* newptr;
+
+	newptr = mm_aligned_alloc(BUF_ALIGN, newsize);
+	if (!newptr)
+		return NULL;
+
+	if (ptr) {
+		memcpy(newptr, ptr, oldsize);
+		mm_aligned_free(ptr);
+	}
+
+	return newptr;
+}
+
+
+static
+void* grow_realloc(void* ptr, size_t oldsize, size_t newsize)
+{
+	(void)oldsize;
+	return mm_aligned_realloc(ptr, BUF_ALIGN, newsize);
+}
+
+
+/*
+ * Grow a buffer by doubling its size from START_SIZE to max_size, filling
+ * the new part at each step as a receive buffer or a growing array would.
+ * Report the time spent in growing only (filling time excluded).
+ */
+static
+void run_perf_realloc(const char* name,
+                      void* (*grow)(void*, size_t, size_t))
+{
+	struct mm_timespec start, end;
+	int64_t grow_ns = 0;
+	size_t size, oldsize;
+	char* buf;
+	int round;
+
+	for (round = 0; round < NUM_ROUND; round++) {
+		buf = NULL;
+		oldsize = 0;
+		for (size = START_SIZE; size <= max_size; size *= 2) {
+			mm_gettime(MM_CLK_MONOTONIC, &start);
+			buf = grow(buf, oldsize, size);
+			mm_gettime(MM_CLK_MONOTONIC, &end);
+			if (!buf) {
+				mm_print_lasterror("cannot grow buffer");
+				exit(EXIT_FAILURE);
+			}
+
+			grow_ns += diff_ns(&start, &end);
+			memset(buf + oldsize, 'x', size - oldsize);
+			oldsize = size;
+		}
+
+		mm_aligned_free(buf);
+	}
+
+	printf("%-30s: %10.3f ms per growth sequence\n",
+	       name, (double)grow_ns / (NUM_ROUND * 1.0e6));
+}
+
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1)
+		max_size = (size_t)atoi(argv[1]) * 1024*1024;
+
+	if (max_size < START_SIZE) {
+		fprintf(stderr, "max size must be at least 1 MiB\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("growth from %i kiB to %zu MiB\n",
+	       START_SIZE/1024, max_size/(1024*1024));
+
+	run_perf_realloc("mm_aligned_alloc+memcpy+free", grow_alloc_copy);
+	run_perf_realloc("mm_aligned_realloc", grow_realloc);
+
+	return EXIT_SUCCESS;
+}
@@ -9,6 +9,8 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <strings.h>
 
 #include "api-testcases.h"
@@ -223,6 +225,106 @@ START_TEST(multiple_maps_test)
 END_TEST
 #undef N
 
+static const int map_anon_flags[] = {
+	MM_MAP_RDWR,
+	MM_MAP_RDWR | MM_MAP_GUARD,
+	MM_MAP_RDWR | MM_MAP_LAZY,
+	MM_MAP_RDWR | MM_MAP_GUARD | MM_MAP_LAZY,
+};
+
+#define ANON_NUM_PAGES  16
+START_TEST(map_anon_test)
+{
+	int mflags = map_anon_flags[_i];
+	size_t len = ANON_NUM_PAGES * MM_PAGESZ;
+	size_t i;
+	char* map;
+	char* mid;
+
+	map = mm_map_anon(len, mflags);
+	ck_assert(map != NULL);
+	ck_assert(((uintptr_t)map & (MM_PAGESZ-1)) == 0);
+
+	if (mflags & MM_MAP_LAZY)
+		ck_assert(mm_map_recommit(map, len) == 0);
+
+	for (i = 0; i < len; i++)
+		ck_assert(map[i] == 0);
+
+	memset(map, 'x', len);
+
+	// Give back middle pages to the system and reuse them
+	mid = map + 4*MM_PAGESZ;
+	ck_assert(mm_map_decommit(mid, 4*MM_PAGESZ, 0) == 0);
+	ck_assert(mm_map_recommit(mid, 4*MM_PAGESZ) == 0);
+	for (i = 0; i < 4*MM_PAGESZ; i++)
+		ck_assert(mid[i] == 0);
+
+	ck_assert(map[4*MM_PAGESZ - 1] == 'x');
+	ck_assert(map[8*MM_PAGESZ] == 'x');
+
+	memset(mid, 'y', 4*MM_PAGESZ);
+	ck_assert(mm_map_decommit(mid, 4*MM_PAGESZ, MM_MAP_DECOMMIT_DEFER) == 0);
+	ck_assert(mm_map_recommit(mid, 4*MM_PAGESZ) == 0);
+	memset(mid, 'z', 4*MM_PAGESZ);
+
+	// Whole mapping can be decommitted
+	ck_assert(mm_map_decommit(map, len, 0) == 0);
+
+	ck_assert(mm_unmap(map) == 0);
+}
+END_TEST
+#undef ANON_NUM_PAGES
+
+
+START_TEST(map_anon_invalid_test)
+{
+	struct mm_error_state errstate;
+	char* map;
+	char* fmap;
+	int fd;
+
+	mm_save_errorstate(&errstate);
+
+	ck_assert(mm_map_anon(MM_PAGESZ, MM_MAP_SHARED) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	ck_assert(mm_map_anon(0, MM_MAP_RDWR) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+
+	map = mm_map_anon(2*MM_PAGESZ, MM_MAP_RDWR|MM_MAP_GUARD);
+	ck_assert(map != NULL);
+
+	ck_assert(mm_map_decommit(map + 1, MM_PAGESZ, 0) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	ck_assert(mm_map_decommit(map, MM_PAGESZ, ~MM_MAP_DECOMMIT_DEFER) == -1);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	ck_assert(mm_map_decommit(&errstate, MM_PAGESZ, 0) == -1);
+
+	// Range exceeding the mapping (or a mapping not anonymous) is refused
+	// on platforms tracking the mappings
+	if (mm_map_decommit(map + MM_PAGESZ, 2*MM_PAGESZ, 0) == -1)
+		ck_assert(mm_get_lasterror_number() == EFAULT);
+
+	fd = mm_anon_shm();
+	ck_assert(fd >= 0);
+	ck_assert(mm_ftruncate(fd, MM_PAGESZ) == 0);
+	ck_assert(mm_mapfile(fd, 0, MM_PAGESZ,
+	                     MM_MAP_RDWR|MM_MAP_SHARED|MM_MAP_GUARD) == NULL);
+	ck_assert(mm_get_lasterror_number() == EINVAL);
+	fmap = mm_mapfile(fd, 0, MM_PAGESZ, MM_MAP_RDWR|MM_MAP_SHARED);
+	ck_assert(fmap != NULL);
+	ck_assert(mm_map_decommit(fmap, MM_PAGESZ, 0) == -1);
+	ck_assert(mm_get_lasterror_number() == EFAULT);
+	ck_assert(mm_unmap(fmap) == 0);
+	mm_close(fd);
+
+	ck_assert(mm_unmap(map) == 0);
+
+	mm_set_errorstate(&errstate);
+}
+END_TEST
+
+
 LOCAL_SYMBOL
 TCase* create_shm_tcase(void)
 {
@@ -239,6 +341,8 @@ TCase* create_shm_tcase(void)
 	tcase_add_test(tc, mapfile_invalid_offset_test);
 	tcase_add_test(tc, invalid_unmap_test);
 	tcase_add_test(tc, multiple_maps_test);
+	tcase_add_loop_test(tc, map_anon_test, 0, MM_NELEM(map_anon_flags));
+	tcase_add_test(tc, map_anon_invalid_test);
 
 	return tc;
 }
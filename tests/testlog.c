@@ -7,8 +7,15 @@
 
 #include <stdlib.h>
 #include <mmlog.h>
+#include <mmsysio.h>
+#include <mmthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ERRFD   2 // STDERR_FILENO
 
 static
 void logged_func(void)
@@ -100,10 +107,587 @@ int test_basic_logging(void)
 	return 1;
 }
 
+
+#define ASYNC_LOG_FILE          BUILDDIR"/testlog-async.log"
+#define NUM_LOG_THREADS         4
+#define NUM_LOG_LINES           500
+
+static
+void* log_lines_thread(void* arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < NUM_LOG_LINES; i++)
+		mm_log_info("async line %i", i);
+
+	return NULL;
+}
+
+
+// Log from several threads in asynchronous mode and return the number of
+// lines written in the log plus the number of lines reported as dropped
+static
+int count_async_log_lines(size_t num_records, int policy)
+{
+	mm_thread_t thids[NUM_LOG_THREADS];
+	char line[512];
+	const char* msg;
+	FILE* fp;
+	int i, fd, stderr_fd, num = -1;
+
+	// Redirect log to a file
+	fd = mm_open(ASYNC_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	stderr_fd = mm_dup(ERRFD);
+	mm_dup2(fd, ERRFD);
+	mm_close(fd);
+
+	if (mm_log_async_start(num_records, policy))
+		goto exit;
+
+	for (i = 0; i < NUM_LOG_THREADS; i++)
+		mm_thr_create(&thids[i], log_lines_thread, NULL);
+
+	for (i = 0; i < NUM_LOG_THREADS; i++)
+		mm_thr_join(thids[i], NULL);
+
+	mm_log_flush();
+	mm_log_async_stop();
+
+	fp = fopen(ASYNC_LOG_FILE, "r");
+	if (!fp)
+		goto exit;
+
+	num = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		msg = strstr(line, " : ");
+		if (!msg)
+			continue;
+
+		if (strstr(msg, "log messages dropped"))
+			num += atoi(msg + 3);
+		else if (!strncmp(msg, " : async line ", 14))
+			num++;
+	}
+
+	fclose(fp);
+
+exit:
+	mm_dup2(stderr_fd, ERRFD);
+	mm_close(stderr_fd);
+	return num;
+}
+
+
+static
+int test_async_logging(void)
+{
+	int total = NUM_LOG_THREADS * NUM_LOG_LINES;
+
+	return count_async_log_lines(16, MM_LOG_ASYNC_BLOCK) == total
+	       && count_async_log_lines(4, MM_LOG_ASYNC_DROP_NEWEST) == total
+	       && count_async_log_lines(4, MM_LOG_ASYNC_DROP_OLDEST) == total
+	       && count_async_log_lines(0, -1) == -1;
+}
+
+
+#define BINARY_LOG_FILE         BUILDDIR"/testlog-binary.bin"
+#define DECODED_LOG_FILE        BUILDDIR"/testlog-binary.log"
+
+// Only read up to the precision of the conversions: not null terminated
+static const char unterminated[4] = {'a', 'b', 'c', 'd'};
+
+#define BINARY_LOG_CASES(X) \
+	X("int %i, negative %d, hex %#x", 42, -7, 0xbeef) \
+	X("long %ld, long long %lld, unsigned %llu", -123456789L, \
+	  -1234567890123LL, 18446744073709551615ULL) \
+	X("size %zu, char %c, short %hd", (size_t)4096, 'm', (short)-12) \
+	X("double %f, %.3e, %g, long double %Lf", 3.14159, -0.000123, 1e100, \
+	  (long double)2.5) \
+	X("string %s, padded [%-8s], precision %.3s", "hello", "ab", "truncated") \
+	X("star width [%*d], star precision [%.*f]", 6, 12, 2, 1.23456) \
+	X("unterminated [%.*s], [%.4s]", 3, unterminated, unterminated) \
+	X("%d%% done, pointer %p", 99, (void*)0x1234) \
+	X("wide string %ls", L"fallback")
+
+static
+void log_binary_cases(void)
+{
+#define LOG_CASE(fmt, ...) mm_log_info(fmt, __VA_ARGS__);
+	BINARY_LOG_CASES(LOG_CASE)
+#undef LOG_CASE
+}
+
+
+// Check that each log message of @path matches the expected message
+static
+int check_binary_log_cases(const char* path)
+{
+	char line[512], expected[256];
+	const char* msg;
+	FILE* fp;
+	int i = 0, ok = 1;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+#define CHECK_CASE(fmt, ...) \
+	if (ok) { \
+		snprintf(expected, sizeof(expected), fmt"\n", __VA_ARGS__); \
+		ok = fgets(line, sizeof(line), fp) \
+		     && (msg = strstr(line, " : ")) \
+		     && !strcmp(msg + 3, expected); \
+		i++; \
+	}
+
+	BINARY_LOG_CASES(CHECK_CASE)
+#undef CHECK_CASE
+
+	if (!ok)
+		fprintf(stderr, "binary log mismatch on case %i\n", i);
+
+	fclose(fp);
+	return ok;
+}
+
+
+static
+int test_binary_logging(void)
+{
+	int fd, out_fd, stderr_fd, rv;
+
+	// Deferred formatting to binary stream, then decoded
+	fd = mm_open(BINARY_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	if (fd < 0 || mm_log_binary_start(fd))
+		return 0;
+
+	log_binary_cases();
+	mm_log_binary_stop();
+	mm_close(fd);
+
+	fd = mm_open(BINARY_LOG_FILE, O_RDONLY, 0);
+	out_fd = mm_open(DECODED_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	rv = mm_log_binary_decode(fd, out_fd);
+	mm_close(fd);
+	mm_close(out_fd);
+	if (rv || !check_binary_log_cases(DECODED_LOG_FILE))
+		return 0;
+
+	// Deferred formatting to the log output
+	fd = mm_open(DECODED_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	stderr_fd = mm_dup(ERRFD);
+	mm_dup2(fd, ERRFD);
+	mm_close(fd);
+
+	rv = mm_log_binary_start(-1);
+	if (!rv) {
+		log_binary_cases();
+		mm_log_flush();
+		mm_log_binary_stop();
+	}
+
+	mm_dup2(stderr_fd, ERRFD);
+	mm_close(stderr_fd);
+
+	return !rv && check_binary_log_cases(DECODED_LOG_FILE);
+}
+
+
+#define NUM_WRAP_CYCLES         4
+#define NUM_WRAP_LINES          2100
+
+// Wrap the ring of the thread with records of mixed sizes so that the end of
+// the ring is reached with less than a record header left, then with
+// formats that cannot be recorded in binary, and check that every record is
+// either decoded or reported as dropped
+static
+int test_binary_ring_wrap(void)
+{
+	char line[512];
+	const char* msg;
+	FILE* fp;
+	int c, i, fd, out_fd, rv, num = 0;
+
+	fd = mm_open(BINARY_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	if (fd < 0 || mm_log_binary_start(fd))
+		return 0;
+
+	// Each record with an argument shifts the offset of the next plain
+	// records in the ring by 8 bytes
+	for (c = 0; c < NUM_WRAP_CYCLES; c++) {
+		mm_log_info("wrap %d", c);
+		for (i = 0; i < NUM_WRAP_LINES; i++) {
+			mm_log_info("wrap");
+			if (i % 256 == 0)
+				mm_log_flush();
+		}
+	}
+
+	// Unsupported formats are recorded formatted: they must fit in the
+	// space reserved for them as well
+	for (i = 0; i < NUM_WRAP_LINES; i++) {
+		mm_log_info("wrap unsupported %ls %*d", L"wide", i % 200, i);
+		if (i % 256 == 0)
+			mm_log_flush();
+	}
+
+	mm_log_binary_stop();
+	mm_close(fd);
+
+	fd = mm_open(BINARY_LOG_FILE, O_RDONLY, 0);
+	out_fd = mm_open(DECODED_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	rv = mm_log_binary_decode(fd, out_fd);
+	mm_close(fd);
+	mm_close(out_fd);
+
+	fp = fopen(DECODED_LOG_FILE, "r");
+	if (rv || !fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		msg = strstr(line, " : ");
+		if (!msg)
+			continue;
+
+		if (strstr(msg, "log messages dropped"))
+			num += atoi(msg + 3);
+		else if (!strncmp(msg, " : wrap", 7))
+			num++;
+	}
+
+	fclose(fp);
+	return num == NUM_WRAP_CYCLES * (NUM_WRAP_LINES + 1) + NUM_WRAP_LINES;
+}
+
+
+#define TIMESTAMP_LOG_FILE      BUILDDIR"/testlog-timestamp.log"
+
+// Log a line with timestamp @format and return the length of its time stamp
+static
+int get_timestamp_len(int format)
+{
+	char line[512];
+	const char* end;
+	FILE* fp;
+	int fd, stderr_fd, len = -1;
+
+	fd = mm_open(TIMESTAMP_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	stderr_fd = mm_dup(ERRFD);
+	mm_dup2(fd, ERRFD);
+	mm_close(fd);
+
+	mm_log_set_timestamp(format);
+	mm_log_info("timestamp line");
+	mm_log_set_timestamp(MM_LOG_TS_DEFAULT);
+
+	mm_dup2(stderr_fd, ERRFD);
+	mm_close(stderr_fd);
+
+	fp = fopen(TIMESTAMP_LOG_FILE, "r");
+	if (!fp)
+		return -1;
+
+	if (fgets(line, sizeof(line), fp)
+	    && strstr(line, " : timestamp line\n")
+	    && (end = strstr(line, " INFO ")))
+		len = end - line;
+
+	fclose(fp);
+	return len;
+}
+
+
+static
+int test_timestamp_formats(void)
+{
+	// "dd/mm/yy HH:MM:SS", "dd/mm/yy HH:MM:SS.uuuuuu", "%10d.uuuuuu"
+	return get_timestamp_len(MM_LOG_TS_DEFAULT) == 17
+	       && get_timestamp_len(MM_LOG_TS_USEC) == 24
+	       && get_timestamp_len(MM_LOG_TS_MONOTONIC) >= 17
+	       && mm_log_set_timestamp(-1) == -1
+	       && mm_log_set_timestamp(MM_LOG_TS_DEFAULT) == MM_LOG_TS_DEFAULT;
+}
+
+
+#define SINK_LOG_FILE           BUILDDIR"/testlog-sink.log"
+#define ROTATED_LOG_FILE        BUILDDIR"/testlog-rotated.log"
+#define ROTATED_MAX_SIZE        4096
+#define ROTATED_MAX_FILES       2
+
+static
+void* log_levels_thread(void* arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < NUM_LOG_LINES; i++) {
+		mm_log_info("sink info line %i", i);
+		if (i % 10 == 0)
+			mm_log_warn("sink warn line %i", i);
+	}
+
+	return NULL;
+}
+
+
+// Return the number of lines of @path containing @pattern, -1 if @path
+// does not exist or is bigger than @max_size
+static
+int count_file_lines(const char* path, const char* pattern, size_t max_size)
+{
+	char line[512];
+	size_t size = 0;
+	FILE* fp;
+	int num = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		size += strlen(line);
+		if (strstr(line, pattern))
+			num++;
+	}
+
+	fclose(fp);
+	return size <= max_size ? num : -1;
+}
+
+
+static
+void remove_file(const char* path)
+{
+	if (!mm_check_access(path, F_OK))
+		mm_unlink(path);
+}
+
+
+static
+int test_file_sinks(void)
+{
+	struct mm_log_file_opts opts = {.maxlvl = MM_LOG_WARN};
+	struct mm_log_file_opts rotated_opts = {
+		.maxlvl = MM_LOG_DEBUG,
+		.max_size = ROTATED_MAX_SIZE,
+		.max_files = ROTATED_MAX_FILES,
+	};
+	mm_thread_t thids[NUM_LOG_THREADS];
+	int i, sink, rotated_sink, prev_lvl, num_warn, ok;
+
+	remove_file(SINK_LOG_FILE);
+	remove_file(ROTATED_LOG_FILE);
+	remove_file(ROTATED_LOG_FILE".1");
+	remove_file(ROTATED_LOG_FILE".2");
+
+	sink = mm_log_add_file(SINK_LOG_FILE, &opts);
+	rotated_sink = mm_log_add_file(ROTATED_LOG_FILE, &rotated_opts);
+	if (sink < 0 || rotated_sink < 0)
+		return 0;
+
+	// Keep the standard error quiet
+	prev_lvl = mm_log_set_sink_maxlvl(MM_LOG_SINK_STDERR, MM_LOG_NONE);
+
+	for (i = 0; i < NUM_LOG_THREADS; i++)
+		mm_thr_create(&thids[i], log_levels_thread, NULL);
+
+	for (i = 0; i < NUM_LOG_THREADS; i++)
+		mm_thr_join(thids[i], NULL);
+
+	mm_log_flush();
+
+	num_warn = NUM_LOG_THREADS * NUM_LOG_LINES / 10;
+	ok = count_file_lines(SINK_LOG_FILE, "sink warn line", SIZE_MAX)
+	     == num_warn
+	     && count_file_lines(SINK_LOG_FILE, "sink info line", SIZE_MAX)
+	     == 0
+	     // The rotated files hold the most recent lines
+	     && count_file_lines(ROTATED_LOG_FILE, "sink",
+	                         ROTATED_MAX_SIZE) > 0
+	     && count_file_lines(ROTATED_LOG_FILE".1", "sink",
+	                         ROTATED_MAX_SIZE) > 0
+	     && count_file_lines(ROTATED_LOG_FILE".2", "sink",
+	                         ROTATED_MAX_SIZE) > 0
+	     && mm_check_access(ROTATED_LOG_FILE".3", F_OK) == ENOENT;
+
+	mm_log_set_sink_maxlvl(MM_LOG_SINK_STDERR, prev_lvl);
+	ok = ok
+	     && mm_log_remove_sink(sink) == 0
+	     && mm_log_remove_sink(rotated_sink) == 0
+	     && mm_log_remove_sink(sink) == -1;
+
+	return ok;
+}
+
+
+static int num_arg_eval;
+
+static
+int count_arg_eval(void)
+{
+	return num_arg_eval++;
+}
+
+
+static
+int test_module_levels(void)
+{
+	int prev_lvl, prev_module_lvl, ok;
+
+	prev_lvl = mm_log_set_maxlvl(MM_LOG_INFO);
+	prev_module_lvl = mm_log_set_module_maxlvl("testlog", MM_LOG_DEBUG);
+
+	ok = mm_log_enabled(MM_LOG_DEBUG, "testlog")
+	     && !mm_log_enabled(MM_LOG_DEBUG, "othermodule")
+	     && mm_log_enabled(MM_LOG_INFO, "othermodule")
+	     && !mm_log_enabled(MM_LOG_NONE, "testlog");
+
+	// The arguments of a disabled log must not be evaluated
+	mm_log_set_module_maxlvl("testlog", MM_LOG_WARN);
+	mm_log_info("evaluated %i", count_arg_eval());
+	mm_log_debug("evaluated %i", count_arg_eval());
+	ok = ok && num_arg_eval == 0;
+
+	// The global level does not override the level set for the module
+	mm_log_set_maxlvl(MM_LOG_DEBUG);
+	mm_log_info("evaluated %i", count_arg_eval());
+	ok = ok && num_arg_eval == 0
+	     && mm_log_enabled(MM_LOG_DEBUG, "othermodule")
+	     && !mm_log_enabled(MM_LOG_INFO, "testlog");
+
+	mm_log_set_module_maxlvl("testlog", MM_LOG_INFO);
+	mm_log_info("evaluated %i", count_arg_eval());
+	ok = ok && num_arg_eval == 1;
+
+	// The macros must be usable as expressions, enabled or not
+	ok ? mm_log_info("evaluated %i", count_arg_eval()) : (void)0;
+	ok ? mm_log_debug("evaluated %i", count_arg_eval()) : (void)0;
+	(void)(mm_log_info("evaluated %i", count_arg_eval()), num_arg_eval++);
+	ok = ok && num_arg_eval == 4
+	     && mm_log_set_module_maxlvl("testlog", MM_LOG_DEBUG+1) == -1;
+
+	mm_log_set_module_maxlvl("testlog", prev_module_lvl);
+	mm_log_set_maxlvl(prev_lvl);
+
+	return ok;
+}
+
+
+#define RECORDER_NAME           "testlog-recorder"
+#define RECORDER_READ_FILE      BUILDDIR"/testlog-recorder.log"
+#define RECORDER_DUMP_FILE      BUILDDIR"/testlog-recorder-dump.log"
+#define RECORDER_SIZE           4096
+#define NUM_RECORDED_LINES      1000
+
+static
+int write_recorder_file(const char* path, int dump)
+{
+	int fd, rv = 0;
+
+	fd = mm_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+
+	if (dump)
+		mm_log_recorder_dump(fd);
+	else
+		rv = mm_log_recorder_read(RECORDER_NAME, fd);
+
+	mm_close(fd);
+	return rv;
+}
+
+
+// Read a shared memory object whose header announces a data area of @size
+static
+int read_forged_recorder(uint64_t size)
+{
+	struct {
+		char magic[8];
+		uint64_t size;
+		uint64_t head;
+	} hdr = {.magic = "MMLOGREC", .size = size, .head = 100};
+	int fd, rv = -1;
+
+	fd = mm_shm_open(RECORDER_NAME"-forged", O_CREAT|O_TRUNC|O_RDWR, 0600);
+	if (fd < 0)
+		return -1;
+
+	if (!mm_ftruncate(fd, 64 + RECORDER_SIZE)
+	    && mm_write(fd, &hdr, sizeof(hdr)) == sizeof(hdr))
+		rv = mm_log_recorder_read(RECORDER_NAME"-forged", ERRFD);
+
+	mm_close(fd);
+	mm_shm_unlink(RECORDER_NAME"-forged");
+	return rv;
+}
+
+
+static
+int test_flight_recorder(void)
+{
+	struct mm_log_recorder_opts opts = {
+		.maxlvl = MM_LOG_DEBUG,
+		.size = RECORDER_SIZE,
+	};
+	int i, prev_lvl, prev_stderr_lvl, ok;
+
+	prev_lvl = mm_log_set_maxlvl(MM_LOG_INFO);
+	prev_stderr_lvl = mm_log_set_sink_maxlvl(MM_LOG_SINK_STDERR,
+	                                         MM_LOG_NONE);
+
+	if (mm_log_recorder_start(RECORDER_NAME, &opts))
+		return 0;
+
+	// The debug lines are only taken by the recorder
+	for (i = 0; i < NUM_RECORDED_LINES; i++)
+		mm_log(MM_LOG_DEBUG, "recorded", "recorder line %i", i);
+
+	ok = mm_log_enabled(MM_LOG_DEBUG, "recorded")
+	     && mm_log_recorder_start(RECORDER_NAME, &opts) == -1
+	     && write_recorder_file(RECORDER_READ_FILE, 0) == 0
+	     && write_recorder_file(RECORDER_DUMP_FILE, 1) == 0
+	     // Only the most recent lines fit in the recorder
+	     && count_file_lines(RECORDER_READ_FILE, "recorder line",
+	                         RECORDER_SIZE) > 0
+	     && count_file_lines(RECORDER_READ_FILE, "recorder line 999\n",
+	                         RECORDER_SIZE) == 1
+	     && count_file_lines(RECORDER_READ_FILE, "recorder line 0\n",
+	                         RECORDER_SIZE) == 0
+	     && count_file_lines(RECORDER_DUMP_FILE, "recorder line 999\n",
+	                         SIZE_MAX) == 1
+	     && count_file_lines(RECORDER_DUMP_FILE, "---- ", SIZE_MAX) == 2;
+
+	ok = ok
+	     && mm_log_recorder_stop() == 0
+	     && !mm_log_enabled(MM_LOG_DEBUG, "recorded")
+	     && mm_log_recorder_read(RECORDER_NAME, 1) == -1
+	     && mm_log_recorder_stop() == -1
+	     // The header of a recorder left by another process is checked
+	     && read_forged_recorder(0) == -1
+	     && read_forged_recorder(RECORDER_SIZE) == 0;
+
+	mm_log_set_sink_maxlvl(MM_LOG_SINK_STDERR, prev_stderr_lvl);
+	mm_log_set_maxlvl(prev_lvl);
+
+	return ok;
+}
+
+
 int main(void)
 {
 	return (test_basic_logging()
 					&& test_crash()
-					&& test_check())?
+					&& test_check()
+					&& test_async_logging()
+					&& test_binary_logging()
+					&& test_binary_ring_wrap()
+					&& test_timestamp_formats()
+					&& test_file_sinks()
+					&& test_module_levels()
+					&& test_flight_recorder())?
 		EXIT_SUCCESS : EXIT_FAILURE;
 }
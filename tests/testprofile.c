@@ -6,9 +6,15 @@
 #endif
 
 
+#include "mmerrno.h"
+#include "mmlib.h"
 #include "mmprofile.h"
+#include "mmthread.h"
+#include "mmtime.h"
+#include "mmsysio.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #define OUTFD	1 //STDOUT_FILENO
@@ -69,8 +75,797 @@ void print_profile_labelled(void)
 }
 
 
+#define NUM_CTX_THREAD  2
+
+static
+void* profile_ctx_thread(void* arg)
+{
+	struct mm_profile_ctx* ctx = arg;
+	int i, j;
+	volatile int x;
+
+	for (i = 0; i < 100; i++) {
+		x = 2;
+		mm_profile_ctx_tic(ctx);
+		for (j = 0; j < 10; j++)
+			x *= 2;
+		mm_profile_ctx_toc_label(ctx, "short");
+		for (j = 0; j < 100; j++)
+			x *= 2;
+		mm_profile_ctx_toc_label(ctx, "long");
+
+		// Default context of this thread must not interfere with
+		// the one of main thread
+		mm_tic();
+		mm_toc();
+	}
+
+	return NULL;
+}
+
+
+static
+int print_profile_ctx(void)
+{
+	struct mm_profile_ctx* ctx[NUM_CTX_THREAD];
+	mm_thread_t thids[NUM_CTX_THREAD];
+	int i;
+
+	for (i = 0; i < NUM_CTX_THREAD; i++) {
+		ctx[i] = mm_profile_ctx_create(PROF_RESET_CPUCLOCK);
+		if (!ctx[i])
+			return -1;
+	}
+
+	mm_tic();
+	for (i = 0; i < NUM_CTX_THREAD; i++)
+		mm_thr_create(&thids[i], profile_ctx_thread, ctx[i]);
+
+	for (i = 0; i < NUM_CTX_THREAD; i++)
+		mm_thr_join(thids[i], NULL);
+
+	mm_toc_label("threads");
+
+	for (i = 0; i < NUM_CTX_THREAD; i++) {
+		if (mm_profile_ctx_get_data(ctx[i], 1, PROF_MAX) < 0)
+			return -1;
+
+		mm_profile_ctx_print(ctx[i], PROF_DEFAULT, OUTFD);
+		mm_profile_ctx_destroy(ctx[i]);
+	}
+
+	mm_profile_print(PROF_CURR, OUTFD);
+
+	// Only one point of measure must have been recorded in main thread
+	if (mm_profile_get_data(1, PROF_CURR) != -1)
+		return -1;
+
+	return 0;
+}
+
+
+#define NUM_TOC_ITER    10000
+#define NUM_TOC_PER_ITER  10
+
+/*
+ * Print the average cost of a mm_toc() call with the wall clock timer and
+ * with the TSC based timer. On a x86-64 linux host, the first is dominated
+ * by the call to clock_gettime() (~20-40ns even with vDSO) while the TSC
+ * based timer costs only the rdtscp instruction (~5-10ns).
+ */
+static
+void print_toc_cost(void)
+{
+	static const struct {
+		int flags;
+		const char* name;
+	} timers[] = {
+		{0, "wall clock"},
+		{PROF_RESET_TSC, "TSC"},
+	};
+	struct mm_timespec start, end;
+	int64_t duration;
+	int i, j, k;
+
+	for (i = 0; i < (int)(sizeof(timers)/sizeof(timers[0])); i++) {
+		mm_profile_reset(timers[i].flags);
+
+		mm_gettime(MM_CLK_MONOTONIC, &start);
+		for (j = 0; j < NUM_TOC_ITER; j++) {
+			mm_tic();
+			for (k = 0; k < NUM_TOC_PER_ITER; k++)
+				mm_toc();
+		}
+
+		mm_gettime(MM_CLK_MONOTONIC, &end);
+
+		duration = mm_timediff_ns(&end, &start);
+		printf("mm_tic()/mm_toc() with %s timer: %.1f ns/call\n",
+		       timers[i].name,
+		       (double)duration / (NUM_TOC_ITER*(NUM_TOC_PER_ITER+1)));
+	}
+}
+
+
+#define NUM_MANY_POINTS 40
+#define NUM_LOTS_POINTS 5000
+
+static
+int print_profile_many_points(void)
+{
+	static const char* const labels[] = {"even", "odd"};
+	struct mm_profile_ctx* ctx;
+	int i, j, rv = -1;
+	volatile int x;
+
+	ctx = mm_profile_ctx_create(PROF_RESET_CPUCLOCK);
+	if (!ctx)
+		return -1;
+
+	// Points beyond the ones embedded in the context must be kept and
+	// the same label may be reused at several points
+	for (i = 0; i < 100; i++) {
+		x = 2;
+		mm_profile_ctx_tic(ctx);
+		for (j = 0; j < NUM_MANY_POINTS; j++) {
+			x += j;
+			mm_profile_ctx_toc_label(ctx, labels[j % 2]);
+		}
+	}
+
+	mm_profile_ctx_print(ctx, PROF_MIN|PROF_MEAN, OUTFD);
+
+	if (mm_profile_ctx_get_data(ctx, NUM_MANY_POINTS-1, PROF_MAX) <= 0
+	    || mm_profile_ctx_get_data(ctx, NUM_MANY_POINTS, PROF_MAX) != -1)
+		goto exit;
+
+	// There is no limit on the number of points of an iteration
+	mm_profile_ctx_reset(ctx, PROF_RESET_CPUCLOCK);
+	for (i = 0; i < 2; i++) {
+		mm_profile_ctx_tic(ctx);
+		for (j = 0; j < NUM_LOTS_POINTS; j++)
+			mm_profile_ctx_toc(ctx);
+	}
+
+	if (mm_profile_ctx_get_data(ctx, NUM_LOTS_POINTS-1, PROF_MAX) < 0
+	    || mm_profile_ctx_get_data(ctx, NUM_LOTS_POINTS, PROF_MAX) != -1)
+		goto exit;
+
+	rv = 0;
+
+exit:
+	mm_profile_ctx_destroy(ctx);
+	return rv;
+}
+
+
+// Return 1 if the output of mm_profile_ctx_print() contains all @labels
+static
+int print_has_labels(struct mm_profile_ctx* ctx, const char* const* labels,
+                     int num_labels)
+{
+	char buf[4096];
+	int i, fds[2];
+	ssize_t rsz;
+
+	if (mm_pipe(fds))
+		return 0;
+
+	mm_profile_ctx_print(ctx, PROF_MEAN, fds[1]);
+	mm_close(fds[1]);
+	rsz = mm_read(fds[0], buf, sizeof(buf)-1);
+	mm_close(fds[0]);
+	if (rsz <= 0)
+		return 0;
+
+	buf[rsz] = '\0';
+	for (i = 0; i < num_labels; i++) {
+		if (!strstr(buf, labels[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static
+int print_profile_label_buffer(void)
+{
+	static const char* const labels[] = {"stage-one", "stage-two"};
+	static const char* const reset_labels[] = {"stage-three", "stage-four"};
+	struct mm_profile_ctx* ctx;
+	char buf[32];
+	int i, rv = -1;
+
+	ctx = mm_profile_ctx_create(PROF_RESET_CPUCLOCK);
+	if (!ctx)
+		return -1;
+
+	// The same buffer holds a different label at each point
+	for (i = 0; i < 10; i++) {
+		mm_profile_ctx_tic(ctx);
+		snprintf(buf, sizeof(buf), "%s", labels[0]);
+		mm_profile_ctx_toc_label(ctx, buf);
+		snprintf(buf, sizeof(buf), "%s", labels[1]);
+		mm_profile_ctx_toc_label(ctx, buf);
+	}
+
+	mm_profile_ctx_print(ctx, PROF_MEAN, OUTFD);
+	if (!print_has_labels(ctx, labels, 2))
+		goto exit;
+
+	// After a reset dropping the labels, the new content must be used
+	mm_profile_ctx_reset(ctx, PROF_RESET_CPUCLOCK);
+	for (i = 0; i < 10; i++) {
+		mm_profile_ctx_tic(ctx);
+		snprintf(buf, sizeof(buf), "%s", reset_labels[0]);
+		mm_profile_ctx_toc_label(ctx, buf);
+		snprintf(buf, sizeof(buf), "%s", reset_labels[1]);
+		mm_profile_ctx_toc_label(ctx, buf);
+	}
+
+	mm_profile_ctx_print(ctx, PROF_MEAN, OUTFD);
+	if (!print_has_labels(ctx, reset_labels, 2))
+		goto exit;
+
+	rv = 0;
+
+exit:
+	mm_profile_ctx_destroy(ctx);
+	return rv;
+}
+
+
+static
+void busy_loop(int n)
+{
+	volatile int x = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		x += i;
+}
+
+
+static
+int print_profile_tree(void)
+{
+	int i, fds[2], num_lines = 0;
+	ssize_t rsz;
+	char buf[1024];
+
+	mm_profile_reset(0);
+	for (i = 0; i < 100; i++) {
+		mm_profile_enter("frame");
+
+		mm_profile_enter("update");
+		busy_loop(100);
+		mm_profile_enter("physics");
+		busy_loop(500);
+		mm_profile_leave();
+		mm_profile_leave();
+
+		mm_profile_enter("render");
+		busy_loop(1000);
+		mm_profile_leave();
+
+		mm_profile_leave();
+	}
+
+	// Unbalanced call must be ignored
+	mm_profile_leave();
+
+	mm_profile_print_tree(PROF_MEAN|PROF_MAX|PROF_P99, OUTFD);
+	mm_profile_print_collapsed(OUTFD);
+
+	// Check that collapsed stacks output has one line per scope path
+	if (mm_pipe(fds))
+		return -1;
+
+	mm_profile_print_collapsed(fds[1]);
+	mm_close(fds[1]);
+	rsz = mm_read(fds[0], buf, sizeof(buf)-1);
+	mm_close(fds[0]);
+	if (rsz <= 0)
+		return -1;
+
+	buf[rsz] = '\0';
+	for (i = 0; i < rsz; i++)
+		num_lines += (buf[i] == '\n');
+
+	if (num_lines != 4 || !strstr(buf, "frame;update;physics "))
+		return -1;
+
+	return 0;
+}
+
+
+#define NUM_EXHAUST_SCOPES      4096
+
+static int alloc_hooked;
+static int alloc_fail;
+
+static
+void* test_alloc(void* data, size_t alignment, size_t size)
+{
+	void* ptr;
+
+	(void)data;
+
+	if (alloc_fail)
+		return NULL;
+
+	if (alignment < sizeof(void*))
+		alignment = sizeof(void*);
+
+	return posix_memalign(&ptr, alignment, size) ? NULL : ptr;
+}
+
+
+static
+void test_free(void* data, void* ptr)
+{
+	(void)data;
+	free(ptr);
+}
+
+
+// Return the number of calls of the scope printed at @indent depth
+static
+int get_scope_calls(struct mm_profile_ctx* ctx, const char* name, int indent)
+{
+	char buf[4096], pattern[64];
+	const char* line;
+	int fds[2], calls = -1;
+	ssize_t rsz;
+
+	if (mm_pipe(fds))
+		return -1;
+
+	mm_profile_ctx_print_tree(ctx, PROF_MEAN, fds[1]);
+	mm_close(fds[1]);
+	rsz = mm_read(fds[0], buf, sizeof(buf)-1);
+	mm_close(fds[0]);
+	if (rsz <= 0)
+		return -1;
+
+	buf[rsz] = '\0';
+	sprintf(pattern, "\n%*s%s ", indent, "", name);
+	line = strstr(buf, pattern);
+	if (line)
+		sscanf(line + strlen(pattern), " | %i", &calls);
+
+	return calls;
+}
+
+
+static
+int print_profile_tree_nomem(void)
+{
+	static char keys[NUM_EXHAUST_SCOPES];
+	struct mm_profile_ctx* ctx;
+	int i, rv = -1;
+
+	// The scope nodes cannot be allocated without the allocator hook
+	if (!alloc_hooked) {
+		printf("allocator hook not available, skipped\n");
+		return 0;
+	}
+
+	ctx = mm_profile_ctx_create(0);
+	if (!ctx)
+		return -1;
+
+	mm_profile_ctx_enter(ctx, "top");
+	mm_profile_ctx_enter(ctx, "inner");
+	mm_profile_ctx_leave(ctx);
+	mm_profile_ctx_leave(ctx);
+
+	// Fill the scope arena until new nodes cannot be allocated
+	alloc_fail = 1;
+	mm_profile_ctx_enter(ctx, "top");
+	for (i = 0; i < NUM_EXHAUST_SCOPES; i++) {
+		mm_profile_ctx_enter(ctx, keys + i);
+		mm_profile_ctx_leave(ctx);
+	}
+
+	// A scope already in the tree, entered inside a lost scope, must not
+	// be recorded (nor popped in place of the enclosing lost scope)
+	mm_profile_ctx_enter(ctx, "lost");
+	mm_profile_ctx_enter(ctx, "inner");
+	mm_profile_ctx_leave(ctx);
+	mm_profile_ctx_leave(ctx);
+	mm_profile_ctx_leave(ctx);
+	alloc_fail = 0;
+
+	if (get_scope_calls(ctx, "top", 0) == 2
+	    && get_scope_calls(ctx, "inner", 2) == 1)
+		rv = 0;
+
+	mm_profile_ctx_destroy(ctx);
+	return rv;
+}
+
+
+#define NUM_TRACE_THREAD        2
+#define TRACE_FILE              BUILDDIR"/testprofile-trace.json"
+
+static
+void* trace_thread(void* arg)
+{
+	int i;
+
+	mm_trace_set_thread_name(arg);
+	for (i = 0; i < 100; i++) {
+		mm_trace_begin("work");
+		busy_loop(100);
+		mm_trace_counter("iteration", i);
+		mm_trace_end();
+	}
+
+	mm_trace_instant("done");
+	return NULL;
+}
+
+
+static
+int print_trace(void)
+{
+	static char* const names[NUM_TRACE_THREAD] = {"worker A", "worker B"};
+	mm_thread_t thids[NUM_TRACE_THREAD];
+	char buf[256];
+	ssize_t rsz;
+	int i, fd, rv = -1;
+
+	for (i = 0; i < NUM_TRACE_THREAD; i++)
+		mm_thr_create(&thids[i], trace_thread, names[i]);
+
+	for (i = 0; i < NUM_TRACE_THREAD; i++)
+		mm_thr_join(thids[i], NULL);
+
+	fd = mm_open(TRACE_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	if (fd < 0)
+		return -1;
+
+	if (mm_trace_flush(fd))
+		goto exit;
+
+	// Check beginning of the JSON document
+	mm_seek(fd, 0, SEEK_SET);
+	rsz = mm_read(fd, buf, sizeof(buf)-1);
+	if (rsz <= 0)
+		goto exit;
+
+	buf[rsz] = '\0';
+	if (strncmp(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39))
+		goto exit;
+
+	printf("trace written in %s\n", TRACE_FILE);
+	rv = 0;
+
+exit:
+	mm_close(fd);
+	return rv;
+}
+
+
+#define NUM_HIST_ITER     1000
+#define MAX_HIST_BUCKETS  512
+
+static
+int print_profile_percentiles(void)
+{
+	struct mm_profile_ctx* ctx;
+	struct mm_profile_bucket buckets[MAX_HIST_BUCKETS];
+	int64_t p90, p99, p999;
+	uint64_t count = 0;
+	int i, j, num, rv = -1;
+	volatile int x;
+
+	ctx = mm_profile_ctx_create(0);
+	if (!ctx)
+		return -1;
+
+	if (mm_profile_ctx_set_precision(ctx, 1) != -1
+	    || mm_profile_ctx_set_precision(ctx, 8))
+		goto exit;
+
+	for (i = 0; i < NUM_HIST_ITER; i++) {
+		x = 2;
+		mm_profile_ctx_tic(ctx);
+		for (j = 0; j < i % 100; j++)
+			x += j;
+		mm_profile_ctx_toc_label(ctx, "variable");
+	}
+
+	mm_profile_ctx_print(ctx, PROF_MEDIAN|PROF_P90|PROF_P99|PROF_P999,
+	                     OUTFD);
+
+	p90 = mm_profile_ctx_get_data(ctx, 0, PROF_P90);
+	p99 = mm_profile_ctx_get_data(ctx, 0, PROF_P99);
+	p999 = mm_profile_ctx_get_data(ctx, 0, PROF_P999);
+	if (p90 <= 0 || p90 > p99 || p99 > p999)
+		goto exit;
+
+	// Buckets must be ordered and account for all iterations (the last
+	// one has been accounted by mm_profile_ctx_print())
+	num = mm_profile_ctx_get_histogram(ctx, 0, buckets, MAX_HIST_BUCKETS);
+	if (num <= 0 || num > MAX_HIST_BUCKETS)
+		goto exit;
+
+	for (i = 0; i < num; i++) {
+		if (buckets[i].lower > buckets[i].upper
+		    || (i > 0 && buckets[i].lower <= buckets[i-1].upper))
+			goto exit;
+
+		count += buckets[i].count;
+	}
+
+	if (count != NUM_HIST_ITER)
+		goto exit;
+
+	rv = 0;
+
+exit:
+	mm_profile_ctx_destroy(ctx);
+	return rv;
+}
+
+
+#define PERFCNT_MASK \
+	(PROF_CYCLES|PROF_INSTR|PROF_IPC|PROF_CACHE_MISS|PROF_BRANCH_MISS)
+
+static
+int print_profile_counters(void)
+{
+	struct mm_profile_ctx* ctx;
+	int64_t instr, ipc;
+	int i, rv = -1;
+
+	ctx = mm_profile_ctx_create(PROF_RESET_PERFCNT);
+	if (!ctx)
+		return -1;
+
+	for (i = 0; i < 100; i++) {
+		mm_profile_ctx_tic(ctx);
+		busy_loop(1000);
+		mm_profile_ctx_toc_label(ctx, "busy loop");
+		mm_profile_ctx_toc_label(ctx, "empty");
+	}
+
+	mm_profile_ctx_print(ctx, PROF_MEAN|PERFCNT_MASK, OUTFD);
+
+	// Hardware counters are optional (container, perf_event_paranoid...)
+	instr = mm_profile_ctx_get_data(ctx, 0, PROF_INSTR);
+	ipc = mm_profile_ctx_get_data(ctx, 0, PROF_IPC);
+	if (instr == -1) {
+		printf("hardware counters not available, check skipped\n");
+	} else if (instr < 1000 || ipc <= 0) {
+		goto exit;
+	}
+
+	// Counters must be released by a reset without PROF_RESET_PERFCNT
+	mm_profile_ctx_reset(ctx, 0);
+	mm_profile_ctx_tic(ctx);
+	mm_profile_ctx_toc(ctx);
+	if (mm_profile_ctx_get_data(ctx, 0, PROF_CYCLES) != -1)
+		goto exit;
+
+	rv = 0;
+
+exit:
+	mm_profile_ctx_destroy(ctx);
+	return rv;
+}
+
+
+#define SAMPLE_FILE             BUILDDIR"/testprofile-sample.txt"
+
+static
+void spin_cpu_ms(int ms)
+{
+	struct mm_timespec start, now;
+
+	mm_gettime(MM_CLK_CPU_PROCESS, &start);
+	do {
+		busy_loop(1000);
+		mm_gettime(MM_CLK_CPU_PROCESS, &now);
+	} while (mm_timediff_ns(&now, &start) < ms * 1000000LL);
+}
+
+
+static
+int print_profile_sample(void)
+{
+	char buf[4096];
+	ssize_t rsz;
+	int fd, rv = -1;
+
+	if (mm_profile_sample_start(1000)) {
+		if (mm_get_lasterror_number() == ENOTSUP) {
+			printf("sampling profiler not supported, skipped\n");
+			return 0;
+		}
+
+		return -1;
+	}
+
+	// A second start must fail
+	if (mm_profile_sample_start(0) != -1)
+		return -1;
+
+	spin_cpu_ms(200);
+
+	fd = mm_open(SAMPLE_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	if (fd < 0 || mm_profile_sample_stop(fd, PROF_SAMPLE_COLLAPSED))
+		goto exit;
+
+	// Check that at least a stack has been written
+	mm_seek(fd, 0, SEEK_SET);
+	rsz = mm_read(fd, buf, sizeof(buf)-1);
+	if (rsz <= 0)
+		goto exit;
+
+	buf[rsz] = '\0';
+	if (!strchr(buf, ' ') || !strchr(buf, '\n'))
+		goto exit;
+
+	printf("collapsed stacks written in %s\n", SAMPLE_FILE);
+	rv = 0;
+
+exit:
+	if (fd >= 0)
+		mm_close(fd);
+
+	return rv;
+}
+
+
+#define SHM_PROFILE_NAME        "/testprofile-shm"
+#define SHM_PROFILE_FILE        BUILDDIR"/testprofile-shm.txt"
+#define NUM_SHM_CTX             2
+#define NUM_SHM_ITER            100
+
+static
+int print_profile_shm(void)
+{
+	struct mm_profile_ctx* ctx[NUM_SHM_CTX] = {NULL};
+	char buf[4096];
+	ssize_t rsz;
+	int i, j, prev_flags, fd = -1, rv = -1;
+
+	// Remove leftover of a previous run if any
+	prev_flags = mm_error_set_flags(MM_ERROR_SET, MM_ERROR_NOLOG);
+	mm_shm_unlink(SHM_PROFILE_NAME);
+	mm_error_set_flags(prev_flags, MM_ERROR_NOLOG);
+
+	// Several contexts (as if in different processes) accumulate in the
+	// same shared profile
+	for (i = 0; i < NUM_SHM_CTX; i++) {
+		ctx[i] = mm_profile_ctx_create_shared(SHM_PROFILE_NAME, 0);
+		if (!ctx[i])
+			goto exit;
+	}
+
+	for (j = 0; j < NUM_SHM_ITER; j++) {
+		for (i = 0; i < NUM_SHM_CTX; i++) {
+			mm_profile_ctx_tic(ctx[i]);
+			busy_loop(100);
+			mm_profile_ctx_toc_label(ctx[i], "busy loop");
+		}
+	}
+
+	// Account last iteration
+	for (i = 0; i < NUM_SHM_CTX; i++)
+		mm_profile_ctx_tic(ctx[i]);
+
+	if (mm_profile_shm_print(SHM_PROFILE_NAME, PROF_DEFAULT|PROF_P99,
+	                         OUTFD))
+		goto exit;
+
+	fd = mm_open(SHM_PROFILE_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	if (fd < 0 || mm_profile_shm_print(SHM_PROFILE_NAME, PROF_MEAN, fd))
+		goto exit;
+
+	mm_seek(fd, 0, SEEK_SET);
+	rsz = mm_read(fd, buf, sizeof(buf)-1);
+	if (rsz <= 0)
+		goto exit;
+
+	buf[rsz] = '\0';
+	if (strncmp(buf, "200 iterations, 2 contexts attached\n", 36)
+	    || !strstr(buf, "busy loop"))
+		goto exit;
+
+	rv = 0;
+
+exit:
+	if (fd >= 0)
+		mm_close(fd);
+
+	for (i = 0; i < NUM_SHM_CTX; i++)
+		mm_profile_ctx_destroy(ctx[i]);
+
+	mm_shm_unlink(SHM_PROFILE_NAME);
+	return rv;
+}
+
+
+#define SLOW_THRESHOLD_NS       5000000
+#define NUM_SLOW_ITER           20
+
+static
+int print_profile_slow(void)
+{
+	struct mm_profile_ctx* ctx;
+	struct mm_profile_slow_iter iters[4];
+	int i, num, rv = -1;
+
+	ctx = mm_profile_ctx_create(0);
+	if (!ctx)
+		return -1;
+
+	// Check the 2nd point of measure: iterations 5 and 12 are slow
+	if (mm_profile_ctx_set_slow_threshold(ctx, 1, SLOW_THRESHOLD_NS))
+		goto exit;
+
+	for (i = 0; i < NUM_SLOW_ITER; i++) {
+		mm_profile_ctx_tic(ctx);
+		busy_loop(100);
+		mm_profile_ctx_toc_label(ctx, "fast");
+		if (i == 5 || i == 12)
+			mm_relative_sleep_ms(2 * SLOW_THRESHOLD_NS / 1000000);
+
+		mm_profile_ctx_toc_label(ctx, "maybe slow");
+	}
+
+	// End the last iteration
+	mm_profile_ctx_tic(ctx);
+
+	if (mm_profile_ctx_print_slow(ctx, 0, OUTFD))
+		goto exit;
+
+	num = mm_profile_ctx_get_slow_iters(ctx, iters, MM_NELEM(iters));
+	if (num != 2
+	    || iters[0].iteration != 5 || iters[1].iteration != 12
+	    || iters[0].num_points != 2
+	    || iters[0].timings[1] < SLOW_THRESHOLD_NS
+	    || iters[1].total < iters[1].timings[1])
+		goto exit;
+
+	// Check on the whole iteration, 1 ns is exceeded by all iterations
+	if (mm_profile_ctx_set_slow_threshold(ctx, -1, 1))
+		goto exit;
+
+	for (i = 0; i < NUM_SLOW_ITER; i++) {
+		mm_profile_ctx_tic(ctx);
+		busy_loop(100);
+		mm_profile_ctx_toc(ctx);
+	}
+
+	num = mm_profile_ctx_get_slow_iters(ctx, iters, MM_NELEM(iters));
+	if (num != MM_NELEM(iters)
+	    || iters[MM_NELEM(iters)-1].iteration != 2*NUM_SLOW_ITER-1)
+		goto exit;
+
+	rv = 0;
+
+exit:
+	mm_profile_ctx_destroy(ctx);
+	return rv;
+}
+
+
 int main(void)
 {
+	struct mm_allocator allocator = {
+		.alloc = test_alloc,
+		.free = test_free,
+	};
+
+	// Must be set before mmlib allocates anything
+	alloc_hooked = (mm_set_allocator(&allocator) == 0);
+
 	printf("Timing with default settings\n");
 	fflush(stdout);
 	print_profile();
@@ -85,6 +880,15 @@ int main(void)
 	mm_profile_reset(PROF_RESET_CPUCLOCK);
 	print_profile();
 
+	printf("\nTiming with TSC based timer\n");
+	fflush(stdout);
+	mm_profile_reset(PROF_RESET_TSC);
+	print_profile();
+
+	printf("\nCost of mm_toc() call\n");
+	print_toc_cost();
+	fflush(stdout);
+
 	printf("\nLabelled mm_toc() 1st\n");
 	fflush(stdout);
 	mm_profile_reset(PROF_RESET_CPUCLOCK);
@@ -95,5 +899,83 @@ int main(void)
 	mm_profile_reset(PROF_RESET_CPUCLOCK|PROF_RESET_KEEPLABEL);
 	print_profile_labelled();
 
+	printf("\nSeparate contexts in threads\n");
+	fflush(stdout);
+	mm_profile_reset(0);
+	if (print_profile_ctx()) {
+		fprintf(stderr, "profiling contexts failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nMore points than embedded in context\n");
+	fflush(stdout);
+	if (print_profile_many_points()) {
+		fprintf(stderr, "profiling many points failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nLabels in a reused buffer\n");
+	fflush(stdout);
+	if (print_profile_label_buffer()) {
+		fprintf(stderr, "profiling labels in reused buffer failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nScoped call tree\n");
+	fflush(stdout);
+	if (print_profile_tree()) {
+		fprintf(stderr, "profiling call tree failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nScoped call tree without memory\n");
+	fflush(stdout);
+	if (print_profile_tree_nomem()) {
+		fprintf(stderr, "profiling call tree without memory failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nTrace events\n");
+	fflush(stdout);
+	if (print_trace()) {
+		fprintf(stderr, "trace events failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nPercentiles\n");
+	fflush(stdout);
+	if (print_profile_percentiles()) {
+		fprintf(stderr, "profiling percentiles failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nHardware counters\n");
+	fflush(stdout);
+	if (print_profile_counters()) {
+		fprintf(stderr, "profiling hardware counters failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nSampling profiler\n");
+	fflush(stdout);
+	if (print_profile_sample()) {
+		fprintf(stderr, "sampling profiler failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nShared memory profile\n");
+	fflush(stdout);
+	if (print_profile_shm()) {
+		fprintf(stderr, "shared memory profile failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\nSlow iterations\n");
+	fflush(stdout);
+	if (print_profile_slow()) {
+		fprintf(stderr, "slow iteration capture failed\n");
+		return EXIT_FAILURE;
+	}
+
 	return EXIT_SUCCESS;
 }